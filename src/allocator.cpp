@@ -0,0 +1,43 @@
+#include "allocator.h"
+
+class DefaultAllocator : public Allocator {
+public:
+	void* alloc(size_t size) override {
+		return ::operator new(size, std::nothrow);
+	}
+	void free(void* p, size_t size) override {
+		(void)size;
+		::operator delete(p);
+	}
+};
+
+/*static*/ Allocator& Allocator::Default()
+{
+	// Never destroyed: pools may be freed during static destruction.
+	static Allocator* allocator = new DefaultAllocator();
+	return *allocator;
+}
+
+void* LimitedAllocator::alloc(size_t size)
+{
+	if (size > _limit || _used > _limit - size)
+		throw OutOfMemory();
+	void* p = _allocator.alloc(size);
+	if (!p)
+		throw OutOfMemory();
+	_used += size;
+	return p;
+}
+
+void LimitedAllocator::charge(size_t size, bool force)
+{
+	if (!force && (size > _limit || _used > _limit - size))
+		throw OutOfMemory();
+	_used += size;
+}
+
+void LimitedAllocator::free(void* p, size_t size)
+{
+	_allocator.free(p, size);
+	_used -= size;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+
+/*
+* Where a Heap gets its memory: the slabs for its pools, objects too
+* large to pool, and the elements of lists. A host with its own memory
+* tracking implements this and passes it to the Interpreter (see
+* InterpreterOptions::allocator).
+*
+* alloc() returns memory aligned for any type, or nullptr if there is
+* none. free() is given the size that was allocated.
+*/
+class Allocator {
+public:
+	virtual ~Allocator() {}
+	virtual void* alloc(size_t size) = 0;
+	virtual void free(void* p, size_t size) = 0;
+
+	// ::operator new and delete.
+	static Allocator& Default();
+};
+
+// Thrown by LimitedAllocator. The engines report it as a runtime error.
+class OutOfMemory : public std::bad_alloc {
+public:
+	const char* what() const noexcept override { return "Out of memory"; }
+};
+
+/*
+* Passes allocations on to another Allocator, while the bytes allocated
+* stay under a limit. An alloc() that would go over it (or that the
+* other Allocator fails) throws OutOfMemory.
+*/
+class LimitedAllocator : public Allocator {
+public:
+	static constexpr size_t kNoLimit = SIZE_MAX;
+
+	LimitedAllocator(Allocator& allocator, size_t limit = kNoLimit) : _allocator(allocator), _limit(limit) {}
+
+	void* alloc(size_t size) override;
+	void free(void* p, size_t size) override;
+
+	// Counts memory that came from elsewhere (the characters of strings)
+	// against the limit. Throws OutOfMemory if it would go over, unless
+	// 'force'd.
+	void charge(size_t size, bool force = false);
+	void uncharge(size_t size) { _used -= size; }
+
+	size_t used() const { return _used; }
+	size_t limit() const { return _limit; }
+	// Lowering the limit below used() only affects later allocations.
+	void setLimit(size_t limit) { _limit = limit; }
+
+private:
+	Allocator& _allocator;
+	size_t _limit;
+	size_t _used = 0;
+};
+
+// Adapts an Allocator for the standard containers.
+template<typename T>
+class StdAllocator {
+public:
+	using value_type = T;
+
+	StdAllocator(Allocator& allocator) : _allocator(&allocator) {}
+	template<typename U>
+	StdAllocator(const StdAllocator<U>& other) : _allocator(other.allocator()) {}
+
+	T* allocate(size_t n) {
+		void* p = _allocator->alloc(n * sizeof(T));
+		if (!p) throw OutOfMemory();
+		return static_cast<T*>(p);
+	}
+	void deallocate(T* p, size_t n) {
+		_allocator->free(p, n * sizeof(T));
+	}
+
+	Allocator* allocator() const { return _allocator; }
+
+	template<typename U>
+	bool operator==(const StdAllocator<U>& rhs) const { return _allocator == rhs.allocator(); }
+	template<typename U>
+	bool operator!=(const StdAllocator<U>& rhs) const { return _allocator != rhs.allocator(); }
+
+private:
+	Allocator* _allocator;
+};
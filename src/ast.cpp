@@ -1,4 +1,13 @@
 #include "ast.h"
 #include "error.h"
 
-
+/*static*/ bool ASTListFuncExpr::FromName(const std::string& name, ListFunc& func, int& nArgs)
+{
+	if (name == "append") { func = ListFunc::kAppend; nArgs = 2; return true; }
+	if (name == "pop") { func = ListFunc::kPop; nArgs = 1; return true; }
+	if (name == "size") { func = ListFunc::kSize; nArgs = 1; return true; }
+	if (name == "has") { func = ListFunc::kHas; nArgs = 2; return true; }
+	if (name == "remove") { func = ListFunc::kRemove; nArgs = 2; return true; }
+	if (name == "keys") { func = ListFunc::kKeys; nArgs = 1; return true; }
+	return false;
+}
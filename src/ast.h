@@ -5,6 +5,7 @@
 #include "token.h"
 
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -42,9 +43,24 @@ class ASTBinaryExpr;
 class ASTUnaryExpr;
 class ASTLogicalExpr;
 class ASTCallExpr;
+class ASTListExpr;
+class ASTIndexExpr;
+class ASTIndexAssignExpr;
+class ASTSliceExpr;
+class ASTListFuncExpr;
 
 using ASTExprPtr = std::shared_ptr<ASTExprNode>;
 
+// Where the tree walker finds a variable: 'depth' scopes out from the
+// current one, at 'slot' in that scope. Set by ResolveSlots() (resolver.h).
+// A depth of -1 is a global, which is looked up by name.
+struct VarSlot {
+    int depth = -1;
+    int slot = -1;
+
+    bool isGlobal() const { return depth < 0; }
+};
+
 // -------- Statements ----------
 
 class ASTStmtVisitor
@@ -63,6 +79,8 @@ class ASTStmtNode {
     public:
 	virtual ~ASTStmtNode() = default;
 	virtual void accept(ASTStmtVisitor& visitor, int depth) const = 0;
+
+	int line = -1;	// where the statement starts (if known), set by the Parser
 };
 
 class ASTExprStmt : public ASTStmtNode
@@ -143,7 +161,7 @@ public:
 class ASTVarDeclStmt : public ASTStmtNode
 {
 public:
-    ASTVarDeclStmt(const std::string& name, ValueType valueType, ASTExprPtr expr) : name(name), valueType(valueType), expr(expr) {
+    ASTVarDeclStmt(const StrPtr& name, ValueType valueType, ASTExprPtr expr) : name(name), valueType(valueType), expr(expr) {
         LOG_AST(ASTVarDeclStmt);
     }
     virtual void accept(ASTStmtVisitor& visitor, int depth) const override { 
@@ -151,9 +169,10 @@ public:
         visitor.visit(*this, depth);
     }
 
-    std::string name;
+    StrPtr name;    // interned by the Parser
     ValueType valueType;
     ASTExprPtr expr;
+    mutable VarSlot slot;
 };
 
 class ASTFuncDeclStmt : public ASTStmtNode
@@ -185,6 +204,11 @@ public:
     virtual void visit(const ASTUnaryExpr&, int depth) = 0;
     virtual void visit(const ASTLogicalExpr&, int depth) = 0;
     virtual void visit(const ASTCallExpr&, int depth) = 0;
+    virtual void visit(const ASTListExpr&, int depth) = 0;
+    virtual void visit(const ASTIndexExpr&, int depth) = 0;
+    virtual void visit(const ASTIndexAssignExpr&, int depth) = 0;
+    virtual void visit(const ASTSliceExpr&, int depth) = 0;
+    virtual void visit(const ASTListFuncExpr&, int depth) = 0;
 };
 
 // Abstract syntax tree (AST) nodes
@@ -197,6 +221,12 @@ public:
         return ValueType();
     }
     virtual const ASTIdentifierExpr* asIdentifier() { return nullptr; }
+    virtual const ASTValueExpr* asValue() { return nullptr; }
+    virtual const ASTListExpr* asList() { return nullptr; }
+    virtual const ASTIndexExpr* asIndex() { return nullptr; }
+
+    // Set by the TypeChecker (typecheck.h). ValueType() if not known.
+    mutable ValueType staticType;
 };
 
 class ASTValueExpr : public ASTExprNode
@@ -214,6 +244,7 @@ public:
     virtual ValueType duckType() const override {
         return value.type;
     }
+    virtual const ASTValueExpr* asValue() override { return this; }
 
     Value value;
 };
@@ -221,7 +252,7 @@ public:
 class ASTAssignmentExpr : public ASTExprNode
 {
 public:
-	ASTAssignmentExpr(const std::string& name, ASTExprPtr right) : name(name), right(right) {
+	ASTAssignmentExpr(const StrPtr& name, ASTExprPtr right) : name(name), right(right) {
         LOG_AST(ASTAssignmentExpr);
     }
 
@@ -230,14 +261,15 @@ public:
         visitor.visit(*this, depth);
     }
 
-	std::string name;
+	StrPtr name;	// interned by the Parser
 	ASTExprPtr right;
+	mutable VarSlot slot;
 };
 
 class ASTIdentifierExpr : public ASTExprNode
 { 
 public:
-	ASTIdentifierExpr(const std::string& name) : name(name) {
+	ASTIdentifierExpr(const StrPtr& name) : name(name) {
         LOG_AST(ASTIdentifierExpr);
     }
     virtual void accept(ASTExprVisitor& visitor, int depth) const override { 
@@ -246,7 +278,8 @@ public:
     }
     virtual const ASTIdentifierExpr* asIdentifier() override { return this; }
 
-    std::string name;
+    StrPtr name;    // interned by the Parser
+    mutable VarSlot slot;
 };
 
 class ASTBinaryExpr : public ASTExprNode
@@ -316,3 +349,108 @@ class ASTLogicalExpr : public ASTExprNode
 	ASTExprPtr left;
 	ASTExprPtr right;
 };
+
+// [a, b, c]: the elements are evaluated in order, and the list is sized once.
+class ASTListExpr : public ASTExprNode
+{
+public:
+    ASTListExpr(const std::vector<ASTExprPtr>& elements, ValueType type) : elements(elements), type(type) {
+        LOG_AST(ASTListExpr);
+    }
+    virtual void accept(ASTExprVisitor& visitor, int depth) const override {
+        LOG_AST_VISIT(ASTListExpr, depth);
+        visitor.visit(*this, depth);
+    }
+
+    virtual ValueType duckType() const override {
+        return type.pType == PType::tNone ? ValueType() : type;
+    }
+    virtual const ASTListExpr* asList() override { return this; }
+
+    std::vector<ASTExprPtr> elements;
+    // The list type, from the elements or the declaration. If the Parser
+    // couldn't tell, the pType is tNone, and the engine uses the type of
+    // the first element.
+    ValueType type;
+};
+
+// list[index]
+class ASTIndexExpr : public ASTExprNode
+{
+public:
+    ASTIndexExpr(ASTExprPtr list, ASTExprPtr index) : list(list), index(index) {
+        LOG_AST(ASTIndexExpr);
+    }
+    virtual void accept(ASTExprVisitor& visitor, int depth) const override {
+        LOG_AST_VISIT(ASTIndexExpr, depth);
+        visitor.visit(*this, depth);
+    }
+    virtual const ASTIndexExpr* asIndex() override { return this; }
+
+    ASTExprPtr list;
+    ASTExprPtr index;
+};
+
+// list[index] = right. Like any assignment, its value is 'right'.
+class ASTIndexAssignExpr : public ASTExprNode
+{
+public:
+    ASTIndexAssignExpr(ASTExprPtr list, ASTExprPtr index, ASTExprPtr right) : list(list), index(index), right(right) {
+        LOG_AST(ASTIndexAssignExpr);
+    }
+    virtual void accept(ASTExprVisitor& visitor, int depth) const override {
+        LOG_AST_VISIT(ASTIndexAssignExpr, depth);
+        visitor.visit(*this, depth);
+    }
+
+    ASTExprPtr list;
+    ASTExprPtr index;
+    ASTExprPtr right;
+};
+
+// list[begin:end]: a view of the elements from 'begin' up to (not
+// including) 'end', which shares the list's storage. Either bound can be
+// left out (nullptr): begin is then 0, and end the size of the list.
+class ASTSliceExpr : public ASTExprNode
+{
+public:
+    ASTSliceExpr(ASTExprPtr list, ASTExprPtr begin, ASTExprPtr end) : list(list), begin(begin), end(end) {
+        LOG_AST(ASTSliceExpr);
+    }
+    virtual void accept(ASTExprVisitor& visitor, int depth) const override {
+        LOG_AST_VISIT(ASTSliceExpr, depth);
+        visitor.visit(*this, depth);
+    }
+
+    ASTExprPtr list;
+    ASTExprPtr begin;
+    ASTExprPtr end;
+};
+
+// The built in list and map functions, which work on any element type.
+enum class ListFunc {
+    kAppend,    // append(list, value): adds to the end, and returns nothing
+    kPop,       // pop(list): removes and returns the last element
+    kSize,      // size(list or map): the number of elements
+    kHas,       // has(map, key): true if the map has the key
+    kRemove,    // remove(map, key): removes the key; true if it was there
+    kKeys,      // keys(map): a str[] of the keys
+};
+
+class ASTListFuncExpr : public ASTExprNode
+{
+public:
+    ASTListFuncExpr(ListFunc func, const std::vector<ASTExprPtr>& arguments) : func(func), arguments(arguments) {
+        LOG_AST(ASTListFuncExpr);
+    }
+    virtual void accept(ASTExprVisitor& visitor, int depth) const override {
+        LOG_AST_VISIT(ASTListFuncExpr, depth);
+        visitor.visit(*this, depth);
+    }
+
+    // Returns false if 'name' isn't a list function.
+    static bool FromName(const std::string& name, ListFunc& func, int& nArgs);
+
+    ListFunc func;
+    std::vector<ASTExprPtr> arguments;     // the list is first
+};
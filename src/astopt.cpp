@@ -0,0 +1,392 @@
+#include "astopt.h"
+
+// Counts the nodes in a tree, so the pass can report what it removed.
+class ASTCounter : public ASTExprVisitor, public ASTStmtVisitor {
+public:
+	int count = 0;
+
+	void add(const ASTExprPtr& expr) { if (expr) expr->accept(*this, 0); }
+	void add(const ASTStmtPtr& stmt) { if (stmt) stmt->accept(*this, 0); }
+
+	void visit(const ASTValueExpr&, int) override { count++; }
+	void visit(const ASTIdentifierExpr&, int) override { count++; }
+	void visit(const ASTAssignmentExpr& node, int) override { count++; add(node.right); }
+	void visit(const ASTBinaryExpr& node, int) override { count++; add(node.left); add(node.right); }
+	void visit(const ASTUnaryExpr& node, int) override { count++; add(node.right); }
+	void visit(const ASTLogicalExpr& node, int) override { count++; add(node.left); add(node.right); }
+	void visit(const ASTCallExpr& node, int) override {
+		count++;
+		add(node.callee);
+		for (const ASTExprPtr& arg : node.arguments) add(arg);
+	}
+	void visit(const ASTListExpr& node, int) override {
+		count++;
+		for (const ASTExprPtr& e : node.elements) add(e);
+	}
+	void visit(const ASTIndexExpr& node, int) override { count++; add(node.list); add(node.index); }
+	void visit(const ASTIndexAssignExpr& node, int) override { count++; add(node.list); add(node.index); add(node.right); }
+	void visit(const ASTSliceExpr& node, int) override { count++; add(node.list); add(node.begin); add(node.end); }
+	void visit(const ASTListFuncExpr& node, int) override {
+		count++;
+		for (const ASTExprPtr& arg : node.arguments) add(arg);
+	}
+
+	void visit(const ASTExprStmt& node, int) override { count++; add(node.expr); }
+	void visit(const ASTReturnStmt& node, int) override { count++; add(node.expr); }
+	void visit(const ASTBlockStmt& node, int) override {
+		count++;
+		for (const ASTStmtPtr& stmt : node.stmts) add(stmt);
+	}
+	void visit(const ASTVarDeclStmt& node, int) override { count++; add(node.expr); }
+	void visit(const ASTIfStmt& node, int) override { count++; add(node.condition); add(node.thenBranch); add(node.elseBranch); }
+	void visit(const ASTWhileStmt& node, int) override { count++; add(node.condition); add(node.body); }
+	void visit(const ASTFuncDeclStmt& node, int) override { count++; add(node.body); }
+};
+
+// Returns an empty Value if the operation can't be folded; it is
+// then left for the engine to evaluate (or report.)
+static Value FoldBinary(TokenType op, const Value& lhs, const Value& rhs)
+{
+	if (lhs.type != rhs.type || lhs.type.layout != Layout::tScalar)
+		return Value();
+
+	if (lhs.type.pType == PType::tNum) {
+		double a = lhs.vNumber;
+		double b = rhs.vNumber;
+		switch (op) {
+		case TokenType::PLUS: return Value::Number(a + b);
+		case TokenType::MINUS: return Value::Number(a - b);
+		case TokenType::MULT: return Value::Number(a * b);
+		case TokenType::DIVIDE: return Value::Number(a / b);
+		case TokenType::GREATER: return Value::Boolean(a > b);
+		case TokenType::GREATER_EQUAL: return Value::Boolean(a >= b);
+		case TokenType::LESS: return Value::Boolean(a < b);
+		case TokenType::LESS_EQUAL: return Value::Boolean(a <= b);
+		case TokenType::BANG_EQUAL: return Value::Boolean(a != b);
+		case TokenType::EQUAL_EQUAL: return Value::Boolean(a == b);
+		default: break;
+		}
+	}
+	else if (lhs.type.pType == PType::tBool) {
+		switch (op) {
+		case TokenType::BANG_EQUAL: return Value::Boolean(lhs.vBoolean != rhs.vBoolean);
+		case TokenType::EQUAL_EQUAL: return Value::Boolean(lhs.vBoolean == rhs.vBoolean);
+		default: break;
+		}
+	}
+	else if (lhs.type.pType == PType::tStr) {
+		// Only concatenation: the engines don't agree (yet) on string comparison.
+		if (op == TokenType::PLUS)
+			return Value::String(lhs.str() + rhs.str());
+	}
+	return Value();
+}
+
+// A replacement statement keeps the line of the original.
+template<typename T, typename... Args>
+static std::shared_ptr<T> Rebuild(const ASTStmtNode& node, Args&&... args)
+{
+	std::shared_ptr<T> stmt = std::make_shared<T>(std::forward<Args>(args)...);
+	stmt->line = node.line;
+	return stmt;
+}
+
+/*
+* The nodes are shared and visited as const, so rather than editing
+* in place the folder builds a replacement for any node whose children
+* changed. A fold() returns the original pointer if nothing changed.
+*/
+class ASTFolder : public ASTExprVisitor, public ASTStmtVisitor {
+public:
+	ASTExprPtr fold(const ASTExprPtr& expr);
+	// Returns null if the statement was removed.
+	ASTStmtPtr fold(const ASTStmtPtr& stmt);
+
+	void visit(const ASTValueExpr& node, int depth) override;
+	void visit(const ASTIdentifierExpr& node, int depth) override;
+	void visit(const ASTAssignmentExpr& node, int depth) override;
+	void visit(const ASTBinaryExpr& node, int depth) override;
+	void visit(const ASTUnaryExpr& node, int depth) override;
+	void visit(const ASTLogicalExpr& node, int depth) override;
+	void visit(const ASTCallExpr& node, int depth) override;
+	void visit(const ASTListExpr& node, int depth) override;
+	void visit(const ASTIndexExpr& node, int depth) override;
+	void visit(const ASTIndexAssignExpr& node, int depth) override;
+	void visit(const ASTSliceExpr& node, int depth) override;
+	void visit(const ASTListFuncExpr& node, int depth) override;
+
+	void visit(const ASTExprStmt& node, int depth) override;
+	void visit(const ASTReturnStmt& node, int depth) override;
+	void visit(const ASTBlockStmt& node, int depth) override;
+	void visit(const ASTVarDeclStmt& node, int depth) override;
+	void visit(const ASTIfStmt& node, int depth) override;
+	void visit(const ASTWhileStmt& node, int depth) override;
+	void visit(const ASTFuncDeclStmt& node, int depth) override;
+
+private:
+	// Folds each expression; returns true if any changed.
+	bool foldAll(const std::vector<ASTExprPtr>& in, std::vector<ASTExprPtr>& out);
+
+	// Set by a visit() when the node is replaced (or removed.)
+	ASTExprPtr exprResult;
+	ASTStmtPtr stmtResult;
+	bool stmtRemoved = false;
+};
+
+ASTExprPtr ASTFolder::fold(const ASTExprPtr& expr)
+{
+	if (!expr) return expr;
+	exprResult = nullptr;
+	expr->accept(*this, 0);
+
+	ASTExprPtr result;
+	result.swap(exprResult);
+	return result ? result : expr;
+}
+
+ASTStmtPtr ASTFolder::fold(const ASTStmtPtr& stmt)
+{
+	if (!stmt) return stmt;
+	stmtResult = nullptr;
+	stmtRemoved = false;
+	stmt->accept(*this, 0);
+
+	ASTStmtPtr result;
+	result.swap(stmtResult);
+	bool removed = stmtRemoved;
+	stmtRemoved = false;
+
+	if (removed) return nullptr;
+	return result ? result : stmt;
+}
+
+void ASTFolder::visit(const ASTValueExpr&, int)
+{
+}
+
+void ASTFolder::visit(const ASTIdentifierExpr&, int)
+{
+}
+
+void ASTFolder::visit(const ASTAssignmentExpr& node, int)
+{
+	ASTExprPtr right = fold(node.right);
+	if (right != node.right)
+		exprResult = std::make_shared<ASTAssignmentExpr>(node.name, right);
+}
+
+void ASTFolder::visit(const ASTBinaryExpr& node, int)
+{
+	ASTExprPtr left = fold(node.left);
+	ASTExprPtr right = fold(node.right);
+
+	const ASTValueExpr* lhs = left->asValue();
+	const ASTValueExpr* rhs = right->asValue();
+	if (lhs && rhs) {
+		Value v = FoldBinary(node.type, lhs->value, rhs->value);
+		if (v.type != ValueType()) {
+			exprResult = std::make_shared<ASTValueExpr>(v);
+			return;
+		}
+	}
+	if (left != node.left || right != node.right)
+		exprResult = std::make_shared<ASTBinaryExpr>(node.type, left, right);
+}
+
+void ASTFolder::visit(const ASTUnaryExpr& node, int)
+{
+	ASTExprPtr right = fold(node.right);
+
+	if (const ASTValueExpr* v = right->asValue()) {
+		if (node.type == TokenType::MINUS && v->value.type == ValueType(PType::tNum)) {
+			exprResult = std::make_shared<ASTValueExpr>(Value::Number(-v->value.vNumber));
+			return;
+		}
+		if (node.type == TokenType::BANG) {
+			exprResult = std::make_shared<ASTValueExpr>(Value::Boolean(!v->value.isTruthy()));
+			return;
+		}
+	}
+	if (right != node.right)
+		exprResult = std::make_shared<ASTUnaryExpr>(node.type, right);
+}
+
+void ASTFolder::visit(const ASTLogicalExpr& node, int)
+{
+	ASTExprPtr left = fold(node.left);
+	ASTExprPtr right = fold(node.right);
+
+	// A constant left side either short circuits, or the
+	// expression is the right side.
+	if (const ASTValueExpr* v = left->asValue()) {
+		bool truthy = v->value.isTruthy();
+		if (node.type == TokenType::LOGIC_OR)
+			exprResult = truthy ? std::make_shared<ASTValueExpr>(Value::Boolean(true)) : right;
+		else
+			exprResult = truthy ? right : std::make_shared<ASTValueExpr>(Value::Boolean(false));
+		return;
+	}
+	if (left != node.left || right != node.right)
+		exprResult = std::make_shared<ASTLogicalExpr>(node.type, left, right);
+}
+
+void ASTFolder::visit(const ASTCallExpr& node, int)
+{
+	ASTExprPtr callee = fold(node.callee);
+	bool changed = callee != node.callee;
+
+	std::vector<ASTExprPtr> arguments;
+	for (const ASTExprPtr& arg : node.arguments) {
+		arguments.push_back(fold(arg));
+		changed = changed || arguments.back() != arg;
+	}
+	if (changed)
+		exprResult = std::make_shared<ASTCallExpr>(callee, node.paren, arguments);
+}
+
+bool ASTFolder::foldAll(const std::vector<ASTExprPtr>& in, std::vector<ASTExprPtr>& out)
+{
+	bool changed = false;
+	for (const ASTExprPtr& e : in) {
+		out.push_back(fold(e));
+		changed = changed || out.back() != e;
+	}
+	return changed;
+}
+
+void ASTFolder::visit(const ASTListExpr& node, int)
+{
+	std::vector<ASTExprPtr> elements;
+	if (foldAll(node.elements, elements))
+		exprResult = std::make_shared<ASTListExpr>(elements, node.type);
+}
+
+void ASTFolder::visit(const ASTIndexExpr& node, int)
+{
+	ASTExprPtr list = fold(node.list);
+	ASTExprPtr index = fold(node.index);
+	if (list != node.list || index != node.index)
+		exprResult = std::make_shared<ASTIndexExpr>(list, index);
+}
+
+void ASTFolder::visit(const ASTIndexAssignExpr& node, int)
+{
+	ASTExprPtr list = fold(node.list);
+	ASTExprPtr index = fold(node.index);
+	ASTExprPtr right = fold(node.right);
+	if (list != node.list || index != node.index || right != node.right)
+		exprResult = std::make_shared<ASTIndexAssignExpr>(list, index, right);
+}
+
+void ASTFolder::visit(const ASTSliceExpr& node, int)
+{
+	ASTExprPtr list = fold(node.list);
+	ASTExprPtr begin = fold(node.begin);
+	ASTExprPtr end = fold(node.end);
+	if (list != node.list || begin != node.begin || end != node.end)
+		exprResult = std::make_shared<ASTSliceExpr>(list, begin, end);
+}
+
+void ASTFolder::visit(const ASTListFuncExpr& node, int)
+{
+	std::vector<ASTExprPtr> arguments;
+	if (foldAll(node.arguments, arguments))
+		exprResult = std::make_shared<ASTListFuncExpr>(node.func, arguments);
+}
+
+void ASTFolder::visit(const ASTExprStmt& node, int)
+{
+	// A constant expression statement is kept: at the top level it is the result.
+	ASTExprPtr expr = fold(node.expr);
+	if (expr != node.expr)
+		stmtResult = Rebuild<ASTExprStmt>(node, expr);
+}
+
+void ASTFolder::visit(const ASTReturnStmt& node, int)
+{
+	ASTExprPtr expr = fold(node.expr);
+	if (expr != node.expr)
+		stmtResult = Rebuild<ASTReturnStmt>(node, expr);
+}
+
+void ASTFolder::visit(const ASTBlockStmt& node, int)
+{
+	bool changed = false;
+	std::vector<ASTStmtPtr> stmts;
+	for (const ASTStmtPtr& stmt : node.stmts) {
+		ASTStmtPtr s = fold(stmt);
+		changed = changed || s != stmt;
+		if (s) stmts.push_back(s);
+	}
+	if (changed)
+		stmtResult = Rebuild<ASTBlockStmt>(node, stmts);
+}
+
+void ASTFolder::visit(const ASTVarDeclStmt& node, int)
+{
+	ASTExprPtr expr = fold(node.expr);
+	if (expr != node.expr)
+		stmtResult = Rebuild<ASTVarDeclStmt>(node, node.name, node.valueType, expr);
+}
+
+void ASTFolder::visit(const ASTIfStmt& node, int)
+{
+	ASTExprPtr condition = fold(node.condition);
+	ASTStmtPtr thenBranch = fold(node.thenBranch);
+	ASTStmtPtr elseBranch = fold(node.elseBranch);
+	// Branches are blocks, which are never removed.
+	REQUIRE(thenBranch);
+
+	// The branch taken is a block, so replacing the 'if' keeps the scope.
+	if (const ASTValueExpr* v = condition->asValue()) {
+		if (v->value.isTruthy())
+			stmtResult = thenBranch;
+		else if (elseBranch)
+			stmtResult = elseBranch;
+		else
+			stmtRemoved = true;
+		return;
+	}
+	if (condition != node.condition || thenBranch != node.thenBranch || elseBranch != node.elseBranch)
+		stmtResult = Rebuild<ASTIfStmt>(node, condition, thenBranch, elseBranch);
+}
+
+void ASTFolder::visit(const ASTWhileStmt& node, int)
+{
+	ASTExprPtr condition = fold(node.condition);
+	if (const ASTValueExpr* v = condition->asValue()) {
+		if (!v->value.isTruthy()) {
+			stmtRemoved = true;
+			return;
+		}
+	}
+	ASTStmtPtr body = fold(node.body);
+	REQUIRE(body);
+	if (condition != node.condition || body != node.body)
+		stmtResult = Rebuild<ASTWhileStmt>(node, condition, body);
+}
+
+void ASTFolder::visit(const ASTFuncDeclStmt& node, int)
+{
+	ASTStmtPtr body = fold(node.body);
+	if (body != node.body)
+		stmtResult = Rebuild<ASTFuncDeclStmt>(node, node.name, node.params, node.returnType, body);
+}
+
+int OptimizeAST(std::vector<ASTStmtPtr>& stmts)
+{
+	ASTCounter before;
+	for (const ASTStmtPtr& stmt : stmts) before.add(stmt);
+
+	ASTFolder folder;
+	std::vector<ASTStmtPtr> out;
+	for (const ASTStmtPtr& stmt : stmts) {
+		ASTStmtPtr s = folder.fold(stmt);
+		if (s) out.push_back(s);
+	}
+	stmts.swap(out);
+
+	ASTCounter after;
+	for (const ASTStmtPtr& stmt : stmts) after.add(stmt);
+	return before.count - after.count;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "ast.h"
+
+/*
+* Optimization pass between the Parser and execution (either engine).
+* Folds binary, unary, and logical expressions of constant values
+* (`60 * 60 * 24` becomes `86400`) and prunes if / while statements
+* with constant conditions (`if false { ... }` is removed.)
+* Returns the number of AST nodes removed.
+*/
+int OptimizeAST(std::vector<ASTStmtPtr>& stmts);
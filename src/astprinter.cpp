@@ -42,9 +42,16 @@ void ASTPrinter::visit(const ASTWhileStmt& node, int depth)
 	node.body->accept(*this, depth + 1);
 }
 
+void ASTPrinter::visit(const ASTFuncDeclStmt& node, int depth)
+{
+	fmt::print("STMT func decl: {}: {}\n", node.name, node.returnType.typeName());
+	if (node.body)
+		node.body->accept(*this, depth + 1);
+}
+
 void ASTPrinter::visit(const ASTVarDeclStmt& node, int depth)
 {
-	fmt::print("STMT var decl: {}: {}\n", node.name, node.valueType.typeName());
+	fmt::print("STMT var decl: {}: {}\n", node.name.str(), node.valueType.typeName());
 	if (node.expr)
 		node.expr->accept(*this, depth + 1);
 }
@@ -58,13 +65,13 @@ void ASTPrinter::visit(const ASTValueExpr& node, int depth)
 void ASTPrinter::visit(const ASTIdentifierExpr& node, int depth)
 {
 	fmt::print("{: >{}}", "", depth * 2);
-	fmt::print("Identifier: {}\n", node.name);
+	fmt::print("Identifier: {}\n", node.name.str());
 }
 
 void ASTPrinter::visit(const ASTAssignmentExpr& node, int depth)
 {
 	fmt::print("{: >{}}", "", depth * 2);
-	fmt::print("Assignment: {}\n", node.name);
+	fmt::print("Assignment: {}\n", node.name.str());
 
 	node.right->accept(*this, depth + 1);
 }
@@ -112,6 +119,56 @@ void ASTPrinter::visit(const ASTCallExpr& node, int depth)
 	node.callee->accept(*this, depth + 1);
 }
 
+void ASTPrinter::visit(const ASTListExpr& node, int depth)
+{
+	fmt::print("{: >{}}", "", depth * 2);
+	fmt::print("List: {}\n", node.type.typeName());
+	for (const ASTExprPtr& e : node.elements)
+		e->accept(*this, depth + 1);
+}
+
+void ASTPrinter::visit(const ASTIndexExpr& node, int depth)
+{
+	fmt::print("{: >{}}", "", depth * 2);
+	fmt::print("Index:\n");
+	node.list->accept(*this, depth + 1);
+	node.index->accept(*this, depth + 1);
+}
+
+void ASTPrinter::visit(const ASTIndexAssignExpr& node, int depth)
+{
+	fmt::print("{: >{}}", "", depth * 2);
+	fmt::print("Index assignment:\n");
+	node.list->accept(*this, depth + 1);
+	node.index->accept(*this, depth + 1);
+	node.right->accept(*this, depth + 1);
+}
+
+void ASTPrinter::visit(const ASTSliceExpr& node, int depth)
+{
+	fmt::print("{: >{}}", "", depth * 2);
+	fmt::print("Slice:\n");
+	node.list->accept(*this, depth + 1);
+	for (const ASTExprPtr& bound : { node.begin, node.end }) {
+		if (bound) {
+			bound->accept(*this, depth + 1);
+		}
+		else {
+			fmt::print("{: >{}}", "", (depth + 1) * 2);
+			fmt::print("(default)\n");
+		}
+	}
+}
+
+void ASTPrinter::visit(const ASTListFuncExpr& node, int depth)
+{
+	static const char* kNames[] = { "append", "pop", "size", "has", "remove", "keys" };
+	fmt::print("{: >{}}", "", depth * 2);
+	fmt::print("List func: {}\n", kNames[(int)node.func]);
+	for (const ASTExprPtr& arg : node.arguments)
+		arg->accept(*this, depth + 1);
+}
+
 void ASTPrinter::print(const ASTExprPtr& ast)
 {
 	ast->accept(*this, 0);
@@ -11,6 +11,11 @@ public:
 	void visit(const ASTUnaryExpr& node, int depth) override;
 	void visit(const ASTLogicalExpr& node, int depth) override;
 	void visit(const ASTCallExpr& node, int depth) override;
+	void visit(const ASTListExpr& node, int depth) override;
+	void visit(const ASTIndexExpr& node, int depth) override;
+	void visit(const ASTIndexAssignExpr& node, int depth) override;
+	void visit(const ASTSliceExpr& node, int depth) override;
+	void visit(const ASTListFuncExpr& node, int depth) override;
 
 	void visit(const ASTExprStmt&, int depth) override;
 	void visit(const ASTReturnStmt&, int depth) override;
@@ -18,6 +23,7 @@ public:
 	void visit(const ASTBlockStmt&, int depth) override;
 	void visit(const ASTIfStmt& node, int depth) override;
 	void visit(const ASTWhileStmt& node, int depth) override;
+	void visit(const ASTFuncDeclStmt& node, int depth) override;
 
 	void print(const ASTExprPtr& ast);
 };
\ No newline at end of file
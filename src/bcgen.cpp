@@ -1,54 +1,381 @@
 #include "bcgen.h"
+#include "errorreporting.h"
+
+#include <fmt/core.h>
+
+static constexpr uint32_t kMaxJump = 0xffff;
+
+// Emits a forward jump with a placeholder offset, and returns
+// where it is so it can be patched.
+static size_t EmitJump(std::vector<Instruction>& bc, OpCode op)
+{
+	bc.push_back(PackOpCode(op, 0));
+	return bc.size() - 1;
+}
+
+// Patches the jump at 'at' to land on the next instruction emitted.
+static void PatchJump(std::vector<Instruction>& bc, size_t at)
+{
+	OpCode op = OpCode::NO_OP;
+	uint32_t index = 0;
+	UnpackOpCode(bc[at], op, index);
+
+	size_t offset = bc.size() - (at + 1);
+	if (offset > kMaxJump) {
+		ErrorReporter::report("BCGen", 0, fmt::format("Jump of {} instructions is too far", offset));
+		return;
+	}
+	bc[at] = PackOpCode(op, static_cast<uint32_t>(offset));
+}
+
+// Emits a backward jump to 'target'
+static void EmitLoop(std::vector<Instruction>& bc, size_t target)
+{
+	size_t offset = bc.size() + 1 - target;
+	if (offset > kMaxJump) {
+		ErrorReporter::report("BCGen", 0, fmt::format("Loop of {} instructions is too far", offset));
+		return;
+	}
+	bc.push_back(PackOpCode(OpCode::LOOP, static_cast<uint32_t>(offset)));
+}
+
+bool BCResolver::resolveLocal(const std::string& name, uint32_t& slot) const
+{
+	// Search backwards so the innermost scope wins.
+	for (size_t i = locals.size(); i > 0; i--) {
+		if (locals[i - 1].name == name) {
+			slot = static_cast<uint32_t>(i - 1);
+			return true;
+		}
+	}
+	return false;
+}
+
+bool BCResolver::declareLocal(const std::string& name)
+{
+	// A local can shadow a global or a local in an enclosing scope,
+	// but can't be re-declared in its own scope.
+	for (size_t i = locals.size(); i > 0 && locals[i - 1].depth == scopeDepth; i--) {
+		if (locals[i - 1].name == name)
+			return false;
+	}
+	locals.push_back({ name, scopeDepth });
+	return true;
+}
+
+uint32_t BCResolver::popScope()
+{
+	REQUIRE(scopeDepth > 0);
+	uint32_t n = 0;
+	while (!locals.empty() && locals.back().depth == scopeDepth) {
+		locals.pop_back();
+		n++;
+	}
+	scopeDepth--;
+	return n;
+}
 
 void BCExprGenerator::visit(const ASTValueExpr& node, int depth)
 {
 	(void)depth;
 	uint32_t slot = pool.add(node.value);
-	bc.push_back(PackOpCode(OpCode::PUSH, slot));
+	EmitOpCode(bc, OpCode::PUSH, slot);
 }
 
 void BCExprGenerator::visit(const ASTIdentifierExpr& node, int depth)
 {
 	(void)depth;
-	uint32_t slot = pool.add(Value::String(node.name));
-	bc.push_back(PackOpCode(OpCode::PUSH, slot));
-	bc.push_back(PackOpCode(OpCode::LOAD));
+	uint32_t slot = 0;
+	if (resolver.resolveLocal(node.name.str(), slot))
+		EmitOpCode(bc, OpCode::LOAD_LOCAL, slot);
+	else
+		EmitOpCode(bc, OpCode::LOAD_GLOBAL, resolver.resolveGlobal(node.name.str()));
 }
 
-void BCExprGenerator::visit(const ASTBinaryExpr& node, int depth)
+void BCExprGenerator::visit(const ASTAssignmentExpr& node, int depth)
 {
-	(void)depth;
+	node.right->accept(*this, depth + 1);
 
-	// These are alreaded 'visited' 
+	uint32_t slot = 0;
+	if (resolver.resolveLocal(node.name.str(), slot))
+		EmitOpCode(bc, OpCode::STORE_LOCAL, slot);
+	else
+		EmitOpCode(bc, OpCode::STORE_GLOBAL, resolver.resolveGlobal(node.name.str()));
+}
+
+// The typed op code for an operator, if there is one for the operand type.
+static OpCode TypedBinaryOp(TokenType op, ValueType type)
+{
+	if (type == ValueType(PType::tNum)) {
+		switch (op) {
+		case TokenType::PLUS: return OpCode::ADD_NUM;
+		case TokenType::MINUS: return OpCode::SUB_NUM;
+		case TokenType::MULT: return OpCode::MUL_NUM;
+		case TokenType::DIVIDE: return OpCode::DIV_NUM;
+		case TokenType::EQUAL_EQUAL: return OpCode::EQ_NUM;
+		case TokenType::BANG_EQUAL: return OpCode::NOT_EQ_NUM;
+		case TokenType::LESS: return OpCode::LESS_NUM;
+		case TokenType::LESS_EQUAL: return OpCode::LESS_EQUAL_NUM;
+		case TokenType::GREATER: return OpCode::GREATER_NUM;
+		case TokenType::GREATER_EQUAL: return OpCode::GREATER_EQUAL_NUM;
+		default: break;
+		}
+	}
+	else if (type == ValueType(PType::tBool)) {
+		if (op == TokenType::EQUAL_EQUAL) return OpCode::EQ_BOOL;
+		if (op == TokenType::BANG_EQUAL) return OpCode::NOT_EQ_BOOL;
+	}
+	else if (type == ValueType(PType::tStr)) {
+		if (op == TokenType::PLUS) return OpCode::CONCAT_STR;
+	}
+	return OpCode::NO_OP;
+}
+
+void BCExprGenerator::visit(const ASTBinaryExpr& node, int depth)
+{
 	REQUIRE(node.left);
 	REQUIRE(node.right);
 
-	// So we just need to ad the operation.
+	node.left->accept(*this, depth + 1);
+	node.right->accept(*this, depth + 1);
+
+	// If the TypeChecker resolved the operands, use the unchecked op code.
+	if (node.left->staticType == node.right->staticType) {
+		OpCode typed = TypedBinaryOp(node.type, node.left->staticType);
+		if (typed != OpCode::NO_OP) {
+			bc.push_back(PackOpCode(typed));
+			return;
+		}
+	}
+
 	switch (node.type) {
 	case TokenType::PLUS: bc.push_back(PackOpCode(OpCode::ADD)); break;
 	case TokenType::MINUS: bc.push_back(PackOpCode(OpCode::SUB)); break;
 	case TokenType::MULT: bc.push_back(PackOpCode(OpCode::MUL)); break;
 	case TokenType::DIVIDE: bc.push_back(PackOpCode(OpCode::DIV)); break;
+	case TokenType::EQUAL_EQUAL: bc.push_back(PackOpCode(OpCode::EQUAL)); break;
+	case TokenType::BANG_EQUAL: bc.push_back(PackOpCode(OpCode::NOT_EQUAL)); break;
+	case TokenType::LESS: bc.push_back(PackOpCode(OpCode::LESS)); break;
+	case TokenType::LESS_EQUAL: bc.push_back(PackOpCode(OpCode::LESS_EQUAL)); break;
+	case TokenType::GREATER: bc.push_back(PackOpCode(OpCode::GREATER)); break;
+	case TokenType::GREATER_EQUAL: bc.push_back(PackOpCode(OpCode::GREATER_EQUAL)); break;
 	default: REQUIRE(false);
 	}
 }
 
 void BCExprGenerator::visit(const ASTUnaryExpr& node, int depth)
 {
-	(void)depth;
-
-	// These are alreaded 'visited' 
 	REQUIRE(node.right);
+	node.right->accept(*this, depth + 1);
 
-	// So we just need to ad the operation.
 	switch (node.type) {
-	case TokenType::MINUS: bc.push_back(PackOpCode(OpCode::NEGATE)); break;
+	case TokenType::MINUS:
+		bc.push_back(PackOpCode(node.right->staticType == ValueType(PType::tNum) ? OpCode::NEGATE_NUM : OpCode::NEGATE));
+		break;
 	case TokenType::BANG: bc.push_back(PackOpCode(OpCode::NOT)); break;
 	default: REQUIRE(false);
 	}
 }
 
+void BCExprGenerator::visit(const ASTLogicalExpr& node, int depth)
+{
+	REQUIRE(node.type == TokenType::LOGIC_AND || node.type == TokenType::LOGIC_OR);
+
+	// Same semantics as the Interpreter: if the left side decides
+	// the result, it is a bool. Else the result is the right side.
+	//		left
+	//		JUMP_IF_FALSE (and) / JUMP_IF_TRUE (or) -> shortCircuit
+	//		right
+	//		JUMP -> end
+	// shortCircuit:
+	//		PUSH false (and) / true (or)
+	// end:
+	bool isAnd = node.type == TokenType::LOGIC_AND;
+
+	node.left->accept(*this, depth + 1);
+	size_t shortCircuit = EmitJump(bc, isAnd ? OpCode::JUMP_IF_FALSE : OpCode::JUMP_IF_TRUE);
+	node.right->accept(*this, depth + 1);
+	size_t end = EmitJump(bc, OpCode::JUMP);
+
+	PatchJump(bc, shortCircuit);
+	uint32_t slot = pool.add(Value::Boolean(!isAnd));
+	EmitOpCode(bc, OpCode::PUSH, slot);
+	PatchJump(bc, end);
+}
+
+void BCExprGenerator::visit(const ASTCallExpr& node, int depth)
+{
+	node.callee->accept(*this, depth + 1);
+	for (const ASTExprPtr& arg : node.arguments) {
+		arg->accept(*this, depth + 1);
+	}
+	bc.push_back(PackOpCode(OpCode::CALL, static_cast<uint32_t>(node.arguments.size())));
+}
+
+void BCExprGenerator::visit(const ASTListExpr& node, int depth)
+{
+	for (const ASTExprPtr& e : node.elements) {
+		e->accept(*this, depth + 1);
+	}
+	if (node.elements.size() >= (1u << 24)) {
+		ErrorReporter::report("BCGen", 0, fmt::format("List literal of {} elements is too long", node.elements.size()));
+		return;
+	}
+	EmitOpCode(bc, OpCode::NEW_LIST, PackNewList(node.type.pType, static_cast<uint32_t>(node.elements.size())));
+}
+
+void BCExprGenerator::visit(const ASTIndexExpr& node, int depth)
+{
+	node.list->accept(*this, depth + 1);
+	node.index->accept(*this, depth + 1);
+	bc.push_back(PackOpCode(OpCode::LOAD_INDEX));
+}
+
+void BCExprGenerator::visit(const ASTIndexAssignExpr& node, int depth)
+{
+	node.list->accept(*this, depth + 1);
+	node.index->accept(*this, depth + 1);
+	node.right->accept(*this, depth + 1);
+	bc.push_back(PackOpCode(OpCode::STORE_INDEX));
+}
+
+void BCExprGenerator::visit(const ASTSliceExpr& node, int depth)
+{
+	node.list->accept(*this, depth + 1);
+	uint32_t bounds = 0;
+	if (node.begin) {
+		node.begin->accept(*this, depth + 1);
+		bounds |= kSliceBegin;
+	}
+	if (node.end) {
+		node.end->accept(*this, depth + 1);
+		bounds |= kSliceEnd;
+	}
+	bc.push_back(PackOpCode(OpCode::LOAD_SLICE, bounds));
+}
+
+void BCExprGenerator::visit(const ASTListFuncExpr& node, int depth)
+{
+	for (const ASTExprPtr& arg : node.arguments) {
+		arg->accept(*this, depth + 1);
+	}
+	switch (node.func) {
+	case ListFunc::kAppend: bc.push_back(PackOpCode(OpCode::LIST_APPEND)); break;
+	case ListFunc::kPop: bc.push_back(PackOpCode(OpCode::LIST_POP)); break;
+	case ListFunc::kSize: bc.push_back(PackOpCode(OpCode::LIST_SIZE)); break;
+	case ListFunc::kHas: bc.push_back(PackOpCode(OpCode::MAP_HAS)); break;
+	case ListFunc::kRemove: bc.push_back(PackOpCode(OpCode::MAP_REMOVE)); break;
+	case ListFunc::kKeys: bc.push_back(PackOpCode(OpCode::MAP_KEYS)); break;
+	}
+}
+
 void BCExprGenerator::generate(const ASTExprNode& node)
 {
 	node.accept(*this, 0);
 }
+
+void BCStmtGenerator::generate(const ASTStmtNode& node)
+{
+	statement(node, 0);
+}
+
+void BCStmtGenerator::statement(const ASTStmtNode& node, int depth)
+{
+	if (lines && node.line >= 0) {
+		uint32_t at = static_cast<uint32_t>(bc.size());
+		uint32_t line = static_cast<uint32_t>(node.line);
+		if (!lines->empty() && lines->back().instruction == at)
+			lines->back().line = line;
+		else if (lines->empty() || lines->back().line != line)
+			lines->push_back({ at, line });
+	}
+	node.accept(*this, depth);
+}
+
+void BCStmtGenerator::visit(const ASTExprStmt& node, int depth)
+{
+	// The for() statement can have an empty increment.
+	if (!node.expr) return;
+
+	node.expr->accept(exprGen, depth + 1);
+	bc.push_back(PackOpCode(depth == 0 ? OpCode::RESULT : OpCode::POP));
+}
+
+void BCStmtGenerator::visit(const ASTReturnStmt& node, int depth)
+{
+	node.expr->accept(exprGen, depth + 1);
+	bc.push_back(PackOpCode(OpCode::RESULT));
+}
+
+void BCStmtGenerator::visit(const ASTBlockStmt& node, int depth)
+{
+	resolver.pushScope();
+	for (const auto& stmt : node.stmts) {
+		statement(*stmt, depth + 1);
+	}
+	uint32_t nLocals = resolver.popScope();
+	if (nLocals)
+		EmitOpCode(bc, OpCode::POP_SCOPE, nLocals);
+}
+
+void BCStmtGenerator::visit(const ASTVarDeclStmt& node, int depth)
+{
+	if (node.expr)
+		node.expr->accept(exprGen, depth + 1);
+	else
+		bc.push_back(PackOpCode(OpCode::DEFAULT, PackValueType(node.valueType)));
+
+	if (resolver.depth() == 0) {
+		EmitOpCode(bc, OpCode::DEFINE_GLOBAL, resolver.resolveGlobal(node.name.str()));
+	}
+	else if (!resolver.declareLocal(node.name.str())) {
+		ErrorReporter::report("BCGen", 0, fmt::format("Local variable {} already defined", node.name.str()));
+	}
+	// else the value on the stack is the local
+}
+
+void BCStmtGenerator::visit(const ASTIfStmt& node, int depth)
+{
+	//		condition
+	//		JUMP_IF_FALSE -> else
+	//		then
+	//		JUMP -> end				(if there is an else)
+	// else:
+	//		else
+	// end:
+	node.condition->accept(exprGen, depth + 1);
+	size_t elseJump = EmitJump(bc, OpCode::JUMP_IF_FALSE);
+	statement(*node.thenBranch, depth + 1);
+
+	if (node.elseBranch) {
+		size_t endJump = EmitJump(bc, OpCode::JUMP);
+		PatchJump(bc, elseJump);
+		statement(*node.elseBranch, depth + 1);
+		PatchJump(bc, endJump);
+	}
+	else {
+		PatchJump(bc, elseJump);
+	}
+}
+
+void BCStmtGenerator::visit(const ASTWhileStmt& node, int depth)
+{
+	// start:
+	//		condition
+	//		JUMP_IF_FALSE -> end
+	//		body
+	//		LOOP -> start
+	// end:
+	size_t start = bc.size();
+	node.condition->accept(exprGen, depth + 1);
+	size_t exitJump = EmitJump(bc, OpCode::JUMP_IF_FALSE);
+	statement(*node.body, depth + 1);
+	EmitLoop(bc, start);
+	PatchJump(bc, exitJump);
+}
+
+void BCStmtGenerator::visit(const ASTFuncDeclStmt& node, int depth)
+{
+	(void)depth;
+	ErrorReporter::report("BCGen", 0, fmt::format("func '{}': functions not yet implemented", node.name));
+}
@@ -2,29 +2,85 @@
 
 #include "ast.h"
 
+/*
+* Resolves variable names to slots at compile time. Locals are
+* slots on the Machine stack, in declaration order. Anything else
+* is a global.
+*/
+class BCResolver {
+public:
+	BCResolver(GlobalTable& globals) : globals(globals) {}
+
+	// Returns true and sets the slot if 'name' is a local in scope.
+	bool resolveLocal(const std::string& name, uint32_t& slot) const;
+	uint32_t resolveGlobal(const std::string& name) { return globals.resolve(name); }
+
+	// Returns false if 'name' is already declared in the current scope.
+	bool declareLocal(const std::string& name);
+
+	void pushScope() { scopeDepth++; }
+	uint32_t popScope();	// returns the number of locals that went out of scope
+	int depth() const { return scopeDepth; }
+
+private:
+	struct Local {
+		std::string name;
+		int depth = 0;
+	};
+	std::vector<Local> locals;
+	int scopeDepth = 0;
+	GlobalTable& globals;
+};
+
 class BCExprGenerator : public ASTExprVisitor {
 public:
-	BCExprGenerator(std::vector<Instruction>& bc, ConstPool& pool) : bc(bc), pool(pool) {}
+	BCExprGenerator(std::vector<Instruction>& bc, ConstPool& pool, BCResolver& resolver) : bc(bc), pool(pool), resolver(resolver) {}
 	void generate(const ASTExprNode& node);
 
 	void visit(const ASTValueExpr& node, int depth) override;
 	void visit(const ASTIdentifierExpr& node, int depth) override;
+	void visit(const ASTAssignmentExpr& node, int depth) override;
 	void visit(const ASTBinaryExpr& node, int depth) override;
 	void visit(const ASTUnaryExpr& node, int depth) override;
+	void visit(const ASTLogicalExpr& node, int depth) override;
+	void visit(const ASTCallExpr& node, int depth) override;
+	void visit(const ASTListExpr& node, int depth) override;
+	void visit(const ASTIndexExpr& node, int depth) override;
+	void visit(const ASTIndexAssignExpr& node, int depth) override;
+	void visit(const ASTSliceExpr& node, int depth) override;
+	void visit(const ASTListFuncExpr& node, int depth) override;
 
 private:
 	std::vector<Instruction>& bc;
 	ConstPool& pool;
+	BCResolver& resolver;
 };
 
+/*
+* Compiles statements to byte code. Each top level statement
+* leaves the stack as it found it; an expression (or return)
+* at the top level stores its value with the RESULT op code.
+*/
 class BCStmtGenerator : public ASTStmtVisitor {
 public:
-	BCStmtGenerator(std::vector<Instruction>& bc, ConstPool& pool) : bc(bc), pool(pool) {}
+	// If 'lines' is provided, the debug line table is written to it.
+	BCStmtGenerator(std::vector<Instruction>& bc, ConstPool& pool, GlobalTable& globals, std::vector<LineInfo>* lines = nullptr) : bc(bc), pool(pool), lines(lines), resolver(globals), exprGen(bc, pool, resolver) {}
 	void generate(const ASTStmtNode& node);
 
-	void visit(const ASTExprStmt& node, int) override;
+	void visit(const ASTExprStmt& node, int depth) override;
+	void visit(const ASTReturnStmt& node, int depth) override;
+	void visit(const ASTBlockStmt& node, int depth) override;
+	void visit(const ASTVarDeclStmt& node, int depth) override;
+	void visit(const ASTIfStmt& node, int depth) override;
+	void visit(const ASTWhileStmt& node, int depth) override;
+	void visit(const ASTFuncDeclStmt& node, int depth) override;
 
 private:
+	void statement(const ASTStmtNode& node, int depth);	// records the line, and generates
+
 	std::vector<Instruction>& bc;
 	ConstPool& pool;
+	std::vector<LineInfo>* lines;
+	BCResolver resolver;
+	BCExprGenerator exprGen;
 };
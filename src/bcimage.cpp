@@ -0,0 +1,348 @@
+#include "bcimage.h"
+#include "errorreporting.h"
+
+#include <fmt/core.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#	define WIN32_LEAN_AND_MEAN
+#	define NOMINMAX
+#	include <windows.h>
+#else
+#	include <fcntl.h>
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <unistd.h>
+#endif
+
+static constexpr uint32_t kFnvBasis = 2166136261u;
+
+static uint32_t Fnv1a(const uint8_t* p, size_t n, uint32_t h = kFnvBasis)
+{
+	for (size_t i = 0; i < n; i++) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+// The checksum is of the whole file, with the checksum field itself as 0.
+static uint32_t Checksum(const ImageHeader& header, const uint8_t* data, size_t size)
+{
+	ImageHeader h = header;
+	h.checksum = 0;
+	uint32_t hash = Fnv1a(reinterpret_cast<const uint8_t*>(&h), sizeof(h));
+	return Fnv1a(data + sizeof(h), size - sizeof(h), hash);
+}
+
+static void Append(std::vector<uint8_t>& buf, const void* p, size_t n)
+{
+	const uint8_t* b = static_cast<const uint8_t*>(p);
+	buf.insert(buf.end(), b, b + n);
+}
+
+static void AppendU32(std::vector<uint8_t>& buf, uint32_t v)
+{
+	Append(buf, &v, sizeof(v));
+}
+
+static void AppendString(std::vector<uint8_t>& buf, const std::string& s)
+{
+	AppendU32(buf, static_cast<uint32_t>(s.size()));
+	Append(buf, s.data(), s.size());
+}
+
+/*static*/ uint32_t BCImage::HashSource(const std::string& source)
+{
+	return Fnv1a(reinterpret_cast<const uint8_t*>(source.data()), source.size());
+}
+
+/*static*/ bool BCImage::write(const std::string& path,
+	const std::vector<Instruction>& bc,
+	const ConstPool& pool,
+	const GlobalTable& globals,
+	const std::vector<LineInfo>& lines,
+	uint32_t sourceHash)
+{
+	ImageHeader header = {};
+	header.magic = ImageHeader::kMagic;
+	header.version = ImageHeader::kVersion;
+	header.nOpCodes = static_cast<uint32_t>(OpCode::count);
+	header.sourceHash = sourceHash;
+	header.nInstructions = static_cast<uint32_t>(bc.size());
+	header.nLines = static_cast<uint32_t>(lines.size());
+	header.nGlobals = static_cast<uint32_t>(globals.size());
+	header.nConstants = static_cast<uint32_t>(pool.values.size());
+
+	std::vector<uint8_t> buf(sizeof(ImageHeader));
+	Append(buf, bc.data(), bc.size() * sizeof(Instruction));
+	Append(buf, lines.data(), lines.size() * sizeof(LineInfo));
+
+	header.globalsOffset = static_cast<uint32_t>(buf.size());
+	for (const std::string& name : globals.names) {
+		AppendString(buf, name);
+	}
+
+	header.constantsOffset = static_cast<uint32_t>(buf.size());
+	for (const Value& v : pool.values) {
+		if (v.type.layout != Layout::tScalar) {
+			ErrorReporter::report(path, 0, fmt::format("Can't write a '{}' constant", v.type.typeName()));
+			return false;
+		}
+		uint8_t type[2] = { static_cast<uint8_t>(v.type.pType), static_cast<uint8_t>(v.type.layout) };
+		Append(buf, type, 2);
+
+		switch (v.type.pType) {
+		case PType::tNum:
+			Append(buf, &v.vNumber, sizeof(v.vNumber));
+			break;
+		case PType::tBool:
+		{
+			uint8_t b = v.vBoolean ? 1 : 0;
+			Append(buf, &b, 1);
+			break;
+		}
+		case PType::tStr:
+		case PType::tFunc:
+			AppendString(buf, v.str());
+			break;
+		default:
+			ErrorReporter::report(path, 0, fmt::format("Can't write a '{}' constant", v.type.typeName()));
+			return false;
+		}
+	}
+
+	header.size = static_cast<uint32_t>(buf.size());
+	memcpy(buf.data(), &header, sizeof(header));
+	header.checksum = Checksum(header, buf.data(), buf.size());
+	memcpy(buf.data(), &header, sizeof(header));
+
+	FILE* fp = fopen(path.c_str(), "wb");
+	if (!fp) {
+		ErrorReporter::report(path, 0, "Could not open for writing");
+		return false;
+	}
+	size_t written = fwrite(buf.data(), 1, buf.size(), fp);
+	bool ok = fclose(fp) == 0 && written == buf.size();
+	if (!ok) {
+		ErrorReporter::report(path, 0, "Could not write");
+	}
+	return ok;
+}
+
+bool BCImage::fail(const std::string& path, const std::string& message)
+{
+	ErrorReporter::report(path, 0, message);
+	close();
+	return false;
+}
+
+bool BCImage::load(const std::string& path)
+{
+	close();
+
+#ifdef _WIN32
+	HANDLE f = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (f == INVALID_HANDLE_VALUE)
+		return fail(path, "Could not open");
+	file = f;
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(f, &fileSize) || fileSize.QuadPart < (LONGLONG)sizeof(ImageHeader))
+		return fail(path, "Not a byte code image");
+	HANDLE m = CreateFileMappingA(f, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!m)
+		return fail(path, "Could not map");
+	mapping = m;
+	void* view = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+	if (!view)
+		return fail(path, "Could not map");
+	data = static_cast<const uint8_t*>(view);
+	size = static_cast<size_t>(fileSize.QuadPart);
+#else
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return fail(path, "Could not open");
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(ImageHeader)) {
+		::close(fd);
+		return fail(path, "Not a byte code image");
+	}
+	void* view = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);	// the mapping keeps the file
+	if (view == MAP_FAILED)
+		return fail(path, "Could not map");
+	data = static_cast<const uint8_t*>(view);
+	size = static_cast<size_t>(st.st_size);
+#endif
+
+	header = reinterpret_cast<const ImageHeader*>(data);
+	if (header->magic != ImageHeader::kMagic)
+		return fail(path, "Not a byte code image");
+	if (header->version != ImageHeader::kVersion || header->nOpCodes != static_cast<uint32_t>(OpCode::count))
+		return fail(path, fmt::format("Stale byte code image (version {}, expected {})", header->version, ImageHeader::kVersion));
+	if (header->size != size || Checksum(*header, data, size) != header->checksum)
+		return fail(path, "Corrupt byte code image (checksum)");
+
+	// The checksum passed, but the offsets still need to be in range.
+	uint64_t codeEnd = sizeof(ImageHeader)
+		+ uint64_t(header->nInstructions) * sizeof(Instruction)
+		+ uint64_t(header->nLines) * sizeof(LineInfo);
+	if (codeEnd > header->globalsOffset || header->globalsOffset > header->constantsOffset || header->constantsOffset > size)
+		return fail(path, "Corrupt byte code image (offsets)");
+
+	code = reinterpret_cast<const Instruction*>(data + sizeof(ImageHeader));
+	nCode = header->nInstructions;
+	lineTable = reinterpret_cast<const LineInfo*>(code + nCode);
+	nLines = header->nLines;
+
+	if (!readGlobals(path)) return false;
+	if (!readConstants(path)) return false;
+	return true;
+}
+
+bool BCImage::readGlobals(const std::string& path)
+{
+	const uint8_t* p = data + header->globalsOffset;
+	const uint8_t* end = data + header->constantsOffset;
+
+	globalNames.reserve(header->nGlobals);
+	for (uint32_t i = 0; i < header->nGlobals; i++) {
+		uint32_t len = 0;
+		if (end - p < (ptrdiff_t)sizeof(len))
+			return fail(path, "Corrupt byte code image (globals)");
+		memcpy(&len, p, sizeof(len));
+		p += sizeof(len);
+		if ((uint64_t)(end - p) < len)
+			return fail(path, "Corrupt byte code image (globals)");
+		globalNames.emplace_back(reinterpret_cast<const char*>(p), len);
+		p += len;
+	}
+	return true;
+}
+
+bool BCImage::readConstants(const std::string& path)
+{
+	const uint8_t* p = data + header->constantsOffset;
+	const uint8_t* end = data + size;
+
+	for (uint32_t i = 0; i < header->nConstants; i++) {
+		if (end - p < 2)
+			return fail(path, "Corrupt byte code image (constants)");
+		PType pType = static_cast<PType>(p[0]);
+		Layout layout = static_cast<Layout>(p[1]);
+		p += 2;
+		if (layout != Layout::tScalar)
+			return fail(path, "Corrupt byte code image (constants)");
+
+		Value v;
+		switch (pType) {
+		case PType::tNum:
+		{
+			double d = 0;
+			if (end - p < (ptrdiff_t)sizeof(d))
+				return fail(path, "Corrupt byte code image (constants)");
+			memcpy(&d, p, sizeof(d));
+			p += sizeof(d);
+			v = Value::Number(d);
+			break;
+		}
+		case PType::tBool:
+			if (end - p < 1)
+				return fail(path, "Corrupt byte code image (constants)");
+			v = Value::Boolean(*p != 0);
+			p += 1;
+			break;
+		case PType::tStr:
+		case PType::tFunc:
+		{
+			uint32_t len = 0;
+			if (end - p < (ptrdiff_t)sizeof(len))
+				return fail(path, "Corrupt byte code image (constants)");
+			memcpy(&len, p, sizeof(len));
+			p += sizeof(len);
+			if ((uint64_t)(end - p) < len)
+				return fail(path, "Corrupt byte code image (constants)");
+			std::string s(reinterpret_cast<const char*>(p), len);
+			p += len;
+			v = pType == PType::tStr ? Value::String(s) : Value::Func(s);
+			break;
+		}
+		default:
+			return fail(path, "Corrupt byte code image (constants)");
+		}
+
+		// The pool was unique when written, so the indices come back the same.
+		if (constPool.add(v) != i)
+			return fail(path, "Corrupt byte code image (constants)");
+	}
+	return true;
+}
+
+void BCImage::close()
+{
+#ifdef _WIN32
+	if (data) UnmapViewOfFile(data);
+	if (mapping) CloseHandle(static_cast<HANDLE>(mapping));
+	if (file) CloseHandle(static_cast<HANDLE>(file));
+	mapping = nullptr;
+	file = nullptr;
+#else
+	if (data) munmap(const_cast<uint8_t*>(data), size);
+#endif
+	data = nullptr;
+	size = 0;
+	header = nullptr;
+	code = nullptr;
+	nCode = 0;
+	lineTable = nullptr;
+	nLines = 0;
+	constPool = ConstPool();
+	globalNames.clear();
+}
+
+static bool IsGlobalOp(uint32_t op)
+{
+	switch (static_cast<OpCode>(op)) {
+	case OpCode::DEFINE_GLOBAL:
+	case OpCode::LOAD_GLOBAL:
+	case OpCode::STORE_GLOBAL:
+	case OpCode::SET_GLOBAL:
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool RelocateGlobals(const Instruction* code, size_t n, const std::vector<uint32_t>& slots, std::vector<Instruction>& out)
+{
+	out.clear();
+	out.reserve(n);
+	for (size_t i = 0; i < n; i++) {
+		uint32_t op = code[i] & 0xffff;
+		bool wide = op == static_cast<uint32_t>(OpCode::WIDE) && i + 1 < n;
+		uint32_t target = wide ? code[i + 1] & 0xffff : op;
+
+		if (!IsGlobalOp(target)) {
+			out.push_back(code[i]);
+			continue;
+		}
+
+		uint32_t slot = wide ? (code[i] >> 16) << 16 | (code[i + 1] >> 16) : code[i] >> 16;
+		if (slot >= slots.size())
+			return false;
+		uint32_t newSlot = slots[slot];
+
+		if (wide) {
+			out.push_back(op | ((newSlot >> 16) << 16));
+			out.push_back(target | ((newSlot & 0xffff) << 16));
+			i++;
+		}
+		else {
+			if (newSlot >= 0x10000)
+				return false;
+			out.push_back(op | (newSlot << 16));
+		}
+	}
+	return true;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "bytecode.h"
+
+#include <string>
+#include <vector>
+
+/*
+* A precompiled program: the byte code, ConstPool, globals, and debug
+* line table written to disk, so loading a script skips the Tokenizer,
+* Parser, and code generation.
+*
+* The file is memory mapped, and the instructions (and line table) are
+* used in place. The ConstPool is rebuilt on load, since strings need to
+* be allocated. Layout, in native byte order (the magic number checks):
+*	ImageHeader
+*	instructions	uint32_t[nInstructions]
+*	line table		LineInfo[nLines]
+*	globals			{ uint32_t length, chars }[nGlobals]
+*	constants		{ uint8_t pType, uint8_t layout, data }[nConstants]
+*
+* Errors are sent to the ErrorReporter, with the path as the context.
+*/
+struct ImageHeader {
+	static constexpr uint32_t kMagic = 0x42435253;	// "SRCB"
+	// Bump when the format, or the meaning of an op code, changes.
+	static constexpr uint32_t kVersion = 1;
+
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nOpCodes;			// OpCode::count when written
+	uint32_t checksum;			// FNV-1a of the whole file, with this field as 0
+	uint32_t size;				// of the file, in bytes
+	uint32_t sourceHash;		// of the source text; see BCImage::HashSource()
+	uint32_t nInstructions;
+	uint32_t nLines;
+	uint32_t nGlobals;
+	uint32_t globalsOffset;
+	uint32_t nConstants;
+	uint32_t constantsOffset;
+};
+
+class BCImage
+{
+public:
+	BCImage() = default;
+	~BCImage() { close(); }
+
+	BCImage(const BCImage&) = delete;
+	BCImage& operator=(const BCImage&) = delete;
+
+	// The globals are written by name, in slot order.
+	static bool write(const std::string& path,
+		const std::vector<Instruction>& bc,
+		const ConstPool& pool,
+		const GlobalTable& globals,
+		const std::vector<LineInfo>& lines,
+		uint32_t sourceHash);
+
+	static uint32_t HashSource(const std::string& source);
+
+	// Maps the file, and checks the header and checksum.
+	bool load(const std::string& path);
+	void close();
+	bool isOpen() const { return data != nullptr; }
+
+	const Instruction* instructions() const { return code; }
+	size_t numInstructions() const { return nCode; }
+	const ConstPool& pool() const { return constPool; }
+	const std::vector<std::string>& globals() const { return globalNames; }
+	uint32_t sourceHash() const { return header ? header->sourceHash : 0; }
+
+	const LineInfo* lines() const { return lineTable; }
+	size_t numLines() const { return nLines; }
+	int line(size_t instruction) const { return LineOfInstruction(lineTable, nLines, instruction); }
+
+private:
+	bool fail(const std::string& path, const std::string& message);
+	bool readConstants(const std::string& path);
+	bool readGlobals(const std::string& path);
+
+	const uint8_t* data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	void* file = nullptr;
+	void* mapping = nullptr;
+#endif
+
+	const ImageHeader* header = nullptr;
+	const Instruction* code = nullptr;
+	size_t nCode = 0;
+	const LineInfo* lineTable = nullptr;
+	size_t nLines = 0;
+	ConstPool constPool;
+	std::vector<std::string> globalNames;
+};
+
+// Copies the instructions, moving the global slots: the global at slot 'i'
+// in the image is at 'slots[i]' in the Machine. Returns false if a new
+// slot doesn't fit the instruction (it needs a WIDE prefix it doesn't have.)
+bool RelocateGlobals(const Instruction* code, size_t n, const std::vector<uint32_t>& slots, std::vector<Instruction>& out);
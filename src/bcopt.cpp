@@ -0,0 +1,169 @@
+#include "bcopt.h"
+
+struct DecodedOp {
+	OpCode op = OpCode::NO_OP;
+	uint32_t index = 0;
+};
+
+static bool IsJump(OpCode op)
+{
+	switch (op) {
+	case OpCode::JUMP:
+	case OpCode::JUMP_IF_FALSE:
+	case OpCode::JUMP_IF_TRUE:
+	case OpCode::LOOP:
+	case OpCode::JUMP_IF_NOT_LESS:
+	case OpCode::JUMP_IF_NOT_LESS_EQUAL:
+	case OpCode::JUMP_IF_NOT_GREATER:
+	case OpCode::JUMP_IF_NOT_GREATER_EQUAL:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static size_t JumpTarget(size_t at, const DecodedOp& d)
+{
+	return d.op == OpCode::LOOP ? at + 1 - d.index : at + 1 + d.index;
+}
+
+// ADD_CONST and ADD_LOCALS check their operands, so either ADD will do.
+static bool IsAdd(OpCode op)
+{
+	return op == OpCode::ADD || op == OpCode::ADD_NUM;
+}
+
+// The fused branch for a comparison followed by JUMP_IF_FALSE
+static OpCode CompareBranch(OpCode op)
+{
+	switch (op) {
+	case OpCode::LESS: return OpCode::JUMP_IF_NOT_LESS;
+	case OpCode::LESS_EQUAL: return OpCode::JUMP_IF_NOT_LESS_EQUAL;
+	case OpCode::GREATER: return OpCode::JUMP_IF_NOT_GREATER;
+	case OpCode::GREATER_EQUAL: return OpCode::JUMP_IF_NOT_GREATER_EQUAL;
+	case OpCode::LESS_NUM: return OpCode::JUMP_IF_NOT_LESS;
+	case OpCode::LESS_EQUAL_NUM: return OpCode::JUMP_IF_NOT_LESS_EQUAL;
+	case OpCode::GREATER_NUM: return OpCode::JUMP_IF_NOT_GREATER;
+	case OpCode::GREATER_EQUAL_NUM: return OpCode::JUMP_IF_NOT_GREATER_EQUAL;
+	default: return OpCode::NO_OP;
+	}
+}
+
+int OptimizeBytecode(std::vector<Instruction>& bc, std::vector<LineInfo>* lines)
+{
+	const size_t n = bc.size();
+	std::vector<DecodedOp> in(n);
+	for (size_t i = 0; i < n; i++) {
+		UnpackOpCode(bc[i], in[i].op, in[i].index);
+	}
+
+	// A sequence can only be fused if nothing jumps into the middle of it.
+	std::vector<bool> isTarget(n + 1, false);
+	for (size_t i = 0; i < n; i++) {
+		if (IsJump(in[i].op)) {
+			size_t target = JumpTarget(i, in[i]);
+			REQUIRE(target <= n);
+			isTarget[target] = true;
+		}
+	}
+	auto fusable = [&](size_t i, size_t len) {
+		if (i + len > n) return false;
+		for (size_t k = 1; k < len; k++) {
+			if (isTarget[i + k]) return false;
+		}
+		return true;
+	};
+
+	std::vector<Instruction> out;
+	out.reserve(n);
+	std::vector<size_t> newIndex(n + 1, 0);		// old index -> new index
+
+	// Jumps are re-targeted once all the new indices are known.
+	struct Fixup {
+		size_t at;
+		size_t oldTarget;
+	};
+	std::vector<Fixup> fixups;
+	auto emitJump = [&](OpCode op, size_t oldTarget) {
+		fixups.push_back({ out.size(), oldTarget });
+		out.push_back(PackOpCode(op));
+	};
+
+	for (size_t i = 0; i < n;) {
+		const DecodedOp& a = in[i];
+		const size_t start = out.size();
+		size_t len = 1;
+
+		// A WIDE prefix and its instruction are copied as is.
+		if (a.op == OpCode::WIDE) {
+			REQUIRE(i + 1 < n);
+			out.push_back(bc[i]);
+			out.push_back(bc[i + 1]);
+			len = 2;
+		}
+		// LOAD_LOCAL a; LOAD_LOCAL b; ADD -> ADD_LOCALS a b
+		else if (fusable(i, 3)
+			&& a.op == OpCode::LOAD_LOCAL && a.index < 0x100
+			&& in[i + 1].op == OpCode::LOAD_LOCAL && in[i + 1].index < 0x100
+			&& IsAdd(in[i + 2].op))
+		{
+			out.push_back(PackOpCode(OpCode::ADD_LOCALS, a.index | (in[i + 1].index << 8)));
+			len = 3;
+		}
+		// PUSH k; POP -> nothing
+		else if (fusable(i, 2) && a.op == OpCode::PUSH && in[i + 1].op == OpCode::POP) {
+			len = 2;
+		}
+		// PUSH k; ADD -> ADD_CONST k
+		else if (fusable(i, 2) && a.op == OpCode::PUSH && IsAdd(in[i + 1].op)) {
+			out.push_back(PackOpCode(OpCode::ADD_CONST, a.index));
+			len = 2;
+		}
+		// STORE_X n; POP -> SET_X n
+		else if (fusable(i, 2) && a.op == OpCode::STORE_LOCAL && in[i + 1].op == OpCode::POP) {
+			out.push_back(PackOpCode(OpCode::SET_LOCAL, a.index));
+			len = 2;
+		}
+		else if (fusable(i, 2) && a.op == OpCode::STORE_GLOBAL && in[i + 1].op == OpCode::POP) {
+			out.push_back(PackOpCode(OpCode::SET_GLOBAL, a.index));
+			len = 2;
+		}
+		// LESS; JUMP_IF_FALSE -> JUMP_IF_NOT_LESS (etc.)
+		else if (fusable(i, 2) && CompareBranch(a.op) != OpCode::NO_OP && in[i + 1].op == OpCode::JUMP_IF_FALSE) {
+			emitJump(CompareBranch(a.op), JumpTarget(i + 1, in[i + 1]));
+			len = 2;
+		}
+		else if (IsJump(a.op)) {
+			emitJump(a.op, JumpTarget(i, a));
+		}
+		else {
+			out.push_back(bc[i]);
+		}
+
+		// If the sequence was removed entirely, 'start' is whatever follows it.
+		for (size_t k = 0; k < len; k++) {
+			newIndex[i + k] = start;
+		}
+		i += len;
+	}
+	newIndex[n] = out.size();
+
+	for (const Fixup& f : fixups) {
+		OpCode op = static_cast<OpCode>(out[f.at] & 0xffff);
+		size_t target = newIndex[f.oldTarget];
+		// Sequences only shrink, so the offsets still fit.
+		uint32_t offset = static_cast<uint32_t>(op == OpCode::LOOP ? f.at + 1 - target : target - (f.at + 1));
+		out[f.at] = PackOpCode(op, offset);
+	}
+
+	if (lines) {
+		for (LineInfo& info : *lines) {
+			REQUIRE(info.instruction <= n);
+			info.instruction = static_cast<uint32_t>(newIndex[info.instruction]);
+		}
+	}
+
+	int removed = static_cast<int>(n - out.size());
+	bc.swap(out);
+	return removed;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "bytecode.h"
+
+/*
+* Peephole optimizer for the byte code from BCStmtGenerator.
+* Fuses common sequences into super instructions (ADD_CONST,
+* ADD_LOCALS, SET_LOCAL, JUMP_IF_NOT_LESS, etc.), removes
+* PUSH/POP pairs, and fixes up the jumps (and the line table, if given.)
+* Returns the number of instructions removed.
+*/
+int OptimizeBytecode(std::vector<Instruction>& bc, std::vector<LineInfo>* lines = nullptr);
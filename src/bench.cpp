@@ -0,0 +1,868 @@
+#include "bench.h"
+#include "bcgen.h"
+#include "bcimage.h"
+#include "bcopt.h"
+#include "boxedvalue.h"
+#include "errorreporting.h"
+#include "hashmap.h"
+#include "interpreter.h"
+#include "listops.h"
+#include "machine.h"
+#include "parser.h"
+#include "sort.h"
+#include "typecheck.h"
+#include "vecops.h"
+
+#include <fmt/core.h>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <map>
+#include <unordered_map>
+
+using BenchClock = std::chrono::steady_clock;
+
+static double ElapsedMS(BenchClock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(BenchClock::now() - start).count();
+}
+
+static bool CompileBench(const std::string& src, Machine& machine, std::vector<Instruction>& bc, ConstPool& pool, bool typeCheck = false)
+{
+	Tokenizer tokenizer(src);
+	Parser parser(tokenizer, "bench");
+	std::vector<ASTStmtPtr> stmts = parser.parseStmts();
+	if (typeCheck) {
+		TypeChecker checker;
+		checker.check(stmts);
+	}
+
+	BCStmtGenerator generator(bc, pool, machine.globalTable);
+	for (const auto& stmt : stmts) {
+		if (stmt) generator.generate(*stmt);
+	}
+	if (ErrorReporter::hasError()) {
+		ErrorReporter::printReports();
+		ErrorReporter::clear();
+		return false;
+	}
+	return true;
+}
+
+// In a block, so the variables are locals and the program can be run repeatedly.
+static const char* const kLoopSrc =
+	"{\n"
+	"	var sum = 0\n"
+	"	for var i = 0; i < 1000000; i = i + 1 {\n"
+	"		if i > 10 && sum >= 0 {\n"
+	"			sum = sum + i * 2 - 1\n"
+	"		}\n"
+	"	}\n"
+	"}";
+
+// Best of 'reps' runs, in ms.
+static double TimeExecute(Machine& machine, const std::vector<Instruction>& bc, const ConstPool& pool, int reps)
+{
+	double best = 0;
+	for (int i = 0; i < reps; i++) {
+		machine.instructionCount = 0;
+		BenchClock::time_point start = BenchClock::now();
+		machine.execute(bc, pool);
+		double ms = ElapsedMS(start);
+		if (i == 0 || ms < best) best = ms;
+	}
+	return best;
+}
+
+// Instructions per second through the switch and threaded dispatch.
+static void BenchDispatch()
+{
+	Heap heap;
+	Machine machine(heap);
+	std::vector<Instruction> bc;
+	ConstPool pool;
+	if (!CompileBench(kLoopSrc, machine, bc, pool)) return;
+
+	static constexpr int kReps = 5;
+	for (Machine::Dispatch dispatch : { Machine::Dispatch::kSwitch, Machine::Dispatch::kThreaded }) {
+		const char* name = dispatch == Machine::Dispatch::kSwitch ? "switch" : "threaded";
+		if (dispatch == Machine::Dispatch::kThreaded && !Machine::hasThreadedDispatch()) {
+			fmt::print("  {: <10} not available\n", name);
+			continue;
+		}
+		machine.dispatch = dispatch;
+
+		double best = TimeExecute(machine, bc, pool, kReps);
+		uint64_t nInstructions = machine.instructionCount;
+		if (machine.hasError()) {
+			fmt::print("  {: <10} error: {}\n", name, machine.errorMessage());
+			machine.clearError();
+			continue;
+		}
+		fmt::print("  {: <10} {:8.1f}M instructions/s  ({} instructions in {:.2f}ms)\n",
+			name, nInstructions / (best * 1000.0), nInstructions, best);
+	}
+}
+
+// The same loop, before and after the peephole optimizer.
+static void BenchPeephole()
+{
+	Heap heap;
+	Machine machine(heap);
+	std::vector<Instruction> bc;
+	ConstPool pool;
+	if (!CompileBench(kLoopSrc, machine, bc, pool)) return;
+
+	static constexpr int kReps = 5;
+	for (bool optimize : { false, true }) {
+		const char* name = optimize ? "optimized" : "plain";
+		size_t size = bc.size();
+		if (optimize) OptimizeBytecode(bc);
+
+		double best = TimeExecute(machine, bc, pool, kReps);
+		if (machine.hasError()) {
+			fmt::print("  {: <10} error: {}\n", name, machine.errorMessage());
+			machine.clearError();
+			continue;
+		}
+		fmt::print("  {: <10} {:8.2f}ms  {} executed, {} -> {} in the program\n",
+			name, best, machine.instructionCount, size, bc.size());
+	}
+}
+
+// The same loop, with and without the TypeChecker (so with the checked
+// or typed op codes), both through the peephole optimizer.
+static void BenchTypedOps()
+{
+	static constexpr int kReps = 5;
+	for (bool typed : { false, true }) {
+		const char* name = typed ? "typed" : "checked";
+		Heap heap;
+		Machine machine(heap);
+		std::vector<Instruction> bc;
+		ConstPool pool;
+		if (!CompileBench(kLoopSrc, machine, bc, pool, typed)) return;
+		OptimizeBytecode(bc);
+
+		double best = TimeExecute(machine, bc, pool, kReps);
+		if (machine.hasError()) {
+			fmt::print("  {: <10} error: {}\n", name, machine.errorMessage());
+			machine.clearError();
+			continue;
+		}
+		fmt::print("  {: <10} {:8.2f}ms  {} executed\n", name, best, machine.instructionCount);
+	}
+}
+
+// Compile time of a data heavy script. Hashing the ConstPool (and the
+// WIDE prefix past 64K constants) should keep the time per constant flat.
+static void BenchCompileConstants()
+{
+	for (int n : { 25000, 50000, 100000 }) {
+		// Alternating number and string constants, each in a global.
+		std::string src;
+		for (int i = 0; i < n; i++) {
+			if (i & 1)
+				src += fmt::format("var c{} = \"s{}\"\n", i, i);
+			else
+				src += fmt::format("var c{} = {}\n", i, i);
+		}
+		src += fmt::format("return c{}", n - 2);
+
+		Heap heap;
+		Machine machine(heap);
+		std::vector<Instruction> bc;
+		ConstPool pool;
+
+		BenchClock::time_point start = BenchClock::now();
+		if (!CompileBench(src, machine, bc, pool)) return;
+		double ms = ElapsedMS(start);
+
+		machine.execute(bc, pool);
+		bool ok = !machine.hasError() && machine.result == Value::Number(n - 2);
+		fmt::print("  {: >6} constants {:8.2f}ms  {:6.0f}ns/constant  pool={} {}\n",
+			n, ms, ms * 1e6 / n, pool.values.size(), ok ? "" : "ERROR");
+	}
+}
+
+// Startup: compiling a script from source vs. loading its precompiled image.
+static void BenchImageLoad()
+{
+	std::string src;
+	for (int i = 0; i < 20000; i++) {
+		src += fmt::format("var c{} = {}\n", i, i);
+		src += fmt::format("c{} = c{} * 2 + 1\n", i, i);
+	}
+	src += "return c0";
+	const std::string path = (std::filesystem::temp_directory_path() / "bench.scribec").string();
+
+	static constexpr int kReps = 5;
+	double compileMS = 0;
+	for (int i = 0; i < kReps; i++) {
+		Heap heap;
+		Machine machine(heap);
+		std::vector<Instruction> bc;
+		ConstPool pool;
+		BenchClock::time_point start = BenchClock::now();
+		if (!CompileBench(src, machine, bc, pool)) return;
+		double ms = ElapsedMS(start);
+		if (i == 0 || ms < compileMS) compileMS = ms;
+
+		if (i == 0 && !BCImage::write(path, bc, pool, machine.globalTable, {}, BCImage::HashSource(src))) {
+			ErrorReporter::printReports();
+			ErrorReporter::clear();
+			return;
+		}
+	}
+
+	double loadMS = 0;
+	for (int i = 0; i < kReps; i++) {
+		BCImage image;
+		BenchClock::time_point start = BenchClock::now();
+		if (!image.load(path)) {
+			ErrorReporter::printReports();
+			ErrorReporter::clear();
+			return;
+		}
+		double ms = ElapsedMS(start);
+		if (i == 0 || ms < loadMS) loadMS = ms;
+	}
+	std::filesystem::remove(path);
+
+	fmt::print("  source {:8.2f}ms\n", compileMS);
+	fmt::print("  image  {:8.2f}ms  ({:.1f}x)\n", loadMS, compileMS / loadMS);
+}
+
+static double NumberOf(const Value& v) { return v.vNumber; }
+static double NumberOf(const BoxedValue& v) { return v.asNumber(); }
+static Value MakeNumber(Value*, double d) { return Value::Number(d); }
+static BoxedValue MakeNumber(BoxedValue*, double d) { return BoxedValue::Number(d); }
+
+// What the Machine does with its stack: load locals, do arithmetic,
+// store the result, and pass strings around. Returns ms.
+template<typename V>
+static double StackWorkload(std::vector<V> frame, int iterations, double& checksum)
+{
+	std::vector<V> stack;
+	stack.reserve(64);
+	const size_t n = frame.size();
+	BenchClock::time_point start = BenchClock::now();
+	for (int i = 0; i < iterations; i++) {
+		size_t a = i % 6;
+		size_t b = (i + 1) % 6;
+		stack.push_back(frame[a]);
+		stack.push_back(frame[b]);
+		double r = NumberOf(stack[stack.size() - 2]) + NumberOf(stack.back());
+		stack.pop_back();
+		stack.pop_back();
+		stack.push_back(MakeNumber((V*)nullptr, r * 0.5));
+		frame[a] = stack.back();
+		stack.pop_back();
+
+		// A string local copied to the stack, and stored to another.
+		stack.push_back(frame[6 + (i & 1)]);
+		frame[n - 1 - (i & 1)] = stack.back();
+		stack.pop_back();
+	}
+	double ms = ElapsedMS(start);
+	checksum = 0;
+	for (size_t i = 0; i < 6; i++) checksum += NumberOf(frame[i]);
+	return ms;
+}
+
+// Value vs. the 8 byte BoxedValue, on a stack heavy workload, and on a script
+// through the tree walker's Environment and the Machine's stack (which store
+// BoxedValues when built with SCRIBE_NANBOX.)
+static void BenchNaNBoxing()
+{
+	static constexpr int kIterations = 2000000;
+	static constexpr int kReps = 5;
+
+	std::vector<Value> values;
+	std::vector<BoxedValue> boxed;
+	for (int i = 0; i < 6; i++) {
+		values.push_back(Value::Number(i));
+		boxed.push_back(BoxedValue::Number(i));
+	}
+	for (const char* s : { "a string that is long enough to allocate", "another string, also too long for SSO" }) {
+		values.push_back(Value::String(s));
+		boxed.push_back(BoxedValue::String(s));
+	}
+
+	double valueMS = 0, boxedMS = 0, valueSum = 0, boxedSum = 0;
+	for (int i = 0; i < kReps; i++) {
+		double ms = StackWorkload(values, kIterations, valueSum);
+		if (i == 0 || ms < valueMS) valueMS = ms;
+		ms = StackWorkload(boxed, kIterations, boxedSum);
+		if (i == 0 || ms < boxedMS) boxedMS = ms;
+	}
+	fmt::print("  Value      {:2} bytes {:8.2f}ms\n", sizeof(Value), valueMS);
+	fmt::print("  BoxedValue {:2} bytes {:8.2f}ms  ({:.1f}x) {}\n", sizeof(BoxedValue), boxedMS, valueMS / boxedMS,
+		valueSum == boxedSum ? "" : "ERROR");
+
+	static const char* const kEnvSrc =
+		"var s = \"a string that is long enough to allocate\"\n"
+		"var t = \"\"\n"
+		"var n: num = 0\n"
+		"for var i = 0; i < 100000; i = i + 1 {\n"
+		"	t = s\n"
+		"	n = n + i\n"
+		"}\n"
+		"return n";
+	const char* stored = NANBOX_VALUES() ? "BoxedValue" : "Value";
+	for (bool bytecode : { false, true }) {
+		InterpreterOptions options;
+		options.bytecode = bytecode;
+		double scriptMS = 0;
+		bool ok = true;
+		for (int i = 0; i < kReps; i++) {
+			Interpreter interpreter(options);
+			BenchClock::time_point start = BenchClock::now();
+			Value r = interpreter.interpret(kEnvSrc, "bench");
+			double ms = ElapsedMS(start);
+			if (i == 0 || ms < scriptMS) scriptMS = ms;
+			ok = ok && r == Value::Number(99999.0 * 100000.0 / 2.0);
+		}
+		fmt::print("  {: <11} {:8.2f}ms  ({} stores {}) {}\n", bytecode ? "bytecode" : "tree walker", scriptMS,
+			bytecode ? "Machine stack" : "Environment", stored, ok ? "" : "ERROR");
+	}
+}
+
+// Building a string with 'log = log + line'. With ropes the time per
+// append should stay flat as the log grows, rather than growing with it.
+static void BenchConcat()
+{
+	for (bool bytecode : { false, true }) {
+		for (int n : { 5000, 10000, 20000 }) {
+			const std::string src = fmt::format(
+				"var log = \"\"\n"
+				"for var i = 0; i < {}; i = i + 1 {{\n"
+				"	log = log + \"a line of the chat log, about fifty characters long. \"\n"
+				"}}\n"
+				"return log", n);
+
+			InterpreterOptions options;
+			options.bytecode = bytecode;
+			Interpreter interpreter(options);
+			BenchClock::time_point start = BenchClock::now();
+			Value r = interpreter.interpret(src, "bench");
+			double ms = ElapsedMS(start);
+			bool ok = r.type == ValueType(PType::tStr) && r.str().size() == size_t(n) * 53;
+			fmt::print("  {: <10} {: >6} appends {:8.2f}ms  {:6.0f}ns/append {}\n",
+				bytecode ? "bytecode" : "tree", n, ms, ms * 1e6 / n, ok ? "" : "ERROR");
+		}
+	}
+}
+
+// Locals in the tree walker: a block entered on every iteration, with
+// locals read and written at several depths.
+static void BenchTreeWalkerLocals()
+{
+	static const char* const kSrc =
+		"var total = 0\n"
+		"for var i = 0; i < 100000; i = i + 1 {\n"
+		"	var a: num = i\n"
+		"	var b: num = a * 2\n"
+		"	{\n"
+		"		var c: num = a + b\n"
+		"		total = total + c\n"
+		"	}\n"
+		"}\n"
+		"return total";
+	static constexpr int kReps = 5;
+
+	double best = 0;
+	bool ok = true;
+	for (int i = 0; i < kReps; i++) {
+		Interpreter interpreter;
+		BenchClock::time_point start = BenchClock::now();
+		Value r = interpreter.interpret(kSrc, "bench");
+		double ms = ElapsedMS(start);
+		if (i == 0 || ms < best) best = ms;
+		ok = ok && r == Value::Number(3.0 * 99999.0 * 100000.0 / 2.0);
+	}
+	fmt::print("  100K iterations {:8.2f}ms  {:6.0f}ns/iteration {}\n", best, best * 1e6 / 100000, ok ? "" : "ERROR");
+}
+
+// A script building a num[] with append(), then summing it by index.
+static void BenchListBuildSum()
+{
+	static constexpr int kSize = 1000000;
+	const std::string src = fmt::format(
+		"var a: num[]\n"
+		"for var i = 0; i < {0}; i = i + 1 {{\n"
+		"	append(a, i)\n"
+		"}}\n"
+		"var sum = 0\n"
+		"for var i = 0; i < size(a); i = i + 1 {{\n"
+		"	sum = sum + a[i]\n"
+		"}}\n"
+		"return sum", kSize);
+
+	for (bool bytecode : { false, true }) {
+		InterpreterOptions options;
+		options.bytecode = bytecode;
+		Interpreter interpreter(options);
+		BenchClock::time_point start = BenchClock::now();
+		Value r = interpreter.interpret(src, "bench");
+		double ms = ElapsedMS(start);
+		bool ok = r == Value::Number((kSize - 1.0) * kSize / 2.0);
+		fmt::print("  {: <10} 1M build+sum {:8.2f}ms  {:6.1f}ns/element {}\n",
+			bytecode ? "bytecode" : "tree", ms, ms * 1e6 / kSize, ok ? "" : "ERROR");
+	}
+}
+
+// Windows onto a large sample buffer, as a slice (a view) and as a copy.
+static void BenchListSlices()
+{
+	static constexpr int kSize = 1 << 20;
+	static constexpr int kWindow = 4096;
+	static constexpr int kReps = 20000;
+
+	Heap heap;
+	Value samples = Value::Default(ValueType(PType::tNum, Layout::tList), heap);
+	NumList* list = static_cast<NumList*>(samples.heapPtr.get());
+	list->setSize(kSize);
+	for (int i = 0; i < kSize; i++)
+		list->set(i, i % 100);
+
+	for (bool copy : { false, true }) {
+		std::string error;
+		double sum = 0;
+		BenchClock::time_point start = BenchClock::now();
+		for (int i = 0; i < kReps; i++) {
+			const Value begin = Value::Number((i * 97) % (kSize - kWindow));
+			const Value end = Value::Number(begin.vNumber + kWindow);
+			Value window = ListSlice(heap, samples, &begin, &end, error);
+			if (copy) {
+				// data() on a view copies it: copy on write.
+				static_cast<NumList*>(window.heapPtr.get())->data();
+			}
+			sum += static_cast<const NumList*>(window.heapPtr.get())->get(kWindow - 1);
+			window = Value();
+			heap.freePending();
+		}
+		double ms = ElapsedMS(start);
+		fmt::print("  {: <6} {} x {} elements {:8.2f}ms  {:8.0f}ns/window {}\n",
+			copy ? "copy" : "slice", kReps, kWindow, ms, ms * 1e6 / kReps, error.empty() && sum > 0 ? "" : "ERROR");
+	}
+}
+
+// A lookup table of 50K str keys: building it, and looking up every key
+// (hits) and as many keys it doesn't have (misses.)
+static void BenchMaps()
+{
+	static constexpr int kEntries = 50000;
+	std::vector<std::string> keys, missing;
+	for (int i = 0; i < kEntries; i++) {
+		keys.push_back(fmt::format("item_{}", i * 7));
+		missing.push_back(fmt::format("item_{}", i * 7 + 3));
+	}
+
+	auto run = [&](const char* name, auto& map, auto set, auto find) {
+		BenchClock::time_point start = BenchClock::now();
+		for (int i = 0; i < kEntries; i++)
+			set(map, keys[i], double(i));
+		double buildMS = ElapsedMS(start);
+
+		start = BenchClock::now();
+		double sum = 0;
+		int misses = 0;
+		for (int rep = 0; rep < 10; rep++) {
+			for (int i = 0; i < kEntries; i++) {
+				sum += find(map, keys[i]);
+				misses += find(map, missing[i]) < 0;
+			}
+		}
+		double lookupMS = ElapsedMS(start);
+		bool ok = sum == 10 * (kEntries - 1.0) * kEntries / 2 && misses == 10 * kEntries;
+		fmt::print("  {: <14} build {:6.2f}ms  {:5.1f}ns/lookup {}\n", name, buildMS, lookupMS * 1e6 / (20.0 * kEntries), ok ? "" : "ERROR");
+	};
+
+	Heap heap;
+	HeapPtr ptr(heap.make<NumMap>(heap, 0));
+	run("NumMap", *static_cast<NumMap*>(ptr.get()),
+		[](NumMap& m, const std::string& k, double v) { m.set(k, v); },
+		[](const NumMap& m, const std::string& k) { const double* v = m.find(k); return v ? *v : -1.0; });
+
+	std::map<std::string, double> tree;
+	run("std::map", tree,
+		[](auto& m, const std::string& k, double v) { m[k] = v; },
+		[](const auto& m, const std::string& k) { auto it = m.find(k); return it != m.end() ? it->second : -1.0; });
+
+	std::unordered_map<std::string, double> hashed;
+	run("unordered_map", hashed,
+		[](auto& m, const std::string& k, double v) { m[k] = v; },
+		[](const auto& m, const std::string& k) { auto it = m.find(k); return it != m.end() ? it->second : -1.0; });
+}
+
+// The host reading a script global every frame: a GlobalHandle, against
+// a lookup by name in the Environment.
+static void BenchGlobalHandles()
+{
+	static constexpr int kReads = 10000;
+	static constexpr int kReps = 20;
+
+	// Best of kReps, in ns per read.
+	auto time = [](auto&& read) {
+		double best = 0, sum = 0;
+		for (int rep = 0; rep < kReps; rep++) {
+			BenchClock::time_point start = BenchClock::now();
+			for (int i = 0; i < kReads; i++) {
+				sum += read();
+			}
+			double ns = ElapsedMS(start) * 1e6 / kReads;
+			if (rep == 0 || ns < best) best = ns;
+		}
+		return std::make_pair(best, sum / kReps);
+	};
+	std::string src;
+	for (int i = 0; i < 64; i++) {
+		src += fmt::format("var g{} = {}\n", i, i);
+	}
+	src += "var speed = 1.5\n";
+
+	StringTable strings;
+	Environment env(strings);
+	for (int i = 0; i < 64; i++) {
+		env.define(strings.intern(fmt::format("g{}", i)), Value::Number(i));
+	}
+	env.define(strings.intern("speed"), Value::Number(1.5));
+	const StrPtr speedName = strings.intern("speed");
+
+	auto byPtr = time([&]() { Value v; env.get(speedName, v); return v.vNumber; });
+	auto byName = time([&]() { Value v; env.get(strings.intern("speed"), v); return v.vNumber; });
+	fmt::print("  {: <19} {:6.1f}ns\n", "env.get (interned)", byPtr.first);
+	fmt::print("  {: <19} {:6.1f}ns\n", "env.get (string)", byName.first);
+
+	for (bool bytecode : { false, true }) {
+		InterpreterOptions options;
+		options.bytecode = bytecode;
+		Interpreter interpreter(options);
+		interpreter.interpret(src, "bench");
+		GlobalHandle<double> speed = interpreter.globalHandle<double>("speed");
+		if (!speed.valid()) {
+			fmt::print("  ERROR: no handle\n");
+			continue;
+		}
+		auto handle = time([&]() { return speed.get(); });
+		fmt::print("  {: <19} {:6.1f}ns  ({:.0f}x) {}\n", bytecode ? "handle (bytecode)" : "handle (tree)", handle.first,
+			byName.first / handle.first, handle.second == byPtr.second ? "" : "ERROR");
+	}
+}
+
+// The longest pause of a collection, all at once against in 200us steps.
+static void BenchIncrementalGC()
+{
+	static constexpr int kObjects = 500000;
+	static const std::chrono::microseconds kBudget(200);
+
+	for (bool incremental : { false, true }) {
+		Heap heap;
+		std::vector<HeapPtr> live;
+		for (int i = 0; i < kObjects; i++) {
+			NumList* list = heap.make<NumList>(heap, 4);
+			if (i % 2 == 0)
+				live.emplace_back(list);
+		}
+
+		double maxMS = 0, totalMS = 0;
+		int steps = 0;
+		bool done = false;
+		while (!done) {
+			BenchClock::time_point start = BenchClock::now();
+			if (incremental) {
+				done = heap.step(kBudget);
+			}
+			else {
+				heap.collect();
+				done = true;
+			}
+			double ms = ElapsedMS(start);
+			maxMS = std::max(maxMS, ms);
+			totalMS += ms;
+			steps++;
+		}
+		fmt::print("  {: <12} {:5} steps  max pause {:7.3f}ms  total {:7.2f}ms {}\n",
+			incremental ? "step(200us)" : "collect()", steps, maxMS, totalMS,
+			heap.size() == live.size() ? "" : "ERROR");
+		live.clear();
+		heap.collect();
+	}
+}
+
+// A script that creates a list and a string on every iteration, which
+// the heap and string pools serve without malloc once they have grown.
+static void BenchAllocation()
+{
+	static const char* const kSrc =
+		"var total = 0\n"
+		"for var i = 0; i < 200000; i = i + 1 {\n"
+		"	var list: num[]\n"
+		"	var s: str = \"item \" + \"name\"\n"
+		"	total = total + 1\n"
+		"}\n"
+		"return total";
+	static constexpr int kReps = 5;
+
+	for (bool bytecode : { false, true }) {
+		InterpreterOptions options;
+		options.bytecode = bytecode;
+		options.optimizeAST = false;	// keep the concatenation
+		double best = 0;
+		for (int i = 0; i < kReps; i++) {
+			Interpreter interpreter(options);
+			BenchClock::time_point start = BenchClock::now();
+			interpreter.interpret(kSrc, "bench");
+			double ms = ElapsedMS(start);
+			if (i == 0 || ms < best) best = ms;
+		}
+		fmt::print("  {: <10} {:8.2f}ms  {:6.0f}ns/iteration\n", bytecode ? "bytecode" : "tree", best, best * 1e6 / 200000);
+	}
+}
+
+// The cost after each interpret() in a long session: 100K live lists,
+// and a little garbage. A full collection walks the whole heap, where
+// freeing the pending list only touches the garbage.
+static void BenchFreeGarbage()
+{
+	static constexpr int kLive = 100000;
+	static constexpr int kGarbage = 10;
+	static constexpr int kCalls = 100;
+
+	for (bool full : { true, false }) {
+		Heap heap;
+		std::vector<HeapPtr> live;
+		for (int i = 0; i < kLive; i++) {
+			live.emplace_back(heap.make<NumList>(heap, 4));
+		}
+		heap.collect();		// so freeGarbage() won't collect
+
+		double totalMS = 0;
+		for (int call = 0; call < kCalls; call++) {
+			for (int i = 0; i < kGarbage; i++) {
+				HeapPtr temp(heap.make<NumList>(heap, 4));
+			}
+			BenchClock::time_point start = BenchClock::now();
+			if (full)
+				heap.collect();
+			else
+				heap.freeGarbage();
+			totalMS += ElapsedMS(start);
+		}
+		fmt::print("  {: <14} {:8.3f}ms per call {}\n", full ? "collect()" : "freeGarbage()", totalMS / kCalls,
+			heap.size() == size_t(kLive) ? "" : "ERROR");
+		live.clear();
+		heap.collect();
+	}
+
+	// And through the Interpreter: the cost of each interpret() shouldn't
+	// grow with the lists still alive.
+	std::string globals;
+	for (int i = 0; i < kLive; i++) {
+		globals += fmt::format("var list{}: num[]\n", i);
+	}
+	Interpreter ip;
+	ip.interpret(globals, "bench");
+	double totalMS = 0;
+	bool ok = ip.memoryStats().heap.objects == size_t(kLive);
+	for (int call = 0; call < kCalls; call++) {
+		BenchClock::time_point start = BenchClock::now();
+		Value r = ip.interpret("return size([1, 2])", "bench");
+		totalMS += ElapsedMS(start);
+		ok = ok && r.type == ValueType(PType::tNum);
+	}
+	fmt::print("  {: <14} {:8.3f}ms per call {}\n", "interpret()", totalMS / kCalls, ok ? "" : "ERROR");
+}
+
+// Filling and copying a 1M element NumList: an element at a time
+// through set(), against the bulk operations (one memcpy for the copy).
+static void BenchListBulk()
+{
+	static constexpr int kSize = 1000000;
+	static constexpr int kReps = 20;
+
+	Heap heap;
+	std::vector<double> source(kSize);
+	for (int i = 0; i < kSize; i++) {
+		source[i] = i;
+	}
+	HeapPtr srcPtr(heap.make<NumList>(heap, 0));
+	NumList* src = static_cast<NumList*>(srcPtr.get());
+	src->append(source.data(), kSize);
+	HeapPtr dstPtr(heap.make<NumList>(heap, kSize));
+	NumList* dst = static_cast<NumList*>(dstPtr.get());
+
+	auto run = [&](const char* label, auto op) {
+		double best = 0;
+		for (int i = 0; i < kReps; i++) {
+			BenchClock::time_point start = BenchClock::now();
+			op();
+			double ms = ElapsedMS(start);
+			if (i == 0 || ms < best) best = ms;
+		}
+		double gbPerSec = kSize * sizeof(double) / (best * 1e6);
+		fmt::print("  {: <16} {:8.3f}ms  {:6.2f}GB/s {}\n", label, best, gbPerSec,
+			dst->get(kSize - 1) == src->get(kSize - 1) || dst->get(kSize - 1) == 1 ? "" : "ERROR");
+	};
+	run("fill set()", [&] { for (int i = 0; i < kSize; i++) dst->set(i, 1); });
+	run("fill()", [&] { dst->fill(1); });
+	run("copy set()", [&] { for (int i = 0; i < kSize; i++) dst->set(i, src->get(i)); });
+	run("copyFrom()", [&] { dst->copyFrom(*src); });
+	run("append(span)", [&] { dst->setSize(0); dst->append(source.data(), kSize); });
+}
+
+// The num[] operators (vecops.h) at each SIMD level, on a 10K element
+// list: a particle system's worth, per frame. The kernels alone, and the
+// operators, which also make the result list.
+static void BenchNumListOps()
+{
+	static constexpr int kSize = 10000;
+	static constexpr int kReps = 2000;
+
+	Heap heap;
+	Value a = Value::Default(ValueType(PType::tNum, Layout::tList), heap);
+	Value b = Value::Default(ValueType(PType::tNum, Layout::tList), heap);
+	for (int i = 0; i < kSize; i++) {
+		static_cast<NumList*>(a.heapPtr.get())->append(i * 0.5);
+		static_cast<NumList*>(b.heapPtr.get())->append(kSize - i);
+	}
+	const double* pa = static_cast<NumList*>(a.heapPtr.get())->data();
+	const double* pb = static_cast<NumList*>(b.heapPtr.get())->data();
+	std::vector<double> out(kSize);
+	std::vector<uint8_t> flags(kSize);
+
+	auto report = [](const char* level, const char* what, double ms, bool ok) {
+		fmt::print("  {: <7} {: <12} {:8.2f}ms  {:6.2f}ns/element {}\n", level, what, ms, ms * 1e6 / (double(kSize) * kReps), ok ? "" : "ERROR");
+	};
+
+	const SimdLevel detected = DetectSimdLevel();
+	for (SimdLevel level : { SimdLevel::kScalar, SimdLevel::kSSE2, SimdLevel::kAVX }) {
+		if (level > detected) continue;
+		SetSimdLevel(level);
+		const char* name = SimdLevelName(level);
+
+		BenchClock::time_point start = BenchClock::now();
+		for (int i = 0; i < kReps; i++) {
+			VecArith(VecOp::kMul, pa, pb, Broadcast::kNone, out.data(), kSize);
+		}
+		report(name, "kernel a*b", ElapsedMS(start), out[1] == 0.5 * (kSize - 1));
+
+		start = BenchClock::now();
+		for (int i = 0; i < kReps; i++) {
+			VecCompare(VecOp::kLess, pa, pb, Broadcast::kNone, flags.data(), kSize);
+		}
+		report(name, "kernel a<b", ElapsedMS(start), flags[0] == 1 && flags[kSize - 1] == 0);
+
+		std::string error;
+		start = BenchClock::now();
+		for (int i = 0; i < kReps; i++) {
+			{
+				Value r = NumListOp(heap, VecOp::kMul, a, b, error);
+			}
+			heap.freePending();		// as a host would, each frame
+		}
+		report(name, "a*b", ElapsedMS(start), error.empty());
+	}
+	SetSimdLevel(detected);
+}
+
+// The native list functions: the sorts behind sort() on 1M random nums
+// (fractions, and integers), and the sum(), dot() and indexOf() kernels at
+// each SIMD level.
+static void BenchListBuiltins()
+{
+	static constexpr int kSortSize = 1000000;
+	std::vector<double> reals(kSortSize), ints(kSortSize);
+	uint64_t x = 1;
+	for (int i = 0; i < kSortSize; i++) {
+		x = x * 6364136223846793005ull + 1442695040888963407ull;
+		reals[i] = double(int64_t(x >> 11)) * 1e-9 - 4.5e6;
+		ints[i] = double(x >> 44);
+	}
+	for (const std::vector<double>* input : { &reals, &ints }) {
+		const char* what = input == &reals ? "reals" : "ints";
+		auto sortReport = [&](const char* sort, double ms, const std::vector<double>& v) {
+			const bool ok = std::is_sorted(v.begin(), v.end());
+			fmt::print("  {: <5} {: <14} {:8.2f}ms  {:6.2f}ns/element {}\n", what, sort, ms, ms * 1e6 / kSortSize, ok ? "" : "ERROR");
+		};
+		std::vector<double> v = *input;
+		BenchClock::time_point start = BenchClock::now();
+		std::sort(v.begin(), v.end());
+		sortReport("std::sort", ElapsedMS(start), v);
+
+		v = *input;
+		start = BenchClock::now();
+		PdqSort(v.data(), v.data() + v.size());
+		sortReport("PdqSort", ElapsedMS(start), v);
+
+		v = *input;
+		start = BenchClock::now();
+		RadixSortNums(v.data(), v.size());
+		sortReport("RadixSortNums", ElapsedMS(start), v);
+	}
+
+	static constexpr int kSize = 10000;
+	static constexpr int kReps = 2000;
+	std::vector<double> a(kSize), b(kSize);
+	for (int i = 0; i < kSize; i++) {
+		a[i] = i * 0.5;
+		b[i] = kSize - i;
+	}
+	auto report = [](const char* level, const char* what, double ms, bool ok) {
+		fmt::print("  {: <7} {: <12} {:8.2f}ms  {:6.2f}ns/element {}\n", level, what, ms, ms * 1e6 / (double(kSize) * kReps), ok ? "" : "ERROR");
+	};
+
+	const SimdLevel detected = DetectSimdLevel();
+	for (SimdLevel level : { SimdLevel::kScalar, SimdLevel::kSSE2, SimdLevel::kAVX }) {
+		if (level > detected) continue;
+		SetSimdLevel(level);
+		const char* name = SimdLevelName(level);
+
+		double sum = 0;
+		BenchClock::time_point start = BenchClock::now();
+		for (int i = 0; i < kReps; i++) {
+			sum += VecSum(a.data(), kSize);
+		}
+		report(name, "sum", ElapsedMS(start), sum == kReps * 0.25 * (kSize - 1.0) * kSize);
+
+		double dot = 0;
+		start = BenchClock::now();
+		for (int i = 0; i < kReps; i++) {
+			dot += VecDot(a.data(), b.data(), kSize);
+		}
+		report(name, "dot", ElapsedMS(start), dot > 0);
+
+		size_t found = 0;
+		start = BenchClock::now();
+		for (int i = 0; i < kReps; i++) {
+			found += VecFind(a.data(), -1.0, kSize);
+		}
+		report(name, "indexOf", ElapsedMS(start), found == size_t(kSize) * kReps);
+	}
+	SetSimdLevel(detected);
+}
+
+#define RUN_BENCH(bench) fmt::print("Bench: {}\n", #bench); bench
+
+void Bench()
+{
+	RUN_BENCH(BenchDispatch());
+	RUN_BENCH(BenchPeephole());
+	RUN_BENCH(BenchTypedOps());
+	RUN_BENCH(BenchNaNBoxing());
+	RUN_BENCH(BenchConcat());
+	RUN_BENCH(BenchTreeWalkerLocals());
+	RUN_BENCH(BenchGlobalHandles());
+	RUN_BENCH(BenchIncrementalGC());
+	RUN_BENCH(BenchAllocation());
+	RUN_BENCH(BenchFreeGarbage());
+	RUN_BENCH(BenchListBulk());
+	RUN_BENCH(BenchNumListOps());
+	RUN_BENCH(BenchListBuildSum());
+	RUN_BENCH(BenchListSlices());
+	RUN_BENCH(BenchMaps());
+	RUN_BENCH(BenchListBuiltins());
+	RUN_BENCH(BenchCompileConstants());
+	RUN_BENCH(BenchImageLoad());
+}
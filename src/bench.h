@@ -0,0 +1,5 @@
+#pragma once
+
+// Micro benchmarks, run with: scribe --bench
+// Build in release for meaningful numbers.
+void Bench();
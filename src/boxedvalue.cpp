@@ -0,0 +1,137 @@
+#include "boxedvalue.h"
+#include "hashmap.h"
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+BoxedValue::BoxedValue(uint64_t tag, const void* ptr)
+{
+	uint64_t p = reinterpret_cast<uint64_t>(ptr);
+	REQUIRE((p & ~kPointerMask) == 0);
+	bits = kSign | kQNaN | (tag << kTagShift) | p;
+}
+
+/*static*/ BoxedValue BoxedValue::Number(double v)
+{
+	if (isnan(v))
+		return BoxedValue(kCanonicalNaN);
+	uint64_t b = 0;
+	memcpy(&b, &v, sizeof(b));
+	return BoxedValue(b);
+}
+
+/*static*/ BoxedValue BoxedValue::List(HeapObject* list)
+{
+	REQUIRE(list);
+	list->addRef();
+	return BoxedValue(kList, list);
+}
+
+double BoxedValue::asNumber() const
+{
+	assert(isNumber());
+	double d = 0;
+	memcpy(&d, &bits, sizeof(d));
+	return d;
+}
+
+BoxedValue& BoxedValue::operator=(const BoxedValue& rhs)
+{
+	if (this == &rhs) return *this;
+	// Add first: the rhs may be the last reference through this.
+	BoxedValue tmp(rhs);
+	release();
+	bits = tmp.bits;
+	tmp.bits = kNone;
+	return *this;
+}
+
+BoxedValue& BoxedValue::operator=(BoxedValue&& rhs) noexcept
+{
+	if (this == &rhs) return *this;
+	release();
+	bits = rhs.bits;
+	rhs.bits = kNone;
+	return *this;
+}
+
+void BoxedValue::addRef()
+{
+	if (!isPointer()) return;
+	if (isList())
+		asObject()->addRef();
+	else
+		strObj()->addRef();
+}
+
+void BoxedValue::release()
+{
+	if (!isPointer()) return;
+	if (isList()) {
+		asObject()->release();
+	}
+	else {
+		strObj()->release();
+	}
+	bits = kNone;
+}
+
+ValueType BoxedValue::type() const
+{
+	if (isNumber()) return ValueType(PType::tNum);
+	if (isBoolean()) return ValueType(PType::tBool);
+	if (isString()) return ValueType(PType::tStr);
+	if (isFunc()) return ValueType(PType::tFunc);
+	if (isList()) {
+		const HeapObject* obj = asObject();
+		if (dynamic_cast<const NumList*>(obj)) return ValueType(PType::tNum, Layout::tList);
+		if (dynamic_cast<const BoolList*>(obj)) return ValueType(PType::tBool, Layout::tList);
+		if (dynamic_cast<const StrList*>(obj)) return ValueType(PType::tStr, Layout::tList);
+		if (dynamic_cast<const NumMap*>(obj)) return ValueType(PType::tNum, Layout::tMap);
+		if (dynamic_cast<const BoolMap*>(obj)) return ValueType(PType::tBool, Layout::tMap);
+		if (dynamic_cast<const StrMap*>(obj)) return ValueType(PType::tStr, Layout::tMap);
+	}
+	return ValueType();
+}
+
+bool BoxedValue::operator==(const BoxedValue& rhs) const
+{
+	if (isNumber() && rhs.isNumber())
+		return asNumber() == rhs.asNumber();
+	if ((isString() && rhs.isString()) || (isFunc() && rhs.isFunc()))
+		return StrObj::Equal(strObj(), rhs.strObj());
+	return bits == rhs.bits;
+}
+
+/*static*/ BoxedValue BoxedValue::From(const Value& v)
+{
+	if (v.type.layout != Layout::tScalar) {
+		HeapObject* obj = v.heapPtr.get();
+		return obj ? List(obj) : BoxedValue();
+	}
+	switch (v.type.pType) {
+	case PType::tNum: return Number(v.vNumber);
+	case PType::tBool: return Boolean(v.vBoolean);
+	case PType::tStr:
+	case PType::tFunc:
+		v.vStr->addRef();
+		return BoxedValue(v.type.pType == PType::tStr ? kString : kFunc, v.vStr);
+	default: return BoxedValue();
+	}
+}
+
+Value BoxedValue::toValue() const
+{
+	if (isNumber()) return Value::Number(asNumber());
+	if (isBoolean()) return Value::Boolean(asBoolean());
+	if (isString()) return Value::String(StrPtr::Share(strObj()));
+	if (isFunc()) return Value::Func(StrPtr::Share(strObj()));
+	if (isList()) {
+		Value v;
+		v.type = type();
+		v.heapPtr.set(asObject());
+		return v;
+	}
+	return Value();
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "value.h"
+
+#include <stdint.h>
+#include <string>
+
+// Build with SCRIBE_NANBOX=1 (the SCRIBE_NANBOX CMake option) to store
+// variables, and the Machine's stack, as BoxedValues rather than Values.
+#ifndef SCRIBE_NANBOX
+#	define SCRIBE_NANBOX 0
+#endif
+#define NANBOX_VALUES() SCRIBE_NANBOX
+
+/*
+* An 8 byte alternative to Value, which is a ValueType, a union, and a
+* HeapPtr (24 bytes). The encoding is NaN-boxing:
+*	numbers		the double itself; a NaN result is stored as the canonical quiet NaN
+*	none/bool	immediates in the quiet NaN space
+*	str/func	a tagged pointer to the StrObj, shared with Value
+*	list/map	a tagged pointer to the HeapObject, which holds the ref count
+*
+* Pointers must fit in 48 bits, as they do on x64 and ARM64.
+*/
+class BoxedValue {
+public:
+	BoxedValue() : bits(kNone) {}
+	~BoxedValue() { release(); }
+
+	BoxedValue(const BoxedValue& rhs) : bits(rhs.bits) { addRef(); }
+	BoxedValue(BoxedValue&& rhs) noexcept : bits(rhs.bits) { rhs.bits = kNone; }
+	BoxedValue& operator=(const BoxedValue& rhs);
+	BoxedValue& operator=(BoxedValue&& rhs) noexcept;
+
+	static BoxedValue Number(double v);
+	static BoxedValue Boolean(bool v) { return BoxedValue(v ? kTrue : kFalse); }
+	static BoxedValue String(const std::string& v) { return BoxedValue(kString, StrObj::Create(v)); }
+	static BoxedValue Func(const std::string& v) { return BoxedValue(kFunc, StrObj::Create(v)); }
+	static BoxedValue List(HeapObject* list);
+
+	// Conversion to and from Value. Lists and maps share the HeapObject.
+	static BoxedValue From(const Value& v);
+	Value toValue() const;
+
+	bool isNone() const { return bits == kNone; }
+	bool isNumber() const { return (bits & kQNaN) != kQNaN; }
+	bool isBoolean() const { return bits == kTrue || bits == kFalse; }
+	bool isString() const { return isPointer(kString); }
+	bool isFunc() const { return isPointer(kFunc); }
+	bool isList() const { return isPointer(kList); }
+
+	// Warning: unchecked!
+	double asNumber() const;
+	bool asBoolean() const { return bits == kTrue; }
+	const std::string& asString() const { return strObj()->str(); }
+	HeapObject* asObject() const { return reinterpret_cast<HeapObject*>(bits & kPointerMask); }
+
+	ValueType type() const;
+
+	bool operator==(const BoxedValue& rhs) const;
+	bool operator!=(const BoxedValue& rhs) const { return !(*this == rhs); }
+
+	uint64_t raw() const { return bits; }
+
+	static void test();
+
+private:
+	static constexpr uint64_t kSign = 0x8000000000000000;
+	static constexpr uint64_t kQNaN = 0x7ffc000000000000;
+	static constexpr uint64_t kCanonicalNaN = 0x7ff8000000000000;
+	static constexpr uint64_t kNone = kQNaN | 1;
+	static constexpr uint64_t kFalse = kQNaN | 2;
+	static constexpr uint64_t kTrue = kQNaN | 3;
+
+	// Pointers set the sign bit, and have a 2 bit tag above the 48 bit address.
+	static constexpr uint64_t kTagShift = 48;
+	static constexpr uint64_t kTagMask = uint64_t(3) << kTagShift;
+	static constexpr uint64_t kPointerMask = (uint64_t(1) << kTagShift) - 1;
+	static constexpr uint64_t kString = 0;
+	static constexpr uint64_t kFunc = 1;
+	static constexpr uint64_t kList = 2;
+
+	explicit BoxedValue(uint64_t bits) : bits(bits) {}
+	BoxedValue(uint64_t tag, const void* ptr);
+
+	bool isPointer() const { return (bits & (kSign | kQNaN)) == (kSign | kQNaN); }
+	bool isPointer(uint64_t tag) const { return isPointer() && (bits & kTagMask) == (tag << kTagShift); }
+	StrObj* strObj() const { return reinterpret_cast<StrObj*>(bits & kPointerMask); }
+
+	void addRef();
+	void release();
+
+	uint64_t bits;
+};
+
+static_assert(sizeof(BoxedValue) == 8, "BoxedValue should be 8 bytes");
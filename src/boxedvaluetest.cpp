@@ -0,0 +1,96 @@
+#include "boxedvalue.h"
+#include "test.h"
+
+#include <math.h>
+
+static void Immediates()
+{
+	BoxedValue none;
+	TEST(none.isNone());
+	TEST(!none.isNumber());
+	TEST(none.type() == ValueType());
+
+	BoxedValue t = BoxedValue::Boolean(true);
+	BoxedValue f = BoxedValue::Boolean(false);
+	TEST(t.isBoolean() && f.isBoolean());
+	TEST(t.asBoolean() == true);
+	TEST(f.asBoolean() == false);
+	TEST(t != f);
+	TEST(t.type() == ValueType(PType::tBool));
+}
+
+static void Numbers()
+{
+	for (double d : { 0.0, -0.0, 1.0, -2.5, 1e300, -1e-300, HUGE_VAL, -HUGE_VAL }) {
+		BoxedValue v = BoxedValue::Number(d);
+		TEST(v.isNumber());
+		TEST(v.asNumber() == d);
+		TEST(v.type() == ValueType(PType::tNum));
+	}
+	// Any NaN becomes the canonical one, so it can't be mistaken for a tag.
+	BoxedValue nan = BoxedValue::Number(-NAN);
+	TEST(nan.isNumber());
+	TEST(isnan(nan.asNumber()));
+	TEST(!nan.isNone() && !nan.isBoolean() && !nan.isString());
+}
+
+static void Strings()
+{
+	BoxedValue a = BoxedValue::String("hello");
+	TEST(a.isString());
+	TEST(!a.isFunc());
+	TEST(a.asString() == "hello");
+
+	// Copies share the string.
+	BoxedValue b = a;
+	TEST(b.raw() == a.raw());
+	TEST(&b.asString() == &a.asString());
+	a = BoxedValue::Number(1);
+	TEST(b.asString() == "hello");
+
+	BoxedValue c = std::move(b);
+	TEST(b.isNone());
+	TEST(c.asString() == "hello");
+	const BoxedValue& self = c;
+	c = self;
+	TEST(c.asString() == "hello");
+
+	TEST(BoxedValue::String("x") == BoxedValue::String("x"));
+	TEST(BoxedValue::String("x") != BoxedValue::Func("x"));
+	TEST(BoxedValue::Func("print").type() == ValueType(PType::tFunc));
+}
+
+static void Conversion()
+{
+	Heap heap;
+	for (const Value& v : { Value::Number(3.5), Value::Boolean(true), Value::String("str"), Value::Func("f"), Value() }) {
+		BoxedValue b = BoxedValue::From(v);
+		TEST(b.type() == v.type);
+		Value back = b.toValue();
+		TEST(back == v);
+	}
+
+	Value list = Value::Default(ValueType(PType::tNum, Layout::tList), heap);
+	HeapObject* obj = list.heapPtr.get();
+	TEST(obj->getRefCount() == 1);
+	{
+		BoxedValue b = BoxedValue::From(list);
+		TEST(b.isList());
+		TEST(b.asObject() == obj);
+		TEST(b.type() == ValueType(PType::tNum, Layout::tList));
+		TEST(obj->getRefCount() == 2);
+
+		Value back = b.toValue();
+		TEST(back.heapPtr.get() == obj);
+		TEST(obj->getRefCount() == 3);
+	}
+	TEST(obj->getRefCount() == 1);
+}
+
+void BoxedValue::test()
+{
+	RUN_TEST(Immediates());
+	RUN_TEST(Numbers());
+	RUN_TEST(Strings());
+	RUN_TEST(Conversion());
+}
@@ -4,6 +4,11 @@
 #include "value.h"
 
 #include <stdint.h>
+#include <string.h>
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 enum class OpCode : uint16_t
@@ -30,14 +35,73 @@ enum class OpCode : uint16_t
 	GREATER_EQUAL,
 
 	// There isn't really a global, just a top-level scope. And that top-level scope is per file.
-	DEFINE_GLOBAL,		// key, init-value		0 (global)
-	DEFINE_LOCAL,		// key, init-value		0 (local to current scope depth)
-	LOAD,				// key                  value
-	STORE,				// key, value			0
-	PUSH_SCOPE,			// 0					0
-	POP_SCOPE,			// 0					0
+	// Variables are resolved at compile time: the index is the slot in the
+	// GlobalTable, or for a local, the slot on the stack. A local is defined
+	// by leaving its initial value on the stack.
+	DEFINE_GLOBAL,		// init-value			0
+	LOAD_GLOBAL,		// 0					value
+	STORE_GLOBAL,		// value				value
+	LOAD_LOCAL,			// 0					value
+	STORE_LOCAL,		// value				value
+	POP_SCOPE,			// locals[index]		0
+	DEFAULT,			// 0					default value of the type packed in the index
+
+	// Jumps: the index is an offset from the next instruction.
+	JUMP,				// 0					0 (forward)
+	JUMP_IF_FALSE,		// condition			0 (forward)
+	JUMP_IF_TRUE,		// condition			0 (forward)
+	LOOP,				// 0					0 (backward)
+
+	CALL,				// func, args[index]	return value
 
 	PRINT,				// value				0
+	RESULT,				// value				0 (stored as the result of the program)
+
+	// Super instructions, produced by OptimizeBytecode()
+	ADD_CONST,			// lhs					lhs + pool[index]
+	ADD_LOCALS,			// 0					local[index & 0xff] + local[index >> 8]
+	SET_LOCAL,			// value				0 (STORE_LOCAL, POP)
+	SET_GLOBAL,			// value				0 (STORE_GLOBAL, POP)
+	JUMP_IF_NOT_LESS,			// lhs, rhs		0 (LESS, JUMP_IF_FALSE)
+	JUMP_IF_NOT_LESS_EQUAL,		// lhs, rhs		0
+	JUMP_IF_NOT_GREATER,		// lhs, rhs		0
+	JUMP_IF_NOT_GREATER_EQUAL,	// lhs, rhs		0
+
+	// Prefix for an index that doesn't fit in 16 bits: the next
+	// instruction's index is (index << 16) | its own. See EmitOpCode().
+	WIDE,
+
+	// Typed op codes, for operands whose types the TypeChecker has
+	// resolved. They don't check their operands at run time: the Machine
+	// proves the types before it runs the code.
+	ADD_NUM,			// lhs, rhs				result
+	SUB_NUM,			// lhs, rhs				result
+	MUL_NUM,			// lhs, rhs				result
+	DIV_NUM,			// lhs, rhs				result
+	NEGATE_NUM,			// value				result
+	LESS_NUM,			// lhs, rhs				bool
+	LESS_EQUAL_NUM,		// lhs, rhs				bool
+	GREATER_NUM,		// lhs, rhs				bool
+	GREATER_EQUAL_NUM,	// lhs, rhs				bool
+	EQ_NUM,				// lhs, rhs				bool
+	NOT_EQ_NUM,			// lhs, rhs				bool
+	EQ_BOOL,			// lhs, rhs				bool
+	NOT_EQ_BOOL,		// lhs, rhs				bool
+	CONCAT_STR,			// lhs, rhs				lhs + rhs
+
+	// Lists (listops.h). NEW_LIST's index is packed by PackNewList().
+	NEW_LIST,			// elements[n]			list
+	LOAD_INDEX,			// list, index			element
+	STORE_INDEX,		// list, index, value	value
+	LIST_APPEND,		// list, value			none
+	LIST_POP,			// list					element
+	LIST_SIZE,			// list					num
+	// The index says which bounds are on the stack: kSliceBegin | kSliceEnd.
+	LOAD_SLICE,			// list, begin?, end?	view
+	// Maps. LOAD_INDEX, STORE_INDEX and LIST_SIZE also take a map.
+	MAP_HAS,			// map, key				bool
+	MAP_REMOVE,			// map, key				bool
+	MAP_KEYS,			// map					str[]
 
 	count,
 };
@@ -51,6 +115,30 @@ inline uint32_t PackOpCode(OpCode op) {
 	return static_cast<uint32_t>(op);
 }
 
+inline uint32_t PackValueType(ValueType type) {
+	return static_cast<uint32_t>(type.pType) | (static_cast<uint32_t>(type.layout) << 8);
+}
+
+inline ValueType UnpackValueType(uint32_t index) {
+	return ValueType(static_cast<PType>(index & 0xff), static_cast<Layout>(index >> 8));
+}
+
+// NEW_LIST's index: the number of elements, and their type (or PType::tNone,
+// for the type of the first element.) More than 255 elements needs a WIDE.
+inline uint32_t PackNewList(PType elementType, uint32_t n) {
+	REQUIRE(n < (1u << 24));
+	return (n << 8) | static_cast<uint32_t>(elementType);
+}
+
+inline void UnpackNewList(uint32_t index, PType& elementType, uint32_t& n) {
+	elementType = static_cast<PType>(index & 0xff);
+	n = index >> 8;
+}
+
+// LOAD_SLICE's index.
+constexpr uint32_t kSliceBegin = 1;
+constexpr uint32_t kSliceEnd = 2;
+
 inline void UnpackOpCode(uint32_t a, OpCode& op, uint32_t& index) {
 	uint16_t u16 = static_cast<uint16_t>(a & 0xffff);
 	REQUIRE(static_cast<uint32_t>(u16) < static_cast<uint32_t>(OpCode::count));
@@ -58,23 +146,50 @@ inline void UnpackOpCode(uint32_t a, OpCode& op, uint32_t& index) {
 	index = a >> 16;
 }
 
+// Maps the names of globals to their slots. Owned by the Machine
+// (which stores the values) and filled in by the compiler.
+struct GlobalTable
+{
+	std::vector<std::string> names;
+	std::map<std::string, uint32_t> slots;
+
+	// Returns the slot of 'name', adding it if needed.
+	uint32_t resolve(const std::string& name) {
+		auto it = slots.find(name);
+		if (it != slots.end())
+			return it->second;
+
+		uint32_t slot = static_cast<uint32_t>(names.size());
+		names.push_back(name);
+		slots[name] = slot;
+		return slot;
+	}
+
+	size_t size() const { return names.size(); }
+};
+
 struct ConstPool
 {
 	ConstPool() {
 		// Useful, and this way there is always a 0 index.
-		values.push_back(Value::Number(0.0));
+		add(Value::Number(0.0));
 	}
 
 	std::vector<Value> values;
 
+	// Returns the index of 'value', adding it if it isn't already in the pool.
 	uint32_t add(const Value& value) {
-		auto it = std::find(values.begin(), values.end(), value);
-		if (it != values.end()) {
-			return (uint32_t)std::distance(values.begin(), it);
+		size_t hash = Hash(value);
+		auto range = index.equal_range(hash);
+		for (auto it = range.first; it != range.second; ++it) {
+			if (Same(values[it->second], value))
+				return it->second;
 		}
 
+		uint32_t i = static_cast<uint32_t>(values.size());
 		values.push_back(value);
-		return static_cast<uint32_t>(values.size() - 1);
+		index.emplace(hash, i);
+		return i;
 	}
 
 	const Value& get(uint32_t index) const {
@@ -82,6 +197,65 @@ struct ConstPool
 		REQUIRE(index < values.size());
 		return values[index];
 	}
+
+private:
+	// hash -> index in 'values'. Numbers are keyed on their bits, so
+	// 0 and -0 are different constants (and a NaN is only stored once.)
+	std::unordered_multimap<size_t, uint32_t> index;
+
+	static uint64_t Bits(double d) {
+		uint64_t u;
+		memcpy(&u, &d, sizeof(u));
+		return u;
+	}
+
+	static size_t Hash(const Value& v) {
+		size_t h = 0;
+		switch (v.type.pType) {
+		case PType::tNum: h = std::hash<uint64_t>()(Bits(v.vNumber)); break;
+		case PType::tBool: h = v.vBoolean ? 1 : 0; break;
+		case PType::tStr:
+		case PType::tFunc: h = v.vStr->hash(); break;
+		default: break;
+		}
+		return h ^ (PackValueType(v.type) * 0x9e3779b9u);
+	}
+
+	static bool Same(const Value& a, const Value& b) {
+		if (a.type != b.type) return false;
+		switch (a.type.pType) {
+		case PType::tNum: return Bits(a.vNumber) == Bits(b.vNumber);
+		case PType::tBool: return a.vBoolean == b.vBoolean;
+		case PType::tStr:
+		case PType::tFunc: return StrObj::Equal(a.vStr, b.vStr);
+		default: return a == b;
+		}
+	}
 };
 
 using Instruction = uint32_t;
+
+// Debug line table entry: the instructions from 'instruction' up to
+// the next entry were compiled from 'line'.
+struct LineInfo {
+	uint32_t instruction;
+	uint32_t line;
+};
+
+// Returns the line for an instruction, or -1 if it isn't known.
+inline int LineOfInstruction(const LineInfo* lines, size_t nLines, size_t instruction) {
+	int line = -1;
+	for (size_t i = 0; i < nLines && lines[i].instruction <= instruction; i++)
+		line = static_cast<int>(lines[i].line);
+	return line;
+}
+
+// Appends 'op' with an index of any size, prefixed with WIDE
+// if the index doesn't fit in 16 bits.
+inline void EmitOpCode(std::vector<Instruction>& bc, OpCode op, uint32_t index) {
+	if (index >= 0x10000) {
+		bc.push_back(PackOpCode(OpCode::WIDE, index >> 16));
+		index &= 0xffff;
+	}
+	bc.push_back(PackOpCode(op, index));
+}
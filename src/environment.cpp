@@ -1,62 +1,66 @@
 #include "environment.h"
 
-bool Environment::define(const std::string& name, const Value& v)
+// Converts to and from the stored representation.
+#if NANBOX_VALUES()
+static BoxedValue Store(const Value& v) { return BoxedValue::From(v); }
+static Value Load(const BoxedValue& v) { return v.toValue(); }
+#else
+static const Value& Store(const Value& v) { return v; }
+static Value&& Store(Value&& v) { return std::move(v); }
+static const Value& Load(const Value& v) { return v; }
+#endif
+
+bool Environment::define(const StrPtr& name, Value v)
 {
-	auto it = env.find(name);
-	if (it != env.end()) return false;
-	env[name] = v;
+	auto result = env.try_emplace(name, Store(std::move(v)));
+	if (result.second)
+		return true;
+	if (builtins.erase(name) == 0)
+		return false;
+	// try_emplace() left v alone. Assigned in place, so find() pointers
+	// stay good.
+	result.first->second = Store(std::move(v));
 	return true;
 }
 
-bool Environment::set(const std::string& name, const Value& v)
+bool Environment::defineBuiltin(const StrPtr& name, Value v)
 {
-	auto it = env.find(name);
-	if (it == env.end()) return false;
-	it->second = v;
+	if (!define(name, std::move(v)))
+		return false;
+	builtins.insert(name);
 	return true;
 }
 
-Value Environment::get(const std::string& name)
+bool Environment::set(const StrPtr& name, const Value& v)
 {
-	Value v;
 	auto it = env.find(name);
-	if (it != env.end())
-		v = it->second;
-	return v;
-}
-
-void EnvironmentStack::push()
-{
-	stack.push_back(Environment());
-}
-
-void EnvironmentStack::pop()
-{
-	stack.pop_back();
+	if (it == env.end()) return false;
+	it->second = Store(v);
+	return true;
 }
 
-bool EnvironmentStack::define(const std::string& name, const Value& v)
+bool Environment::get(const StrPtr& name, Value& out) const
 {
-	REQUIRE(!stack.empty());
-	return stack.back().define(name, v);
+	auto it = env.find(name);
+	if (it == env.end()) return false;
+	out = Load(it->second);
+	return true;
 }
 
-bool EnvironmentStack::set(const std::string& name, const Value& v)
+Environment::Slot* Environment::find(const StrPtr& name)
 {
-	for (auto it = stack.rbegin(); it != stack.rend(); ++it) {
-		if (it->set(name, v)) 
-			return true;
-	}
-	return false;
+	auto it = env.find(name);
+	return it == env.end() ? nullptr : &it->second;
 }
 
-Value EnvironmentStack::get(const std::string& name)
+void LocalFrames::define(int slot, Value v)
 {
-	Value v;
-	for (auto it = stack.rbegin(); it != stack.rend(); ++it) {
-		v = it->get(name);
-		if (v.type != ValueType())
-			break;
-	}
-	return v;
+	REQUIRE(!bases.empty());
+	// Locals are defined in the order the Resolver numbered them.
+	REQUIRE(slots.size() - bases.back() == size_t(slot));
+#if NANBOX_VALUES()
+	slots.push_back(BoxedValue::From(v));
+#else
+	slots.push_back(std::move(v));
+#endif
 }
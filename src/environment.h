@@ -1,37 +1,90 @@
 #pragma once
 
 #include "value.h"
+#include "boxedvalue.h"
 
+#include <assert.h>
 #include <string>
-#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+// Variables are keyed by their interned names, so a lookup hashes
+// and compares pointers. The names must come from 'strings'.
 class Environment
 {
 public:
-	Environment() {}
+#if NANBOX_VALUES()
+	using Slot = BoxedValue;
+#else
+	using Slot = Value;
+#endif
 
-	bool define(const std::string& name, const Value& v);
-	bool set(const std::string& name, const Value& v);
-	Value get(const std::string& name);
+	Environment(StringTable& strings) : strings(&strings) {}
+
+	// The value is moved in, so pass an rvalue to avoid a copy. Fails if
+	// the name is defined, unless by defineBuiltin().
+	bool define(const StrPtr& name, Value v);
+	// A host function: a script may declare a variable of the same name,
+	// which replaces it.
+	bool defineBuiltin(const StrPtr& name, Value v);
+	bool set(const StrPtr& name, const Value& v);
+	// Copies the value to 'out' if found.
+	bool get(const StrPtr& name, Value& out) const;
+	// The stored value, or null if not found. Variables are never removed,
+	// so the pointer is good for the life of the Environment.
+	Slot* find(const StrPtr& name);
+
+	// For the host side, to get a name to define.
+	StrPtr intern(const std::string& name) { return strings->intern(name); }
 
 private:
-	std::map<std::string, Value> env;
+	StringTable* strings;
+	std::unordered_map<StrPtr, Slot, StrPtr::Hash> env;
+	std::unordered_set<StrPtr, StrPtr::Hash> builtins;
 };
 
-class EnvironmentStack
+// The locals of the tree walker: one array for every scope, which is
+// reused from block to block, so defining a local doesn't allocate once
+// the array has grown. ResolveSlots() (resolver.h) gives each use of a
+// local its (depth, slot).
+class LocalFrames
 {
 public:
-	EnvironmentStack() { push(); }
-	
-	void push();
-	void pop();
-	
-	bool define(const std::string& name, const Value& v);
-	bool set(const std::string& name, const Value& v);
-	Value get(const std::string& name);
+	void push() { bases.push_back(slots.size()); }
+	void pop() {
+		REQUIRE(!bases.empty());
+		slots.resize(bases.back());
+		bases.pop_back();
+	}
+	size_t numScopes() const { return bases.size(); }
 
-	Environment& globalEnv() { return stack[0]; }
+	// Defines the next slot in the current scope.
+	void define(int slot, Value v);
+	void set(int depth, int slot, const Value& v) { at(depth, slot) = Store(v); }
+	Value get(int depth, int slot) const { return Load(at(depth, slot)); }
 
 private:
-	std::vector<Environment> stack;
-};
\ No newline at end of file
+#if NANBOX_VALUES()
+	using Slot = BoxedValue;
+	static BoxedValue Store(const Value& v) { return BoxedValue::From(v); }
+	static Value Load(const BoxedValue& v) { return v.toValue(); }
+#else
+	using Slot = Value;
+	static const Value& Store(const Value& v) { return v; }
+	static const Value& Load(const Value& v) { return v; }
+#endif
+
+	// Warning: unchecked in release builds!
+	size_t index(int depth, int slot) const {
+		assert(depth >= 0 && size_t(depth) < bases.size());
+		size_t i = bases[bases.size() - 1 - depth] + slot;
+		assert(i < slots.size());
+		return i;
+	}
+	const Slot& at(int depth, int slot) const { return slots[index(depth, slot)]; }
+	Slot& at(int depth, int slot) { return slots[index(depth, slot)]; }
+
+	std::vector<Slot> slots;
+	std::vector<size_t> bases;	// where each scope starts in 'slots'
+};
@@ -29,7 +29,8 @@ bool FFI::add(const std::string& name,
 	};
 	funcDefs[name] = def;
 
-	env.define(name, Value::Func(name));
+	StrPtr symbol = env.intern(name);
+	env.defineBuiltin(symbol, Value::Func(symbol));
 	return true;
 }
 
@@ -45,20 +46,53 @@ FFI::RC FFI::call(const std::string& name, std::vector<Value>& stack, int nArgs)
 		return RC::kIncorrectNumArgs;
 	}
 
-	std::vector<Value> args(nArgs);
-	for (int i = 0; i < nArgs; ++i) {
-		// The stack order is "reversed" from the arg order.
-		// Go backward to put the args in the expected order.
-		const Value& value = stack[stack.size() - nArgs + i];
-		if (!funcDef.variante && value.type != funcDef.argTypes[i]) {
-			return RC::kIncorrectArgType;
+	// The stack order is "reversed" from the arg order.
+	// Go backward to put the args in the expected order.
+	const size_t first = stack.size() - nArgs;
+	if (!funcDef.variante) {
+		for (int i = 0; i < nArgs; ++i) {
+			if (stack[first + i].type != funcDef.argTypes[i]) {
+				return RC::kIncorrectArgType;
+			}
 		}
-		args[i] = value;
 	}
-	stack.resize(stack.size() - nArgs);
+	// The args are popped, so they can be moved rather than copied.
+	std::vector<Value> args;
+	args.reserve(nArgs);
+	for (int i = 0; i < nArgs; ++i) {
+		args.push_back(std::move(stack[first + i]));
+	}
+	stack.resize(first);
+	funcDef.handler->error.clear();
 	Value rc = funcDef.handler->call(name, args, funcDef.returnType);
-	stack.push_back(rc);
+	if (!funcDef.handler->error.empty()) {
+		errorMessage = std::move(funcDef.handler->error);
+		funcDef.handler->error.clear();
+		return RC::kFailed;
+	}
+	// The TypeChecker relies on the declared return type.
+	if (rc.type != funcDef.returnType) {
+		return RC::kError;
+	}
+	stack.push_back(std::move(rc));
 	return RC::kOkay;
 }
 
+ValueType FFI::returnType(const std::string& name) const
+{
+	auto it = funcDefs.find(name);
+	if (it == funcDefs.end())
+		return ValueType();
+	return it->second.returnType;
+}
+
+std::vector<std::string> FFI::names() const
+{
+	std::vector<std::string> names;
+	for (const auto& it : funcDefs) {
+		names.push_back(it.first);
+	}
+	return names;
+}
+
 
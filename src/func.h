@@ -20,6 +20,10 @@ public:
 	virtual Value call(const std::string& name, 
 		const std::vector<Value>& args, 
 		ValueType returnType) = 0;
+
+	// Set by call() when the arguments are wrong in a way the types don't
+	// catch (an empty list, say.) The FFI reports it as RC::kFailed.
+	std::string error;
 };
 
 class FFI
@@ -38,9 +42,14 @@ public:
 		kFuncNotFound,
 		kIncorrectNumArgs,
 		kIncorrectArgType,
+		kFailed,	// the handler set its error; see lastError()
 		kError
 	};
 	FFI::RC call(const std::string& name, std::vector<Value>& stack, int nArgs);
+	const std::string& lastError() const { return errorMessage; }
+
+	std::vector<std::string> names() const;
+	ValueType returnType(const std::string& name) const;	// ValueType() if not found
 
 private:
 	struct FuncDef {
@@ -51,4 +60,5 @@ private:
 		FFIHandler* handler;
 	};
 	std::map<std::string, FuncDef> funcDefs;
+	std::string errorMessage;
 };
\ No newline at end of file
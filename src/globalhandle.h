@@ -0,0 +1,84 @@
+#pragma once
+
+#include "environment.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// How a GlobalHandle reads and writes each type. The host types are
+// double (num), bool (bool), and std::string (str).
+template<typename T> struct GlobalTraits;
+
+template<> struct GlobalTraits<double> {
+	using Result = double;
+	static constexpr PType kType = PType::tNum;
+	static double Get(const Value& v) { return v.vNumber; }
+	static double Get(const BoxedValue& v) { return v.asNumber(); }
+	static void Set(Value& v, double d) { v.vNumber = d; }
+	static void Set(BoxedValue& v, double d) { v = BoxedValue::Number(d); }
+};
+
+template<> struct GlobalTraits<bool> {
+	using Result = bool;
+	static constexpr PType kType = PType::tBool;
+	static bool Get(const Value& v) { return v.vBoolean; }
+	static bool Get(const BoxedValue& v) { return v.asBoolean(); }
+	static void Set(Value& v, bool b) { v.vBoolean = b; }
+	static void Set(BoxedValue& v, bool b) { v = BoxedValue::Boolean(b); }
+};
+
+template<> struct GlobalTraits<std::string> {
+	using Result = const std::string&;
+	static constexpr PType kType = PType::tStr;
+	static const std::string& Get(const Value& v) { return v.str(); }
+	static const std::string& Get(const BoxedValue& v) { return v.asString(); }
+	static void Set(Value& v, const std::string& s) { v = Value::String(s); }
+	static void Set(BoxedValue& v, const std::string& s) { v = BoxedValue::String(s); }
+};
+
+/*
+* A script global, resolved by name once (Interpreter::globalHandle) so
+* the host can read and write it every frame without a lookup or an
+* allocation (strings aside, which allocate when set.)
+*
+* The handle points at the storage of whichever engine the Interpreter
+* runs: a slot of the Machine globals, or the value in the global
+* Environment of the tree walker. Both stay put as globals are added.
+* A handle is good for the life of its Interpreter.
+*/
+template<typename T>
+class GlobalHandle {
+public:
+	using Traits = GlobalTraits<T>;
+	using EnvSlot = Environment::Slot;
+
+	GlobalHandle() {}
+
+	bool valid() const { return machineGlobals || envSlot; }
+
+	// Warning: unchecked! The handle must be valid.
+	typename Traits::Result get() const {
+		if (machineGlobals)
+			return Traits::Get((*machineGlobals)[slot]);
+		return Traits::Get(*envSlot);
+	}
+	void set(const T& v) {
+		if (machineGlobals)
+			Traits::Set((*machineGlobals)[slot], v);
+		else
+			Traits::Set(*envSlot, v);
+	}
+
+private:
+	friend class Interpreter;
+	GlobalHandle(std::vector<Value>* globals, uint32_t slot) : machineGlobals(globals), slot(slot) {}
+	GlobalHandle(EnvSlot* s) : envSlot(s) {}
+
+	static ValueType TypeOf(const Value& v) { return v.type; }
+	static ValueType TypeOf(const BoxedValue& v) { return v.type(); }
+
+	std::vector<Value>* machineGlobals = nullptr;
+	uint32_t slot = 0;
+	EnvSlot* envSlot = nullptr;
+};
@@ -0,0 +1,248 @@
+#pragma once
+
+#include "heap.h"
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+* A map from K to V, as an open addressing hash table with Robin Hood
+* probing. The table is two flat arrays: one byte of metadata per slot
+* (0 for empty, or 1 + how far the entry is from the slot its hash
+* picked), and the entries. A lookup scans the metadata and only compares
+* keys that are the same distance from home as the one it is looking for,
+* so a miss rarely touches the entries at all.
+*
+* Iteration (forEach) is in slot order, so it is stable as long as the
+* map isn't changed. set() on a new key, erase() and reserve() can move
+* entries.
+*
+* The elements come from the heap's allocator. Like ObjList, a map of
+* plain data, and strings, holds no references.
+*/
+template<typename K, typename V>
+class HashMap : public HeapObject
+{
+public:
+	explicit HashMap(Heap& heap, int capacity = 0) :
+		_meta(StdAllocator<uint8_t>(heap.allocator())),
+		_entries(StdAllocator<Entry>(heap.allocator()))
+	{
+		reserve(capacity);
+	}
+	virtual ~HashMap() {}
+
+	int size() const {
+		return _size;
+	}
+
+	// The number of slots, a power of 2 (or 0.)
+	int capacity() const {
+		return (int)_meta.size();
+	}
+
+	// Makes room for 'n' entries, so adding them won't rehash.
+	void reserve(int n) {
+		size_t slots = kMinCapacity;
+		while (slots * kMaxLoadNum < size_t(n) * kMaxLoadDen)
+			slots *= 2;
+		if (n > 0 && slots > _meta.size()) {
+			const size_t before = externalBytes();
+			rehash(slots);
+			trackBytes(before);
+		}
+	}
+
+	const V* find(const K& key) const {
+		const int slot = findSlot(key);
+		return slot >= 0 ? &_entries[slot].value : nullptr;
+	}
+
+	V* find(const K& key) {
+		const int slot = findSlot(key);
+		return slot >= 0 ? &_entries[slot].value : nullptr;
+	}
+
+	bool contains(const K& key) const {
+		return findSlot(key) >= 0;
+	}
+
+	// Adds the key, or changes its value. (A NaN key, which is never equal
+	// to itself, can't be added.)
+	void set(const K& key, V value) {
+		if constexpr (std::is_floating_point<K>::value)
+			REQUIRE(key == key);
+		if (V* v = find(key)) {
+			*v = std::move(value);
+			return;
+		}
+		const size_t before = externalBytes();
+		if (size_t(_size + 1) * kMaxLoadDen > _meta.size() * kMaxLoadNum)
+			rehash(std::max<size_t>(kMinCapacity, _meta.size() * 2));
+		Entry entry{ key, std::move(value) };
+		while (!insert(entry))
+			rehash(_meta.size() * 2);
+		trackBytes(before);
+	}
+
+	// Returns false if the key wasn't there.
+	bool erase(const K& key) {
+		int slot = findSlot(key);
+		if (slot < 0)
+			return false;
+		// Backward shift: move the entries after it back a slot, until one
+		// that is home (or an empty slot). No tombstones are needed.
+		const size_t mask = _meta.size() - 1;
+		size_t i = slot;
+		size_t next = (i + 1) & mask;
+		while (_meta[next] > 1) {
+			_meta[i] = _meta[next] - 1;
+			_entries[i] = std::move(_entries[next]);
+			i = next;
+			next = (next + 1) & mask;
+		}
+		_meta[i] = 0;
+		_entries[i] = Entry();
+		_size--;
+		return true;
+	}
+
+	// Removes every entry, and keeps the capacity.
+	void clear() {
+		std::fill(_meta.begin(), _meta.end(), uint8_t(0));
+		std::fill(_entries.begin(), _entries.end(), Entry());
+		_size = 0;
+	}
+
+	// Calls f(key, value) for each entry, in slot order.
+	template<typename F>
+	void forEach(F&& f) const {
+		for (size_t i = 0; i < _meta.size(); i++) {
+			if (_meta[i])
+				f(_entries[i].key, _entries[i].value);
+		}
+	}
+
+	size_t externalBytes() const override {
+		return _meta.capacity() * sizeof(uint8_t) + _entries.capacity() * sizeof(Entry);
+	}
+
+private:
+	static_assert(!std::is_same<K, HeapPtr>::value && !std::is_same<V, HeapPtr>::value,
+		"a map of references would need storeRef() and trace()");
+
+	struct Entry {
+		K key = K();
+		V value = V();
+	};
+
+	// Fibonacci hashing: spreads out hashes that differ only in their high
+	// (or low) bits, such as small integers as doubles.
+	size_t home(const K& key) const {
+		const uint64_t h = static_cast<uint64_t>(std::hash<K>()(key)) * 0x9E3779B97F4A7C15ull;
+		return static_cast<size_t>(h >> _shift);
+	}
+
+	int findSlot(const K& key) const {
+		if (_size == 0)
+			return -1;
+		const size_t mask = _meta.size() - 1;
+		size_t i = home(key);
+		// Robin Hood keeps the entries of a run in order of distance: once
+		// one is closer to its home than this key would be, it isn't there.
+		for (int dist = 1; _meta[i] >= dist; dist++) {
+			if (_meta[i] == dist && _entries[i].key == key)
+				return (int)i;
+			i = (i + 1) & mask;
+		}
+		return -1;
+	}
+
+	// Moves in an entry that isn't in the map. Returns false, and leaves
+	// the map and 'entry' alone, if an entry would end up too far from
+	// its home for the metadata to record.
+	bool insert(Entry& entry) {
+		const size_t mask = _meta.size() - 1;
+		size_t i = home(entry.key);
+		// Each entry up to the first empty slot may move one further away.
+		{
+			size_t j = i;
+			for (int dist = 1; _meta[j]; dist++, j = (j + 1) & mask) {
+				if (dist >= kMaxDist || _meta[j] >= kMaxDist)
+					return false;
+			}
+		}
+		uint8_t dist = 1;
+		Entry moving = std::move(entry);
+		while (_meta[i]) {
+			// Robin Hood: take the slot from an entry closer to its home.
+			if (_meta[i] < dist) {
+				std::swap(_meta[i], dist);
+				std::swap(_entries[i], moving);
+			}
+			dist++;
+			i = (i + 1) & mask;
+		}
+		_meta[i] = dist;
+		_entries[i] = std::move(moving);
+		_size++;
+		return true;
+	}
+
+	// Moves the entries to a table of 'slots' (a power of 2) slots.
+	void rehash(size_t slots) {
+		std::vector<uint8_t, StdAllocator<uint8_t>> meta(slots, uint8_t(0), _meta.get_allocator());
+		std::vector<Entry, StdAllocator<Entry>> entries(slots, Entry(), _entries.get_allocator());
+		meta.swap(_meta);
+		entries.swap(_entries);
+		_shift = 64;
+		for (size_t s = slots; s > 1; s >>= 1)
+			_shift--;
+		_size = 0;
+		for (size_t i = 0; i < meta.size(); i++) {
+			// Too many collisions at this size (which takes a very poor
+			// hash) grows the new table, and carries on.
+			while (meta[i] && !insert(entries[i]))
+				rehash(_meta.size() * 2);
+		}
+	}
+
+	void trackBytes(size_t before) {
+		if (externalBytes() != before)
+			externalBytesChanged(before);
+	}
+
+	static constexpr size_t kMinCapacity = 8;
+	// Rehash above 7/8 full.
+	static constexpr size_t kMaxLoadNum = 7;
+	static constexpr size_t kMaxLoadDen = 8;
+	static constexpr int kMaxDist = 255;
+
+	std::vector<uint8_t, StdAllocator<uint8_t>> _meta;
+	std::vector<Entry, StdAllocator<Entry>> _entries;
+	int _size = 0;
+	int _shift = 64;	// home() uses the top bits of the hash
+};
+
+// The maps of the language, keyed by str.
+class NumMap : public HashMap<std::string, double> {
+public:
+	NumMap(Heap& heap, int capacity) : HashMap(heap, capacity) {}
+	virtual const char* name() const override { return "NumMap"; }
+};
+
+class BoolMap : public HashMap<std::string, bool> {
+public:
+	BoolMap(Heap& heap, int capacity) : HashMap(heap, capacity) {}
+	virtual const char* name() const override { return "BoolMap"; }
+};
+
+class StrMap : public HashMap<std::string, std::string> {
+public:
+	StrMap(Heap& heap, int capacity) : HashMap(heap, capacity) {}
+	virtual const char* name() const override { return "StrMap"; }
+};
@@ -1,23 +1,378 @@
 #include "heap.h"
+#include "stringtable.h"
 
 #include <fmt/core.h>
+#include <algorithm>
+#include <chrono>
+#include <limits>
+
+Heap::Heap(Allocator& allocator, size_t limit) : _memory(new HeapMemory(*this, allocator, limit)),
+	_strBudget(new StrBudget(_memory->allocator.limited))
+{
+}
+
+Heap::~Heap()
+{
+	// Strings can outlive the heap, and its limit.
+	_strBudget->detach();
+	_strBudget->release();
+
+	using Color = HeapObject::Color;
+
+	// What is reached from a root - an object referenced from outside the
+	// heap - is orphaned. This is a full mark, from scratch: a collection
+	// in progress is dropped.
+	_phase = Phase::kIdle;
+	_gray.clear();
+	for (HeapObject* obj = _head; obj; obj = obj->_next) {
+		obj->_color = Color::kWhite;
+	}
+	for (HeapObject* obj = _head; obj; obj = obj->_next) {
+		if (obj->getRootRefCount() > 0)
+			shade(obj);
+	}
+	while (!_gray.empty()) {
+		HeapObject* obj = _gray.back();
+		_gray.pop_back();
+		obj->_color = Color::kBlack;
+		obj->trace(*this);
+	}
+
+	// References from the rest are dropped first, so no destructor
+	// releases an object that has already been destroyed.
+	for (HeapObject* obj = _head; obj; obj = obj->_next) {
+		if (obj->_color == Color::kWhite)
+			obj->clearRefs();
+	}
+	HeapObject* obj = _head;
+	while (obj) {
+		HeapObject* next = obj->_next;
+		if (obj->_color == Color::kWhite) {
+			_memory->free(obj);
+		}
+		else {
+			obj->_heap = nullptr;
+			obj->_pending = false;
+			obj->_prev = obj->_next = nullptr;
+			obj->_orphanOf = _memory;
+			_memory->orphans++;
+		}
+		obj = next;
+	}
+	_head = _tail = nullptr;
+
+	if (_memory->orphans == 0)
+		delete _memory;
+	else
+		_memory->allocator.heap = nullptr;
+}
+
+void HeapMemory::free(HeapObject* obj)
+{
+	const uint8_t pool = obj->_pool;
+	if (pool == HeapObject::kNotPooled) {
+		delete obj;
+		return;
+	}
+	const size_t size = obj->_size;
+	obj->~HeapObject();
+	if (pool == HeapObject::kLarge)
+		allocator.free(obj, size);
+	else
+		pools[pool]->free(obj);
+}
+
+/*static*/ void HeapMemory::releaseOrphan(HeapObject* obj)
+{
+	HeapMemory* memory = obj->_orphanOf;
+	// Releasing what it refers to may free other orphans; this one still
+	// counts, so the memory stays until it is freed.
+	obj->clearRefs();
+	memory->free(obj);
+	if (--memory->orphans == 0 && !memory->allocator.heap)
+		delete memory;
+}
+
+void Heap::destroy(HeapObject* obj)
+{
+	unlink(obj);
+	_bytes -= obj->_size + obj->externalBytes();
+	_stats.frees++;
+	_memory->free(obj);
+}
+
+size_t Heap::poolBytesReserved() const
+{
+	size_t bytes = 0;
+	for (const std::unique_ptr<SlabPool>& pool : _memory->pools) {
+		if (pool) bytes += pool->bytesReserved();
+	}
+	return bytes;
+}
+
+void* HeapMemory::HeapAllocator::alloc(size_t size)
+{
+	try {
+		return limited.alloc(size);
+	}
+	catch (const OutOfMemory&) {
+		// The garbage waiting to be freed may make room. The collector
+		// may be using it, though.
+		if (!heap || !heap->_pending || heap->isCollecting())
+			throw;
+	}
+	heap->freePending();
+	return limited.alloc(size);
+}
+
+void Heap::link(HeapObject* obj, size_t size)
+{
+	REQUIRE(obj && !obj->_heap);
+	obj->_heap = this;
+	obj->_size = static_cast<uint32_t>(size);
+	// Created during a collection, so it survives that collection.
+	obj->_color = isCollecting() ? HeapObject::Color::kBlack : HeapObject::Color::kWhite;
+
+	obj->_prev = _tail;
+	obj->_next = nullptr;
+	if (_tail)
+		_tail->_next = obj;
+	else
+		_head = obj;
+	_tail = obj;
+	_size++;
+
+	_stats.allocations++;
+	_stats.peakObjects = std::max(_stats.peakObjects, _size);
+	addBytes(size + obj->externalBytes());
+}
+
+void Heap::addBytes(size_t bytes)
+{
+	_bytes += bytes;
+	_stats.peakBytes = std::max(_stats.peakBytes, _bytes);
+}
+
+void Heap::unlink(HeapObject* obj)
+{
+	if (obj->_prev)
+		obj->_prev->_next = obj->_next;
+	else
+		_head = obj->_next;
+	if (obj->_next)
+		obj->_next->_prev = obj->_prev;
+	else
+		_tail = obj->_prev;
+	obj->_prev = obj->_next = nullptr;
+	_size--;
+}
+
+void Heap::enqueue(HeapObject* obj)
+{
+	// It stays in the list until it is freed, so the collector sees the
+	// heap as it is.
+	obj->_pending = true;
+	obj->_nextPending = _pending;
+	_pending = obj;
+}
+
+void Heap::freePending()
+{
+	// The collector may be holding pending objects (on the gray list, or
+	// as the cursor), so they wait for it.
+	if (isCollecting())
+		return;
+
+	while (_pending) {
+		HeapObject* obj = _pending;
+		_pending = obj->_nextPending;
+		// Anything it held alone joins the queue.
+		obj->clearRefs();
+		destroy(obj);
+	}
+}
+
+void Heap::freeGarbage()
+{
+	freePending();
+	if (_size >= _collectAt) {
+		collect();
+		_collectAt = std::max(kMinCollectSize, _size * 2);
+	}
+}
+
+using PauseClock = std::chrono::steady_clock;
+
+static double ElapsedMS(PauseClock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(PauseClock::now() - start).count();
+}
 
 void Heap::collect()
 {
-	// delete unreferenced objects
-	for (size_t i = 0; i < _objects.size(); i++) {
-		if (_objects[i]->getRefCount() == 0) {
-			delete _objects[i];
-			_objects[i] = nullptr;
+	static constexpr int kAll = std::numeric_limits<int>::max();
+	const PauseClock::time_point start = PauseClock::now();
+
+	// Objects created during a collection in progress survive it, so
+	// finish that one before running a full one.
+	if (isCollecting())
+		advance(kAll);
+	advance(kAll);
+	_stats.recordPause(ElapsedMS(start));
+}
+
+bool Heap::step(std::chrono::microseconds budget)
+{
+	// The clock is checked between chunks of work, rather than per object.
+	static constexpr int kChunk = 64;
+
+	const PauseClock::time_point start = PauseClock::now();
+	const PauseClock::time_point end = start + budget;
+	bool done = false;
+	while (!done) {
+		done = advance(kChunk);
+		if (PauseClock::now() >= end)
+			break;
+	}
+	_stats.recordPause(ElapsedMS(start));
+	return done;
+}
+
+bool Heap::advance(int units)
+{
+	using Color = HeapObject::Color;
+
+	if (_phase == Phase::kIdle) {
+		_phase = Phase::kScanRoots;
+		_cursor = _head;
+		// Growing the gray list as it fills would copy it, in one step.
+		_gray.reserve(_size);
+	}
+	while (units > 0) {
+		switch (_phase) {
+		case Phase::kScanRoots:
+			if (!_cursor) {
+				_phase = Phase::kMark;
+				break;
+			}
+			if (_cursor->getRootRefCount() > 0)
+				shade(_cursor);
+			_cursor = _cursor->_next;
+			units--;
+			break;
+
+		case Phase::kMark:
+			if (_gray.empty()) {
+				// Nothing runs between here and the end of the step, so
+				// nothing can be shaded once the gray list is empty.
+				_phase = Phase::kClear;
+				_cursor = _head;
+				break;
+			}
+			else {
+				HeapObject* obj = _gray.back();
+				_gray.pop_back();
+				obj->_color = Color::kBlack;
+				obj->trace(*this);
+				units--;
+			}
+			break;
+
+		case Phase::kClear:
+			if (!_cursor) {
+				_phase = Phase::kFree;
+				_cursor = _head;
+				break;
+			}
+			if (_cursor->_color == Color::kWhite)
+				_cursor->clearRefs();
+			_cursor = _cursor->_next;
+			units--;
+			break;
+
+		case Phase::kFree:
+			if (!_cursor) {
+				_phase = Phase::kIdle;
+				_collections++;
+				// Including what the collection itself queued.
+				freePending();
+				return true;
+			}
+			else {
+				HeapObject* obj = _cursor;
+				_cursor = obj->_next;
+				// Pending objects are freed from the queue.
+				if (obj->_color == Color::kWhite && !obj->_pending)
+					destroy(obj);
+				else
+					obj->_color = Color::kWhite;
+				units--;
+			}
+			break;
+
+		case Phase::kIdle:
+			REQUIRE(false);
+			break;
 		}
 	}
-	_objects.erase(std::remove(_objects.begin(), _objects.end(), nullptr), _objects.end());
+	return false;
 }
 
 void Heap::report()
 {
-	fmt::print("Heap has {} objects\n", _objects.size());
-	for (const auto& obj : _objects) {
+	fmt::print("Heap has {} objects\n", _size);
+	for (HeapObject* obj = _head; obj; obj = obj->_next) {
 		fmt::print("  Object {} has {} refs\n", obj->name(), obj->getRefCount());
 	}
-}
\ No newline at end of file
+}
+
+HeapStats Heap::stats() const
+{
+	HeapStats stats = _stats;
+	stats.objects = _size;
+	stats.bytes = _bytes;
+	stats.collections = _collections;
+	stats.allocated = allocated();
+	stats.limit = limit();
+	for (const HeapObject* obj = _head; obj; obj = obj->_next) {
+		HeapStats::Type& type = stats.types[obj->name()];
+		type.count++;
+		type.bytes += obj->_size + obj->externalBytes();
+	}
+	return stats;
+}
+
+/*static*/ int HeapStats::PauseBucket(double ms)
+{
+	int bucket = 0;
+	for (double limit = 0.01; bucket < kPauseBuckets - 1 && ms >= limit; limit *= 10)
+		bucket++;
+	return bucket;
+}
+
+void HeapStats::recordPause(double ms)
+{
+	pauses[PauseBucket(ms)]++;
+	totalPauseMS += ms;
+	maxPauseMS = std::max(maxPauseMS, ms);
+}
+
+void HeapStats::print() const
+{
+	static const char* kPauseNames[kPauseBuckets] = { "<10us", "<100us", "<1ms", "<10ms", "<100ms", ">=100ms" };
+
+	fmt::print("Heap: {} objects, {} bytes (peak {} objects, {} bytes)\n", objects, bytes, peakObjects, peakBytes);
+	for (const auto& it : types) {
+		fmt::print("  {: <12} {:8} objects {:12} bytes\n", it.first, it.second.count, it.second.bytes);
+	}
+	fmt::print("  {} allocations, {} frees, {} collections\n", allocations, frees, collections);
+	if (limit == LimitedAllocator::kNoLimit)
+		fmt::print("  {} bytes allocated, no limit\n", allocated);
+	else
+		fmt::print("  {} bytes allocated, of a limit of {}\n", allocated, limit);
+	fmt::print("  Pauses: {:.3f}ms total, {:.3f}ms max\n   ", totalPauseMS, maxPauseMS);
+	for (int i = 0; i < kPauseBuckets; i++) {
+		fmt::print(" {} {}", kPauseNames[i], pauses[i]);
+	}
+	fmt::print("\n");
+}
@@ -1,18 +1,41 @@
 #pragma once
 
+#include "allocator.h"
 #include "error.h"
+#include "pool.h"
 
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+class Heap;
+class HeapMemory;
+class StrBudget;
+class HeapPtr;
 class NumList;
 class BoolList;
 class StrList;
 
 /* 
-* A HeapObject is constructed like any other object.
-* However, it MUST:
-* - be added to the heap
-* - be held by a HeapPtr
+* A HeapObject is created with Heap::make(), which allocates it from the
+* heap's pools. (It can also be constructed like any other object, and
+* then added to the heap.) It MUST be held by a HeapPtr.
+*
+* The ref count counts every reference. An object that holds references
+* to other objects (a container) keeps them in HeapPtrs, changes them
+* with storeRef(), and reports them from trace(). The Heap can then tell
+* references from other objects - which don't keep an object alive on
+* their own, or a cycle would never be freed - from roots.
+*
+* An object still referenced from outside when its Heap is destroyed is
+* orphaned (see ~Heap): it is freed when its ref count reaches zero.
 */
 class HeapObject {
 public:
@@ -20,45 +43,347 @@ public:
 	virtual ~HeapObject() {}
 	virtual const char* name() const = 0;	// debugging
 
-	void addRef() {
-		_refCount++;
-	}
-	void release() {
-		--_refCount;
-		REQUIRE(_refCount >= 0);
-	}
+	// Calls heap.shade() on each object this one refers to.
+	virtual void trace(Heap& heap) const { (void)heap; }
+	// Drops the references this object holds. Called on garbage before it
+	// is deleted, so objects in a cycle don't release each other once deleted.
+	virtual void clearRefs() {}
+	// Memory the object owns outside itself (a list's elements), for
+	// HeapStats. A change must be reported with externalBytesChanged().
+	virtual size_t externalBytes() const { return 0; }
+
+	void addRef();	// includes the write barrier: see Heap
+	void release();	// at zero, the object is queued to be freed
 	int getRefCount() const {
 		return _refCount;
 	}
+	// References from outside the heap: the stacks, variables, and the host.
+	int getRootRefCount() const {
+		return _refCount - _innerRefs;
+	}
+
+protected:
+	// Stores 'v' in 'field', a reference held by this object.
+	void storeRef(HeapPtr& field, const HeapPtr& v);
+	// Called when externalBytes() has changed from 'before'.
+	void externalBytesChanged(size_t before);
 
 private:
+	friend class Heap;
+	friend class HeapMemory;
+	enum class Color : uint8_t {
+		kWhite,		// not reached (yet)
+		kGray,		// reached, but its references haven't been traced
+		kBlack		// reached and traced
+	};
+
 	int _refCount = 0;
+	int _innerRefs = 0;		// the part of _refCount from other HeapObjects
+	Color _color = Color::kWhite;
+	uint8_t _pool = kNotPooled;		// the size class it was allocated from, or kLarge
+	bool _pending = false;			// on the heap's pending free list
+	uint32_t _size = 0;				// sizeof the object, for HeapStats
+	Heap* _heap = nullptr;
+	// The heap's list of objects, and its pending free list.
+	HeapObject* _prev = nullptr;
+	HeapObject* _next = nullptr;
+	union {
+		HeapObject* _nextPending = nullptr;	// in a heap
+		HeapMemory* _orphanOf;				// orphaned: where its memory came from
+	};
+
+	static constexpr uint8_t kNotPooled = 0xff;	// created with new
+	static constexpr uint8_t kLarge = 0xfe;		// from the heap's allocator
+};
+
+/*
+* A snapshot of a Heap, from Heap::stats(). Bytes are the objects, and
+* the memory they own (see HeapObject::externalBytes.)
+*/
+struct HeapStats {
+	struct Type {
+		size_t count = 0;
+		size_t bytes = 0;
+	};
+	std::map<std::string, Type> types;	// live objects, by HeapObject::name()
+
+	size_t objects = 0;
+	size_t bytes = 0;
+	size_t peakObjects = 0;		// the most live at once
+	size_t peakBytes = 0;
+	uint64_t allocations = 0;	// since the heap was created
+	uint64_t frees = 0;
+	int collections = 0;
+	// From the heap's Allocator (pool slabs included), and its limit.
+	size_t allocated = 0;
+	size_t limit = 0;
+
+	// Collector pauses: each step(), and each collect(), by how long it
+	// took: under 10us, 100us, 1ms, 10ms, 100ms, and longer.
+	static constexpr int kPauseBuckets = 6;
+	uint64_t pauses[kPauseBuckets] = {};
+	double totalPauseMS = 0;
+	double maxPauseMS = 0;
+
+	static int PauseBucket(double ms);
+	void recordPause(double ms);
+	void print() const;
 };
 
+/*
+* The heap owns every HeapObject, and frees them with an incremental,
+* tri-color mark and sweep collector. Each step() does as much work as
+* fits in its time budget, so a collection can be spread over frames:
+*
+*	kScanRoots	objects with root references are shaded gray
+*	kMark		gray objects are traced, which shades what they refer to
+*	kClear		unreached (white) objects drop their references
+*	kFree		unreached objects are deleted; the rest go back to white
+*
+* The program keeps running between steps, so while marking, any new
+* reference to a white object shades it (the write barrier, in
+* HeapObject::addRef, which HeapPtr assignment and ObjList::set go
+* through.) Objects created during a collection are black, so they
+* survive it.
+*
+* Most garbage never needs the collector: when an object's ref count
+* reaches zero, release() queues it, and freePending() frees the queue.
+* That costs as much as the garbage, not the heap. The collector is for
+* what ref counts can't free, cycles.
+*
+* Objects are allocated from a SlabPool per size class, so creating and
+* freeing them doesn't go through malloc. Destroying the Heap destroys
+* the objects that nothing outside it refers to, and releases the pools'
+* memory in bulk. The rest - a list the host kept from interpret(), and
+* whatever it refers to - are orphaned: they are freed, one by one, as
+* their ref counts reach zero (a cycle of orphans is never freed), and
+* the memory goes back to the host's Allocator with the last of them.
+* So the Allocator must outlive any object the host keeps.
+*
+* The pools' slabs, larger objects, and the elements of lists all come
+* from the Allocator the heap is created with, up to its limit. An
+* allocation that would go over the limit first frees the pending
+* garbage, then throws OutOfMemory, which the engines report as a
+* runtime error. The strings made while the Interpreter runs are charged
+* against the same limit, through strBudget().
+*/
 class Heap {
 public:
-	// This is not garbage collection, just a way to clean up the heap.
-	// Objects can be using memory with no references, so this collect()
-	// method will delete them.
+	Heap(Allocator& allocator = Allocator::Default(), size_t limit = LimitedAllocator::kNoLimit);
+	~Heap();
+
+	Heap(const Heap&) = delete;
+	Heap& operator=(const Heap&) = delete;
+
+	// Creates a T in the pool for its size, and adds it to the heap.
+	template<typename T, typename... Args>
+	T* make(Args&&... args);
+
+	// For memory the objects own, such as list elements.
+	Allocator& allocator();
+	// The bytes taken from the host's allocator, and the limit on them.
+	size_t allocated() const;
+	size_t limit() const;
+	void setLimit(size_t limit);
+	// Charges strings to the limit: see StrBudget.
+	StrBudget* strBudget() const { return _strBudget; }
+
+	// Runs a full collection, finishing the one in progress, if any.
 	void collect();
+	// Frees the objects whose ref count reached zero (and anything they
+	// held alone.) Waits for a collection in progress to finish.
+	void freePending();
+	// freePending(), and a full collection, for cycles, once the heap has
+	// grown to twice its size after the last one.
+	void freeGarbage();
 
-	// When a HeapObject is created, it MUST be added to the heap.
-	void add(HeapObject* obj) {
-		_objects.push_back(obj);
-	};
+	// Does up to 'budget' of collection work, starting a new collection
+	// if there isn't one in progress. Returns true if the collection is
+	// finished.
+	bool step(std::chrono::microseconds budget);
+	// As step(), but up to 'units' of work: an object scanned, traced,
+	// or swept. For tests, and hosts that want to count work, not time.
+	bool advance(int units);
+
+	bool isCollecting() const { return _phase != Phase::kIdle; }
+	bool isMarking() const { return _phase == Phase::kScanRoots || _phase == Phase::kMark; }
+	int collections() const { return _collections; }	// completed
+
+	// A HeapObject created with new, rather than make(), MUST be added
+	// to the heap. It is then deleted by the heap.
+	template<typename T>
+	void add(T* obj) { link(obj, sizeof(T)); }
 
-	const std::vector<HeapObject*>& objects() const {
-		return _objects;
+	size_t size() const { return _size; }
+	// The objects, and the memory they own.
+	size_t bytes() const { return _bytes; }
+	uint64_t allocations() const { return _stats.allocations; }
+	uint64_t frees() const { return _stats.frees; }
+	// Walks the heap for the per type counts.
+	HeapStats stats() const;
+	template<typename F>
+	void forEach(F&& f) const {
+		for (HeapObject* obj = _head; obj; obj = obj->_next)
+			f(obj);
+	}
+
+	// Marks an object as reached.
+	void shade(HeapObject* obj) {
+		if (obj->_color == HeapObject::Color::kWhite) {
+			obj->_color = HeapObject::Color::kGray;
+			_gray.push_back(obj);
+		}
 	}
 
 	// Reports open objects.
 	// Generally want to collect() first
 	void report();
 
+	static void test();
+
+	// The size classes, in bytes. Anything larger uses new and delete.
+	static constexpr size_t kSizeClasses[] = { 32, 48, 64, 96, 128, 192, 256 };
+	static constexpr int kNumSizeClasses = sizeof(kSizeClasses) / sizeof(kSizeClasses[0]);
+	static constexpr int SizeClass(size_t size) {
+		for (int i = 0; i < kNumSizeClasses; i++) {
+			if (size <= kSizeClasses[i]) return i;
+		}
+		return -1;
+	}
+	// Memory held by the pools, in use or free.
+	size_t poolBytesReserved() const;
+
 private:
-	std::vector<HeapObject*> _objects;
+	enum class Phase {
+		kIdle,
+		kScanRoots,
+		kMark,
+		kClear,
+		kFree
+	};
+	static constexpr size_t kMinCollectSize = 1024;
+
+	friend class HeapObject;
+	friend class HeapMemory;
+
+	void link(HeapObject* obj, size_t size);
+	void addBytes(size_t bytes);
+	void enqueue(HeapObject* obj);
+	void unlink(HeapObject* obj);
+	void destroy(HeapObject* obj);		// back to its pool, or deleted
+
+	// The allocator and the pools. Deleted with the heap, unless there are
+	// orphans: then by the last of them.
+	HeapMemory* _memory;
+	StrBudget* _strBudget;
+
+	Phase _phase = Phase::kIdle;
+	HeapObject* _cursor = nullptr;		// the next object, for the phases that walk the list
+	int _collections = 0;
+	size_t _collectAt = kMinCollectSize;	// the size for freeGarbage() to collect at
+
+	// Every object, in the order added, so objects added during a
+	// collection come after the cursor.
+	HeapObject* _head = nullptr;
+	HeapObject* _tail = nullptr;
+	size_t _size = 0;
+	HeapObject* _pending = nullptr;
+	std::vector<HeapObject*> _gray;
+
+	size_t _bytes = 0;
+	HeapStats _stats;		// the counters; stats() fills in the rest
+};
+
+// Where a Heap's objects, and the memory they own, come from: the host's
+// allocator, under the limit, and the pools.
+class HeapMemory {
+public:
+	HeapMemory(Heap& heap, Allocator& allocator, size_t limit) : allocator(heap, allocator, limit) {}
+
+	// Returns an object's memory, after destroying it.
+	void free(HeapObject* obj);
+	// Frees an orphan whose ref count reached zero, and the memory, if it
+	// was the last one.
+	static void releaseOrphan(HeapObject* obj);
+
+	class HeapAllocator : public Allocator {
+	public:
+		HeapAllocator(Heap& heap, Allocator& allocator, size_t limit) : heap(&heap), limited(allocator, limit) {}
+		void* alloc(size_t size) override;
+		void free(void* p, size_t size) override { limited.free(p, size); }
+
+		Heap* heap;		// null once the heap is gone
+		LimitedAllocator limited;
+	};
+
+	HeapAllocator allocator;
+	std::unique_ptr<SlabPool> pools[Heap::kNumSizeClasses];		// created as needed
+	size_t orphans = 0;
 };
 
+inline Allocator& Heap::allocator() { return _memory->allocator; }
+inline size_t Heap::allocated() const { return _memory->allocator.limited.used(); }
+inline size_t Heap::limit() const { return _memory->allocator.limited.limit(); }
+inline void Heap::setLimit(size_t limit) { _memory->allocator.limited.setLimit(limit); }
+
+template<typename T, typename... Args>
+T* Heap::make(Args&&... args)
+{
+	static_assert(std::is_base_of<HeapObject, T>::value, "Heap::make() is for HeapObjects");
+	constexpr int sizeClass = SizeClass(sizeof(T));
+
+	T* obj = nullptr;
+	if constexpr (sizeClass < 0) {
+		void* p = _memory->allocator.alloc(sizeof(T));
+		try {
+			obj = new (p) T(std::forward<Args>(args)...);
+		}
+		catch (...) {
+			_memory->allocator.free(p, sizeof(T));
+			throw;
+		}
+		obj->_pool = HeapObject::kLarge;
+	}
+	else {
+		std::unique_ptr<SlabPool>& pool = _memory->pools[sizeClass];
+		if (!pool)
+			pool = std::make_unique<SlabPool>(kSizeClasses[sizeClass], _memory->allocator);
+		void* p = pool->alloc();
+		try {
+			obj = new (p) T(std::forward<Args>(args)...);
+		}
+		catch (...) {
+			pool->free(p);
+			throw;
+		}
+		obj->_pool = static_cast<uint8_t>(sizeClass);
+	}
+	add(obj);
+	return obj;
+}
+
+inline void HeapObject::addRef()
+{
+	_refCount++;
+	if (_heap && _color == Color::kWhite && _heap->isMarking())
+		_heap->shade(this);
+}
+
+inline void HeapObject::release()
+{
+	--_refCount;
+	REQUIRE(_refCount >= 0);
+	if (_refCount == 0) {
+		if (_heap) {
+			if (!_pending)
+				_heap->enqueue(this);
+		}
+		else if (_orphanOf) {
+			HeapMemory::releaseOrphan(this);
+		}
+	}
+}
+
 // A heap pointer is a smart pointer that automatically increments the ref count
 class HeapPtr {
 public:
@@ -71,6 +396,24 @@ public:
 		if (_ptr)
 			_ptr->addRef();
 	}
+	HeapPtr(HeapPtr&& other) noexcept : _ptr(other._ptr) {
+		other._ptr = nullptr;
+	}
+	HeapPtr& operator=(const HeapPtr& other) {
+		if (other._ptr)
+			other._ptr->addRef();
+		clear();
+		_ptr = other._ptr;
+		return *this;
+	}
+	HeapPtr& operator=(HeapPtr&& other) noexcept {
+		if (this != &other) {
+			clear();
+			_ptr = other._ptr;
+			other._ptr = nullptr;
+		}
+		return *this;
+	}
 	~HeapPtr() {
 		if (_ptr) {
 			_ptr->release();
@@ -82,6 +425,10 @@ public:
 		_ptr->addRef();
 	}
 
+	HeapObject* get() const {
+		return _ptr;
+	}
+
 	void clear() {
 		if (_ptr) {
 			_ptr->release();
@@ -93,50 +440,289 @@ private:
 	HeapObject* _ptr;
 };
 
+inline void HeapObject::externalBytesChanged(size_t before)
+{
+	// Before it is added, add() counts it all.
+	if (_heap) {
+		_heap->_bytes -= before;
+		_heap->addBytes(externalBytes());
+	}
+}
+
+inline void HeapObject::storeRef(HeapPtr& field, const HeapPtr& v)
+{
+	if (v.get()) v.get()->_innerRefs++;
+	if (field.get()) field.get()->_innerRefs--;
+	field = v;
+}
+
+/*
+* A list of T, stored contiguously. Lists of plain data (num, bool) can
+* be filled and copied in bulk, and data() gives direct access to the
+* elements, for host code and for native builtins.
+*
+* bool is stored as one byte per element, since std::vector<bool> packs
+* bits and so has no data(). Lists of HeapPtr go one element at a time
+* through storeRef(), for the ref counts and the write barrier.
+*
+* A list can also be a view: a window onto the elements of another list
+* (its parent), which it keeps alive. Reading a view copies nothing.
+* Anything that changes a view, including the non-const data(), first
+* copies its elements (copy on write), after which it is a list of its
+* own. Changes to the parent are seen by its views, and a view that the
+* parent has shrunk past is cut short.
+*/
 template<typename T> 
 class ObjList : public HeapObject
 {
 public:
-	ObjList(int initialSize) {
+	using Element = typename std::conditional<std::is_same<T, bool>::value, uint8_t, T>::type;
+
+	// The elements come from the heap's allocator.
+	ObjList(Heap& heap, int initialSize) : _list(StdAllocator<Element>(heap.allocator())) {
 		setSize(initialSize);
 	}
 	virtual ~ObjList() {}
 
+	// A list of references goes through storeRef(), for the ref counts
+	// and the write barrier.
+	static constexpr bool kHoldsRefs = std::is_same<T, HeapPtr>::value;
+
 	T get(int i) const {
-		return _list[i];
+		return T(elements()[i]);
 	}
 
 	void set(int i, T v) {
-		_list[i] = v;
+		unshare();
+		if constexpr (kHoldsRefs)
+			storeRef(_list[i], v);
+		else
+			_list[i] = Element(v);
 	}
 
 	int size() const {
-		return (int)_list.size();
+		if (!_parent.get())
+			return (int)_list.size();
+		return std::clamp(parentList()->size() - _offset, 0, _length);
 	}
 
 	void setSize(int size) {
+		unshare();
+		if constexpr (kHoldsRefs) {
+			for (int i = size; i < this->size(); i++)
+				storeRef(_list[i], HeapPtr());
+		}
+		const size_t before = capacityBytes();
 		_list.resize(size);
+		trackCapacity(before);
+	}
+
+	void reserve(int capacity) {
+		unshare();
+		const size_t before = capacityBytes();
+		_list.reserve(capacity);
+		trackCapacity(before);
+	}
+
+	int capacity() const {
+		return (int)_list.capacity();
+	}
+
+	Element* data() { unshare(); return _list.data(); }
+	const Element* data() const { return elements(); }
+
+	// Makes this a view of the elements [offset, offset + length) of
+	// 'list', which must be in bounds. This must be a new, empty list of
+	// the same type. A view of a view refers to the original list.
+	void viewOf(const ObjList& list, int offset, int length) {
+		REQUIRE(_list.empty() && !_parent.get());
+		REQUIRE(offset >= 0 && length >= 0 && offset + length <= list.size());
+		const ObjList* root = &list;
+		if (list._parent.get()) {
+			root = list.parentList();
+			offset += list._offset;
+		}
+		storeRef(_parent, HeapPtr(const_cast<ObjList*>(root)));
+		_offset = offset;
+		_length = length;
+	}
+
+	bool isView() const {
+		return _parent.get() != nullptr;
+	}
+
+	// Sets every element to 'v'.
+	void fill(T v) {
+		unshare();
+		if constexpr (kHoldsRefs) {
+			for (HeapPtr& p : _list)
+				storeRef(p, v);
+		}
+		else {
+			std::fill(_list.begin(), _list.end(), Element(v));
+		}
+	}
+
+	// Makes this a copy of 'other', resizing as needed.
+	void copyFrom(const ObjList& other) {
+		if (&other == this)
+			return;
+		if (other._parent.get() == this) {
+			// A view of this list: its elements move as this one is resized.
+			std::vector<Element> copy(other.elements(), other.elements() + other.size());
+			setSize((int)copy.size());
+			for (int i = 0; i < (int)copy.size(); i++)
+				set(i, T(copy[i]));
+			return;
+		}
+		unshare();
+		const Element* src = other.elements();
+		const int n = other.size();
+		if constexpr (kHoldsRefs) {
+			setSize(n);
+			for (int i = 0; i < n; i++)
+				storeRef(_list[i], src[i]);
+		}
+		else {
+			const size_t before = capacityBytes();
+			_list.assign(src, src + n);
+			trackCapacity(before);
+		}
+	}
+
+	// Adds 'n' elements to the end. 'values' must not point into this list.
+	void append(const Element* values, int n) {
+		REQUIRE(n >= 0);
+		unshare();
+		grow(n);
+		if constexpr (kHoldsRefs) {
+			int start = size();
+			setSize(start + n);
+			for (int i = 0; i < n; i++)
+				storeRef(_list[start + i], values[i]);
+		}
+		else {
+			const size_t before = capacityBytes();
+			_list.insert(_list.end(), values, values + n);
+			trackCapacity(before);
+		}
+	}
+
+	void append(T v) {
+		unshare();
+		grow(1);
+		if constexpr (kHoldsRefs) {
+			_list.emplace_back();
+			storeRef(_list.back(), v);
+		}
+		else {
+			_list.push_back(Element(v));
+		}
+	}
+
+	// Removes and returns the last element. The capacity is kept, so
+	// popping and appending again doesn't reallocate.
+	T pop() {
+		unshare();
+		REQUIRE(!_list.empty());
+		T v = T(_list.back());
+		if constexpr (kHoldsRefs)
+			storeRef(_list.back(), HeapPtr());
+		_list.pop_back();
+		return v;
+	}
+
+	size_t externalBytes() const override {
+		return capacityBytes();
+	}
+
+	void trace(Heap& heap) const override {
+		if (_parent.get())
+			heap.shade(_parent.get());
+		if constexpr (kHoldsRefs) {
+			for (const HeapPtr& p : _list) {
+				if (p.get()) heap.shade(p.get());
+			}
+		}
+		else {
+			(void)heap;
+		}
+	}
+
+	void clearRefs() override {
+		storeRef(_parent, HeapPtr());
+		if constexpr (kHoldsRefs) {
+			for (HeapPtr& p : _list)
+				storeRef(p, HeapPtr());
+		}
 	}
 
 private:
-	std::vector<double> _list;
+	const ObjList* parentList() const {
+		return static_cast<const ObjList*>(_parent.get());
+	}
+	const Element* elements() const {
+		return _parent.get() ? parentList()->_list.data() + _offset : _list.data();
+	}
+	// Gives a view its own copy of its elements, and drops the parent.
+	void unshare() {
+		if (!_parent.get())
+			return;
+		const Element* src = elements();
+		const int n = size();
+		const size_t before = capacityBytes();
+		if constexpr (kHoldsRefs) {
+			_list.resize(n);
+			for (int i = 0; i < n; i++)
+				storeRef(_list[i], src[i]);
+		}
+		else {
+			_list.assign(src, src + n);
+		}
+		trackCapacity(before);
+		storeRef(_parent, HeapPtr());
+		_offset = _length = 0;
+	}
+
+	size_t capacityBytes() const {
+		return _list.capacity() * sizeof(Element);
+	}
+	void trackCapacity(size_t before) {
+		if (capacityBytes() != before)
+			externalBytesChanged(before);
+	}
+	// Makes room for 'n' more elements. The capacity at least doubles, so
+	// appending one at a time is amortized O(1) with any std::vector.
+	void grow(int n) {
+		const size_t needed = _list.size() + n;
+		if (needed <= _list.capacity())
+			return;
+		reserve((int)std::max<size_t>({ needed, _list.capacity() * 2, kMinCapacity }));
+	}
+	static constexpr size_t kMinCapacity = 8;
+
+	std::vector<Element, StdAllocator<Element>> _list;
+	// For a view: the list it looks into (never itself a view), and where.
+	HeapPtr _parent;
+	int _offset = 0;
+	int _length = 0;
 };
 
 class NumList : public ObjList<double> {
 public:
-	NumList(int initialSize) : ObjList(initialSize) {}
+	NumList(Heap& heap, int initialSize) : ObjList(heap, initialSize) {}
 	virtual const char* name() const override { return "NumList"; }
 };
 
 class BoolList : public ObjList<bool> {
 public:
-	BoolList(int initialSize) : ObjList(initialSize) {}
+	BoolList(Heap& heap, int initialSize) : ObjList(heap, initialSize) {}
 	virtual const char* name() const override { return "BoolList"; }
 };
 
 class StrList : public ObjList<std::string> {
 	public:
-	StrList(int initialSize) : ObjList(initialSize) {}
+	StrList(Heap& heap, int initialSize) : ObjList(heap, initialSize) {}
 	virtual const char* name() const override { return "StrList"; }
 };
 
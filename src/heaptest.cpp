@@ -0,0 +1,539 @@
+#include "hashmap.h"
+#include "heap.h"
+#include "test.h"
+
+#include <map>
+
+
+// A container with two references, so tests can build graphs and cycles.
+class Pair : public HeapObject {
+public:
+	virtual const char* name() const override { return "Pair"; }
+
+	void setA(const HeapPtr& v) { storeRef(a, v); }
+	void setB(const HeapPtr& v) { storeRef(b, v); }
+
+	void trace(Heap& heap) const override {
+		if (a.get()) heap.shade(a.get());
+		if (b.get()) heap.shade(b.get());
+	}
+	void clearRefs() override {
+		storeRef(a, HeapPtr());
+		storeRef(b, HeapPtr());
+	}
+
+	HeapPtr a, b;
+};
+
+static Pair* NewPair(Heap& heap)
+{
+	return heap.make<Pair>();
+}
+
+static bool Contains(const Heap& heap, const HeapObject* obj)
+{
+	bool found = false;
+	heap.forEach([&](const HeapObject* o) { found = found || o == obj; });
+	return found;
+}
+
+static void Unreferenced()
+{
+	Heap heap;
+	NewPair(heap);
+	HeapPtr kept(NewPair(heap));
+	heap.add(new Pair());		// not from a pool
+	heap.collect();
+	TEST(heap.size() == 1);
+	TEST(Contains(heap, kept.get()));
+	TEST(heap.collections() == 1);
+}
+
+static void Cycles()
+{
+	Heap heap;
+	HeapObject* first = nullptr;
+	{
+		HeapPtr a(NewPair(heap));
+		first = a.get();
+		HeapPtr b(NewPair(heap));
+		static_cast<Pair*>(a.get())->setA(b);
+		static_cast<Pair*>(b.get())->setA(a);
+		TEST(a.get()->getRefCount() == 2);
+		TEST(a.get()->getRootRefCount() == 1);
+
+		// Reachable from a root, so both survive.
+		heap.collect();
+		TEST(heap.size() == 2);
+	}
+	// Only the cycle refers to them now: a ref count would never free them.
+	TEST(first->getRefCount() == 1);
+	heap.freePending();
+	TEST(heap.size() == 2);
+	heap.collect();
+	TEST(heap.size() == 0);
+}
+
+static void Incremental()
+{
+	Heap heap;
+	HeapPtr root(NewPair(heap));
+	// A long chain from the root, and as much garbage.
+	Pair* tail = static_cast<Pair*>(root.get());
+	for (int i = 0; i < 20000; i++) {
+		HeapPtr next(NewPair(heap));
+		tail->setA(next);
+		tail = static_cast<Pair*>(next.get());
+		NewPair(heap);
+	}
+	TEST(heap.size() == 40001);
+
+	// Not all in one step, but it gets there.
+	int steps = 1;
+	while (!heap.step(std::chrono::microseconds(1)))
+		steps++;
+	TEST(steps > 1);
+	TEST(heap.size() == 20001);
+	TEST(!heap.isCollecting());
+}
+
+static void WriteBarrier()
+{
+	// 'x' is only referred to by 'holder', and its root scan is done.
+	// Then the program moves the reference: to a new root, and out of
+	// 'holder'. Without the barrier, 'x' would never be reached.
+	Heap heap;
+	Pair* x = NewPair(heap);
+	HeapPtr holder(NewPair(heap));
+	static_cast<Pair*>(holder.get())->setA(HeapPtr(x));
+	TEST(x->getRootRefCount() == 0);
+
+	TEST(!heap.advance(1));		// scans 'x'
+	TEST(heap.isMarking());
+	HeapPtr moved = static_cast<Pair*>(holder.get())->a;
+	static_cast<Pair*>(holder.get())->setA(HeapPtr());
+	heap.collect();
+	TEST(Contains(heap, x));
+	TEST(x->getRefCount() == 1);
+
+	// And a reference stored in an object that has been traced (black.)
+	static_cast<Pair*>(holder.get())->setA(moved);
+	moved.clear();
+	HeapPtr y(NewPair(heap));
+	TEST(!heap.advance(4));		// scans all three, and traces 'y'
+	static_cast<Pair*>(y.get())->setB(static_cast<Pair*>(holder.get())->a);
+	static_cast<Pair*>(holder.get())->setA(HeapPtr());
+	heap.collect();
+	TEST(Contains(heap, x));
+	TEST(x->getRootRefCount() == 0);
+
+	// Objects created during a collection survive it.
+	TEST(!heap.advance(1));
+	Pair* created = NewPair(heap);
+	while (!heap.advance(1)) {}
+	TEST(Contains(heap, created));
+	heap.collect();
+	TEST(!Contains(heap, created));
+}
+
+static void PendingFree()
+{
+	Heap heap;
+	{
+		// A chain, held only by its head.
+		HeapPtr head(NewPair(heap));
+		HeapPtr next(NewPair(heap));
+		static_cast<Pair*>(head.get())->setA(next);
+		static_cast<Pair*>(next.get())->setA(HeapPtr(NewPair(heap)));
+	}
+	// Queued, and freed without the collector.
+	TEST(heap.size() == 3);
+	heap.freePending();
+	TEST(heap.size() == 0);
+	TEST(heap.collections() == 0);
+
+	// A collection in progress holds on to the queue until it finishes.
+	HeapPtr a(NewPair(heap));
+	TEST(!heap.advance(1));
+	a.clear();
+	heap.freePending();
+	TEST(heap.size() == 1);
+	while (!heap.advance(1)) {}
+	TEST(heap.size() == 0);
+
+	// freeGarbage() only collects once the heap has grown.
+	HeapPtr kept(NewPair(heap));
+	heap.freeGarbage();
+	TEST(heap.collections() == 1);
+	for (int i = 0; i < 2000; i++) {
+		NewPair(heap);
+	}
+	heap.freeGarbage();
+	TEST(heap.collections() == 2);
+	TEST(heap.size() == 1);
+}
+
+static void Pools()
+{
+	static_assert(Heap::SizeClass(1) == 0, "smallest class");
+	static_assert(Heap::SizeClass(sizeof(Pair)) >= 0, "Pair is pooled");
+	static_assert(Heap::SizeClass(1024) < 0, "too large to pool");
+
+	Heap heap;
+	for (int i = 0; i < 10000; i++) {
+		NewPair(heap);
+	}
+	const size_t reserved = heap.poolBytesReserved();
+	TEST(reserved >= 10000 * sizeof(Pair));
+	heap.collect();
+	TEST(heap.size() == 0);
+
+	// Freed blocks are reused, rather than the pool growing.
+	for (int i = 0; i < 10000; i++) {
+		NewPair(heap);
+	}
+	TEST(heap.poolBytesReserved() == reserved);
+
+	// Whatever is left, cycles included, goes with the heap.
+	Pair* a = NewPair(heap);
+	Pair* b = NewPair(heap);
+	a->setA(HeapPtr(b));
+	b->setA(HeapPtr(a));
+}
+
+// A list of references, for the bulk operations that go through storeRef().
+class RefList : public ObjList<HeapPtr> {
+public:
+	RefList(Heap& heap, int initialSize) : ObjList(heap, initialSize) {}
+	virtual const char* name() const override { return "RefList"; }
+};
+
+static void ListBulk()
+{
+	Heap heap;
+	static_assert(sizeof(BoolList::Element) == 1, "one byte per bool");
+
+	HeapPtr nums(heap.make<NumList>(heap, 0));
+	NumList* a = static_cast<NumList*>(nums.get());
+	const double values[] = { 1, 2, 3, 4 };
+	a->append(values, 4);
+	a->append(5);
+	TEST(a->size() == 5);
+	TEST(a->get(4) == 5);
+	TEST(a->data()[2] == 3);
+
+	HeapPtr copy(heap.make<NumList>(heap, 100));
+	NumList* b = static_cast<NumList*>(copy.get());
+	b->copyFrom(*a);
+	TEST(b->size() == 5);
+	TEST(b->get(0) == 1 && b->get(4) == 5);
+	b->fill(7);
+	TEST(b->get(0) == 7 && b->get(4) == 7 && a->get(0) == 1);
+
+	a->reserve(1000);
+	TEST(a->capacity() >= 1000 && a->size() == 5);
+
+	HeapPtr bools(heap.make<BoolList>(heap, 3));
+	BoolList* c = static_cast<BoolList*>(bools.get());
+	c->fill(true);
+	c->set(1, false);
+	TEST(c->get(0) && !c->get(1) && c->get(2));
+	TEST(c->data()[0] == 1 && c->data()[1] == 0);
+
+	HeapPtr strs(heap.make<StrList>(heap, 2));
+	StrList* d = static_cast<StrList*>(strs.get());
+	d->fill("x");
+	d->append("y");
+	TEST(d->size() == 3 && d->get(0) == "x" && d->get(2) == "y");
+
+	// Copies of references count as inner references, and keep the
+	// objects alive through a collection.
+	HeapPtr refs(heap.make<RefList>(heap, 0));
+	RefList* e = static_cast<RefList*>(refs.get());
+	{
+		HeapPtr first(NewPair(heap));
+		const HeapPtr pairs[] = { first, HeapPtr(NewPair(heap)) };
+		e->append(pairs, 2);
+		TEST(first.get()->getRootRefCount() == 2);	// 'first', and pairs[0]
+	}
+	HeapPtr refsCopy(heap.make<RefList>(heap, 0));
+	static_cast<RefList*>(refsCopy.get())->copyFrom(*e);
+	HeapObject* first = e->get(0).get();
+	TEST(first->getRefCount() == 2);
+	TEST(first->getRootRefCount() == 0);
+	heap.collect();
+	TEST(heap.size() == 8);
+	e->fill(HeapPtr());
+	static_cast<RefList*>(refsCopy.get())->setSize(0);
+	heap.collect();
+	TEST(heap.size() == 6);
+}
+
+static void ListGrowth()
+{
+	Heap heap;
+	HeapPtr nums(heap.make<NumList>(heap, 0));
+	NumList* a = static_cast<NumList*>(nums.get());
+
+	// Appending one at a time reallocates a logarithmic number of times.
+	int reallocations = 0;
+	int capacity = a->capacity();
+	for (int i = 0; i < 10000; i++) {
+		a->append(i);
+		if (a->capacity() != capacity) {
+			TEST(a->capacity() >= 2 * capacity);
+			capacity = a->capacity();
+			reallocations++;
+		}
+	}
+	TEST(a->size() == 10000);
+	TEST(reallocations <= 12);
+
+	// Popping keeps the capacity.
+	TEST(a->pop() == 9999);
+	TEST(a->pop() == 9998);
+	TEST(a->size() == 9998 && a->capacity() == capacity);
+	a->append(-1);
+	TEST(a->get(9998) == -1 && a->capacity() == capacity);
+
+	HeapPtr refs(heap.make<RefList>(heap, 0));
+	RefList* b = static_cast<RefList*>(refs.get());
+	b->append(HeapPtr(NewPair(heap)));
+	HeapPtr popped = b->pop();
+	TEST(b->size() == 0);
+	TEST(popped.get()->getRootRefCount() == 1);
+}
+
+static void ListViews()
+{
+	Heap heap;
+	HeapPtr nums(heap.make<NumList>(heap, 0));
+	NumList* a = static_cast<NumList*>(nums.get());
+	for (int i = 0; i < 10; i++)
+		a->append(i);
+
+	// A view copies nothing, and sees changes to its parent.
+	HeapPtr view(heap.make<NumList>(heap, 0));
+	NumList* v = static_cast<NumList*>(view.get());
+	const size_t bytes = heap.bytes();
+	v->viewOf(*a, 2, 5);
+	TEST(v->isView() && v->size() == 5);
+	TEST(v->get(0) == 2 && v->get(4) == 6);
+	TEST(v->externalBytes() == 0 && heap.bytes() == bytes);
+	TEST(static_cast<const NumList*>(v)->data() == a->data() + 2);
+	a->set(3, 30);
+	TEST(v->get(1) == 30);
+
+	// A view of a view refers to the original list.
+	HeapPtr inner(heap.make<NumList>(heap, 0));
+	NumList* w = static_cast<NumList*>(inner.get());
+	w->viewOf(*v, 1, 2);
+	TEST(w->get(0) == 30 && w->get(1) == 4);
+	TEST(a->getRefCount() == 3);
+
+	// The view keeps its parent alive.
+	nums.clear();
+	heap.collect();
+	TEST(heap.size() == 3);
+	TEST(v->get(4) == 6);
+
+	// Changing a view copies it first, and leaves the parent alone.
+	v->set(0, -1);
+	TEST(!v->isView() && v->size() == 5);
+	TEST(v->get(0) == -1 && v->get(1) == 30 && w->get(0) == 30);
+	TEST(a->get(2) == 2);
+	TEST(a->getRefCount() == 1);
+
+	// A view the parent shrinks past is cut short.
+	a->setSize(3);
+	TEST(w->size() == 0);
+	a->setSize(10);
+	TEST(w->size() == 2);
+
+	inner.clear();
+	heap.collect();
+	TEST(heap.size() == 1);
+}
+
+// A map with num keys, which the language doesn't have.
+class IdMap : public HashMap<double, std::string> {
+public:
+	IdMap(Heap& heap, int capacity) : HashMap(heap, capacity) {}
+	virtual const char* name() const override { return "IdMap"; }
+};
+
+static void Maps()
+{
+	Heap heap;
+	HeapPtr ptr(heap.make<IdMap>(heap, 0));
+	IdMap* m = static_cast<IdMap*>(ptr.get());
+	TEST(m->size() == 0 && m->capacity() == 0 && !m->find(1));
+
+	// Checked against std::map, through growth, overwrites and erases.
+	std::map<double, std::string> expected;
+	for (int i = 0; i < 20000; i++) {
+		const double key = (i * 7919) % 5000;
+		if (i % 3 == 2) {
+			TEST(m->erase(key) == (expected.erase(key) == 1));
+		}
+		else {
+			m->set(key, std::to_string(i));
+			expected[key] = std::to_string(i);
+		}
+	}
+	TEST(m->size() == (int)expected.size());
+	for (const auto& [key, value] : expected) {
+		const std::string* v = m->find(key);
+		TEST(v && *v == value);
+	}
+	TEST(!m->contains(-1) && !m->contains(5000));
+
+	// Iteration visits each entry once, in the same order until a change.
+	std::vector<double> order;
+	m->forEach([&](double key, const std::string&) { order.push_back(key); });
+	TEST(order.size() == expected.size());
+	std::vector<double> again;
+	m->set(order[0], "changed");	// not a new key: nothing moves
+	m->forEach([&](double key, const std::string&) { again.push_back(key); });
+	TEST(again == order);
+
+	// reserve() makes room up front, and the heap counts the table.
+	HeapPtr reservedPtr(heap.make<IdMap>(heap, 0));
+	IdMap* r = static_cast<IdMap*>(reservedPtr.get());
+	const size_t bytes = heap.bytes();
+	r->reserve(1000);
+	const int capacity = r->capacity();
+	TEST(capacity >= 1000 && (capacity & (capacity - 1)) == 0);
+	TEST(heap.bytes() == bytes + r->externalBytes());
+	for (int i = 0; i < 1000; i++)
+		r->set(i, "x");
+	TEST(r->capacity() == capacity && r->size() == 1000);
+
+	r->clear();
+	TEST(r->size() == 0 && r->capacity() == capacity && !r->contains(1));
+}
+
+static void Stats()
+{
+	Heap heap;
+	HeapPtr kept(heap.make<NumList>(heap, 0));
+	NewPair(heap);
+	heap.add(new Pair());
+	HeapStats stats = heap.stats();
+	TEST(stats.objects == 3);
+	TEST(stats.allocations == 3 && stats.frees == 0);
+	TEST(stats.types["Pair"].count == 2);
+	TEST(stats.types["Pair"].bytes == 2 * sizeof(Pair));
+	TEST(stats.bytes == 2 * sizeof(Pair) + sizeof(NumList));
+
+	// A list's elements count, as it grows.
+	NumList* list = static_cast<NumList*>(kept.get());
+	list->reserve(1000);
+	TEST(heap.bytes() == stats.bytes + list->capacity() * sizeof(double));
+
+	heap.collect();
+	stats = heap.stats();
+	TEST(stats.objects == 1 && stats.frees == 2);
+	TEST(stats.bytes == sizeof(NumList) + list->capacity() * sizeof(double));
+	TEST(stats.peakObjects == 3);
+	TEST(stats.peakBytes == 2 * sizeof(Pair) + sizeof(NumList) + list->capacity() * sizeof(double));
+	TEST(stats.collections == 1);
+	TEST(stats.types.count("Pair") == 0);
+
+	// The collect(), and the steps.
+	while (!heap.step(std::chrono::microseconds(100))) {}
+	stats = heap.stats();
+	uint64_t pauses = 0;
+	for (uint64_t n : stats.pauses)
+		pauses += n;
+	TEST(pauses >= 2);
+	TEST(stats.maxPauseMS <= stats.totalPauseMS);
+	TEST(HeapStats::PauseBucket(0.001) == 0);
+	TEST(HeapStats::PauseBucket(0.5) == 2);
+	TEST(HeapStats::PauseBucket(1000) == HeapStats::kPauseBuckets - 1);
+}
+
+// Counts what is outstanding, to check the heap returns it all.
+class CountingAllocator : public Allocator {
+public:
+	void* alloc(size_t size) override {
+		allocs++;
+		bytes += size;
+		return Allocator::Default().alloc(size);
+	}
+	void free(void* p, size_t size) override {
+		allocs--;
+		bytes -= size;
+		Allocator::Default().free(p, size);
+	}
+	int allocs = 0;
+	size_t bytes = 0;
+};
+
+static void Limit()
+{
+	CountingAllocator counting;
+	{
+		static constexpr size_t kLimit = 4 * SlabPool::kSlabBytes;
+		Heap heap(counting, kLimit);
+		HeapPtr kept(heap.make<NumList>(heap, 10));
+		TEST(counting.allocs == 2);		// a slab, and the elements
+		TEST(heap.allocated() == counting.bytes);
+
+		// Too large: the list is left as it was.
+		NumList* list = static_cast<NumList*>(kept.get());
+		bool thrown = false;
+		try {
+			list->setSize(int(kLimit / sizeof(double)));
+		}
+		catch (const OutOfMemory&) {
+			thrown = true;
+		}
+		TEST(thrown);
+		TEST(list->size() == 10);
+		TEST(heap.allocated() <= kLimit);
+
+		// Garbage waiting to be freed makes room, rather than throwing.
+		for (int i = 0; i < 100000; i++) {
+			HeapPtr temp(heap.make<NumList>(heap, 100));
+		}
+		TEST(heap.allocated() <= kLimit);
+
+		// Live objects don't.
+		std::vector<HeapPtr> live;
+		thrown = false;
+		try {
+			while (true)
+				live.emplace_back(NewPair(heap));
+		}
+		catch (const OutOfMemory&) {
+			thrown = true;
+		}
+		TEST(thrown);
+		TEST(heap.allocated() <= kLimit);
+		TEST(heap.stats().limit == kLimit);
+
+		live.clear();
+		heap.freePending();
+		heap.setLimit(LimitedAllocator::kNoLimit);
+		list->setSize(int(kLimit / sizeof(double)));
+		TEST(heap.allocated() > kLimit);
+	}
+	TEST(counting.allocs == 0 && counting.bytes == 0);
+}
+
+void Heap::test()
+{
+	RUN_TEST(Unreferenced());
+	RUN_TEST(Cycles());
+	RUN_TEST(Incremental());
+	RUN_TEST(WriteBarrier());
+	RUN_TEST(PendingFree());
+	RUN_TEST(Pools());
+	RUN_TEST(ListBulk());
+	RUN_TEST(ListGrowth());
+	RUN_TEST(ListViews());
+	RUN_TEST(Maps());
+	RUN_TEST(Stats());
+	RUN_TEST(Limit());
+}
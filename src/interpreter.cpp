@@ -6,12 +6,24 @@
 #include "func.h"
 #include "scribelib.h"
 #include "astprinter.h"
+#include "astopt.h"
+#include "bcgen.h"
+#include "bcimage.h"
+#include "bcopt.h"
+#include "listops.h"
+#include "resolver.h"
+#include "vecops.h"
 
 #define DEBUG_INTERPRETER() 0
 
-Interpreter::Interpreter()
+Interpreter::Interpreter(const InterpreterOptions& options) :
+	heap(options.allocator ? *options.allocator : Allocator::Default(), options.memoryLimit ? options.memoryLimit : LimitedAllocator::kNoLimit),
+	globals(strings), options(options), machine(heap, &ffi), typeChecker(&ffi)
 {
-	AttachStdLib(ffi, env.globalEnv());
+	AttachStdLib(ffi, globals);
+	for (const std::string& name : ffi.names()) {
+		machine.setBuiltin(name, Value::Func(strings.intern(name)));
+	}
 }
 
 Value Interpreter::interpret(const std::string& input, const std::string& ctxName)
@@ -20,15 +32,63 @@ Value Interpreter::interpret(const std::string& input, const std::string& ctxNam
 #if DEBUG_INTERPRETER()
     tokenizer.debug = true;
 #endif	
-    Parser parser(tokenizer, ctxName);
-    Value rc;
-
+    Parser parser(tokenizer, ctxName, &strings);
+	parser.setShadowedGlobals(shadowedGlobals);
     std::vector<ASTStmtPtr> stmts = parser.parseStmts();
 
 	if (ErrorReporter::hasError()) {
 		return Value();
 	}
+	shadowedGlobals = parser.shadowedGlobals();
+	astNodesRemoved = options.optimizeAST ? OptimizeAST(stmts) : 0;
+	if (options.typeCheck) {
+		typeChecker.check(stmts);
+	}
+	if (!options.bytecode) {
+		ResolveSlots(stmts);
+		if (ErrorReporter::hasError()) {
+			return Value();
+		}
+	}
+
+	const uint64_t allocations = heap.allocations();
+	const uint64_t frees = heap.frees();
+	Value rc = options.bytecode ? executeBytecode(stmts) : execute(stmts);
+	finishRun(allocations, frees);
+
+    return rc;
+}
+
+void Interpreter::finishRun(uint64_t allocations, uint64_t frees)
+{
+	heap.freeGarbage();
+	runAllocations = heap.allocations() - allocations;
+	runFrees = heap.frees() - frees;
+}
+
+MemoryStats Interpreter::memoryStats() const
+{
+	MemoryStats stats;
+	stats.heap = heap.stats();
+	stats.strings = StrObj::GetStats();
+	stats.internedStrings = strings.size();
+	stats.allocations = runAllocations;
+	stats.frees = runFrees;
+	return stats;
+}
+
+void MemoryStats::print() const
+{
+	heap.print();
+	fmt::print("Strings: {} strings, {} bytes, {} interned\n", strings.count, strings.bytes, internedStrings);
+	fmt::print("Last run: {} allocations, {} frees\n", allocations, frees);
+}
 
+Value Interpreter::execute(const std::vector<ASTStmtPtr>& stmts)
+{
+	// The strings the script makes count against the limit.
+	StrBudget::Scope strScope(heap.strBudget());
+	Value rc;
 	try {
 		for (const auto& stmt : stmts) {
 			// Clear the stack at the beginning of the loop so
@@ -41,7 +101,7 @@ Value Interpreter::interpret(const std::string& input, const std::string& ctxNam
 #endif
 			stmt->accept(*this, 0);
 			if (stack.size() == 1)
-				rc = stack[0];
+				rc = std::move(stack[0]);
 		}
 		REQUIRE(stack.size() <= 1);
 
@@ -50,12 +110,122 @@ Value Interpreter::interpret(const std::string& input, const std::string& ctxNam
 	}
 	catch (InterpreterError& e) {
 		fmt::print("Interpreter run-time error: {}\n", e.what());
+		while (locals.numScopes() > 0)
+			locals.pop();
 	}
-	heap.collect();
-	if (heap.objects().size() > 0)
-		heap.report();
+	catch (const OutOfMemory& e) {
+		// Over the heap's limit: see Heap.
+		ErrorReporter::reportRuntime(e.what());
+		fmt::print("Interpreter run-time error: {}\n", e.what());
+		while (locals.numScopes() > 0)
+			locals.pop();
+	}
+	return rc;
+}
 
-    return rc;
+bool Interpreter::generateBytecode(const std::vector<ASTStmtPtr>& stmts, std::vector<Instruction>& bc, ConstPool& pool, std::vector<LineInfo>& lines)
+{
+	BCStmtGenerator generator(bc, pool, machine.globalTable, &lines);
+
+	for (const auto& stmt : stmts) {
+		generator.generate(*stmt);
+	}
+	if (ErrorReporter::hasError()) {
+		return false;
+	}
+	if (options.optimizeBytecode) {
+		OptimizeBytecode(bc, &lines);
+	}
+#if DEBUG_INTERPRETER()
+	machine.dump(bc, pool);
+#endif
+	return true;
+}
+
+Value Interpreter::runBytecode(const Instruction* bc, size_t n, const ConstPool& pool, const LineInfo* lines, size_t nLines)
+{
+	StrBudget::Scope strScope(heap.strBudget());
+	machine.result = Value();
+	machine.execute(bc, n, pool);
+	machine.stack.clear();
+
+	if (machine.hasError()) {
+		int line = LineOfInstruction(lines, nLines, machine.errorInstruction());
+		ErrorReporter::reportRuntime(machine.errorMessage());
+		fmt::print("Machine run-time error (line {}): {}\n", line, machine.errorMessage());
+		machine.clearError();
+		return Value();
+	}
+	return std::move(machine.result);
+}
+
+Value Interpreter::executeBytecode(const std::vector<ASTStmtPtr>& stmts)
+{
+	std::vector<Instruction> bc;
+	ConstPool pool;
+	std::vector<LineInfo> lines;
+
+	if (!generateBytecode(stmts, bc, pool, lines)) {
+		return Value();
+	}
+	return runBytecode(bc.data(), bc.size(), pool, lines.data(), lines.size());
+}
+
+bool Interpreter::compile(const std::string& input, const std::string& ctxName, const std::string& imagePath)
+{
+	Tokenizer tokenizer(input);
+	Parser parser(tokenizer, ctxName, &strings);
+	std::vector<ASTStmtPtr> stmts = parser.parseStmts();
+	if (ErrorReporter::hasError()) {
+		return false;
+	}
+	if (options.optimizeAST) {
+		OptimizeAST(stmts);
+	}
+	if (options.typeCheck) {
+		typeChecker.check(stmts);
+	}
+
+	std::vector<Instruction> bc;
+	ConstPool pool;
+	std::vector<LineInfo> lines;
+	if (!generateBytecode(stmts, bc, pool, lines)) {
+		return false;
+	}
+	return BCImage::write(imagePath, bc, pool, machine.globalTable, lines, BCImage::HashSource(input));
+}
+
+Value Interpreter::interpretImage(const BCImage& image)
+{
+	REQUIRE(image.isOpen());
+
+	// The image was compiled against its own global table. If the
+	// names land in the same slots here (as they do for a new
+	// Interpreter) the instructions run in place.
+	const std::vector<std::string>& names = image.globals();
+	std::vector<uint32_t> slots(names.size());
+	bool inPlace = true;
+	for (size_t i = 0; i < names.size(); i++) {
+		slots[i] = machine.globalTable.resolve(names[i]);
+		inPlace = inPlace && slots[i] == i;
+	}
+
+	const uint64_t allocations = heap.allocations();
+	const uint64_t frees = heap.frees();
+	Value rc;
+	if (inPlace) {
+		rc = runBytecode(image.instructions(), image.numInstructions(), image.pool(), image.lines(), image.numLines());
+	}
+	else {
+		std::vector<Instruction> bc;
+		if (!RelocateGlobals(image.instructions(), image.numInstructions(), slots, bc)) {
+			ErrorReporter::reportRuntime("Byte code image: too many globals to relocate");
+			return Value();
+		}
+		rc = runBytecode(bc.data(), bc.size(), image.pool(), image.lines(), image.numLines());
+	}
+	finishRun(allocations, frees);
+	return rc;
 }
 
 void Interpreter::visit(const ASTExprStmt& node, int depth)
@@ -76,11 +246,11 @@ void Interpreter::visit(const ASTIfStmt& node, int depth)
 	node.condition->accept(*this, depth + 1);
 	REQUIRE(stack.size() == 1);
 
-	Value cond = stack.back();
+	bool truthy = stack.back().isTruthy();
 	popStack();
 
 	RestoreStack rs(stack);
-	if (cond.isTruthy()) {
+	if (truthy) {
 		node.thenBranch->accept(*this, depth + 1);
 	}
 	else if (node.elseBranch) {
@@ -107,34 +277,45 @@ void Interpreter::visit(const ASTWhileStmt& node, int depth)
 
 void Interpreter::visit(const ASTBlockStmt& node, int depth)
 {
-	env.push();
+	locals.push();
 	for (const auto& stmt : node.stmts) {
 		stmt->accept(*this, depth + 1);
 	}
-	env.pop();
+	locals.pop();
 }
 
 void Interpreter::visit(const ASTVarDeclStmt& node, int depth)
 {
 	REQUIRE(stack.empty());
 
-	Value value = Value::Default(node.valueType, heap);
-
+	Value value;
 	if (node.expr) {
 		RestoreStack rs(stack);
 
 		node.expr->accept(*this, depth + 1);
 		REQUIRE(stack.size() == 1);
-		REQUIRE(stack[0].type == value.type);	// Should have been established by parser
-		value = stack[0];
+		REQUIRE(stack[0].type == node.valueType);	// Should have been established by parser
+		value = std::move(stack[0]);
+	}
+	else {
+		value = Value::Default(node.valueType, heap);
 	}
 
-	if (!env.define(node.name, value)) {
-		runtimeError(fmt::format("Env variable {} already defined", node.name));
+	if (!node.slot.isGlobal()) {
+		locals.define(node.slot.slot, std::move(value));
+	}
+	else if (!globals.define(node.name, std::move(value))) {
+		runtimeError(fmt::format("Env variable {} already defined", node.name.str()));
 		return;
 	}
 }
 
+void Interpreter::visit(const ASTFuncDeclStmt& node, int depth)
+{
+	(void)depth;
+	runtimeError(fmt::format("func '{}': functions not yet implemented", node.name));
+}
+
 void Interpreter::runtimeError(const std::string& msg)
 {
 	ErrorReporter::reportRuntime(msg);
@@ -197,13 +378,16 @@ void Interpreter::visit(const ASTIdentifierExpr& node, int depth)
 {
 	(void)depth;
 
-	Value value = env.get(node.name);
-
-	if (value.type == ValueType()) {
-		runtimeError(fmt::format("Could not find var: {}", node.name));
+	if (!node.slot.isGlobal()) {
+		stack.push_back(locals.get(node.slot.depth, node.slot.slot));
+		return;
+	}
+	Value value;
+	if (!globals.get(node.name, value)) {
+		runtimeError(fmt::format("Could not find var: {}", node.name.str()));
 		return;
 	}
-	stack.push_back(value);
+	stack.push_back(std::move(value));
 }
 
 void Interpreter::visit(const ASTAssignmentExpr& node, int depth)
@@ -214,10 +398,12 @@ void Interpreter::visit(const ASTAssignmentExpr& node, int depth)
 
 	node.right->accept(*this, depth + 1);
 
-	Value value = stack.back();
-
-	if (!env.set(node.name, value)) {
-		runtimeError(fmt::format("Could not find var: {}", node.name));
+	// The value stays on the stack, so this is the one copy.
+	if (!node.slot.isGlobal()) {
+		locals.set(node.slot.depth, node.slot.slot, stack.back());
+	}
+	else if (!globals.set(node.name, stack.back())) {
+		runtimeError(fmt::format("Could not find var: {}", node.name.str()));
 		return;
 	}
 }
@@ -244,13 +430,13 @@ Value Interpreter::numberBinaryOp(TokenType op, const Value& lhs, const Value& r
 Value Interpreter::stringBinaryOp(TokenType op, const Value& lhs, const Value& rhs)
 {
 	switch (op) {
-	case TokenType::PLUS: return Value::String(*lhs.vString + *rhs.vString);
-	case TokenType::GREATER: return Value::Boolean(lhs.vString > rhs.vString);
-	case TokenType::GREATER_EQUAL: return Value::Boolean(lhs.vString >= rhs.vString);
-	case TokenType::LESS: return Value::Boolean(lhs.vString < rhs.vString);
-	case TokenType::LESS_EQUAL: return Value::Boolean(lhs.vString <= rhs.vString);
-	case TokenType::BANG_EQUAL: return Value::Boolean(lhs.vString != rhs.vString);
-	case TokenType::EQUAL_EQUAL: return Value::Boolean(lhs.vString == rhs.vString);
+	case TokenType::PLUS: return Value::String(lhs.str() + rhs.str());
+	case TokenType::GREATER: return Value::Boolean(lhs.str() > rhs.str());
+	case TokenType::GREATER_EQUAL: return Value::Boolean(lhs.str() >= rhs.str());
+	case TokenType::LESS: return Value::Boolean(lhs.str() < rhs.str());
+	case TokenType::LESS_EQUAL: return Value::Boolean(lhs.str() <= rhs.str());
+	case TokenType::BANG_EQUAL: return Value::Boolean(!StrObj::Equal(lhs.vStr, rhs.vStr));
+	case TokenType::EQUAL_EQUAL: return Value::Boolean(StrObj::Equal(lhs.vStr, rhs.vStr));
 	default:
 		assert(false);
 	}
@@ -268,6 +454,23 @@ Value Interpreter::boolBinaryOp(TokenType op, const Value& lhs, const Value& rhs
 	return Value();
 }
 
+static bool TokenVecOp(TokenType type, VecOp& op)
+{
+	switch (type) {
+	case TokenType::PLUS: op = VecOp::kAdd; return true;
+	case TokenType::MINUS: op = VecOp::kSub; return true;
+	case TokenType::MULT: op = VecOp::kMul; return true;
+	case TokenType::DIVIDE: op = VecOp::kDiv; return true;
+	case TokenType::LESS: op = VecOp::kLess; return true;
+	case TokenType::LESS_EQUAL: op = VecOp::kLessEqual; return true;
+	case TokenType::GREATER: op = VecOp::kGreater; return true;
+	case TokenType::GREATER_EQUAL: op = VecOp::kGreaterEqual; return true;
+	case TokenType::EQUAL_EQUAL: op = VecOp::kEqual; return true;
+	case TokenType::BANG_EQUAL: op = VecOp::kNotEqual; return true;
+	default: return false;
+	}
+}
+
 void Interpreter::visit(const ASTBinaryExpr& node, int depth)
 {
 	(void)depth;
@@ -280,17 +483,42 @@ void Interpreter::visit(const ASTBinaryExpr& node, int depth)
 	const Value& rhs = getStack(RHS);
 	const Value& lhs = getStack(LHS);
 
+	// Element by element, with the kernels in vecops.h.
+	if (IsNumListOp(lhs, rhs)) {
+		VecOp op = VecOp::kAdd;
+		if (!TokenVecOp(node.type, op)) {
+			runtimeError("BinaryOp: unhandled op for num[]");
+			return;
+		}
+		std::string error;
+		Value result = NumListOp(heap, op, lhs, rhs, error);
+		if (!error.empty()) {
+			runtimeError(error);
+			return;
+		}
+		popStack(2);
+		stack.push_back(std::move(result));
+		return;
+	}
+
 	if (lhs.type != rhs.type) {
 		runtimeError("BinaryOp: type mismatch");
 		return;
 	}
 
 	Value result;
-	assert(lhs.type.layout == Layout::tScalar);	// need to implement reference
-
-	if (lhs.type.pType == PType::tNum) {
+	if (lhs.type.layout != Layout::tScalar) {
+		// Other lists, and maps, compare as references.
+		if (node.type == TokenType::EQUAL_EQUAL || node.type == TokenType::BANG_EQUAL)
+			result = Value::Boolean((lhs == rhs) == (node.type == TokenType::EQUAL_EQUAL));
+	}
+	else if (lhs.type.pType == PType::tNum) {
 		result = numberBinaryOp(node.type, lhs, rhs);
 	}
+	else if (lhs.type.pType == PType::tStr && node.type == TokenType::PLUS) {
+		// Moved off the stack, so a string only the stack holds is appended to in place.
+		result = Value::Concat(std::move(getStack(LHS)), rhs);
+	}
 	else if (lhs.type.pType == PType::tStr) {
 		result = stringBinaryOp(node.type, lhs, rhs);
 	}
@@ -306,7 +534,7 @@ void Interpreter::visit(const ASTBinaryExpr& node, int depth)
 	}
 
 	popStack(2);
-	stack.push_back(result);
+	stack.push_back(std::move(result));
 }
 
 void Interpreter::visit(const ASTUnaryExpr& node, int depth)
@@ -318,11 +546,12 @@ void Interpreter::visit(const ASTUnaryExpr& node, int depth)
 	if (!verifyUnderflow("Unary", 1)) 
 		return;
 
+	if (node.type == TokenType::MINUS && !verifyScalarTypes("Negative", { PType::tNum }))
+		return;
 	Value val = getStack(1);
 	popStack();
 
 	if (node.type == TokenType::MINUS) {
-		if (!verifyScalarTypes("Negative", { PType::tNum })) return;
 		stack.push_back(Value::Number(-val.vNumber));
 	}
 	else if (node.type == TokenType::BANG) {
@@ -374,7 +603,8 @@ void Interpreter::visit(const ASTCallExpr& node, int depth)
 	if (func.type != funcType) {
 		internalError("func has incorrect type");
 	}
-	std::string funcName = *func.vString;
+	// Held, rather than copied, across the pop.
+	StrPtr funcName = StrPtr::Share(func.vStr);
 	popStack();
 
 	// Arguments
@@ -385,17 +615,125 @@ void Interpreter::visit(const ASTCallExpr& node, int depth)
 		}
 	}
 	
-	FFI::RC rc = ffi.call(funcName, stack, (int)node.arguments.size());
+	FFI::RC rc = ffi.call(funcName.str(), stack, (int)node.arguments.size());
 	if (rc == FFI::RC::kFuncNotFound) {
 		assert(false);
 	}
 	else if (rc == FFI::RC::kIncorrectNumArgs) {
-		runtimeError(fmt::format("Incorrect num args calling '{}'", funcName));
+		runtimeError(fmt::format("Incorrect num args calling '{}'", funcName.str()));
 	}
 	else if (rc == FFI::RC::kIncorrectArgType) {
-		runtimeError(fmt::format("Incorrect arg types calling '{}'", funcName));
+		runtimeError(fmt::format("Incorrect arg types calling '{}'", funcName.str()));
+	}
+	else if (rc == FFI::RC::kFailed) {
+		runtimeError(ffi.lastError());
 	}
 	else if (rc == FFI::RC::kError) {
 		internalError("internal error from FFI");
 	}
 }
+
+void Interpreter::visit(const ASTListExpr& node, int depth)
+{
+	// The elements are evaluated onto the stack, then the list is made at its size.
+	{
+		CheckStack cs(stack, node.elements.size());
+		for (const ASTExprPtr& e : node.elements) {
+			e->accept(*this, depth + 1);
+		}
+	}
+	const int n = (int)node.elements.size();
+	std::string error;
+	Value list = MakeList(heap, node.type.pType, stack.data() + stack.size() - n, n, error);
+	if (!error.empty()) {
+		runtimeError(error);
+		return;
+	}
+	popStack(n);
+	stack.push_back(std::move(list));
+}
+
+void Interpreter::visit(const ASTIndexExpr& node, int depth)
+{
+	node.list->accept(*this, depth + 1);
+	node.index->accept(*this, depth + 1);
+	if (!verifyUnderflow("Index", 2))
+		return;
+
+	std::string error;
+	Value element = ListGet(getStack(2), getStack(1), error);
+	if (!error.empty()) {
+		runtimeError(error);
+		return;
+	}
+	popStack(2);
+	stack.push_back(std::move(element));
+}
+
+void Interpreter::visit(const ASTIndexAssignExpr& node, int depth)
+{
+	{
+		CheckStack cs(stack, 3);
+		node.list->accept(*this, depth + 1);
+		node.index->accept(*this, depth + 1);
+		node.right->accept(*this, depth + 1);
+	}
+
+	std::string error;
+	if (!ListSet(getStack(3), getStack(2), getStack(1), error)) {
+		runtimeError(error);
+		return;
+	}
+	// The value stays on the stack.
+	stack.erase(stack.end() - 3, stack.end() - 1);
+}
+
+void Interpreter::visit(const ASTSliceExpr& node, int depth)
+{
+	const int nBounds = (node.begin ? 1 : 0) + (node.end ? 1 : 0);
+	{
+		CheckStack cs(stack, 1 + nBounds);
+		node.list->accept(*this, depth + 1);
+		if (node.begin) node.begin->accept(*this, depth + 1);
+		if (node.end) node.end->accept(*this, depth + 1);
+	}
+
+	const Value* bound = stack.data() + stack.size() - nBounds;
+	const Value* begin = node.begin ? bound++ : nullptr;
+	const Value* end = node.end ? bound : nullptr;
+	std::string error;
+	Value view = ListSlice(heap, getStack(1 + nBounds), begin, end, error);
+	if (!error.empty()) {
+		runtimeError(error);
+		return;
+	}
+	popStack(1 + nBounds);
+	stack.push_back(std::move(view));
+}
+
+void Interpreter::visit(const ASTListFuncExpr& node, int depth)
+{
+	{
+		CheckStack cs(stack, node.arguments.size());
+		for (const ASTExprPtr& arg : node.arguments) {
+			arg->accept(*this, depth + 1);
+		}
+	}
+
+	std::string error;
+	Value result;
+	switch (node.func) {
+	case ListFunc::kAppend: ListAppend(getStack(2), getStack(1), error); break;
+	case ListFunc::kPop: result = ListPop(getStack(1), error); break;
+	case ListFunc::kSize: result = ListSize(getStack(1), error); break;
+	case ListFunc::kHas: result = MapHas(getStack(2), getStack(1), error); break;
+	case ListFunc::kRemove: result = MapRemove(getStack(2), getStack(1), error); break;
+	case ListFunc::kKeys: result = MapKeys(heap, getStack(1), error); break;
+	}
+	if (!error.empty()) {
+		runtimeError(error);
+		return;
+	}
+	popStack((int)node.arguments.size());
+	stack.push_back(std::move(result));
+}
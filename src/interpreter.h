@@ -3,15 +3,76 @@
 #include "ast.h"
 #include "environment.h"
 #include "func.h"
+#include "globalhandle.h"
+#include "machine.h"
+#include "typecheck.h"
 
 #include <exception>
 #include <stdexcept>
 
+class BCImage;
+
+struct InterpreterOptions {
+	// Compile to byte code and run on the Machine, rather than
+	// walking the AST.
+	bool bytecode = false;
+	// Run the peephole optimizer (bcopt.h) on the byte code.
+	bool optimizeBytecode = true;
+	// Fold constant expressions and prune constant branches (astopt.h)
+	// before either engine runs.
+	bool optimizeAST = true;
+	// Resolve static types (typecheck.h) so the byte code can use
+	// the typed op codes.
+	bool typeCheck = true;
+	// Where the heap gets its memory (see allocator.h), and the most it
+	// may take, in bytes, counting the strings a script makes. Going over
+	// is a runtime error. The default is ::operator new, and no limit. A
+	// list the host keeps from interpret() outlives the Interpreter, and
+	// still uses the allocator.
+	Allocator* allocator = nullptr;
+	size_t memoryLimit = 0;
+};
+
+// Memory use, for monitoring: see Interpreter::memoryStats().
+struct MemoryStats {
+	HeapStats heap;
+	StrObj::Stats strings;		// shared by every Interpreter
+	size_t internedStrings = 0;
+	// During the last interpret() or interpretImage() that ran.
+	uint64_t allocations = 0;
+	uint64_t frees = 0;
+
+	void print() const;
+};
+
 class Interpreter : public ASTStmtVisitor, public ASTExprVisitor
 {
+	// First, so it is destroyed last: the values below may refer to it.
+	Heap heap;
+
 public:
-	Interpreter();
+	Interpreter(const InterpreterOptions& options = InterpreterOptions());
     Value interpret(const std::string& input, const std::string& contextName);
+	int astNodesRemoved = 0;	// by OptimizeAST() in the last interpret()
+
+	// Compiles 'input' to byte code, and writes it as a precompiled
+	// image (see bcimage.h) to 'imagePath'.
+	bool compile(const std::string& input, const std::string& contextName, const std::string& imagePath);
+	// Runs a loaded image on the Machine. The instructions are executed in
+	// place from the mapped file, unless the globals need to be relocated.
+	Value interpretImage(const BCImage& image);
+
+	// Resolves a global, from a script or the host, so the host can read
+	// and write it without a lookup (see globalhandle.h). The handle is
+	// invalid if there is no global 'name' of type T.
+	template<typename T>
+	GlobalHandle<T> globalHandle(const std::string& name);
+
+	// Runs the garbage collector for up to 'budget' (see Heap::step), so a
+	// host can spread a collection over frames. Returns true when it finishes.
+	bool stepHeap(std::chrono::microseconds budget) { return heap.step(budget); }
+
+	MemoryStats memoryStats() const;
 
 	// ASTStmtVisitor
     virtual void visit(const ASTExprStmt&, int depth) override;
@@ -20,6 +81,7 @@ public:
 	virtual void visit(const ASTBlockStmt&, int depth) override;
 	virtual void visit(const ASTIfStmt& node, int depth) override;
 	virtual void visit(const ASTWhileStmt& node, int depth) override;
+	virtual void visit(const ASTFuncDeclStmt& node, int depth) override;
 
 	// ASTExprVisitor
 	void visit(const ASTValueExpr& node, int depth) override;
@@ -29,7 +91,13 @@ public:
 	void visit(const ASTUnaryExpr& node, int depth) override;
 	void visit(const ASTLogicalExpr& node, int depth) override;
 	void visit(const ASTCallExpr& node, int depth) override;
+	void visit(const ASTListExpr& node, int depth) override;
+	void visit(const ASTIndexExpr& node, int depth) override;
+	void visit(const ASTIndexAssignExpr& node, int depth) override;
+	void visit(const ASTSliceExpr& node, int depth) override;
+	void visit(const ASTListFuncExpr& node, int depth) override;
 
+	StringTable strings;	// identifiers, literals, and func names; outlives the values
 	std::vector<Value> stack;
 	FFI ffi;
 
@@ -46,6 +114,13 @@ private:
 	bool verifyTypes(const std::string& ctx, const std::vector<ValueType>& types);	// checks underflow as well
 	bool verifyScalarTypes(const std::string& ctx, const std::vector<PType>& types); // checks underflow
 
+	Value execute(const std::vector<ASTStmtPtr>& stmts);
+	Value executeBytecode(const std::vector<ASTStmtPtr>& stmts);
+	bool generateBytecode(const std::vector<ASTStmtPtr>& stmts, std::vector<Instruction>& bc, ConstPool& pool, std::vector<LineInfo>& lines);
+	Value runBytecode(const Instruction* bc, size_t n, const ConstPool& pool, const LineInfo* lines, size_t nLines);
+	// Frees the garbage from a run, and records its allocations.
+	void finishRun(uint64_t allocations, uint64_t frees);
+
 	void popStack(int n = 1) {
 		REQUIRE(n >= 0);
 		REQUIRE(stack.size() >= n);
@@ -66,7 +141,12 @@ private:
 		CheckStack(std::vector<Value>& stack, size_t delta) : stack(stack) {
 			expected = stack.size() + delta;
 		};
-		~CheckStack() { REQUIRE(stack.size() == expected); }
+		~CheckStack() {
+			// Not while a runtime error unwinds: the stack is restored by the catch.
+			if (std::uncaught_exceptions() == 0) {
+				REQUIRE(stack.size() == expected);
+			}
+		}
 		std::vector<Value>& stack;
 		size_t expected = 0;
 	};
@@ -83,7 +163,30 @@ private:
 	static constexpr int LHS = 2;
 	static constexpr int RHS = 1;
 
-	EnvironmentStack env;
-	Heap heap;
+	Environment globals;	// the top level, and the FFI functions
+	LocalFrames locals;		// everything in a block, by slot
+	InterpreterOptions options;
+	Machine machine;
+	TypeChecker typeChecker;
+	std::vector<std::string> shadowedGlobals;	// see Parser::shadowedGlobals()
+	uint64_t runAllocations = 0;	// in the last run, for memoryStats()
+	uint64_t runFrees = 0;
 };
 
+template<typename T>
+GlobalHandle<T> Interpreter::globalHandle(const std::string& name)
+{
+	const ValueType type(GlobalTraits<T>::kType);
+	if (options.bytecode) {
+		auto it = machine.globalTable.slots.find(name);
+		if (it == machine.globalTable.slots.end() || it->second >= machine.globals.size())
+			return GlobalHandle<T>();
+		if (machine.globals[it->second].type != type)
+			return GlobalHandle<T>();
+		return GlobalHandle<T>(&machine.globals, it->second);
+	}
+	Environment::Slot* s = globals.find(strings.intern(name));
+	if (!s || GlobalHandle<T>::TypeOf(*s) != type)
+		return GlobalHandle<T>();
+	return GlobalHandle<T>(s);
+}
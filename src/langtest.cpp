@@ -2,16 +2,24 @@
 #include "interpreter.h"
 #include "test.h"
 #include "errorreporting.h"
+#include "bcimage.h"
+#include "listops.h"
 
+#include <stddef.h>
+#include <stdio.h>
+#include <filesystem>
 #include <string>
 
 // The problem is that runtime errors don't have line numbers. 
 // But should! Until then, flag runtime errors.
 static constexpr int RUNTIME = 0;	
 
+// Every test is run through each engine.
+static InterpreterOptions gOptions;
+
 static void Run(const std::string& s, Value expectedResult = Value(), bool expectedError = false, int errorLine = -1)
 {
-	Interpreter ip;
+	Interpreter ip(gOptions);
 	Value r = ip.interpret(s, "langtest");
 	
 	if (expectedError) {
@@ -31,7 +39,7 @@ static void Run(const std::string& s, Value expectedResult = Value(), bool expec
 
 static void PrintRun(const std::string& s, const std::string& expectedPrint, bool expectedError = false, int errorLine = -1)
 {
-	Interpreter ip;
+	Interpreter ip(gOptions);
 	Value out = ip.interpret(s, "langtest-print");
 
 	if (expectedError) {
@@ -49,7 +57,7 @@ static void PrintRun(const std::string& s, const std::string& expectedPrint, boo
 
 	TEST(out.type.pType == PType::tStr);
 	TEST(out.type.layout == Layout::tScalar);
-	TEST(*out.vString == expectedPrint);
+	TEST(out.str() == expectedPrint);
 }
 
 static void SimplePrint()
@@ -57,11 +65,11 @@ static void SimplePrint()
 	const std::string s =
 		"return format(13)";
 
-	Interpreter ip;
+	Interpreter ip(gOptions);
 	Value out = ip.interpret(s, "langtest");
 	TEST(out.type.pType == PType::tStr);
 	TEST(out.type.layout == Layout::tScalar);
-	TEST(*out.vString == "13");
+	TEST(out.str() == "13");
 }
 
 static void SimpleReturn()
@@ -310,10 +318,248 @@ static void DeclareEmptyList()
 static void DeclareNumList()
 {
 	const std::string s =
-		"var a: num[] = [1, 2, 3]\n";
-	//	"return a[1]";
-	//Run(s, Value::Number(2.0));
-	Run(s, Value());
+		"var a: num[] = [1, 2, 3]\n"
+		"return a[1]";
+	Run(s, Value::Number(2.0));
+}
+
+static void ListLiterals()
+{
+	Run("var a = [1, 2, 3]\n"
+		"var b = [true, false]\n"
+		"var c = ['x', 'y']\n"
+		"return format(a, b, c, [])", Value(), true);	// [] has no type
+	ErrorReporter::clear();
+
+	Run("var a = [1, 2, 3]\n"
+		"var b = [true, false]\n"
+		"var c = ['x', 'y']\n"
+		"var d: num[] = []\n"
+		"return format(a, b, c, d)", Value::String("[1, 2, 3], [true, false], [x, y], []"));
+
+	// Elements are expressions, checked against the declared type.
+	Run("var x = 2\n"
+		"var a: num[] = [x, x * 2, x + 1]\n"
+		"return a[0] + a[1] + a[2]", Value::Number(9));
+	Run("var a: str[] = [1, 2]", Value(), true, RUNTIME);
+	Run("var x = 1\n"
+		"return size([x, 'a'])", Value(), true, RUNTIME);
+	Run("return size([1, 2, 3])", Value::Number(3));
+
+	// Long enough that NEW_LIST needs a WIDE prefix.
+	std::string long_ = "var a = [";
+	for (int i = 0; i < 300; i++) {
+		long_ += fmt::format("{}{}", i ? ", " : "", i);
+	}
+	long_ += "]\nreturn a[299] + size(a)";
+	Run(long_, Value::Number(599));
+	ErrorReporter::clear();
+}
+
+static void ListIndex()
+{
+	const std::string s =
+		"var a: num[] = [1, 2, 3]\n"
+		"var b = 0\n"
+		"b = a[1] = 20\n"
+		"a[2] = a[2] + 1\n"
+		"var c = ['x', 'y']\n"
+		"c[0] = c[1] + 'z'\n"
+		"var r = 0\n"
+		"if c[0] == 'yz' { r = a[0] + a[1] + a[2] + b }\n"
+		"return r";
+	Run(s, Value::Number(45));
+
+	// Bounds checks, at both ends
+	Run("var a = [1, 2, 3]\n"
+		"return a[3]", Value(), true, RUNTIME);
+	Run("var a = [1, 2, 3]\n"
+		"return a[-1]", Value(), true, RUNTIME);
+	Run("var a = [1, 2, 3]\n"
+		"a[3] = 4", Value(), true, RUNTIME);
+	Run("var a = [1, 2, 3]\n"
+		"return a['x']", Value(), true, RUNTIME);
+	Run("var a = [1, 2, 3]\n"
+		"a[0] = 'x'", Value(), true, RUNTIME);
+	Run("var a = 1\n"
+		"return a[0]", Value(), true, RUNTIME);
+	// A fraction is truncated, as the index of an array in C.
+	Run("var a = [1, 2, 3]\n"
+		"return a[1.5]", Value::Number(2));
+	// An error in the arguments of a call
+	Run("var a = [1]\n"
+		"print(a[1])", Value(), true, RUNTIME);
+	ErrorReporter::clear();
+}
+
+static void ListAppendPop()
+{
+	const std::string s =
+		"var a: num[] = []\n"
+		"for var i = 0; i < 1000; i = i + 1 {\n"
+		"  append(a, i)\n"
+		"}\n"
+		"var sum = 0\n"
+		"while size(a) > 500 {\n"
+		"  sum = sum + pop(a)\n"
+		"}\n"
+		"return sum + size(a)";
+	Run(s, Value::Number(374750 + 500));
+
+	Run("var a: str[] = []\n"
+		"append(a, 'x')\n"
+		"append(a, 'y')\n"
+		"return pop(a) + pop(a)", Value::String("yx"));
+
+	Run("var a: num[] = []\n"
+		"return pop(a)", Value(), true, RUNTIME);
+	Run("var a: num[] = []\n"
+		"append(a, true)", Value(), true, RUNTIME);
+	Run("var a: num[] = []\n"
+		"append(a)", Value(), true, 1);
+	ErrorReporter::clear();
+}
+
+static void ListSlices()
+{
+	// A slice sees changes to its list; changing the slice copies it.
+	const std::string s =
+		"var a = [1, 2, 3, 4, 5]\n"
+		"var b: num[] = a[1:4]\n"
+		"a[2] = 30\n"
+		"var seen: num = b[1]\n"
+		"b[0] = -1\n"
+		"return seen + a[1] + b[0] + size(b)";
+	Run(s, Value::Number(30 + 2 - 1 + 3));
+
+	// Bounds can be left out, and a slice of a slice is a slice.
+	Run("var a = ['a', 'b', 'c', 'd']\n"
+		"var b: str[] = a[:3]\n"
+		"var c: str[] = b[1:][1:]\n"
+		"append(c, 'x')\n"
+		"var r = ''\n"
+		"if size(a[:]) == 4 && size(a[4:]) == 0 { r = a[2:][0] + c[0] + c[1] }\n"
+		"return r", Value::String("ccx"));
+
+	Run("var a = [1, 2, 3]\n"
+		"return a[2:1]", Value(), true, RUNTIME);
+	Run("var a = [1, 2, 3]\n"
+		"return a[0:4]", Value(), true, RUNTIME);
+	Run("var a = [1, 2, 3]\n"
+		"return a[-1:]", Value(), true, RUNTIME);
+	Run("var a = [1, 2, 3]\n"
+		"return a[:'x']", Value(), true, RUNTIME);
+	Run("var a = [1, 2, 3]\n"
+		"return a[1:", Value(), true);
+	ErrorReporter::clear();
+}
+
+static void Maps()
+{
+	const std::string s =
+		"var stock: num{}\n"
+		"stock['sword'] = 3\n"
+		"stock['shield'] = 1\n"
+		"stock['sword'] = stock['sword'] + 2\n"
+		"var names: str[] = keys(stock)\n"
+		"var total = 0\n"
+		"for var i = 0; i < size(names); i = i + 1 {\n"
+		"	total = total + stock[names[i]]\n"
+		"}\n"
+		"var r = 0\n"
+		"if has(stock, 'sword') && !has(stock, 'axe') && remove(stock, 'shield') && !remove(stock, 'shield') {\n"
+		"	r = total * 10 + size(stock)\n"
+		"}\n"
+		"return r";
+	Run(s, Value::Number(61));
+
+	Run("var m: str{}\n"
+		"return m['x']", Value(), true, RUNTIME);
+	Run("var m: num{}\n"
+		"m['x'] = 'y'", Value(), true, RUNTIME);
+	Run("var m: num{}\n"
+		"m[1] = 1", Value(), true, RUNTIME);
+	Run("var a: num[]\n"
+		"return has(a, 'x')", Value(), true, RUNTIME);
+	Run("var m: num{\n", Value(), true);
+	// A "{" on the next line is a block.
+	Run("var a: num\n"
+		"{\n"
+		"	a = 2\n"
+		"}\n"
+		"return a", Value::Number(2));
+	ErrorReporter::clear();
+}
+
+static void ListBuiltins()
+{
+	const std::string s =
+		"var a: num[] = [5, -1, 3, 3, 8]\n"
+		"sort(a)\n"
+		"var s = ['pear', 'fig', 'apple']\n"
+		"sort(s)\n"
+		"var b = [3, 1, 2]\n"
+		"var v: num[] = b[0:2]\n"
+		"sort(v)\n"
+		"var r = 0\n"
+		"if min(a) == -1 && max(a) == 8 && sum(a) == 18 && dot(a, a) == 108 {\n"
+		"	r = r + 1\n"
+		"}\n"
+		"if binarySearch(a, 3) == 1 && binarySearch(a, 4) == -1 && indexOf(a, 5) == 3 && count(a, 3) == 2 {\n"
+		"	r = r + 10\n"
+		"}\n"
+		"if indexOf(s, 'fig') == 1 && binarySearch(s, 'pear') == 2 && count(s, 'kiwi') == 0 {\n"
+		"	r = r + 100\n"
+		"}\n"
+		// Sorting a slice sorts its own copy.
+		"if b[0] == 3 && v[0] == 1 && v[1] == 3 {\n"
+		"	r = r + 1000\n"
+		"}\n"
+		"return r";
+	Run(s, Value::Number(1111));
+
+	Run("var e: num[]\n"
+		"return min(e)", Value(), true, RUNTIME);
+	Run("return dot([1, 2], [1])", Value(), true, RUNTIME);
+	Run("return sum(['a'])", Value(), true, RUNTIME);
+	Run("sort(1)", Value(), true, RUNTIME);
+	Run("var s = ['a']\n"
+		"return indexOf(s, 1)", Value(), true, RUNTIME);
+	ErrorReporter::clear();
+}
+
+// A script can declare a variable named for a builtin, which hides it.
+static void ShadowBuiltins()
+{
+	Run("var count = 2\n"
+		"var max = 3\n"
+		"count = count + max\n"
+		"return count", Value::Number(5));
+
+	// A list function, until the end of the block that declared it.
+	Run("var a = [1, 2]\n"
+		"var r = 0\n"
+		"{\n"
+		"	var append = 10\n"
+		"	r = append\n"
+		"}\n"
+		"append(a, 3)\n"
+		"return r + size(a)", Value::Number(13));
+	// ...so this calls the num.
+	Run("var a = [1, 2]\n"
+		"var size = 2\n"
+		"return size(a)", Value(), true, RUNTIME);
+
+	// The globals, and what they hide, last from one script to the next.
+	Interpreter ip(gOptions);
+	ip.interpret("var sum = 4\n"
+		"var size: num = sum", "langtest");
+	Value r = ip.interpret("return sum + size", "langtest");
+	TEST(!ErrorReporter::hasError());
+	TEST(r == Value::Number(8));
+	r = ip.interpret("var sum = 1", "langtest");
+	TEST(ErrorReporter::hasError());
+	ErrorReporter::clear();
 }
 
 static void BasicForTest()
@@ -351,6 +597,198 @@ static void BasicForTestNoDecl()
 	Run(s, Value::Number(20));
 }
 
+static void LocalsInLoop()
+{
+	const std::string s =
+		"var sum = 0\n"
+		"for var i = 0; i < 5; i = i + 1 {\n"
+		"	var sq: num = i * i\n"
+		"	sum = sum + sq\n"
+		"}\n"
+		"return sum";
+	Run(s, Value::Number(30));
+}
+
+// Locals are found by (depth, slot), so shadowing and assignment
+// across scopes, and scopes re-entered in a loop, have to line up.
+static void ResolvedSlots()
+{
+	const std::string s =
+		"var total = 0\n"
+		"{\n"
+		"	var a = 1\n"
+		"	var b = 10\n"
+		"	for var i = 0; i < 3; i = i + 1 {\n"
+		"		var a = 100\n"
+		"		b = b + a + i\n"
+		"		{\n"
+		"			a = a + 1\n"
+		"			total = total + a\n"
+		"		}\n"
+		"	}\n"
+		"	total = total + a + b\n"
+		"}\n"
+		"{\n"
+		"	var a = 1000\n"
+		"	total = total + a\n"
+		"}\n"
+		"return total";
+	Run(s, Value::Number(303 + 1 + 313 + 1000));
+
+	const std::string redeclare =
+		"{\n"
+		"	var x = 1\n"
+		"	var x = 2\n"
+		"}";
+	Run(redeclare, Value(), true);
+}
+
+static void GlobalHandles()
+{
+	Interpreter ip(gOptions);
+	ip.interpret(
+		"var speed = 2\n"
+		"var name = 'player'\n"
+		"var alive = true\n", "langtest");
+	TEST(!ErrorReporter::hasError());
+
+	GlobalHandle<double> speed = ip.globalHandle<double>("speed");
+	GlobalHandle<std::string> name = ip.globalHandle<std::string>("name");
+	GlobalHandle<bool> alive = ip.globalHandle<bool>("alive");
+	TEST(speed.valid() && name.valid() && alive.valid());
+	TEST(speed.get() == 2.0);
+	TEST(name.get() == "player");
+	TEST(alive.get() == true);
+
+	// Wrong type, and not defined.
+	TEST(!ip.globalHandle<bool>("speed").valid());
+	TEST(!ip.globalHandle<double>("missing").valid());
+
+	// Writes are seen by the script, and the handles survive new globals.
+	speed.set(3);
+	name.set("enemy");
+	alive.set(false);
+	Value r = ip.interpret(
+		"var more = 1\n"
+		"speed = speed * 10\n"
+		"if alive { return name }\n"
+		"return name + ' ' + 'down'", "langtest");
+	TEST(!ErrorReporter::hasError());
+	TEST(r.type == ValueType(PType::tStr) && r.str() == "enemy down");
+	TEST(speed.get() == 30.0);
+	ErrorReporter::clear();
+}
+
+static void MemoryUse()
+{
+	Interpreter ip(gOptions);
+	ip.interpret("var a: num[]\n", "langtest");
+	TEST(!ErrorReporter::hasError());
+	MemoryStats stats = ip.memoryStats();
+	TEST(stats.allocations == 1 && stats.frees == 0);
+	TEST(stats.heap.objects == 1);
+	TEST(stats.heap.types["NumList"].count == 1);
+	TEST(stats.internedStrings > 0);
+
+	const size_t strings = stats.strings.count;
+	Value r = ip.interpret("var s = 'abc'\nreturn s + 'def'", "langtest");
+	TEST(r.type == ValueType(PType::tStr) && r.str() == "abcdef");
+	stats = ip.memoryStats();
+	TEST(stats.allocations == 0);
+	TEST(stats.strings.count > strings);
+	TEST(stats.strings.bytes >= stats.strings.count * sizeof(StrObj));
+	ErrorReporter::clear();
+}
+
+static void MemoryLimit()
+{
+	InterpreterOptions options = gOptions;
+	options.memoryLimit = 1;
+	Interpreter ip(options);
+	Value r = ip.interpret(
+		"var a = 1\n"
+		"var b: num[]\n"
+		"return a", "langtest");
+	TEST(ErrorReporter::hasError());
+	TEST(r.type == ValueType());
+	ErrorReporter::clear();
+
+	// A runtime error, after which the interpreter still runs.
+	r = ip.interpret("return a + 1", "langtest");
+	TEST(!ErrorReporter::hasError());
+	TEST(r.type == ValueType(PType::tNum) && r.vNumber == 2);
+}
+
+// Strings count against the memory limit, though they aren't on the heap.
+static void StringMemoryLimit()
+{
+	InterpreterOptions options = gOptions;
+	options.memoryLimit = 1 << 20;
+	Interpreter ip(options);
+	Value r = ip.interpret(
+		"var s = 'abcdefgh'\n"
+		"for var i = 0; i < 20; i = i + 1 {\n"
+		"	s = s + s\n"
+		"}\n"
+		"return s", "langtest");
+	TEST(ErrorReporter::hasError());
+	TEST(r.type == ValueType());
+	ErrorReporter::clear();
+	TEST(ip.memoryStats().heap.allocated < options.memoryLimit);
+
+	// The strings that were freed are no longer charged.
+	r = ip.interpret(
+		"s = 'abcdefgh'\n"
+		"for var i = 0; i < 15; i = i + 1 {\n"
+		"	s = s + s\n"
+		"}\n"
+		"return s", "langtest");
+	TEST(!ErrorReporter::hasError());
+	TEST(r.type == ValueType(PType::tStr) && r.str().size() == 8 << 15);
+}
+
+// A list the host keeps from interpret() outlives the Interpreter: it is
+// orphaned, with what it refers to (a slice's parent), rather than freed.
+static void ResultOutlivesInterpreter()
+{
+	Value list, slice;
+	{
+		Interpreter ip(gOptions);
+		list = ip.interpret("var a: num[] = [1, 2, 3]\nreturn a", "langtest");
+		slice = ip.interpret("var b: num[] = [4, 5, 6]\nreturn b[1:3]", "langtest");
+		TEST(!ErrorReporter::hasError());
+	}
+	TEST(list.toString() == "[1, 2, 3]");
+	TEST(slice.toString() == "[5, 6]");
+	// And it can still grow.
+	std::string error;
+	TEST(ListAppend(list, Value::Number(4), error));
+	TEST(ListAppend(slice, Value::Number(7), error));
+	TEST(list.toString() == "[1, 2, 3, 4]");
+	TEST(slice.toString() == "[5, 6, 7]");
+}
+
+static void NumListOperators()
+{
+	const std::string s =
+		"var a: num[] = [1, 2, 3]\n"
+		"var b: num[] = [10, 20, 30]\n"
+		"var c: num[] = a * 2 + b\n"
+		"var d: bool[] = 25 < c\n"
+		"var r = 0\n"
+		"if d[2] && !d[1] { r = c[0] + c[1] + c[2] }\n"
+		"return r";
+	Run(s, Value::Number(72));
+
+	Run("var a: num[] = [1, 2]\n"
+		"var b: num[] = [1, 2, 3]\n"
+		"return a + b", Value(), true);
+
+	Run("var a: num[]\n"
+		"return a + 'x'", Value(), true);
+	ErrorReporter::clear();
+}
+
 static void SimpleFFIClock()
 {
 	const std::string s =
@@ -362,7 +800,180 @@ static void SimpleFFIClock()
 	Run(s, Value::Boolean(true));
 }
 
-void LangTest()
+static void ConstantFolding()
+{
+	const std::string s =
+		"var x = 0\n"
+		"if false {\n"
+		"	x = 1\n"
+		"}\n"
+		"while false {\n"
+		"	x = 2\n"
+		"}\n"
+		"if true && x == 0 {\n"
+		"	x = 60 * 60 * 24\n"
+		"} else {\n"
+		"	x = 3\n"
+		"}\n"
+		"return x + -(1 - 2)";
+
+	Interpreter ip(gOptions);
+	Value r = ip.interpret(s, "langtest");
+	TEST(!ErrorReporter::hasError());
+	TEST(r == Value::Number(86401));
+	// if (6 nodes), while (6), 'true &&' (2), 60 * 60 * 24 (4), -(1 - 2) (3)
+	TEST(ip.astNodesRemoved == (gOptions.optimizeAST ? 21 : 0));
+}
+
+// Strings are shared, so assigning a string to itself (which loads
+// it, stores it, and returns it) doesn't allocate.
+static void MoveNotCopy()
+{
+	Interpreter ip(gOptions);
+	ip.interpret("var s = \"x\"", "langtest");
+	TEST(!ErrorReporter::hasError());
+
+	uint64_t before = Value::stringAllocations;
+	Value r = ip.interpret("s = s", "langtest");
+	uint64_t n = Value::stringAllocations - before;
+	TEST(!ErrorReporter::hasError());
+	TEST(r == Value::String("x"));
+	TEST(n == 0);
+}
+
+static void InternedStrings()
+{
+	StringTable table;
+	StrPtr a = table.intern("hello");
+	StrPtr b = table.intern(std::string("hel") + "lo");
+	TEST(a == b);
+	TEST(a.get()->isInterned());
+	TEST(table.size() == 1);
+
+	// Equal to a string that isn't interned, by value.
+	Value c = Value::String("hello");
+	TEST(!c.vStr->isInterned());
+	TEST(Value::String(a) == c);
+	TEST(Value::String(a) != Value::String(table.intern("world")));
+
+	// A string leaves the table with its last reference.
+	table.intern("temporary");
+	TEST(table.size() == 1);
+	a.clear();
+	b.clear();
+	TEST(table.size() == 0);
+
+	Run("return \"abc\" == \"abc\"", Value::Boolean(true));
+	Run("var s = \"ab\"\nreturn s + \"c\" == \"abc\"", Value::Boolean(true));
+	Run("var s = \"ab\"\nreturn s + \"c\" != \"abc\"", Value::Boolean(false));
+}
+
+static void StringConcat()
+{
+	// Deep ropes flatten, and free, without recursion.
+	{
+		static constexpr int kN = 100000;
+		const std::string line = "0123456789";
+		Value v = Value::String("");
+		Value shared;
+		for (int i = 0; i < kN; i++) {
+			v = Value::Concat(std::move(v), Value::String(line));
+			if (i == kN / 2) shared = v;	// so the rest can't be in place
+		}
+		TEST(v.vStr->isRope());
+		TEST(v.vStr->length() == line.size() * kN);
+		TEST(v.str().size() == line.size() * kN);
+		TEST(!v.vStr->isRope());
+		TEST(v.str().compare(0, 20, "01234567890123456789") == 0);
+	}
+
+	std::string expected;
+	for (int i = 0; i < 500; i++) {
+		expected += "a line of the log. ";
+	}
+	Run("var log = \"\"\n"
+		"for var i = 0; i < 500; i = i + 1 {\n"
+		"	log = log + \"a line of the log. \"\n"
+		"}\n"
+		"return log", Value::String(expected));
+
+	// Appending to a string doesn't change the strings that share it.
+	const std::string a(200, 'a');
+	Run("var a = \"" + a + "\"\n"
+		"var b: str = a + a\n"
+		"a = a + \"b\"\n"
+		"return b", Value::String(a + a));
+	Run("var a = \"" + a + "\"\n"
+		"var b: str = a + a\n"
+		"a = a + \"b\"\n"
+		"return a", Value::String(a + "b"));
+}
+
+// Overwrites 4 bytes of a file.
+static void PatchFile(const std::string& path, long offset, uint32_t value)
+{
+	FILE* fp = fopen(path.c_str(), "r+b");
+	TEST(fp);
+	fseek(fp, offset, SEEK_SET);
+	fwrite(&value, sizeof(value), 1, fp);
+	fclose(fp);
+}
+
+static void ByteCodeImage()
+{
+	const std::string s =
+		"var x: num = 2\n"
+		"var s = \"a\"\n"
+		"if x > 1 {\n"
+		"	s = s + \"b\"\n"
+		"}\n"
+		"return x * 21\n";
+	const std::string path = (std::filesystem::temp_directory_path() / "langtest.scribec").string();
+
+	InterpreterOptions options;
+	options.bytecode = true;
+	{
+		Interpreter compiler(options);
+		TEST(compiler.compile(s, "langtest", path));
+	}
+	{
+		BCImage image;
+		TEST(image.load(path));
+		TEST(image.sourceHash() == BCImage::HashSource(s));
+		TEST(image.line(0) == 0);
+		TEST(image.line(image.numInstructions() - 1) == 5);
+
+		// Runs in place.
+		Interpreter ip(options);
+		TEST(ip.interpretImage(image) == Value::Number(42));
+		TEST(!ErrorReporter::hasError());
+
+		// The globals have moved, so the instructions are relocated.
+		Interpreter moved(options);
+		moved.interpret("var before = 1", "langtest");
+		TEST(moved.interpretImage(image) == Value::Number(42));
+		TEST(!ErrorReporter::hasError());
+	}
+	{
+		// Corrupt: flip an instruction.
+		PatchFile(path, sizeof(ImageHeader), 0xffffffff);
+		BCImage image;
+		TEST(!image.load(path));
+		TEST(ErrorReporter::hasError());
+		ErrorReporter::clear();
+	}
+	{
+		// Stale: an old version
+		PatchFile(path, offsetof(ImageHeader, version), ImageHeader::kVersion - 1);
+		BCImage image;
+		TEST(!image.load(path));
+		TEST(ErrorReporter::hasError());
+		ErrorReporter::clear();
+	}
+	std::filesystem::remove(path);
+}
+
+static void RunLangTests()
 {
 	RUN_TEST(SimplePrint());
 	RUN_TEST(SimpleReturn());
@@ -388,15 +999,56 @@ void LangTest()
 	RUN_TEST(LogicalOR());
 	RUN_TEST(LogicalAND());
 	RUN_TEST(BasicWhile());
+	RUN_TEST(DeclareEmptyList());
+	RUN_TEST(DeclareNumList());
+	RUN_TEST(ListLiterals());
+	RUN_TEST(ListIndex());
+	RUN_TEST(ListAppendPop());
+	RUN_TEST(ListSlices());
+	RUN_TEST(Maps());
+	RUN_TEST(ListBuiltins());
+	RUN_TEST(ShadowBuiltins());
 	RUN_TEST(BasicForTest());
 	RUN_TEST(BasicForTestNoInit());
 	RUN_TEST(BasicForTestNoDecl());
+	RUN_TEST(LocalsInLoop());
+	RUN_TEST(ResolvedSlots());
+	RUN_TEST(GlobalHandles());
+	RUN_TEST(MemoryUse());
+	RUN_TEST(MemoryLimit());
+	RUN_TEST(StringMemoryLimit());
+	RUN_TEST(ResultOutlivesInterpreter());
+	RUN_TEST(NumListOperators());
 	RUN_TEST(SimpleFFIClock());
+	RUN_TEST(ConstantFolding());
+	RUN_TEST(MoveNotCopy());
+	RUN_TEST(InternedStrings());
+	RUN_TEST(StringConcat());
+}
 
-#if false
-	// note this: https://github.com/munificent/craftinginterpreters/blob/master/note/answers/chapter13_inheritance/3.md
-	// come back to this: https://calebschoepp.com/blog/2020/adding-a-list-data-type-to-lox/
-	RUN_TEST(DeclareEmptyList());
-	RUN_TEST(DeclareNumList());
-#endif
-}
\ No newline at end of file
+void LangTest()
+{
+	fmt::print("LangTest: tree walker\n");
+	gOptions.bytecode = false;
+	gOptions.optimizeAST = false;
+	gOptions.typeCheck = false;
+	RunLangTests();
+
+	fmt::print("LangTest: tree walker, optimized AST\n");
+	gOptions.optimizeAST = true;
+	RunLangTests();
+
+	fmt::print("LangTest: bytecode\n");
+	gOptions.bytecode = true;
+	gOptions.optimizeAST = false;
+	gOptions.optimizeBytecode = false;
+	RunLangTests();
+
+	fmt::print("LangTest: optimized bytecode\n");
+	gOptions.optimizeAST = true;
+	gOptions.optimizeBytecode = true;
+	gOptions.typeCheck = true;
+	RunLangTests();
+
+	RUN_TEST(ByteCodeImage());
+}
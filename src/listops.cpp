@@ -0,0 +1,267 @@
+#include "listops.h"
+#include "hashmap.h"
+
+#include <fmt/core.h>
+#include <type_traits>
+
+void ListTypeError(const char* ctx, const Value& list, std::string& error)
+{
+	error = fmt::format("{}: expected a list, not '{}'", ctx, list.type.typeName());
+}
+
+void ElementTypeError(const char* ctx, PType expected, const Value& element, std::string& error)
+{
+	error = fmt::format("{}: expected '{}', not '{}'", ctx, ValueType(expected).typeName(), element.type.typeName());
+}
+
+static bool CheckIndex(const char* ctx, const Value& index, int size, size_t& i, std::string& error)
+{
+	if (index.type != ValueType(PType::tNum)) {
+		error = fmt::format("{}: expected a num index, not '{}'", ctx, index.type.typeName());
+		return false;
+	}
+	if (!ListIndex(index.vNumber, size, i)) {
+		error = fmt::format("{}: index {} out of bounds for size {}", ctx, index.vNumber, size);
+		return false;
+	}
+	return true;
+}
+
+template<typename L>
+static Value Fill(Heap& heap, const Value* elements, int n, std::string& error)
+{
+	L* list = heap.make<L>(heap, n);
+	Value v;
+	v.type = ValueType(ListTraits<L>::kType, Layout::tList);
+	v.heapPtr.set(list);
+	for (int i = 0; i < n; i++) {
+		if (!CheckElement("list literal", list, elements[i], error))
+			return Value();
+		list->set(i, ListTraits<L>::get(elements[i]));
+	}
+	return v;
+}
+
+Value MakeList(Heap& heap, PType elementType, const Value* elements, int n, std::string& error)
+{
+	REQUIRE(n >= 0);
+	if (elementType == PType::tNone) {
+		if (n == 0) {
+			error = "list literal: an empty list needs a declared type";
+			return Value();
+		}
+		elementType = elements[0].type.layout == Layout::tScalar ? elements[0].type.pType : PType::tNone;
+	}
+	switch (elementType) {
+	case PType::tNum: return Fill<NumList>(heap, elements, n, error);
+	case PType::tBool: return Fill<BoolList>(heap, elements, n, error);
+	case PType::tStr: return Fill<StrList>(heap, elements, n, error);
+	default: break;
+	}
+	error = fmt::format("list literal: no list of '{}'", n ? elements[0].type.typeName() : ValueType(elementType).typeName());
+	return Value();
+}
+
+// Calls f() with the map object, as its type.
+template<typename F>
+static bool WithMap(const char* ctx, const Value& map, std::string& error, F&& f)
+{
+	if (map.type.layout == Layout::tMap && map.heapPtr.get()) {
+		HeapObject* obj = map.heapPtr.get();
+		switch (map.type.pType) {
+		case PType::tNum: f(static_cast<NumMap*>(obj)); return true;
+		case PType::tBool: f(static_cast<BoolMap*>(obj)); return true;
+		case PType::tStr: f(static_cast<StrMap*>(obj)); return true;
+		default: break;
+		}
+	}
+	error = fmt::format("{}: expected a map, not '{}'", ctx, map.type.typeName());
+	return false;
+}
+
+// Maps store their values as their lists store elements.
+template<typename M> struct MapTraits;
+template<> struct MapTraits<NumMap> : ListTraits<NumList> {};
+template<> struct MapTraits<BoolMap> : ListTraits<BoolList> {};
+template<> struct MapTraits<StrMap> : ListTraits<StrList> {};
+
+static bool CheckKey(const char* ctx, const Value& key, std::string& error)
+{
+	if (key.type == ValueType(PType::tStr))
+		return true;
+	error = fmt::format("{}: expected a str key, not '{}'", ctx, key.type.typeName());
+	return false;
+}
+
+static Value MapGet(const Value& map, const Value& key, std::string& error)
+{
+	Value result;
+	WithMap("map index", map, error, [&](auto* m) {
+		if (!CheckKey("map index", key, error))
+			return;
+		if (const auto* v = m->find(key.str()))
+			result = MapTraits<std::remove_pointer_t<decltype(m)>>::make(*v);
+		else
+			error = fmt::format("map index: no key '{}'", key.str());
+	});
+	return result;
+}
+
+static bool MapSet(const Value& map, const Value& key, const Value& value, std::string& error)
+{
+	bool ok = false;
+	WithMap("map index", map, error, [&](auto* m) {
+		using Traits = MapTraits<std::remove_pointer_t<decltype(m)>>;
+		if (!CheckKey("map index", key, error))
+			return;
+		if (value.type != ValueType(Traits::kType)) {
+			error = fmt::format("map value: expected '{}', not '{}'", ValueType(Traits::kType).typeName(), value.type.typeName());
+			return;
+		}
+		m->set(key.str(), Traits::get(value));
+		ok = true;
+	});
+	return ok;
+}
+
+Value ListGet(const Value& list, const Value& index, std::string& error)
+{
+	if (list.type.layout == Layout::tMap)
+		return MapGet(list, index, error);
+	Value result;
+	WithList("list index", list, error, [&](auto* l) {
+		size_t i = 0;
+		if (CheckIndex("list index", index, l->size(), i, error))
+			result = ListTraits<std::remove_pointer_t<decltype(l)>>::make(l->get((int)i));
+	});
+	return result;
+}
+
+bool ListSet(const Value& list, const Value& index, const Value& element, std::string& error)
+{
+	if (list.type.layout == Layout::tMap)
+		return MapSet(list, index, element, error);
+	bool ok = false;
+	WithList("list index", list, error, [&](auto* l) {
+		size_t i = 0;
+		if (CheckIndex("list index", index, l->size(), i, error) && CheckElement("list element", l, element, error)) {
+			l->set((int)i, ListTraits<std::remove_pointer_t<decltype(l)>>::get(element));
+			ok = true;
+		}
+	});
+	return ok;
+}
+
+// A bound of a slice, which can be the size of the list.
+static bool CheckBound(const Value* bound, int size, int fallback, int& i, std::string& error)
+{
+	if (!bound) {
+		i = fallback;
+		return true;
+	}
+	if (bound->type != ValueType(PType::tNum)) {
+		error = fmt::format("slice: expected a num bound, not '{}'", bound->type.typeName());
+		return false;
+	}
+	size_t u = 0;
+	if (!ListIndex(bound->vNumber, size + 1, u)) {
+		error = fmt::format("slice: bound {} out of range for size {}", bound->vNumber, size);
+		return false;
+	}
+	i = (int)u;
+	return true;
+}
+
+Value ListSlice(Heap& heap, const Value& list, const Value* begin, const Value* end, std::string& error)
+{
+	Value result;
+	WithList("slice", list, error, [&](auto* l) {
+		using L = std::remove_pointer_t<decltype(l)>;
+		int b = 0, e = 0;
+		if (!CheckBound(begin, l->size(), 0, b, error) || !CheckBound(end, l->size(), l->size(), e, error))
+			return;
+		if (b > e) {
+			error = fmt::format("slice: begin {} is after end {}", b, e);
+			return;
+		}
+		L* view = heap.make<L>(heap, 0);
+		result.type = list.type;
+		result.heapPtr.set(view);
+		view->viewOf(*l, b, e - b);
+	});
+	return result;
+}
+
+bool ListAppend(const Value& list, const Value& element, std::string& error)
+{
+	bool ok = false;
+	WithList("append", list, error, [&](auto* l) {
+		if (CheckElement("append", l, element, error)) {
+			l->append(ListTraits<std::remove_pointer_t<decltype(l)>>::get(element));
+			ok = true;
+		}
+	});
+	return ok;
+}
+
+Value ListPop(const Value& list, std::string& error)
+{
+	Value result;
+	WithList("pop", list, error, [&](auto* l) {
+		if (l->size() == 0)
+			error = "pop: the list is empty";
+		else
+			result = ListTraits<std::remove_pointer_t<decltype(l)>>::make(l->pop());
+	});
+	return result;
+}
+
+Value ListSize(const Value& list, std::string& error)
+{
+	Value result;
+	if (list.type.layout == Layout::tMap) {
+		WithMap("size", list, error, [&](auto* m) {
+			result = Value::Number(m->size());
+		});
+		return result;
+	}
+	WithList("size", list, error, [&](auto* l) {
+		result = Value::Number(l->size());
+	});
+	return result;
+}
+
+Value MapHas(const Value& map, const Value& key, std::string& error)
+{
+	Value result;
+	WithMap("has", map, error, [&](auto* m) {
+		if (CheckKey("has", key, error))
+			result = Value::Boolean(m->contains(key.str()));
+	});
+	return result;
+}
+
+Value MapRemove(const Value& map, const Value& key, std::string& error)
+{
+	Value result;
+	WithMap("remove", map, error, [&](auto* m) {
+		if (CheckKey("remove", key, error))
+			result = Value::Boolean(m->erase(key.str()));
+	});
+	return result;
+}
+
+Value MapKeys(Heap& heap, const Value& map, std::string& error)
+{
+	Value result;
+	WithMap("keys", map, error, [&](auto* m) {
+		StrList* keys = heap.make<StrList>(heap, 0);
+		result.type = ValueType(PType::tStr, Layout::tList);
+		result.heapPtr.set(keys);
+		keys->reserve(m->size());
+		m->forEach([&](const std::string& key, const auto&) {
+			keys->append(key);
+		});
+	});
+	return result;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "value.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+/*
+* The list and map operations, for both engines: literals, indexing, and
+* the append(), pop(), size(), has(), remove() and keys() built ins. A
+* list or map is a reference: copying the Value shares it.
+*
+* A map (num{}, bool{}, str{}) is keyed by str, and indexing it with a
+* key it doesn't have is an error. ListGet(), ListSet() and ListSize()
+* take a map as well as a list.
+*
+* On an error (a type mismatch, an index out of bounds) they set 'error'
+* and return Value(), or false.
+*/
+
+// The element for a num 'index', truncated toward zero, if it is in
+// bounds. A negative index wraps around to a huge unsigned one, so one
+// compare checks both ends of the range. (NaN, and numbers too large to
+// convert to an integer, fail the first test.)
+inline bool ListIndex(double index, int size, size_t& i)
+{
+	if (!(fabs(index) < 9.0e15))
+		return false;
+	i = static_cast<size_t>(static_cast<int64_t>(index));
+	return i < static_cast<size_t>(size);
+}
+
+// How each list stores its elements, and converts them to and from Values.
+template<typename T> struct ListTraits;
+
+template<> struct ListTraits<NumList> {
+	static constexpr PType kType = PType::tNum;
+	static double get(const Value& v) { return v.vNumber; }
+	static Value make(double d) { return Value::Number(d); }
+};
+
+template<> struct ListTraits<BoolList> {
+	static constexpr PType kType = PType::tBool;
+	static bool get(const Value& v) { return v.vBoolean; }
+	static Value make(bool b) { return Value::Boolean(b); }
+};
+
+template<> struct ListTraits<StrList> {
+	static constexpr PType kType = PType::tStr;
+	static std::string get(const Value& v) { return v.str(); }
+	static Value make(const std::string& s) { return Value::String(s); }
+};
+
+void ListTypeError(const char* ctx, const Value& list, std::string& error);
+void ElementTypeError(const char* ctx, PType expected, const Value& element, std::string& error);
+
+// Calls f() with the list object, as its type. (For the functions that
+// work on all the lists at once, such as the ones in scribelib.)
+template<typename F>
+bool WithList(const char* ctx, const Value& list, std::string& error, F&& f)
+{
+	if (list.type.layout == Layout::tList && list.heapPtr.get()) {
+		HeapObject* obj = list.heapPtr.get();
+		switch (list.type.pType) {
+		case PType::tNum: f(static_cast<NumList*>(obj)); return true;
+		case PType::tBool: f(static_cast<BoolList*>(obj)); return true;
+		case PType::tStr: f(static_cast<StrList*>(obj)); return true;
+		default: break;
+		}
+	}
+	ListTypeError(ctx, list, error);
+	return false;
+}
+
+template<typename L>
+bool CheckElement(const char* ctx, const L*, const Value& element, std::string& error)
+{
+	if (element.type == ValueType(ListTraits<L>::kType))
+		return true;
+	ElementTypeError(ctx, ListTraits<L>::kType, element, error);
+	return false;
+}
+
+// A new list of the 'n' elements, sized once. If the compiler didn't know
+// the element type, 'elementType' is PType::tNone and the list takes the
+// type of the first element.
+Value MakeList(Heap& heap, PType elementType, const Value* elements, int n, std::string& error);
+
+Value ListGet(const Value& list, const Value& index, std::string& error);
+// The element is copied: it is the value of the assignment.
+bool ListSet(const Value& list, const Value& index, const Value& element, std::string& error);
+
+// A view of list[begin:end], which shares the list's storage until either
+// is changed (see ObjList.) A null bound is the start, or the end, of the
+// list. Like an index, a bound is truncated, and 0 <= begin <= end <= size.
+Value ListSlice(Heap& heap, const Value& list, const Value* begin, const Value* end, std::string& error);
+
+bool ListAppend(const Value& list, const Value& element, std::string& error);
+Value ListPop(const Value& list, std::string& error);
+Value ListSize(const Value& list, std::string& error);
+
+Value MapHas(const Value& map, const Value& key, std::string& error);
+// Returns true if the key was there.
+Value MapRemove(const Value& map, const Value& key, std::string& error);
+// A new str[] of the keys, in the order the map iterates.
+Value MapKeys(Heap& heap, const Value& map, std::string& error);
@@ -1,9 +1,54 @@
 #include "machine.h"
+#include "func.h"
+#include "listops.h"
+#include "vecops.h"
 
 #include <fmt/core.h>
 #include <assert.h>
 
-#if 0
+#if defined(__GNUC__) || defined(__clang__)
+#	define COMPUTED_GOTO() 1
+#else
+#	define COMPUTED_GOTO() 0
+#endif
+
+using Slot = Machine::Slot;
+
+// The numbers and bools on the stack, without a Value. SetNum() and
+// SetBool() replace a number or bool in place.
+#if NANBOX_VALUES()
+static inline ValueType TypeOf(const BoxedValue& v) { return v.type(); }
+static inline bool IsNum(const BoxedValue& v) { return v.isNumber(); }
+static inline double Num(const BoxedValue& v) { return v.asNumber(); }
+static inline bool Bool(const BoxedValue& v) { return v.asBoolean(); }
+static inline BoxedValue NumSlot(double d) { return BoxedValue::Number(d); }
+static inline BoxedValue BoolSlot(bool b) { return BoxedValue::Boolean(b); }
+static inline void SetNum(BoxedValue& v, double d) { v = BoxedValue::Number(d); }
+static inline void SetBool(BoxedValue& v, bool b) { v = BoxedValue::Boolean(b); }
+static inline bool Truthy(const BoxedValue& v) { return v.isBoolean() ? v.asBoolean() : v.toValue().isTruthy(); }
+static inline NumList* AsNumList(const BoxedValue& v) { return v.isList() ? dynamic_cast<NumList*>(v.asObject()) : nullptr; }
+#else
+static inline ValueType TypeOf(const Value& v) { return v.type; }
+static inline bool IsNum(const Value& v) { return v.type == ValueType(PType::tNum); }
+static inline double Num(const Value& v) { return v.vNumber; }
+static inline bool Bool(const Value& v) { return v.vBoolean; }
+static inline Value NumSlot(double d) { return Value::Number(d); }
+static inline Value BoolSlot(bool b) { return Value::Boolean(b); }
+static inline void SetNum(Value& v, double d) { v.vNumber = d; }
+static inline void SetBool(Value& v, bool b) { v.type.pType = PType::tBool; v.vBoolean = b; }
+static inline bool Truthy(const Value& v) { return v.isTruthy(); }
+static inline NumList* AsNumList(const Value& v) {
+	return v.type == ValueType(PType::tNum, Layout::tList) ? static_cast<NumList*>(v.heapPtr.get()) : nullptr;
+}
+#endif
+
+// Two numbers aren't a num[] operator, which saves loading them to ask.
+static inline bool NumListOperands(const Slot& lhs, const Slot& rhs)
+{
+	if (IsNum(lhs) && IsNum(rhs)) return false;
+	return IsNumListOp(Machine::Load(lhs), Machine::Load(rhs));
+}
+
 static const char* gOpCodeNames[static_cast<int>(OpCode::count)] = {
 	"NO_OP",
 	"PUSH",
@@ -12,34 +57,92 @@ static const char* gOpCodeNames[static_cast<int>(OpCode::count)] = {
 	"SUB",
 	"MUL",
 	"DIV",
+	"NEGATE",
+	"NOT",
+	"EQUAL",
+	"NOT_EQUAL",
+	"LESS",
+	"LESS_EQUAL",
+	"GREATER",
+	"GREATER_EQUAL",
 	"DEFINE_GLOBAL",
-	"DEFINE_LOCAL",
-	"LOAD",
-	"STORE",
-	"PUSH_SCOPE",
+	"LOAD_GLOBAL",
+	"STORE_GLOBAL",
+	"LOAD_LOCAL",
+	"STORE_LOCAL",
 	"POP_SCOPE",
+	"DEFAULT",
+	"JUMP",
+	"JUMP_IF_FALSE",
+	"JUMP_IF_TRUE",
+	"LOOP",
+	"CALL",
+	"PRINT",
+	"RESULT",
+	"ADD_CONST",
+	"ADD_LOCALS",
+	"SET_LOCAL",
+	"SET_GLOBAL",
+	"JUMP_IF_NOT_LESS",
+	"JUMP_IF_NOT_LESS_EQUAL",
+	"JUMP_IF_NOT_GREATER",
+	"JUMP_IF_NOT_GREATER_EQUAL",
+	"WIDE",
+	"ADD_NUM",
+	"SUB_NUM",
+	"MUL_NUM",
+	"DIV_NUM",
+	"NEGATE_NUM",
+	"LESS_NUM",
+	"LESS_EQUAL_NUM",
+	"GREATER_NUM",
+	"GREATER_EQUAL_NUM",
+	"EQ_NUM",
+	"NOT_EQ_NUM",
+	"EQ_BOOL",
+	"NOT_EQ_BOOL",
+	"CONCAT_STR",
+	"NEW_LIST",
+	"LOAD_INDEX",
+	"STORE_INDEX",
+	"LIST_APPEND",
+	"LIST_POP",
+	"LIST_SIZE",
+	"LOAD_SLICE",
+	"MAP_HAS",
+	"MAP_REMOVE",
+	"MAP_KEYS",
 };
 
-Machine::Machine()
+Machine::Machine(Heap& heap, FFI* ffi) : heap(heap), ffi(ffi)
 {
+	// Check the name and count list are in sync
+	assert(gOpCodeNames[static_cast<int>(OpCode::count) - 1] == std::string("MAP_KEYS"));
+	if (!hasThreadedDispatch())
+		dispatch = Dispatch::kSwitch;
 }
 
-bool Machine::verifyUnderflow(const std::string& ctx, int n)
+/*static*/ bool Machine::hasThreadedDispatch()
 {
-	if (stack.size() < n) {
+	return COMPUTED_GOTO() != 0;
+}
+
+bool Machine::verifyUnderflow(const char* ctx, int n)
+{
+	if ((int)stack.size() < n) {
 		setErrorMessage(fmt::format("{}: stack underflow", ctx));
 		return false;
 	}
 	return true;
 }
 
-bool Machine::verifyTypes(const std::string& ctx, const std::vector<ValueType>& types)
+bool Machine::verifyTypes(const char* ctx, const std::vector<ValueType>& types)
 {
 	REQUIRE(types.size() > 0);
 
 	if (!verifyUnderflow(ctx, (int)types.size())) return false;
 	for (size_t i = 0; i < types.size(); i++) {
-		ValueType type = getStack(1).type;
+		ValueType type = TypeOf(getStack((int)i + 1));
 		if (type != types[i]) {
 			setErrorMessage(fmt::format("{}: expected '{}' at stack -{}", ctx, type.typeName(), i + 1));
 			return false;
@@ -51,74 +154,119 @@ bool Machine::verifyTypes(const std::string& ctx, const std::vector<ValueType>&
 void Machine::popStack(int n)
 {
 	REQUIRE(n >= 0);
-	REQUIRE(stack.size() >= n);
+	REQUIRE((int)stack.size() >= n);
 	stack.resize(stack.size() - n);
 }
 
-void Machine::binaryOp(OpCode opCode)
+const Value* Machine::topValues(int n, std::vector<Value>& scratch)
+{
+	assert(n >= 0 && n <= (int)stack.size());
+#if NANBOX_VALUES()
+	scratch.clear();
+	for (size_t i = stack.size() - n; i < stack.size(); i++)
+		scratch.push_back(Load(stack[i]));
+	return scratch.data();
+#else
+	(void)scratch;
+	return stack.data() + stack.size() - n;
+#endif
+}
+
+bool Machine::numListOp(OpCode opCode)
+{
+	VecOp op = VecOp::kAdd;
+	switch (opCode) {
+	case OpCode::ADD: op = VecOp::kAdd; break;
+	case OpCode::SUB: op = VecOp::kSub; break;
+	case OpCode::MUL: op = VecOp::kMul; break;
+	case OpCode::DIV: op = VecOp::kDiv; break;
+	case OpCode::LESS: op = VecOp::kLess; break;
+	case OpCode::LESS_EQUAL: op = VecOp::kLessEqual; break;
+	case OpCode::GREATER: op = VecOp::kGreater; break;
+	case OpCode::GREATER_EQUAL: op = VecOp::kGreaterEqual; break;
+	case OpCode::EQUAL: op = VecOp::kEqual; break;
+	case OpCode::NOT_EQUAL: op = VecOp::kNotEqual; break;
+	default:
+		setErrorMessage(fmt::format("{}: not an operator on num[]", gOpCodeNames[(int)opCode]));
+		return false;
+	}
+	std::string message;
+	Value result = NumListOp(heap, op, Load(getStack(2)), Load(getStack(1)), message);
+	if (!message.empty()) {
+		setErrorMessage(message);
+		return false;
+	}
+	popStack(2);
+	stack.push_back(Store(std::move(result)));
+	return true;
+}
+
+bool Machine::binaryOp(OpCode opCode)
 {
-	bool stringAdd = stack.size() > 1 && getStack(1).type.pType== PType::tString;
-	assert(getStack(1).type.layout == Layout::tScalar); // others not implemented
+	if (!verifyUnderflow(gOpCodeNames[(int)opCode], 2)) return false;
+	if (NumListOperands(getStack(2), getStack(1))) return numListOp(opCode);
+	bool stringAdd = opCode == OpCode::ADD && TypeOf(getStack(1)).pType == PType::tStr;
 	if (stringAdd) {
 		if (!verifyTypes("ADD concat", {
-			ValueType(PType::tString), 
-			ValueType(PType::tString) })) 
-			return;
+			ValueType(PType::tStr), 
+			ValueType(PType::tStr) })) 
+			return false;
 
-		const std::string& lhs = *getStack(2).vString;
-		const std::string& rhs = *getStack(1).vString;
-		std::string result = lhs + rhs;
-		popStack(2);
-		stack.push_back(Value::String(result));
+		concat();
 	}
 	else {
 		if (!verifyTypes(gOpCodeNames[(int)opCode], {
-			ValueType(PType::tNumber), 
-			ValueType(PType::tNumber) })) 
-			return;
+			ValueType(PType::tNum), 
+			ValueType(PType::tNum) })) 
+			return false;
 
-		double rhs = getStack(1).vNumber;
-		double lhs = getStack(2).vNumber;
+		double rhs = Num(getStack(1));
+		double lhs = Num(getStack(2));
 		popStack(2);
 
 		switch (opCode)
 		{
-		case OpCode::ADD:	stack.push_back(Value::Number(lhs + rhs));	break;
-		case OpCode::SUB:	stack.push_back(Value::Number(lhs - rhs));	break;
-		case OpCode::MUL:	stack.push_back(Value::Number(lhs * rhs));	break;
-		case OpCode::DIV:	stack.push_back(Value::Number(lhs / rhs));	break;
+		case OpCode::ADD:	stack.push_back(NumSlot(lhs + rhs));	break;
+		case OpCode::SUB:	stack.push_back(NumSlot(lhs - rhs));	break;
+		case OpCode::MUL:	stack.push_back(NumSlot(lhs * rhs));	break;
+		case OpCode::DIV:	stack.push_back(NumSlot(lhs / rhs));	break;
 		default:
 			setErrorMessage(fmt::format("Unknown opcode when doing binary number operation: {}", (int)opCode));
+			return false;
 		}
 	}
+	return true;
 }
 
-void Machine::equal(OpCode op)
+bool Machine::equal(OpCode op)
 {
 	REQUIRE(op == OpCode::EQUAL || op == OpCode::NOT_EQUAL);
-	const std::string& opName = op == OpCode::EQUAL ? "EQUAL" : "NOT_EQUAL";
-	if (!verifyUnderflow(opName, 2)) return;
-	const Value& rhs = getStack(1);
-	const Value& lhs = getStack(2);
+	const char* opName = gOpCodeNames[(int)op];
+	if (!verifyUnderflow(opName, 2)) return false;
+	if (NumListOperands(getStack(2), getStack(1))) return numListOp(op);
+	const Value& rhs = Load(getStack(1));
+	const Value& lhs = Load(getStack(2));
 	if (rhs.type != lhs.type) {
 		setErrorMessage(fmt::format("{}: type mismatch: {} != {}", opName, lhs.type.typeName(), rhs.type.typeName()));
-		return;
+		return false;
 	}
 	bool result = rhs == lhs;
 	if (op == OpCode::NOT_EQUAL) result = !result;
 
 	popStack(2);
-	stack.push_back(Value::Boolean(result));
+	stack.push_back(BoolSlot(result));
+	return true;
 }
 
-void Machine::compare(OpCode opCode)
+bool Machine::compare(OpCode opCode)
 {
 	REQUIRE(opCode == OpCode::LESS || opCode == OpCode::LESS_EQUAL || opCode == OpCode::GREATER || opCode == OpCode::GREATER_EQUAL);
-	const std::string& opName = gOpCodeNames[(int)opCode];
-	if (!verifyTypes(opName, { P::tNumber, ValueType::tNumber })) return;
+	const char* opName = gOpCodeNames[(int)opCode];
+	if (stack.size() >= 2 && NumListOperands(getStack(2), getStack(1))) return numListOp(opCode);
+	if (!verifyTypes(opName, { ValueType(PType::tNum), ValueType(PType::tNum) })) return false;
 
-	double rhs = getStack(1).vNumber;
-	double lhs = getStack(2).vNumber;
+	double rhs = Num(getStack(1));
+	double lhs = Num(getStack(2));
 	popStack(2);
 
 	bool result = false;
@@ -130,267 +278,1360 @@ void Machine::compare(OpCode opCode)
 	case OpCode::GREATER_EQUAL:	result = lhs >= rhs; break;
 	default:
 		setErrorMessage(fmt::format("Unknown opcode when doing comparison: {}", (int)opCode));
+		return false;
 	}
-	stack.push_back(Value::Boolean(result));
+	stack.push_back(BoolSlot(result));
+	return true;
 }
 
-void Machine::negative()
+// Replaces the two strings on the top of the stack with their concatenation.
+// Unchecked: the caller checks the types.
+void Machine::concat()
 {
-	if (!verifyTypes("NEGATE", {ValueType::tNumber})) return;
-	double x = getStack(1).vNumber;
+	Slot& lhs = getStack(2);
+	lhs = Store(Value::Concat(Take(lhs), Load(getStack(1))));
+	stack.pop_back();
+}
+
+bool Machine::negative()
+{
+	if (!verifyTypes("NEGATE", { ValueType(PType::tNum) })) return false;
+	double x = Num(getStack(1));
 	//popStack(1);
 	//stack.push_back(Value::Number(-x));
-	getStack(1) = Value::Number(-x);
+	getStack(1) = NumSlot(-x);
+	return true;
 }
 
-void Machine::notOp()
+bool Machine::notOp()
 {
-	if (!verifyUnderflow("NOT", 1)) return;
-	bool x = getStack(1).isTruthy();
+	if (!verifyUnderflow("NOT", 1)) return false;
+	bool x = Truthy(getStack(1));
 	//popStack(1);
 	//stack.push_back(Value::Boolean(!x));
-	getStack(1) = Value::Boolean(!x);
+	getStack(1) = BoolSlot(!x);
+	return true;
 }
 
-void Machine::defineGlobal()
+void Machine::setGlobal(const std::string& name, const Value& value)
 {
-	size_t s = stack.size();
-	if (s < 2) {
-		setErrorMessage("DEFINE_GLOBAL: stack underflow");
-		return;
-	}
+	uint32_t slot = globalTable.resolve(name);
+	if (globals.size() < globalTable.size())
+		globals.resize(globalTable.size());
+	globals[slot] = value;
+}
 
-	if (getStack(2).type != ValueType::tString) {
-		setErrorMessage("DEFINE_GLOBAL: expected 'string' at stack -2");
-		return;
-	}
-	if (getStack(1).type == ValueType::tNone) {
+void Machine::setBuiltin(const std::string& name, const Value& value)
+{
+	setGlobal(name, value);
+	uint32_t slot = globalTable.resolve(name);
+	if (builtins.size() <= slot)
+		builtins.resize(slot + 1);
+	builtins[slot] = true;
+}
+
+bool Machine::defineGlobal(uint32_t slot)
+{
+	if (!verifyUnderflow("DEFINE_GLOBAL", 1)) return false;
+	if (TypeOf(getStack(1)) == ValueType()) {
 		setErrorMessage("DEFINE_GLOBAL: expected value at stack -1");
-		return;
+		return false;
+	}
+	if (slot < builtins.size() && builtins[slot]) {
+		builtins[slot] = false;
+	}
+	else if (globals[slot].type != ValueType()) {
+		setErrorMessage(fmt::format("DEFINE_GLOBAL: key '{}' already exists", globalTable.names[slot]));
+		return false;
 	}
+	globals[slot] = Take(getStack(1));
+	popStack();
+	return true;
+}
 
-	std::string key = std::move(*(getStack(2).vString));
-	Value v = std::move(getStack(1));
-	popStack(2);
+bool Machine::loadGlobal(uint32_t slot)
+{
+	const Value& v = globals[slot];
+	if (v.type == ValueType()) {
+		setErrorMessage(fmt::format("LOAD_GLOBAL: key '{}' not found", globalTable.names[slot]));
+		return false;
+	}
+	stack.push_back(Store(v));
+	return true;
+}
 
-	if (globalVars.find(key) != globalVars.end()) {
-		setErrorMessage(fmt::format("DEFINE_GLOBAL: key '{}' already exists", key));
-		return;
+bool Machine::storeGlobal(uint32_t slot, bool pop)
+{
+	// Assignment is an expression: the value stays on the stack.
+	if (!verifyUnderflow("STORE_GLOBAL", 1)) return false;
+	Value& v = globals[slot];
+	if (v.type == ValueType()) {
+		setErrorMessage(fmt::format("STORE_GLOBAL: key '{}' not found", globalTable.names[slot]));
+		return false;
+	}
+	if (v.type != TypeOf(getStack(1))) {
+		setErrorMessage(fmt::format("STORE_GLOBAL: type mismatch for key '{}'", globalTable.names[slot]));
+		return false;
+	}
+	if (pop) {
+		v = Take(getStack(1));
+		popStack();
 	}
-	globalVars[key] = v;
+	else {
+		v = Load(getStack(1));
+	}
+	return true;
 }
 
+bool Machine::loadLocal(uint32_t slot)
+{
+	if (slot >= stack.size()) {
+		setErrorMessage(fmt::format("LOAD_LOCAL: slot {} out of range", slot));
+		return false;
+	}
+	stack.push_back(stack[slot]);
+	return true;
+}
 
-void Machine::defineLocal()
+bool Machine::storeLocal(uint32_t slot, bool pop)
 {
-	size_t s = stack.size();
-	if (s < 2) {
-		setErrorMessage("DEFINE_LOCAL: stack underflow");
-		return;
+	// The value must be above the local.
+	if (slot + 1 >= stack.size()) {
+		setErrorMessage(fmt::format("STORE_LOCAL: slot {} out of range", slot));
+		return false;
+	}
+	if (TypeOf(stack[slot]) != TypeOf(getStack(1))) {
+		setErrorMessage(fmt::format("STORE_LOCAL: type mismatch for slot {}", slot));
+		return false;
 	}
-	if (getStack(2).type != ValueType::tString) {
-		setErrorMessage("DEFINE_LOCAL: expected 'string' at stack -2");
-		return;
+	if (pop) {
+		stack[slot] = std::move(getStack(1));
+		popStack();
 	}
-	if (getStack(1).type == ValueType::tNone) {
-		setErrorMessage("DEFINE_LOCAL: expected value at stack -1");
-		return;
+	else {
+		stack[slot] = getStack(1);
 	}
+	return true;
+}
 
-	std::string key = std::move(*(getStack(2).vString));
-	Value v = getStack(1);
-	popStack(2);
+bool Machine::defaultValue(uint32_t index)
+{
+	ValueType type = UnpackValueType(index);
+	Value v = Value::Default(type, heap);
+	if (v.type == ValueType()) {
+		setErrorMessage(fmt::format("DEFAULT: no default value for '{}'", type.typeName()));
+		return false;
+	}
+	stack.push_back(Store(std::move(v)));
+	return true;
+}
 
-	const auto it = std::find_if(localVars.begin(), localVars.end(), [&](const LocalVar& lv) {
-		return lv.key == key; 
-		});
+bool Machine::condition(const char* ctx, bool& truthy)
+{
+	if (!verifyUnderflow(ctx, 1)) return false;
+	truthy = Truthy(getStack(1));
+	popStack();
+	return true;
+}
 
-	if (it != localVars.end()) {
-		// Note this means that a local variable can not shadow a higher local.
-		// It can shadow a global.
-		setErrorMessage(fmt::format("DEFINE_LOCAL: key '{}' already exists", key));
-		return;
+bool Machine::call(int nArgs)
+{
+	if (!verifyUnderflow("CALL", nArgs + 1)) return false;
+	const Value& func = Load(getStack(nArgs + 1));
+	if (func.type != ValueType(PType::tFunc)) {
+		setErrorMessage(fmt::format("CALL: expected 'func' at stack -{}", nArgs + 1));
+		return false;
 	}
+	if (!ffi) {
+		setErrorMessage("CALL: no FFI attached");
+		return false;
+	}
+	// Holds the name, rather than copying it, while the func is erased.
+	StrPtr funcName = StrPtr::Share(func.vStr);
+	stack.erase(stack.end() - nArgs - 1);
 
-	localVars.push_back({ scopeDepth, key, v });
+#if NANBOX_VALUES()
+	// The FFI takes a stack of Values: the args move to one of their own.
+	std::vector<Value> args;
+	args.reserve(nArgs);
+	for (size_t i = stack.size() - nArgs; i < stack.size(); i++)
+		args.push_back(Take(stack[i]));
+	popStack(nArgs);
+	FFI::RC rc = ffi->call(funcName.str(), args, nArgs);
+	if (rc == FFI::RC::kOkay)
+		stack.push_back(Store(args.back()));
+#else
+	FFI::RC rc = ffi->call(funcName.str(), stack, nArgs);
+#endif
+	switch (rc) {
+	case FFI::RC::kOkay:
+		return true;
+	case FFI::RC::kFuncNotFound:
+		setErrorMessage(fmt::format("CALL: func '{}' not found", funcName.str()));
+		break;
+	case FFI::RC::kIncorrectNumArgs:
+		setErrorMessage(fmt::format("Incorrect num args calling '{}'", funcName.str()));
+		break;
+	case FFI::RC::kIncorrectArgType:
+		setErrorMessage(fmt::format("Incorrect arg types calling '{}'", funcName.str()));
+		break;
+	case FFI::RC::kFailed:
+		setErrorMessage(ffi->lastError());
+		break;
+	case FFI::RC::kError:
+		setErrorMessage("internal error from FFI");
+		break;
+	}
+	return false;
 }
 
-void Machine::load()
+bool Machine::print()
 {
 	size_t s = stack.size();
 	if (s < 1) {
-		setErrorMessage("LOAD: stack underflow");
-		return;
-	}
-	if (getStack(1).type != ValueType::tString) {
-		setErrorMessage("LOAD: expected 'string' at stack -1");
-		return;
+		setErrorMessage("PRINT: stack underflow");
+		return false;
 	}
-	std::string key = std::move(*(getStack(1).vString));
+	fmt::print("{}\n", Load(getStack(1)).toString());
 	popStack();
+	return true;
+}
 
-	const auto localIt = std::find_if(localVars.begin(), localVars.end(), [&](const LocalVar& lv) {
-		return lv.key == key;
-		});
-	
-	if (localIt != localVars.end()) {
-		// Found in local scope.
-		stack.push_back(localIt->value);
-		return;
-	}
+bool Machine::newList(uint32_t index)
+{
+	PType elementType = PType::tNone;
+	uint32_t n = 0;
+	UnpackNewList(index, elementType, n);
+	if (!verifyUnderflow("NEW_LIST", (int)n)) return false;
 
-	const auto globalIt = globalVars.find(key);
-	if (globalIt != globalVars.end()) {
-		// Found in global scope.
-		stack.push_back(globalIt->second);
-		return;
+	std::string message;
+	std::vector<Value> scratch;
+	Value list = MakeList(heap, elementType, topValues((int)n, scratch), (int)n, message);
+	if (!message.empty()) {
+		setErrorMessage(message);
+		return false;
 	}
-
-	setErrorMessage(fmt::format("LOAD: key '{}' not found", key));
+	popStack((int)n);
+	stack.push_back(Store(std::move(list)));
+	return true;
 }
 
-void Machine::store()
+bool Machine::loadIndex()
 {
-	size_t s = stack.size();
-	if (s < 2) {
-		setErrorMessage("STORE: stack underflow");
-		return;
-	}
-	if (getStack(2).type != ValueType::tString) {
-		setErrorMessage("STORE: expected 'string' at stack -2");
-		return;
+	if (!verifyUnderflow("LOAD_INDEX", 2)) return false;
+	const Slot& list = getStack(2);
+	const Slot& index = getStack(1);
+
+	// The common case, without the Value for the element.
+	const NumList* nums = IsNum(index) ? AsNumList(list) : nullptr;
+	if (nums) {
+		size_t i = 0;
+		if (ListIndex(Num(index), nums->size(), i)) {
+			double d = nums->data()[i];
+			stack.pop_back();
+			getStack(1) = NumSlot(d);
+			return true;
+		}
 	}
-	if (getStack(1).type == ValueType::tNone) {
-		setErrorMessage("STORE: expected value at stack -1");
-		return;
+	std::string message;
+	Value element = ListGet(Load(list), Load(index), message);
+	if (!message.empty()) {
+		setErrorMessage(message);
+		return false;
 	}
-	std::string key = std::move(*(getStack(2).vString));
-	Value v = std::move(getStack(1));
 	popStack(2);
+	stack.push_back(Store(std::move(element)));
+	return true;
+}
 
-	const auto localIt = std::find_if(localVars.begin(), localVars.end(), [&](const LocalVar& lv) {
-		return lv.key == key;
-		});
+bool Machine::storeIndex()
+{
+	// Like STORE_LOCAL, the value stays on the stack.
+	if (!verifyUnderflow("STORE_INDEX", 3)) return false;
+	const Slot& list = getStack(3);
+	const Slot& index = getStack(2);
+	const Slot& value = getStack(1);
 
-	if (localIt != localVars.end()) {
-		// Found in local scope.
-		if (localIt->value.type != v.type) {
-			setErrorMessage(fmt::format("STORE: type mismatch for key '{}'", key));
-			return;
+	NumList* nums = IsNum(index) && IsNum(value) ? AsNumList(list) : nullptr;
+	if (nums) {
+		size_t i = 0;
+		if (ListIndex(Num(index), nums->size(), i)) {
+			nums->data()[i] = Num(value);
+			stack.erase(stack.end() - 3, stack.end() - 1);
+			return true;
 		}
-		localIt->value = v;
-		return;
 	}
+	std::string message;
+	if (!ListSet(Load(list), Load(index), Load(value), message)) {
+		setErrorMessage(message);
+		return false;
+	}
+	stack.erase(stack.end() - 3, stack.end() - 1);
+	return true;
+}
 
-	const auto globalIt = globalVars.find(key);
-	if (globalIt != globalVars.end()) {
-		// Found in global scope.
-		if (globalIt->second.type != v.type) {
-			setErrorMessage(fmt::format("STORE: type mismatch for key '{}'", key));
-			return;
-		}
-		globalIt->second = v;
-		return;
+bool Machine::listAppend()
+{
+	if (!verifyUnderflow("LIST_APPEND", 2)) return false;
+	std::string message;
+	if (!ListAppend(Load(getStack(2)), Load(getStack(1)), message)) {
+		setErrorMessage(message);
+		return false;
 	}
+	popStack(2);
+	stack.push_back(Slot());
+	return true;
+}
 
-	setErrorMessage(fmt::format("STORE: key '{}' not found", key));
+bool Machine::listPop()
+{
+	if (!verifyUnderflow("LIST_POP", 1)) return false;
+	std::string message;
+	Value element = ListPop(Load(getStack(1)), message);
+	if (!message.empty()) {
+		setErrorMessage(message);
+		return false;
+	}
+	getStack(1) = Store(std::move(element));
+	return true;
 }
 
-void Machine::pushScope()
+bool Machine::listSize()
 {
-	scopeDepth++;
+	if (!verifyUnderflow("LIST_SIZE", 1)) return false;
+	std::string message;
+	Value size = ListSize(Load(getStack(1)), message);
+	if (!message.empty()) {
+		setErrorMessage(message);
+		return false;
+	}
+	getStack(1) = Store(std::move(size));
+	return true;
 }
 
-void Machine::popScope()
+bool Machine::loadSlice(uint32_t index)
 {
-	scopeDepth--;
+	const int nBounds = ((index & kSliceBegin) ? 1 : 0) + ((index & kSliceEnd) ? 1 : 0);
+	if (!verifyUnderflow("LOAD_SLICE", 1 + nBounds)) return false;
+	std::vector<Value> scratch;
+	const Value* bound = topValues(nBounds, scratch);
+	const Value* begin = (index & kSliceBegin) ? bound++ : nullptr;
+	const Value* end = (index & kSliceEnd) ? bound : nullptr;
 
-	localVars.erase(std::remove_if(localVars.begin(), localVars.end(), [&](const LocalVar& var) {
-		return var.depth > scopeDepth;
-		}),
-		localVars.end());
+	std::string message;
+	Value view = ListSlice(heap, Load(getStack(1 + nBounds)), begin, end, message);
+	if (!message.empty()) {
+		setErrorMessage(message);
+		return false;
+	}
+	popStack(1 + nBounds);
+	stack.push_back(Store(std::move(view)));
+	return true;
 }
 
-void Machine::print()
+bool Machine::mapFunc(OpCode opCode)
 {
-	size_t s = stack.size();
-	if (s < 1) {
-		setErrorMessage("PRINT: stack underflow");
-		return;
+	const int nArgs = opCode == OpCode::MAP_KEYS ? 1 : 2;
+	if (!verifyUnderflow(gOpCodeNames[(int)opCode], nArgs)) return false;
+	std::string message;
+	Value result;
+	switch (opCode) {
+	case OpCode::MAP_HAS: result = MapHas(Load(getStack(2)), Load(getStack(1)), message); break;
+	case OpCode::MAP_REMOVE: result = MapRemove(Load(getStack(2)), Load(getStack(1)), message); break;
+	case OpCode::MAP_KEYS: result = MapKeys(heap, Load(getStack(1)), message); break;
+	default: REQUIRE(false);
 	}
-	fmt::print("{}\n", getStack(1).toString());
-	popStack();
+	if (!message.empty()) {
+		setErrorMessage(message);
+		return false;
+	}
+	popStack(nArgs);
+	stack.push_back(Store(std::move(result)));
+	return true;
 }
 
 void Machine::execute(const std::vector<Instruction>& instructions, const ConstPool& pool)
 {
-	execute(instructions.data(), static_cast<int>(instructions.size()), pool);
+	execute(instructions.data(), instructions.size(), pool);
+}
+
+bool Machine::verify(const Instruction* instructions, size_t n, const ConstPool& pool)
+{
+	// Checks everything that run() doesn't, so the dispatch loop can
+	// decode without range checks.
+	uint32_t high = 0;	// from a WIDE prefix
+	std::vector<uint32_t> indices(n);
+	bool typed = false;
+	for (size_t i = 0; i < n; i++) {
+		uint32_t op = instructions[i] & 0xffff;
+		uint32_t index = (instructions[i] >> 16) | (high << 16);
+		indices[i] = index;
+		high = 0;
+		if (op >= static_cast<uint32_t>(OpCode::count)) {
+			setErrorMessage(fmt::format("Unknown opcode: {} at {}", op, i));
+			errorAt = i;
+			return false;
+		}
+		if (op == static_cast<uint32_t>(OpCode::WIDE)) {
+			if (i + 1 == n || (instructions[i + 1] & 0xffff) == op) {
+				setErrorMessage(fmt::format("WIDE: no instruction to extend at {}", i));
+				errorAt = i;
+				return false;
+			}
+			high = index;
+			continue;
+		}
+
+		bool ok = true;
+		switch (static_cast<OpCode>(op)) {
+		case OpCode::PUSH:
+		case OpCode::ADD_CONST:
+			ok = index < pool.values.size();
+			break;
+		case OpCode::DEFINE_GLOBAL:
+		case OpCode::LOAD_GLOBAL:
+		case OpCode::STORE_GLOBAL:
+		case OpCode::SET_GLOBAL:
+			ok = index < globals.size();
+			break;
+		case OpCode::JUMP:
+		case OpCode::JUMP_IF_FALSE:
+		case OpCode::JUMP_IF_TRUE:
+		case OpCode::JUMP_IF_NOT_LESS:
+		case OpCode::JUMP_IF_NOT_LESS_EQUAL:
+		case OpCode::JUMP_IF_NOT_GREATER:
+		case OpCode::JUMP_IF_NOT_GREATER_EQUAL:
+			ok = i + 1 + index <= n;
+			break;
+		case OpCode::LOOP:
+			ok = index <= i + 1;
+			break;
+		case OpCode::NEW_LIST:
+			ok = (index & 0xff) <= static_cast<uint32_t>(PType::tFunc);
+			break;
+		case OpCode::LOAD_SLICE:
+			ok = index <= (kSliceBegin | kSliceEnd);
+			break;
+		default:
+			typed = typed || (op >= static_cast<uint32_t>(OpCode::ADD_NUM) && op <= static_cast<uint32_t>(OpCode::CONCAT_STR));
+			break;
+		}
+		if (!ok) {
+			setErrorMessage(fmt::format("{}: index {} out of range at {}", gOpCodeNames[op], index, i));
+			errorAt = i;
+			return false;
+		}
+	}
+	return !typed || verifyTypedOps(instructions, n, pool, indices);
+}
+
+namespace {
+
+// A value on the stack (or in a global) as verifyTypedOps() sees it: its
+// type, if every path agrees on it, and for a func, which one if known.
+struct AbstractValue {
+	bool known = false;
+	ValueType type;
+	const StrObj* func = nullptr;
+
+	static AbstractValue Of(ValueType type) {
+		AbstractValue v;
+		v.known = true;
+		v.type = type;
+		return v;
+	}
+	static AbstractValue Of(const Value& value) {
+		AbstractValue v = Of(value.type);
+		if (value.type == ValueType(PType::tFunc))
+			v.func = value.vStr;
+		return v;
+	}
+	static AbstractValue Any() { return AbstractValue(); }
+
+	bool is(PType pType) const { return known && type == ValueType(pType); }
+	bool isNumList() const { return known && type == ValueType(PType::tNum, Layout::tList); }
+	bool isScalar() const { return known && type.layout == Layout::tScalar; }
+
+	// Widens to cover 'other'. Returns true if it changed.
+	bool join(const AbstractValue& other) {
+		if (!known) return false;
+		if (!other.known || other.type != type) {
+			*this = Any();
+			return true;
+		}
+		if (func && (!other.func || !StrObj::Equal(func, other.func))) {
+			func = nullptr;
+			return true;
+		}
+		return false;
+	}
+};
+
+using AbstractStack = std::vector<AbstractValue>;
+
+// What ADD, SUB, MUL and DIV (or an ADD_CONST or ADD_LOCALS) leave.
+AbstractValue Arithmetic(OpCode op, const AbstractValue& lhs, const AbstractValue& rhs)
+{
+	// A num[] operand makes it element-wise (vecops.h).
+	if (lhs.isNumList() || rhs.isNumList())
+		return AbstractValue::Of(ValueType(PType::tNum, Layout::tList));
+	if (lhs.is(PType::tNum) && rhs.is(PType::tNum))
+		return AbstractValue::Of(ValueType(PType::tNum));
+	if (op == OpCode::ADD && lhs.is(PType::tStr) && rhs.is(PType::tStr))
+		return AbstractValue::Of(ValueType(PType::tStr));
+	return AbstractValue::Any();	// an error, or who knows
+}
+
+// An element of a list, or a value of a map.
+AbstractValue Element(const AbstractValue& container)
+{
+	if (container.known && container.type.layout != Layout::tScalar)
+		return AbstractValue::Of(ValueType(container.type.pType));
+	return AbstractValue::Any();
+}
+
+} // namespace
+
+bool Machine::verifyTypedOps(const Instruction* instructions, size_t n, const ConstPool& pool, const std::vector<uint32_t>& indices)
+{
+	// A global keeps its type once defined (a store must match it) so one
+	// value for each will do: its value now, or what this code defines it
+	// as. An undefined global can't be loaded: the path ends there, with a
+	// run time error. The exception is a builtin that this code replaces
+	// (see setBuiltin()): each path follows whether it has been, yet.
+	std::vector<AbstractValue> globalValues(globals.size());
+	std::vector<bool> defined(globals.size(), false);
+	for (size_t slot = 0; slot < globals.size(); slot++) {
+		if (globals[slot].type != ValueType()) {
+			globalValues[slot] = AbstractValue::Of(globals[slot]);
+			defined[slot] = true;
+		}
+	}
+	std::vector<int> replaced(globals.size(), -1);	// the builtin's place in State::replaced
+	std::vector<AbstractValue> replacements;
+	std::vector<bool> replacementDefined;
+	for (size_t i = 0; i < n; i++) {
+		const uint32_t slot = indices[i];
+		if (static_cast<OpCode>(instructions[i] & 0xffff) == OpCode::DEFINE_GLOBAL
+			&& slot < builtins.size() && builtins[slot] && replaced[slot] < 0)
+		{
+			replaced[slot] = static_cast<int>(replacements.size());
+			replacements.push_back(AbstractValue());
+			replacementDefined.push_back(false);
+		}
+	}
+	// Whether a builtin may still be there, or may have been replaced.
+	constexpr uint8_t kBuiltin = 1, kReplaced = 2;
+	struct State {
+		AbstractStack stack;
+		std::vector<uint8_t> replaced;
+	};
+
+	bool globalsChanged = false;
+	auto widen = [&](AbstractValue& into, bool& isDefined, const AbstractValue& v) {
+		if (!isDefined) {
+			into = v;
+			isDefined = true;
+			globalsChanged = true;
+		}
+		else if (into.join(v)) {
+			globalsChanged = true;
+		}
+	};
+
+	// Until the globals stop changing: a store can widen a global that
+	// an earlier instruction loaded. Each can only widen twice.
+	do {
+		globalsChanged = false;
+		std::vector<State> states(n);
+		std::vector<bool> reached(n, false);
+		std::vector<size_t> work;
+
+		// Joins the state into a successor's. The stack depth must agree.
+		auto flowTo = [&](size_t next, const State& s) {
+			if (next >= n) return true;
+			if (!reached[next]) {
+				states[next] = s;
+				reached[next] = true;
+				work.push_back(next);
+				return true;
+			}
+			State& into = states[next];
+			if (into.stack.size() != s.stack.size()) {
+				setErrorMessage(fmt::format("{}: the stack depth differs on the paths to {}", gOpCodeNames[instructions[next] & 0xffff], next));
+				errorAt = next;
+				return false;
+			}
+			bool changed = false;
+			for (size_t i = 0; i < s.stack.size(); i++)
+				changed = into.stack[i].join(s.stack[i]) || changed;
+			for (size_t i = 0; i < s.replaced.size(); i++) {
+				changed = changed || (into.replaced[i] | s.replaced[i]) != into.replaced[i];
+				into.replaced[i] |= s.replaced[i];
+			}
+			if (changed)
+				work.push_back(next);
+			return true;
+		};
+
+		State entry;
+		for (const Slot& v : stack)
+			entry.stack.push_back(AbstractValue::Of(Load(v)));
+		entry.replaced.assign(replacements.size(), kBuiltin);
+		if (n > 0 && !flowTo(0, entry))
+			return false;
+
+		while (!work.empty()) {
+			const size_t i = work.back();
+			work.pop_back();
+			State state = states[i];
+			AbstractStack& s = state.stack;
+			const OpCode op = static_cast<OpCode>(instructions[i] & 0xffff);
+			const uint32_t index = indices[i];
+			const char* name = gOpCodeNames[(int)op];
+			size_t branch = n;	// a second successor, for the jumps
+
+			auto top = [&](size_t k) -> AbstractValue& { return s[s.size() - k]; };
+			auto pop = [&](size_t k) { s.resize(s.size() - k); };
+			// A typed op's operands.
+			auto expect = [&](PType pType, size_t k) {
+				for (size_t j = 1; j <= k; j++) {
+					if (s.size() < j || !top(j).is(pType)) {
+						setErrorMessage(fmt::format("{}: can't prove '{}' at stack -{}, at {}", name, ValueType(pType).typeName(), j, i));
+						errorAt = i;
+						return false;
+					}
+				}
+				return true;
+			};
+			// A global, as this path sees it. False if it isn't defined.
+			auto loadGlobal = [&](uint32_t slot, AbstractValue& v) {
+				const int r = replaced[slot];
+				const uint8_t where = r < 0 ? kBuiltin : state.replaced[r];
+				bool found = false;
+				if ((where & kBuiltin) && defined[slot]) {
+					v = globalValues[slot];
+					found = true;
+				}
+				if ((where & kReplaced) && replacementDefined[r]) {
+					if (found)
+						v.join(replacements[r]);
+					else
+						v = replacements[r];
+					found = true;
+				}
+				return found;
+			};
+			auto storeGlobal = [&](uint32_t slot, const AbstractValue& v) {
+				const int r = replaced[slot];
+				const uint8_t where = r < 0 ? kBuiltin : state.replaced[r];
+				if (where & kBuiltin) {
+					bool isDefined = defined[slot];
+					widen(globalValues[slot], isDefined, v);
+					defined[slot] = isDefined;
+				}
+				if (where & kReplaced) {
+					bool isDefined = replacementDefined[r];
+					widen(replacements[r], isDefined, v);
+					replacementDefined[r] = isDefined;
+				}
+			};
+			// A store: the value must have the variable's type.
+			auto assign = [&](AbstractValue& var, const AbstractValue& v) {
+				if (var.known && v.known && var.type != v.type)
+					return false;
+				if (!v.known) {
+					var.func = nullptr;		// the same type, but which func?
+				}
+				else {
+					var = v;
+				}
+				return true;
+			};
+
+			// Untyped ops check their operands at run time: one that can't
+			// succeed ends the path.
+			bool live = true;
+			switch (op) {
+			case OpCode::NO_OP:
+			case OpCode::WIDE:
+				break;
+			case OpCode::PUSH:
+				s.push_back(AbstractValue::Of(pool.values[index]));
+				break;
+			case OpCode::POP:
+			case OpCode::PRINT:
+			case OpCode::RESULT:
+				live = s.size() >= 1;
+				if (live) pop(1);
+				break;
+
+			case OpCode::ADD:
+			case OpCode::SUB:
+			case OpCode::MUL:
+			case OpCode::DIV:
+				live = s.size() >= 2;
+				if (live) {
+					AbstractValue r = Arithmetic(op, top(2), top(1));
+					pop(2);
+					s.push_back(r);
+				}
+				break;
+			case OpCode::NEGATE:
+				live = s.size() >= 1;
+				if (live) top(1) = AbstractValue::Of(ValueType(PType::tNum));
+				break;
+			case OpCode::NOT:
+				live = s.size() >= 1;
+				if (live) top(1) = AbstractValue::Of(ValueType(PType::tBool));
+				break;
+			case OpCode::EQUAL:
+			case OpCode::NOT_EQUAL:
+			case OpCode::LESS:
+			case OpCode::LESS_EQUAL:
+			case OpCode::GREATER:
+			case OpCode::GREATER_EQUAL:
+			{
+				live = s.size() >= 2;
+				if (!live) break;
+				// Scalars compare to a bool; a num[] to a bool[].
+				AbstractValue r;
+				if (top(2).isNumList() || top(1).isNumList())
+					r = AbstractValue::Of(ValueType(PType::tBool, Layout::tList));
+				else if (top(2).isScalar() && top(1).isScalar())
+					r = AbstractValue::Of(ValueType(PType::tBool));
+				pop(2);
+				s.push_back(r);
+				break;
+			}
+
+			case OpCode::DEFINE_GLOBAL:
+			{
+				// Defining a global that is already defined is an error.
+				const int r = replaced[index];
+				live = s.size() >= 1 && (r < 0 ? globals[index].type == ValueType() : (state.replaced[r] & kBuiltin) != 0);
+				if (!live) break;
+				if (r >= 0)
+					state.replaced[r] = kReplaced;
+				storeGlobal(index, top(1));
+				pop(1);
+				break;
+			}
+			case OpCode::LOAD_GLOBAL:
+			{
+				AbstractValue v;
+				live = loadGlobal(index, v);
+				if (live) s.push_back(v);
+				break;
+			}
+			case OpCode::STORE_GLOBAL:
+			case OpCode::SET_GLOBAL:
+			{
+				AbstractValue v;
+				live = s.size() >= 1 && loadGlobal(index, v) && assign(v, top(1));
+				if (!live) break;
+				storeGlobal(index, v);
+				if (op == OpCode::SET_GLOBAL) pop(1);
+				break;
+			}
+			case OpCode::LOAD_LOCAL:
+				live = index < s.size();
+				if (live) s.push_back(s[index]);
+				break;
+			case OpCode::STORE_LOCAL:
+			case OpCode::SET_LOCAL:
+				live = size_t(index) + 1 < s.size() && assign(s[index], top(1));
+				if (live && op == OpCode::SET_LOCAL) pop(1);
+				break;
+			case OpCode::POP_SCOPE:
+				live = index <= s.size();
+				if (live) pop(index);
+				break;
+			case OpCode::DEFAULT:
+				s.push_back(AbstractValue::Of(UnpackValueType(index)));
+				break;
+
+			case OpCode::JUMP:
+				live = false;
+				if (!flowTo(i + 1 + index, state)) return false;
+				break;
+			case OpCode::JUMP_IF_FALSE:
+			case OpCode::JUMP_IF_TRUE:
+				live = s.size() >= 1;
+				if (live) pop(1);
+				branch = i + 1 + index;
+				break;
+			case OpCode::LOOP:
+				live = false;
+				if (!flowTo(i + 1 - index, state)) return false;
+				break;
+			case OpCode::JUMP_IF_NOT_LESS:
+			case OpCode::JUMP_IF_NOT_LESS_EQUAL:
+			case OpCode::JUMP_IF_NOT_GREATER:
+			case OpCode::JUMP_IF_NOT_GREATER_EQUAL:
+				live = s.size() >= 2;
+				if (live) pop(2);
+				branch = i + 1 + index;
+				break;
+
+			case OpCode::CALL:
+			{
+				live = s.size() >= size_t(index) + 1;
+				if (!live) break;
+				// FFI::call() checks that a func returns its declared type.
+				const AbstractValue& callee = top(index + 1);
+				AbstractValue r;
+				if (callee.func && ffi && ffi->returnType(callee.func->str()) != ValueType())
+					r = AbstractValue::Of(ffi->returnType(callee.func->str()));
+				pop(index + 1);
+				s.push_back(r);
+				break;
+			}
+
+			case OpCode::ADD_CONST:
+				live = s.size() >= 1;
+				if (live) top(1) = Arithmetic(OpCode::ADD, top(1), AbstractValue::Of(pool.values[index]));
+				break;
+			case OpCode::ADD_LOCALS:
+			{
+				const uint32_t a = index & 0xff;
+				const uint32_t b = index >> 8;
+				live = a < s.size() && b < s.size();
+				if (live) s.push_back(Arithmetic(OpCode::ADD, s[a], s[b]));
+				break;
+			}
+
+			case OpCode::ADD_NUM:
+			case OpCode::SUB_NUM:
+			case OpCode::MUL_NUM:
+			case OpCode::DIV_NUM:
+				if (!expect(PType::tNum, 2)) return false;
+				pop(1);
+				top(1) = AbstractValue::Of(ValueType(PType::tNum));
+				break;
+			case OpCode::NEGATE_NUM:
+				if (!expect(PType::tNum, 1)) return false;
+				break;
+			case OpCode::LESS_NUM:
+			case OpCode::LESS_EQUAL_NUM:
+			case OpCode::GREATER_NUM:
+			case OpCode::GREATER_EQUAL_NUM:
+			case OpCode::EQ_NUM:
+			case OpCode::NOT_EQ_NUM:
+				if (!expect(PType::tNum, 2)) return false;
+				pop(1);
+				top(1) = AbstractValue::Of(ValueType(PType::tBool));
+				break;
+			case OpCode::EQ_BOOL:
+			case OpCode::NOT_EQ_BOOL:
+				if (!expect(PType::tBool, 2)) return false;
+				pop(1);
+				break;
+			case OpCode::CONCAT_STR:
+				if (!expect(PType::tStr, 2)) return false;
+				pop(1);
+				top(1) = AbstractValue::Of(ValueType(PType::tStr));
+				break;
+
+			case OpCode::NEW_LIST:
+			{
+				PType elementType = PType::tNone;
+				uint32_t count = 0;
+				UnpackNewList(index, elementType, count);
+				live = count <= s.size();
+				if (!live) break;
+				// Untyped, it is a list of the first element's type.
+				if (elementType == PType::tNone && count > 0 && top(count).isScalar())
+					elementType = top(count).type.pType;
+				pop(count);
+				s.push_back(elementType == PType::tNone ? AbstractValue::Any() : AbstractValue::Of(ValueType(elementType, Layout::tList)));
+				break;
+			}
+			case OpCode::LOAD_INDEX:
+			{
+				live = s.size() >= 2;
+				if (!live) break;
+				AbstractValue r = Element(top(2));
+				pop(2);
+				s.push_back(r);
+				break;
+			}
+			case OpCode::STORE_INDEX:
+			{
+				live = s.size() >= 3;
+				if (!live) break;
+				AbstractValue v = top(1);
+				pop(3);
+				s.push_back(v);
+				break;
+			}
+			case OpCode::LIST_APPEND:
+				live = s.size() >= 2;
+				if (!live) break;
+				pop(2);
+				s.push_back(AbstractValue::Of(ValueType()));
+				break;
+			case OpCode::LIST_POP:
+				live = s.size() >= 1;
+				if (live) top(1) = Element(top(1));
+				break;
+			case OpCode::LIST_SIZE:
+				live = s.size() >= 1;
+				if (live) top(1) = AbstractValue::Of(ValueType(PType::tNum));
+				break;
+			case OpCode::LOAD_SLICE:
+			{
+				const size_t nBounds = ((index & kSliceBegin) ? 1 : 0) + ((index & kSliceEnd) ? 1 : 0);
+				live = s.size() >= 1 + nBounds;
+				if (!live) break;
+				// A view has the type of its list.
+				AbstractValue list = top(1 + nBounds);
+				pop(1 + nBounds);
+				s.push_back(list.known && list.type.layout == Layout::tList ? list : AbstractValue::Any());
+				break;
+			}
+			case OpCode::MAP_HAS:
+			case OpCode::MAP_REMOVE:
+				live = s.size() >= 2;
+				if (!live) break;
+				pop(2);
+				s.push_back(AbstractValue::Of(ValueType(PType::tBool)));
+				break;
+			case OpCode::MAP_KEYS:
+				live = s.size() >= 1;
+				if (live) top(1) = AbstractValue::Of(ValueType(PType::tStr, Layout::tList));
+				break;
+
+			case OpCode::count:
+				REQUIRE(false);
+				break;
+			}
+
+			if (live && !flowTo(i + 1, state)) return false;
+			if (live && branch < n && !flowTo(branch, state)) return false;
+		}
+	} while (globalsChanged);
+	return true;
 }
 
 void Machine::execute(const Instruction* instructions, size_t n, const ConstPool& pool)
 {
-	for(int i=0; i<n; i++)
-	{
-		if (hasError()) break;
+	if (hasError()) return;
 
-		OpCode opCode = OpCode::NO_OP;
-		uint32_t index = 0;
-		UnpackOpCode(instructions[i], opCode, index);
+	// The compiler may have added globals since the last execute()
+	if (globals.size() < globalTable.size())
+		globals.resize(globalTable.size());
+
+	if (!verify(instructions, n, pool)) return;
+
+	// The heap's limit: see Heap.
+	try {
+#if COMPUTED_GOTO()
+		if (dispatch == Dispatch::kThreaded) {
+			run<true>(instructions, n, pool);
+			return;
+		}
+#endif
+		run<false>(instructions, n, pool);
+	}
+	catch (const OutOfMemory& e) {
+		setErrorMessage(e.what());
+	}
+}
+
+#if COMPUTED_GOTO()
+// Labels as values are a GCC / Clang extension.
+#	pragma GCC diagnostic push
+#	pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+template<bool THREADED>
+void Machine::run(const Instruction* instructions, size_t n, const ConstPool& pool)
+{
+#if COMPUTED_GOTO()
+	// Must be in OpCode order.
+	static void* const kLabels[static_cast<int>(OpCode::count)] = {
+		&&L_NO_OP, &&L_PUSH, &&L_POP,
+		&&L_ADD, &&L_SUB, &&L_MUL, &&L_DIV,
+		&&L_NEGATE, &&L_NOT,
+		&&L_EQUAL, &&L_NOT_EQUAL, &&L_LESS, &&L_LESS_EQUAL, &&L_GREATER, &&L_GREATER_EQUAL,
+		&&L_DEFINE_GLOBAL, &&L_LOAD_GLOBAL, &&L_STORE_GLOBAL, &&L_LOAD_LOCAL, &&L_STORE_LOCAL,
+		&&L_POP_SCOPE, &&L_DEFAULT,
+		&&L_JUMP, &&L_JUMP_IF_FALSE, &&L_JUMP_IF_TRUE, &&L_LOOP,
+		&&L_CALL, &&L_PRINT, &&L_RESULT,
+		&&L_ADD_CONST, &&L_ADD_LOCALS, &&L_SET_LOCAL, &&L_SET_GLOBAL,
+		&&L_JUMP_IF_NOT_LESS, &&L_JUMP_IF_NOT_LESS_EQUAL, &&L_JUMP_IF_NOT_GREATER, &&L_JUMP_IF_NOT_GREATER_EQUAL,
+		&&L_WIDE,
+		&&L_ADD_NUM, &&L_SUB_NUM, &&L_MUL_NUM, &&L_DIV_NUM, &&L_NEGATE_NUM,
+		&&L_LESS_NUM, &&L_LESS_EQUAL_NUM, &&L_GREATER_NUM, &&L_GREATER_EQUAL_NUM,
+		&&L_EQ_NUM, &&L_NOT_EQ_NUM, &&L_EQ_BOOL, &&L_NOT_EQ_BOOL,
+		&&L_CONCAT_STR,
+		&&L_NEW_LIST, &&L_LOAD_INDEX, &&L_STORE_INDEX, &&L_LIST_APPEND, &&L_LIST_POP, &&L_LIST_SIZE,
+		&&L_LOAD_SLICE,
+		&&L_MAP_HAS, &&L_MAP_REMOVE, &&L_MAP_KEYS,
+	};
+	(void)kLabels;
+#endif
+
+	const Instruction* ip = instructions;
+	const Instruction* const end = instructions + n;
+	uint64_t count = 0;
+	OpCode opCode = OpCode::NO_OP;
+	uint32_t index = 0;
+
+	// verify() has checked the op codes, so the decode is unchecked.
+#define FETCH()											\
+	if (ip == end) goto done;							\
+	opCode = static_cast<OpCode>(*ip & 0xffff);			\
+	index = *ip >> 16;									\
+	++ip;												\
+	++count;
 
+	// Threaded: each op jumps straight to the next op's code, which gives
+	// the branch predictor one indirect branch per op (rather than the
+	// single shared one at the top of the switch.)
+#if COMPUTED_GOTO()
+#	define NEXT()										\
+	if constexpr (THREADED) {							\
+		FETCH();										\
+		goto *kLabels[static_cast<int>(opCode)];		\
+	}													\
+	else {												\
+		continue;										\
+	}
+#	define OP(name) L_##name: case OpCode::name:
+#else
+#	define NEXT() continue
+#	define OP(name) case OpCode::name:
+#endif
+	// Ops that can fail set the error message and return false.
+#define CHECK(x) if (!(x)) goto done
+
+	for (;;) {
+		FETCH();
+	dispatch:
 		switch (opCode)
 		{
-		case OpCode::PUSH:
-			stack.push_back(pool.get(index));
-			break;
-		case OpCode::POP:
+		OP(NO_OP)
+			NEXT();
+		OP(PUSH)
+			stack.push_back(Store(pool.values[index]));
+			NEXT();
+		OP(POP)
+			CHECK(verifyUnderflow("POP", 1));
 			popStack();
-			break;
-		case OpCode::ADD:
-		case OpCode::SUB:
-		case OpCode::MUL:
-		case OpCode::DIV:
+			NEXT();
+
+		OP(ADD)
+		OP(SUB)
+		OP(MUL)
+		OP(DIV)
+			CHECK(binaryOp(opCode));
+			NEXT();
+
+		OP(NEGATE)
+			CHECK(negative());
+			NEXT();
+		OP(NOT)
+			CHECK(notOp());
+			NEXT();
+
+		OP(EQUAL)
+		OP(NOT_EQUAL)
+			CHECK(equal(opCode));
+			NEXT();
+
+		OP(LESS)
+		OP(LESS_EQUAL)
+		OP(GREATER)
+		OP(GREATER_EQUAL)
+			CHECK(compare(opCode));
+			NEXT();
+
+		OP(DEFINE_GLOBAL)
+			CHECK(defineGlobal(index));
+			NEXT();
+		OP(LOAD_GLOBAL)
+			CHECK(loadGlobal(index));
+			NEXT();
+		OP(STORE_GLOBAL)
+			CHECK(storeGlobal(index));
+			NEXT();
+		OP(LOAD_LOCAL)
+			CHECK(loadLocal(index));
+			NEXT();
+		OP(STORE_LOCAL)
+			CHECK(storeLocal(index));
+			NEXT();
+		OP(POP_SCOPE)
+			CHECK(verifyUnderflow("POP_SCOPE", (int)index));
+			popStack((int)index);
+			NEXT();
+		OP(DEFAULT)
+			CHECK(defaultValue(index));
+			NEXT();
+
+		// verify() has checked the jump targets.
+		OP(JUMP)
+			ip += index;
+			NEXT();
+		OP(JUMP_IF_FALSE)
 		{
-			binaryOp(opCode);
-			break;
+			bool truthy = false;
+			CHECK(condition("JUMP_IF_FALSE", truthy));
+			if (!truthy) ip += index;
+			NEXT();
 		}
+		OP(JUMP_IF_TRUE)
+		{
+			bool truthy = false;
+			CHECK(condition("JUMP_IF_TRUE", truthy));
+			if (truthy) ip += index;
+			NEXT();
+		}
+		OP(LOOP)
+			ip -= index;
+			NEXT();
 
-		case OpCode::NOT: notOp(); break;
-		case OpCode::NEGATE: negative(); break;
-		case OpCode::DEFINE_GLOBAL: defineGlobal(); break;
-		case OpCode::DEFINE_LOCAL: defineLocal(); break;
-		case OpCode::LOAD: load(); break;
-		case OpCode::STORE: store(); break;
+		OP(CALL)
+			CHECK(call((int)index));
+			NEXT();
+		OP(PRINT)
+			CHECK(print());
+			NEXT();
+		OP(RESULT)
+			CHECK(verifyUnderflow("RESULT", 1));
+			result = Take(getStack(1));
+			popStack();
+			NEXT();
 
-		case OpCode::PUSH_SCOPE: pushScope(); break;
-		case OpCode::POP_SCOPE: popScope(); break;
+		// Super instructions from the peephole optimizer (bcopt.h). Each has
+		// a fast path for numbers, and otherwise falls back to the ops it replaced.
+		OP(ADD_CONST)
+		{
+			const Value& k = pool.values[index];
+			if (!stack.empty() && IsNum(getStack(1)) && k.type == ValueType(PType::tNum)) {
+				SetNum(getStack(1), Num(getStack(1)) + k.vNumber);
+			}
+			else {
+				stack.push_back(Store(k));
+				CHECK(binaryOp(OpCode::ADD));
+			}
+			NEXT();
+		}
+		OP(ADD_LOCALS)
+		{
+			uint32_t a = index & 0xff;
+			uint32_t b = index >> 8;
+			if (a < stack.size() && b < stack.size()
+				&& IsNum(stack[a]) && IsNum(stack[b]))
+			{
+				stack.push_back(NumSlot(Num(stack[a]) + Num(stack[b])));
+			}
+			else {
+				CHECK(loadLocal(a));
+				CHECK(loadLocal(b));
+				CHECK(binaryOp(OpCode::ADD));
+			}
+			NEXT();
+		}
+		OP(SET_LOCAL)
+			CHECK(storeLocal(index, true));
+			NEXT();
+		OP(SET_GLOBAL)
+			CHECK(storeGlobal(index, true));
+			NEXT();
+
+		OP(JUMP_IF_NOT_LESS)
+		OP(JUMP_IF_NOT_LESS_EQUAL)
+		OP(JUMP_IF_NOT_GREATER)
+		OP(JUMP_IF_NOT_GREATER_EQUAL)
+		{
+			static_assert((int)OpCode::JUMP_IF_NOT_GREATER_EQUAL - (int)OpCode::JUMP_IF_NOT_LESS == (int)OpCode::GREATER_EQUAL - (int)OpCode::LESS,
+				"compare branches must be in the same order as the compares");
+			if (stack.size() >= 2 && IsNum(getStack(1)) && IsNum(getStack(2))) {
+				double rhs = Num(getStack(1));
+				double lhs = Num(getStack(2));
+				bool r = false;
+				switch (opCode) {
+				case OpCode::JUMP_IF_NOT_LESS: r = lhs < rhs; break;
+				case OpCode::JUMP_IF_NOT_LESS_EQUAL: r = lhs <= rhs; break;
+				case OpCode::JUMP_IF_NOT_GREATER: r = lhs > rhs; break;
+				default: r = lhs >= rhs; break;
+				}
+				popStack(2);
+				if (!r) ip += index;
+				NEXT();
+			}
+			OpCode cmp = static_cast<OpCode>((int)OpCode::LESS + ((int)opCode - (int)OpCode::JUMP_IF_NOT_LESS));
+			CHECK(compare(cmp));
+			if (!Truthy(getStack(1))) ip += index;	// a bool, or a bool[]
+			popStack();
+			NEXT();
+		}
+
+		OP(WIDE)
+		{
+			// verify() has checked there is a (non WIDE) instruction to extend.
+			uint32_t high = index;
+			FETCH();
+			index |= high << 16;
+#if COMPUTED_GOTO()
+			if constexpr (THREADED) {
+				goto *kLabels[static_cast<int>(opCode)];
+			}
+#endif
+			goto dispatch;
+		}
+
+		// Typed: verifyTypedOps() has established the operand types (and
+		// the stack depth), so these are unchecked.
+#define NUM_OP(name, op)										\
+		OP(name)												\
+		{														\
+			Slot& lhs = getStack(2);							\
+			SetNum(lhs, Num(lhs) op Num(getStack(1)));			\
+			stack.pop_back();									\
+			NEXT();												\
+		}
+		NUM_OP(ADD_NUM, +)
+		NUM_OP(SUB_NUM, -)
+		NUM_OP(MUL_NUM, *)
+		NUM_OP(DIV_NUM, /)
+#undef NUM_OP
+		OP(NEGATE_NUM)
+			SetNum(getStack(1), -Num(getStack(1)));
+			NEXT();
+
+		// The lhs (a number or bool) is replaced by the bool result.
+#define CMP_OP(name, get, op)							\
+		OP(name)										\
+		{												\
+			Slot& lhs = getStack(2);					\
+			bool r = get(lhs) op get(getStack(1));		\
+			stack.pop_back();							\
+			SetBool(lhs, r);							\
+			NEXT();										\
+		}
+		CMP_OP(LESS_NUM, Num, <)
+		CMP_OP(LESS_EQUAL_NUM, Num, <=)
+		CMP_OP(GREATER_NUM, Num, >)
+		CMP_OP(GREATER_EQUAL_NUM, Num, >=)
+		CMP_OP(EQ_NUM, Num, ==)
+		CMP_OP(NOT_EQ_NUM, Num, !=)
+		CMP_OP(EQ_BOOL, Bool, ==)
+		CMP_OP(NOT_EQ_BOOL, Bool, !=)
+#undef CMP_OP
 
-		case OpCode::PRINT: print(); break;
+		OP(CONCAT_STR)
+			concat();
+			NEXT();
+
+		OP(NEW_LIST)
+			CHECK(newList(index));
+			NEXT();
+		OP(LOAD_INDEX)
+			CHECK(loadIndex());
+			NEXT();
+		OP(STORE_INDEX)
+			CHECK(storeIndex());
+			NEXT();
+		OP(LIST_APPEND)
+			CHECK(listAppend());
+			NEXT();
+		OP(LIST_POP)
+			CHECK(listPop());
+			NEXT();
+		OP(LIST_SIZE)
+			CHECK(listSize());
+			NEXT();
+		OP(LOAD_SLICE)
+			CHECK(loadSlice(index));
+			NEXT();
+		OP(MAP_HAS)
+			CHECK(mapFunc(OpCode::MAP_HAS));
+			NEXT();
+		OP(MAP_REMOVE)
+			CHECK(mapFunc(OpCode::MAP_REMOVE));
+			NEXT();
+		OP(MAP_KEYS)
+			CHECK(mapFunc(OpCode::MAP_KEYS));
+			NEXT();
 
 		default:
 			setErrorMessage(fmt::format("Unknown opcode: {}", (int)opCode));
-			break;
+			goto done;
 		}
 	}
+
+done:
+	instructionCount += count;
+	if (hasError())
+		errorAt = ip > instructions ? static_cast<size_t>(ip - instructions) - 1 : 0;
+
+#undef FETCH
+#undef NEXT
+#undef OP
+#undef CHECK
 }
 
+#if COMPUTED_GOTO()
+#	pragma GCC diagnostic pop
+#endif
+
 void Machine::dump(const std::vector<Instruction>& instructions, const ConstPool& pool)
 {
 	fmt::print("Bytecode:\n");
+	uint32_t high = 0;
 	for (size_t i = 0; i < instructions.size(); i++)
 	{
 		OpCode opCode = OpCode::NO_OP;
 		uint32_t index = 0;
 		UnpackOpCode(instructions[i], opCode, index);
+		index |= high << 16;
+		high = 0;
 
 		fmt::print("{: >4}: {: <16}", i, gOpCodeNames[(int)opCode]);
-		if (opCode == OpCode::PUSH || opCode == OpCode::DEFINE_GLOBAL || opCode == OpCode::DEFINE_LOCAL || opCode == OpCode::LOAD)
+		if (opCode == OpCode::WIDE)
+		{
+			high = index;
+			fmt::print("{: >4}\n", index);
+		}
+		else if (opCode == OpCode::PUSH || opCode == OpCode::ADD_CONST)
 		{
 			fmt::print("{: >4}: {}\n", index, pool.get(index).toString());
 		}
+		else if (opCode == OpCode::JUMP || opCode == OpCode::JUMP_IF_FALSE || opCode == OpCode::JUMP_IF_TRUE
+			|| (opCode >= OpCode::JUMP_IF_NOT_LESS && opCode <= OpCode::JUMP_IF_NOT_GREATER_EQUAL))
+		{
+			fmt::print("{: >4} -> {}\n", index, i + 1 + index);
+		}
+		else if (opCode == OpCode::LOOP)
+		{
+			fmt::print("{: >4} -> {}\n", index, i + 1 - index);
+		}
+		else if (opCode == OpCode::NEW_LIST)
+		{
+			PType elementType = PType::tNone;
+			uint32_t count = 0;
+			UnpackNewList(index, elementType, count);
+			fmt::print("{: >4} {}\n", count, ValueType(elementType).typeName());
+		}
+		else if (opCode == OpCode::ADD_LOCALS)
+		{
+			fmt::print("{: >4} {}\n", index & 0xff, index >> 8);
+		}
+		else if (opCode == OpCode::DEFINE_GLOBAL || opCode == OpCode::LOAD_GLOBAL || opCode == OpCode::STORE_GLOBAL || opCode == OpCode::SET_GLOBAL)
+		{
+			fmt::print("{: >4}: {}\n", index, index < globalTable.size() ? globalTable.names[index] : "?");
+		}
+		else if (opCode == OpCode::CALL || opCode == OpCode::LOAD_LOCAL || opCode == OpCode::STORE_LOCAL || opCode == OpCode::SET_LOCAL || opCode == OpCode::POP_SCOPE)
+		{
+			fmt::print("{: >4}\n", index);
+		}
 		else
 		{
 			fmt::print("\n");
 		}
 	}
 }
-#endif
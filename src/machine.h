@@ -1,29 +1,69 @@
 #pragma once
 
 #include "value.h"
+#include "boxedvalue.h"
 #include "error.h"
 #include "bytecode.h"
 
 #include <assert.h>
 #include <stdint.h>
+#include <map>
+#include <string>
+
+class FFI;
 
-#if 0
 // The virtual machine.
 // Given a stack of instructions, executes them.
 class Machine
 {
 public:
-	Machine();
+	Machine(Heap& heap, FFI* ffi = nullptr);
 	~Machine() = default;
 
 	void execute(const std::vector<Instruction>& instructions, const ConstPool& pool);
 	void execute(const Instruction* start, size_t n, const ConstPool& pool);
 
-	std::vector<Value> stack;
-	std::map<std::string, Value> globalVars;
+	// The stack holds Values, or with SCRIBE_NANBOX, BoxedValues; Store()
+	// and Load() convert. Take() moves the Value out, leaving none.
+#if NANBOX_VALUES()
+	using Slot = BoxedValue;
+	static BoxedValue Store(const Value& v) { return BoxedValue::From(v); }
+	static Value Load(const BoxedValue& v) { return v.toValue(); }
+	static Value Take(BoxedValue& v) { Value r = v.toValue(); v = BoxedValue(); return r; }
+#else
+	using Slot = Value;
+	static const Value& Store(const Value& v) { return v; }
+	static Value&& Store(Value&& v) { return std::move(v); }
+	static const Value& Load(const Value& v) { return v; }
+	static Value&& Take(Value& v) { return std::move(v); }
+#endif
+
+	// Locals live on the stack, in slot order.
+	std::vector<Slot> stack;
+	GlobalTable globalTable;
+	std::vector<Value> globals;		// indexed by the GlobalTable slot
+	Value result;	// set by the RESULT op code
+
+	// How execute() dispatches op codes. Threaded (computed goto) needs
+	// GCC or Clang; otherwise the Machine uses the switch.
+	enum class Dispatch {
+		kSwitch,
+		kThreaded
+	};
+	Dispatch dispatch = Dispatch::kThreaded;
+	static bool hasThreadedDispatch();
+
+	uint64_t instructionCount = 0;	// total executed, for benchmarking
+
+	// Defines (or replaces) a global from the host side.
+	void setGlobal(const std::string& name, const Value& value);
+	// Like setGlobal(), but DEFINE_GLOBAL may replace it, once.
+	void setBuiltin(const std::string& name, const Value& value);
 
 	bool hasError() const { return !error.empty(); }
 	const std::string& errorMessage() const { return error;}
+	size_t errorInstruction() const { return errorAt; }	// index of the instruction that failed
+	void clearError() { error.clear(); }
 
 	void dump(const std::vector<Instruction>& instructions, const ConstPool& pool);
 
@@ -31,46 +71,66 @@ public:
 
 private:
 	std::string error;
-	struct LocalVar {
-		int depth = 0;
-		std::string key;
-		Value value;
-	};
-	std::vector<LocalVar> localVars;
-	int scopeDepth = 0;
+	size_t errorAt = 0;
+	Heap& heap;
+	FFI* ffi;
+	std::vector<bool> builtins;		// by slot: set by setBuiltin(), not yet replaced
 
-	void setErrorMessage(const std::string& message) { 
-		error = message; 
+	void setErrorMessage(const std::string& message) {
+		error = message;
 	}
 
-	bool verifyUnderflow(const std::string& ctx, int n);
-	bool verifyTypes(const std::string& ctx, const std::vector<ValueType>& types);	// checks underflow as well
+	bool verifyUnderflow(const char* ctx, int n);
+	bool verifyTypes(const char* ctx, const std::vector<ValueType>& types);	// checks underflow as well
+
+	// Checks the op codes, and the ranges of the indices that run() does not.
+	bool verify(const Instruction* instructions, size_t n, const ConstPool& pool);
+	// Checks that the typed op codes (which run() doesn't check) always
+	// have operands of their types: follows the stack depth, and the types
+	// on it, along every path. 'indices' are the decoded indices.
+	bool verifyTypedOps(const Instruction* instructions, size_t n, const ConstPool& pool, const std::vector<uint32_t>& indices);
+	template<bool THREADED>
+	void run(const Instruction* instructions, size_t n, const ConstPool& pool);
 
 	void popStack(int n = 1);
+	// The top n values, as Values: with SCRIBE_NANBOX, loaded into 'scratch'.
+	const Value* topValues(int n, std::vector<Value>& scratch);
 
 	// Warning: unchecked!
-	Value& getStack(int i) { 
-		assert(i > 0 && i <= stack.size());
-		return stack[stack.size() - i]; 
+	Slot& getStack(int i) {
+		assert(i > 0 && i <= (int)stack.size());
+		return stack[stack.size() - i];
 	}
 
-	// Stack operations.
+	// Stack operations. Return false (and set the error message) on failure.
 	// FIXME: these should be public so the machine can be operated programmatically.
 	//        The trick is how to handle the ConstPool - it's currently passed in to execute(),
 	//        but individual ops need it.
-	void binaryOp(OpCode opCode);
-
-	void equal(OpCode op);			// any type
-	void compare(OpCode opCode);	// numbers only
-
-	void negative();
-	void notOp();
-	void defineGlobal();
-	void defineLocal();
-	void load();
-	void store();
-	void pushScope();
-	void popScope();
-	void print();
+	bool binaryOp(OpCode opCode);
+	bool numListOp(OpCode opCode);	// an operator with a num[] operand
+
+	bool equal(OpCode op);			// any type
+	bool compare(OpCode opCode);	// numbers only
+
+	void concat();
+	bool negative();
+	bool notOp();
+	bool defineGlobal(uint32_t slot);
+	bool loadGlobal(uint32_t slot);
+	bool storeGlobal(uint32_t slot, bool pop = false);	// pop: SET_GLOBAL, which moves the value
+	bool loadLocal(uint32_t slot);
+	bool storeLocal(uint32_t slot, bool pop = false);
+	bool defaultValue(uint32_t index);
+	bool condition(const char* ctx, bool& truthy);
+	bool call(int nArgs);
+	bool print();
+
+	bool newList(uint32_t index);
+	bool loadIndex();
+	bool storeIndex();
+	bool listAppend();
+	bool listPop();
+	bool listSize();
+	bool loadSlice(uint32_t index);
+	bool mapFunc(OpCode opCode);
 };
-#endif
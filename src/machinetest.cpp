@@ -1,23 +1,9 @@
 #include "machine.h"
-#include "fmt/core.h"
+#include "bcopt.h"
+#include "test.h"
 
 #include <assert.h>
 
-#if 0
-#define TEST(x)                                                 \
-	if (!(x)) {	                                                \
-		fmt::print("Test failure line {} in {}\n", __LINE__, __FILE__);\
-        assert(false);                                          \
-	}															\
-
-#define TEST_FP(x, y)                                           \
-	if (fabs(x - y) > 0.0001) {	                                \
-		fmt::print("Test failure line {} in {}\n", __LINE__, __FILE__);\
-        assert(false);                                          \
-	}                                                           \
-
-#define RUN_TEST(test) fmt::print("Test: {}\n", #test); test
-
 // 1 + 2 = 3
 void OnePlusTwoIsThree()
 {
@@ -25,7 +11,8 @@ void OnePlusTwoIsThree()
 	const uint32_t one = pool.add(Value::Number(1.0));
 	const uint32_t two = pool.add(Value::Number(2.0));
 
-	Machine machine;
+	Heap heap;
+	Machine machine(heap);
 	std::vector<Instruction> instructions = {
 		PackOpCode(OpCode::PUSH, one),		// lhs
 		PackOpCode(OpCode::PUSH, two),		// rhs
@@ -35,15 +22,16 @@ void OnePlusTwoIsThree()
 
 	TEST(machine.hasError() == false);
 	TEST(machine.stack.size() == 1);
-	TEST(machine.stack[0].type == ValueType::tNumber);
-	TEST_FP(machine.stack[0].vNumber, 3.0);
+	TEST(Machine::Load(machine.stack[0]).type == ValueType(PType::tNum));
+	TEST_FP(Machine::Load(machine.stack[0]).vNumber, 3.0);
 }
 
 // 1 - 2 = -1
 void OneMinusTwoIsNegativeOne()
 {
 	ConstPool pool;
-	Machine machine;
+	Heap heap;
+	Machine machine(heap);
 
 	const uint32_t one = pool.add(Value::Number(1.0));
 	const uint32_t two = pool.add(Value::Number(2.0));
@@ -57,15 +45,16 @@ void OneMinusTwoIsNegativeOne()
 
 	TEST(machine.hasError() == false);
 	TEST(machine.stack.size() == 1);
-	TEST(machine.stack[0].type == ValueType::tNumber);
-	TEST_FP(machine.stack[0].vNumber, -1.0);
+	TEST(Machine::Load(machine.stack[0]).type == ValueType(PType::tNum));
+	TEST_FP(Machine::Load(machine.stack[0]).vNumber, -1.0);
 }
 
 // (1 + 2) * 3 = 9
 void OnePlusTwoTimesThreeIsNine()
 {
 	ConstPool pool;
-	Machine machine;
+	Heap heap;
+	Machine machine(heap);
 
 	const uint32_t one = pool.add(Value::Number(1.0));
 	const uint32_t two = pool.add(Value::Number(2.0));
@@ -82,8 +71,8 @@ void OnePlusTwoTimesThreeIsNine()
 
 	TEST(machine.hasError() == false);
 	TEST(machine.stack.size() == 1);
-	TEST(machine.stack[0].type == ValueType::tNumber);
-	TEST_FP(machine.stack[0].vNumber, 9.0);
+	TEST(Machine::Load(machine.stack[0]).type == ValueType(PType::tNum));
+	TEST_FP(Machine::Load(machine.stack[0]).vNumber, 9.0);
 }
 
 // (1 + 2) / 3 = 1
@@ -94,7 +83,8 @@ void OnePlusTwoDivThreeIsOne()
 	const uint32_t two = pool.add(Value::Number(2.0));
 	const uint32_t three = pool.add(Value::Number(3.0));
 
-	Machine machine;
+	Heap heap;
+	Machine machine(heap);
 	std::vector<Instruction> instructions = {
 		PackOpCode(OpCode::PUSH, one),		// lhs
 		PackOpCode(OpCode::PUSH, two),		// rhs
@@ -106,58 +96,56 @@ void OnePlusTwoDivThreeIsOne()
 
 	TEST(machine.hasError() == false);
 	TEST(machine.stack.size() == 1);
-	TEST(machine.stack[0].type == ValueType::tNumber);
-	TEST_FP(machine.stack[0].vNumber, 1.0);
+	TEST(Machine::Load(machine.stack[0]).type == ValueType(PType::tNum));
+	TEST_FP(Machine::Load(machine.stack[0]).vNumber, 1.0);
 }
 
 // x = 1
 // y = 2
 // x + y = 3
-void XPlusYIsThree(OpCode def)
+void XPlusYIsThree(bool global)
 {
 	ConstPool pool;
-	Machine machine;
+	Heap heap;
+	Machine machine(heap);
 
-	const uint32_t x = pool.add(Value::String("x"));
-	const uint32_t y = pool.add(Value::String("y"));
 	const uint32_t one = pool.add(Value::Number(1.0));
 	const uint32_t two = pool.add(Value::Number(2.0));
 
-	REQUIRE(def == OpCode::DEFINE_GLOBAL || def == OpCode::DEFINE_LOCAL);
+	// Globals are slots in the global table, locals are slots on the stack.
+	const uint32_t x = global ? machine.globalTable.resolve("x") : 0;
+	const uint32_t y = global ? machine.globalTable.resolve("y") : 1;
+	const OpCode load = global ? OpCode::LOAD_GLOBAL : OpCode::LOAD_LOCAL;
+	const size_t nLocals = global ? 0 : 2;
 
-	std::vector<Instruction> instructions = {
-		PackOpCode(OpCode::PUSH, x),			// "x"
-		PackOpCode(OpCode::PUSH, one),			// 1
-		PackOpCode(def),						// 1 stored to var "x" and assigns type
-		PackOpCode(OpCode::PUSH, y),
-		PackOpCode(OpCode::PUSH, two),
-		PackOpCode(def),						// 2 stored to var "y"
-		PackOpCode(OpCode::PUSH, x),			// "x"
-		PackOpCode(OpCode::LOAD),				// -> 1
-		PackOpCode(OpCode::PUSH, y),			// "y"
-		PackOpCode(OpCode::LOAD, y),			// -> 2
-		PackOpCode(OpCode::ADD),
-	};
+	std::vector<Instruction> instructions;
+	instructions.push_back(PackOpCode(OpCode::PUSH, one));			// 1
+	if (global)
+		instructions.push_back(PackOpCode(OpCode::DEFINE_GLOBAL, x));	// 1 stored to var "x" and assigns type
+	instructions.push_back(PackOpCode(OpCode::PUSH, two));			// 2
+	if (global)
+		instructions.push_back(PackOpCode(OpCode::DEFINE_GLOBAL, y));	// 2 stored to var "y"
+	size_t declEnd = instructions.size();
+	instructions.push_back(PackOpCode(load, x));					// -> 1
+	instructions.push_back(PackOpCode(load, y));					// -> 2
+	instructions.push_back(PackOpCode(OpCode::ADD));
 
-	machine.execute(instructions.data(), 3, pool);
+	machine.execute(instructions.data(), declEnd, pool);
 	TEST(machine.hasError() == false);
-	TEST(machine.stack.size() == 0);
+	TEST(machine.stack.size() == nLocals);
 
-	machine.execute(instructions.data() + 3, 3, pool);
+	machine.execute(instructions.data() + declEnd, instructions.size() - declEnd, pool);
 	TEST(machine.hasError() == false);
-	TEST(machine.stack.size() == 0);
-
-	machine.execute(instructions.data() + 6, instructions.size() - 6, pool);
-	TEST(machine.hasError() == false);
-	TEST(machine.stack.size() == 1);
-	TEST(machine.stack[0].type == ValueType::tNumber);
-	TEST_FP(machine.stack[0].vNumber, 3.0);
+	TEST(machine.stack.size() == nLocals + 1);
+	TEST(Machine::Load(machine.stack.back()).type == ValueType(PType::tNum));
+	TEST_FP(Machine::Load(machine.stack.back()).vNumber, 3.0);
 }
 
 static void CatHelloWorld()
 {
 	ConstPool pool;
-	Machine machine;
+	Heap heap;
+	Machine machine(heap);
 
 	const uint32_t hello = pool.add(Value::String("Hello"));
 	const uint32_t world = pool.add(Value::String(", World"));
@@ -171,8 +159,223 @@ static void CatHelloWorld()
 
 	TEST(machine.hasError() == false);
 	TEST(machine.stack.size() == 1);
-	TEST(machine.stack[0].type == ValueType::tString);
-	TEST(machine.stack[0].vString->compare("Hello, World") == 0);
+	TEST(Machine::Load(machine.stack[0]).type == ValueType(PType::tStr));
+	TEST(Machine::Load(machine.stack[0]).str() == "Hello, World");
+}
+
+// var x = 0
+// while x < 5 { x = x + 1 }
+static void WhileLoop(Machine::Dispatch dispatch, bool optimize)
+{
+	ConstPool pool;
+	Heap heap;
+	Machine machine(heap);
+	if (dispatch == Machine::Dispatch::kThreaded && !Machine::hasThreadedDispatch())
+		return;
+	machine.dispatch = dispatch;
+
+	const uint32_t x = machine.globalTable.resolve("x");
+	const uint32_t zero = pool.add(Value::Number(0.0));
+	const uint32_t one = pool.add(Value::Number(1.0));
+	const uint32_t five = pool.add(Value::Number(5.0));
+
+	std::vector<Instruction> instructions = {
+		PackOpCode(OpCode::PUSH, zero),
+		PackOpCode(OpCode::DEFINE_GLOBAL, x),
+		PackOpCode(OpCode::LOAD_GLOBAL, x),		// 2: loop start
+		PackOpCode(OpCode::PUSH, five),
+		PackOpCode(OpCode::LESS),
+		PackOpCode(OpCode::JUMP_IF_FALSE, 6),	// -> 12
+		PackOpCode(OpCode::LOAD_GLOBAL, x),
+		PackOpCode(OpCode::PUSH, one),
+		PackOpCode(OpCode::ADD),
+		PackOpCode(OpCode::STORE_GLOBAL, x),
+		PackOpCode(OpCode::POP),
+		PackOpCode(OpCode::LOOP, 10),			// -> 2
+		PackOpCode(OpCode::LOAD_GLOBAL, x),		// 12
+		PackOpCode(OpCode::RESULT),
+	};
+	if (optimize) {
+		// LESS+JUMP_IF_FALSE, PUSH+ADD, and STORE_GLOBAL+POP are fused.
+		TEST(OptimizeBytecode(instructions) == 3);
+	}
+	machine.execute(instructions, pool);
+
+	TEST(machine.hasError() == false);
+	TEST(machine.stack.size() == 0);
+	TEST(machine.result.type == ValueType(PType::tNum));
+	TEST_FP(machine.result.vNumber, 5.0);
+	uint64_t expected = optimize ? 2 + 5 * 7 + 3 + 2 : 2 + 5 * 10 + 4 + 2;
+	TEST(machine.instructionCount == expected);
+}
+
+// Jumps out of range are caught before anything executes.
+static void BadJump()
+{
+	ConstPool pool;
+	Heap heap;
+	Machine machine(heap);
+
+	const uint32_t one = pool.add(Value::Number(1.0));
+	std::vector<Instruction> instructions = {
+		PackOpCode(OpCode::PUSH, one),
+		PackOpCode(OpCode::JUMP, 2),
+	};
+	machine.execute(instructions, pool);
+	TEST(machine.hasError());
+	TEST(machine.stack.size() == 0);
+}
+
+// Pool indices past 16 bits use the WIDE prefix.
+static void WideOperands(Machine::Dispatch dispatch)
+{
+	ConstPool pool;
+	Heap heap;
+	Machine machine(heap);
+	if (dispatch == Machine::Dispatch::kThreaded && !Machine::hasThreadedDispatch())
+		return;
+	machine.dispatch = dispatch;
+
+	static constexpr uint32_t kN = 70000;
+	for (uint32_t i = 0; i < kN; i++) {
+		TEST(pool.add(Value::Number(i)) == i);
+	}
+	TEST(pool.add(Value::Number(kN - 1)) == kN - 1);
+	TEST(pool.add(Value::Number(-0.0)) == kN);
+
+	std::vector<Instruction> instructions;
+	EmitOpCode(instructions, OpCode::PUSH, kN - 1);
+	EmitOpCode(instructions, OpCode::PUSH, 1);
+	instructions.push_back(PackOpCode(OpCode::ADD));
+	instructions.push_back(PackOpCode(OpCode::RESULT));
+	TEST(instructions.size() == 5);
+
+	machine.execute(instructions, pool);
+	TEST(machine.hasError() == false);
+	TEST(machine.result.type == ValueType(PType::tNum));
+	TEST_FP(machine.result.vNumber, double(kN));
+
+	// A prefix with nothing to extend.
+	instructions.push_back(PackOpCode(OpCode::WIDE, 1));
+	machine.execute(instructions, pool);
+	TEST(machine.hasError());
+}
+
+static void TypedOps(Machine::Dispatch dispatch)
+{
+	ConstPool pool;
+	Heap heap;
+	Machine machine(heap);
+	if (dispatch == Machine::Dispatch::kThreaded && !Machine::hasThreadedDispatch())
+		return;
+	machine.dispatch = dispatch;
+
+	// (2 + 3) * 4 < 21 == true
+	std::vector<Instruction> instructions;
+	instructions.push_back(PackOpCode(OpCode::PUSH, pool.add(Value::Number(2))));
+	instructions.push_back(PackOpCode(OpCode::PUSH, pool.add(Value::Number(3))));
+	instructions.push_back(PackOpCode(OpCode::ADD_NUM));
+	instructions.push_back(PackOpCode(OpCode::PUSH, pool.add(Value::Number(4))));
+	instructions.push_back(PackOpCode(OpCode::MUL_NUM));
+	instructions.push_back(PackOpCode(OpCode::PUSH, pool.add(Value::Number(21))));
+	instructions.push_back(PackOpCode(OpCode::LESS_NUM));
+	instructions.push_back(PackOpCode(OpCode::PUSH, pool.add(Value::Boolean(true))));
+	instructions.push_back(PackOpCode(OpCode::EQ_BOOL));
+	instructions.push_back(PackOpCode(OpCode::RESULT));
+
+	machine.execute(instructions, pool);
+	TEST(machine.hasError() == false);
+	TEST(machine.result.type == ValueType(PType::tBool));
+	TEST(machine.result.vBoolean == true);
+
+	instructions.clear();
+	instructions.push_back(PackOpCode(OpCode::PUSH, pool.add(Value::String("Hello, "))));
+	instructions.push_back(PackOpCode(OpCode::PUSH, pool.add(Value::String("World"))));
+	instructions.push_back(PackOpCode(OpCode::CONCAT_STR));
+	instructions.push_back(PackOpCode(OpCode::RESULT));
+
+	machine.execute(instructions, pool);
+	TEST(machine.hasError() == false);
+	TEST(machine.result.type == ValueType(PType::tStr));
+	TEST(machine.result.str() == "Hello, World");
+	// The constants are not changed by the in-place concatenation.
+	TEST(pool.values[pool.add(Value::String("Hello, "))].str() == "Hello, ");
+}
+
+// verify() rejects typed op codes it can't prove the operands of, before
+// anything runs.
+static void UnprovenTypedOps()
+{
+	ConstPool pool;
+	Heap heap;
+	Machine machine(heap);
+	const uint32_t zero = pool.add(Value::Number(0));
+	const uint32_t one = pool.add(Value::Number(1));
+	const uint32_t ten = pool.add(Value::Number(10));
+	const uint32_t hello = pool.add(Value::String("hello"));
+	const uint32_t yes = pool.add(Value::Boolean(true));
+
+	auto rejected = [&](const std::vector<Instruction>& instructions) {
+		const uint64_t count = machine.instructionCount;
+		machine.execute(instructions, pool);
+		bool r = machine.hasError() && machine.stack.empty() && machine.instructionCount == count;
+		machine.clearError();
+		machine.stack.clear();
+		return r;
+	};
+	TEST(rejected({ PackOpCode(OpCode::ADD_NUM) }));
+	TEST(rejected({ PackOpCode(OpCode::PUSH, one), PackOpCode(OpCode::NEGATE_NUM), PackOpCode(OpCode::ADD_NUM) }));
+	TEST(rejected({ PackOpCode(OpCode::PUSH, one), PackOpCode(OpCode::PUSH, one), PackOpCode(OpCode::CONCAT_STR) }));
+	TEST(rejected({ PackOpCode(OpCode::PUSH, hello), PackOpCode(OpCode::PUSH, one), PackOpCode(OpCode::LESS_NUM) }));
+	TEST(rejected({ PackOpCode(OpCode::PUSH, one), PackOpCode(OpCode::PUSH, one), PackOpCode(OpCode::EQ_BOOL) }));
+	// A num on one path, and a str on the other.
+	TEST(rejected({
+		PackOpCode(OpCode::PUSH, yes),
+		PackOpCode(OpCode::JUMP_IF_FALSE, 2),
+		PackOpCode(OpCode::PUSH, one),
+		PackOpCode(OpCode::JUMP, 1),
+		PackOpCode(OpCode::PUSH, hello),
+		PackOpCode(OpCode::PUSH, one),
+		PackOpCode(OpCode::ADD_NUM),
+	}));
+	// A loop that grows the stack.
+	TEST(rejected({ PackOpCode(OpCode::PUSH, one), PackOpCode(OpCode::LOOP, 2), PackOpCode(OpCode::NEGATE_NUM) }));
+
+	// A typed loop over a local: for i = 0; i < 10; i = i + 1
+	std::vector<Instruction> loop = {
+		PackOpCode(OpCode::PUSH, zero),
+		PackOpCode(OpCode::LOAD_LOCAL, 0),
+		PackOpCode(OpCode::PUSH, ten),
+		PackOpCode(OpCode::LESS_NUM),
+		PackOpCode(OpCode::JUMP_IF_FALSE, 5),
+		PackOpCode(OpCode::LOAD_LOCAL, 0),
+		PackOpCode(OpCode::PUSH, one),
+		PackOpCode(OpCode::ADD_NUM),
+		PackOpCode(OpCode::SET_LOCAL, 0),
+		PackOpCode(OpCode::LOOP, 9),
+		PackOpCode(OpCode::LOAD_LOCAL, 0),
+		PackOpCode(OpCode::RESULT),
+	};
+	machine.execute(loop, pool);
+	TEST(!machine.hasError());
+	TEST(machine.result.type == ValueType(PType::tNum) && machine.result.vNumber == 10);
+	machine.stack.clear();
+
+	// A builtin is a func, until the code defines a num in its place.
+	StringTable strings;
+	machine.setBuiltin("f", Value::Func(strings.intern("f")));
+	const uint32_t f = machine.globalTable.resolve("f");
+	TEST(rejected({ PackOpCode(OpCode::LOAD_GLOBAL, f), PackOpCode(OpCode::PUSH, one), PackOpCode(OpCode::ADD_NUM) }));
+	machine.execute({
+		PackOpCode(OpCode::PUSH, one),
+		PackOpCode(OpCode::DEFINE_GLOBAL, f),
+		PackOpCode(OpCode::LOAD_GLOBAL, f),
+		PackOpCode(OpCode::PUSH, one),
+		PackOpCode(OpCode::ADD_NUM),
+		PackOpCode(OpCode::RESULT),
+	}, pool);
+	TEST(!machine.hasError());
+	TEST(machine.result.type == ValueType(PType::tNum) && machine.result.vNumber == 2);
 }
 
 void Machine::test()
@@ -181,8 +384,17 @@ void Machine::test()
 	RUN_TEST(OneMinusTwoIsNegativeOne());
 	RUN_TEST(OnePlusTwoTimesThreeIsNine());
 	RUN_TEST(OnePlusTwoDivThreeIsOne());
-	RUN_TEST(XPlusYIsThree(OpCode::DEFINE_GLOBAL));
-	RUN_TEST(XPlusYIsThree(OpCode::DEFINE_LOCAL));
+	RUN_TEST(XPlusYIsThree(true));
+	RUN_TEST(XPlusYIsThree(false));
 	RUN_TEST(CatHelloWorld());
+	RUN_TEST(WhileLoop(Machine::Dispatch::kSwitch, false));
+	RUN_TEST(WhileLoop(Machine::Dispatch::kThreaded, false));
+	RUN_TEST(WhileLoop(Machine::Dispatch::kSwitch, true));
+	RUN_TEST(WhileLoop(Machine::Dispatch::kThreaded, true));
+	RUN_TEST(BadJump());
+	RUN_TEST(WideOperands(Machine::Dispatch::kSwitch));
+	RUN_TEST(WideOperands(Machine::Dispatch::kThreaded));
+	RUN_TEST(TypedOps(Machine::Dispatch::kSwitch));
+	RUN_TEST(TypedOps(Machine::Dispatch::kThreaded));
+	RUN_TEST(UnprovenTypedOps());
 }
-#endif
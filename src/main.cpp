@@ -3,11 +3,106 @@
 #include "token.h"
 #include "langtest.h"
 #include "machine.h"
+#include "bench.h"
+#include "bcimage.h"
+#include "boxedvalue.h"
+#include "sort.h"
+#include "vecops.h"
 
+#include <argh.h>
 #include <fmt/core.h>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
 #include <string>
 #include <iostream>
 
+static bool ReadFile(const std::filesystem::path& path, std::string& text)
+{
+    std::ifstream stream(path, std::ios::binary);
+    if (!stream) return false;
+    std::stringstream ss;
+    ss << stream.rdbuf();
+    text = ss.str();
+    return true;
+}
+
+// Compiles each .scribe file in 'dir' to a .scribec byte code image next to it.
+static int CompileDirectory(const std::string& dir)
+{
+    std::error_code ec;
+    std::filesystem::directory_iterator it(dir, ec);
+    if (ec) {
+        fmt::print("Could not read directory '{}'\n", dir);
+        return 1;
+    }
+
+    int nCompiled = 0;
+    int nFailed = 0;
+    for (const std::filesystem::directory_entry& entry : it) {
+        const std::filesystem::path& path = entry.path();
+        if (!entry.is_regular_file() || path.extension() != ".scribe")
+            continue;
+
+        std::string source;
+        std::filesystem::path imagePath = path;
+        imagePath.replace_extension(".scribec");
+
+        Interpreter interpreter;
+        if (ReadFile(path, source) && interpreter.compile(source, path.string(), imagePath.string())) {
+            nCompiled++;
+        }
+        else {
+            fmt::print("Failed: {}\n", path.string());
+            nFailed++;
+        }
+        ErrorReporter::printReports();
+        ErrorReporter::clear();
+    }
+    fmt::print("Compiled {} file(s), {} failed\n", nCompiled, nFailed);
+    return nFailed ? 1 : 0;
+}
+
+// Runs a script. For a .scribe file, a .scribec image next to it is used
+// if it is current; a .scribec file is run directly.
+static int RunFile(const std::string& file)
+{
+    std::filesystem::path path = file;
+    std::filesystem::path imagePath = path;
+    imagePath.replace_extension(".scribec");
+
+    std::string source;
+    bool isSource = path.extension() != ".scribec";
+    if (isSource && !ReadFile(path, source)) {
+        fmt::print("Could not read '{}'\n", file);
+        return 1;
+    }
+
+    InterpreterOptions options;
+    options.bytecode = true;
+    Interpreter interpreter(options);
+    BCImage image;
+    Value rc;
+    if (std::filesystem::exists(imagePath) && image.load(imagePath.string())
+        && (!isSource || image.sourceHash() == BCImage::HashSource(source)))
+    {
+        rc = interpreter.interpretImage(image);
+    }
+    else if (isSource) {
+        // A missing, stale, or corrupt image: compile from the source.
+        ErrorReporter::clear();
+        rc = interpreter.interpret(source, path.string());
+    }
+
+    bool error = ErrorReporter::hasError();
+    ErrorReporter::printReports();
+    ErrorReporter::clear();
+    if (rc.type != ValueType()) {
+        fmt::print("Result: {}\n", rc.toString());
+    }
+    return error ? 1 : 0;
+}
+
 // Interpreter
 
 /*
@@ -16,14 +111,32 @@
     return x + y;           // add, push result
 */
 
-int main() 
+int main(int argc, const char* argv[])
 {
+    argh::parser cmdl(argc, argv);
+    if (cmdl["--bench"]) {
+        Bench();
+        return 0;
+    }
+    if (cmdl["--compile"]) {
+        // scribe --compile <directory>
+        return CompileDirectory(cmdl(1).str());
+    }
+    if (cmdl["--run"]) {
+        // scribe --run <file.scribe | file.scribec>
+        return RunFile(cmdl(1).str());
+    }
+
 #if defined(_DEBUG) && defined(_WIN32)
     _CrtMemState s1, s2, s3;
     _CrtMemCheckpoint(&s1);
 #endif
     
-    //Machine::test();
+    Machine::test();
+    BoxedValue::test();
+    Heap::test();
+    VecOpsTest();
+    SortTest();
     Tokenizer::test();
     LangTest();
 
@@ -35,6 +148,10 @@ int main()
             fmt::print(">> ");
             std::getline(std::cin, line);
             if (line == "exit") break;
+            if (line == ":memory") {
+                interpreter.memoryStats().print();
+                continue;
+            }
             Value rc = interpreter.interpret(line, "cmd");
 
             if (ErrorReporter::hasError()) {
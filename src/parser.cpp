@@ -2,6 +2,8 @@
 #include "ast.h"
 #include "errorreporting.h"
 
+#include <algorithm>
+
 /*
 	program -> declaration* EOF
 
@@ -32,6 +34,7 @@
 
 	expression -> assignment
 	assignment ->   IDENTIFIER "=" assignment
+				  | call "[" expression "]" "=" assignment
 				  | equality
 	logic_or -> logic_and ( "||" logic_and )*
 	logic_and -> equality ( "&&" equality )*
@@ -40,9 +43,12 @@
 	term -> factor ( ( "+" | "-" ) factor )*
 	factor -> unary ( ( "*" | "/" ) unary )*
 	unary -> ( "!" | "-" ) unary | call
-	call -> primary ( "(" arguments? ")" )*
-	primary -> NUMBER | STRING | "true" | "false" | "(" expression ")" | IDENTIFIER
+	call -> primary ( "(" arguments? ")" | "[" expression "]" | "[" expression? ":" expression? "]" )*
+	primary -> NUMBER | STRING | "true" | "false" | "(" expression ")" | IDENTIFIER | "[" arguments? "]"
 	arguments -> expression ( "," expression )*
+
+	append(), pop() and size() are calls to the list functions (ASTListFuncExpr),
+	unless a variable of that name is in scope.
 */
 
 bool Parser::check(TokenType type) 
@@ -87,7 +93,9 @@ bool Parser::match(const std::vector<TokenType>& types, Token& t)
 std::vector<ASTStmtPtr>  Parser::parseStmts()
 {
 	std::vector<ASTStmtPtr> stmts;
-	while (!tok.done()) {
+	// Checks for EOF (rather than Tokenizer::done()) so that trailing
+	// whitespace, like the newline at the end of a file, is fine.
+	while (tok.peek().type != TokenType::eof) {
 		ASTStmtPtr stmt = declaration();
 		if (stmt) {
 			stmts.push_back(stmt);
@@ -98,15 +106,36 @@ std::vector<ASTStmtPtr>  Parser::parseStmts()
 
 ASTStmtPtr Parser::declaration()
 {
+	int line = tok.peek().line;
+	ASTStmtPtr stmt;
 	if (check(TokenType::FUNC))
-		return funcDecl();
-	if (check(TokenType::VAR))
-		return varDecl();
-	return statement();
+		stmt = funcDecl();
+	else if (check(TokenType::VAR))
+		stmt = varDecl();
+	else
+		stmt = statement();
+
+	if (stmt)
+		stmt->line = line;
+	return stmt;
+}
+
+void Parser::declare(const std::string& name)
+{
+	ListFunc func = ListFunc::kSize;
+	int nArgs = 0;
+	if (ASTListFuncExpr::FromName(name, func, nArgs))
+		shadowed.push_back(name);
+}
+
+bool Parser::isShadowed(const std::string& name) const
+{
+	return std::find(shadowed.begin(), shadowed.end(), name) != shadowed.end();
 }
 
 ASTStmtPtr Parser::funcDecl()
 {
+	Scope scope(*this);
 	Token name = tok.get();
 	if (name.type != TokenType::IDENT) {
 		ErrorReporter::report(ctxName, name.line, "Expected function name");
@@ -141,6 +170,7 @@ ASTStmtPtr Parser::funcDecl()
 				return nullptr;
 			}
 			params.push_back(Param{ param.lexeme, vt });
+			declare(param.lexeme);
 		} while (check(TokenType::COMMA));
 	}
 	if (!check(TokenType::RIGHT_PAREN)) {
@@ -185,6 +215,7 @@ ASTStmtPtr Parser::varDecl()
 		// var a: num[] = []	// declared type
 		// var a: num
 		// var a: num[]
+		// var a: num{}
 
 		Token type;
 		// Read type
@@ -205,12 +236,28 @@ ASTStmtPtr Parser::varDecl()
 			}
 			valueType.layout = Layout::tList;
 		}
+		// A "{" on the next line starts a block, not a map type.
+		else if (tok.peek().type == TokenType::LEFT_BRACE && tok.peek().line == type.line) {
+			tok.get();
+			if (!check(TokenType::RIGHT_BRACE)) {
+				ErrorReporter::report(ctxName, t.line, "Expected '}'");
+				return nullptr;
+			}
+			valueType.layout = Layout::tMap;
+		}
 
 		ASTExprPtr expr = nullptr;
 		if (check(TokenType::EQUAL)) {
 			expr = expression();
 		}
-		return std::make_shared<ASTVarDeclStmt>(t.lexeme, valueType, expr);
+		// A list literal has the declared type (so [] can be typed), and
+		// the elements are checked against it.
+		const ASTListExpr* list = expr ? expr->asList() : nullptr;
+		if (list && list->type != valueType && valueType.layout == Layout::tList) {
+			expr = std::make_shared<ASTListExpr>(list->elements, valueType);
+		}
+		declare(t.lexeme);
+		return std::make_shared<ASTVarDeclStmt>(strings.intern(t.lexeme), valueType, expr);
 	}
 	else {
 		// "var" IDENTIFIER ( "=" expression )?
@@ -221,13 +268,14 @@ ASTStmtPtr Parser::varDecl()
 		}
 
 		// Very simple duck typing rules!
-		ValueType valueType = expr->duckType();
+		ValueType valueType = expr ? expr->duckType() : ValueType();
 		if (valueType == ValueType()) {
 			ErrorReporter::report(ctxName, t.line, "Could not duck type");
 			return nullptr;
 		}
 
-		return std::make_shared<ASTVarDeclStmt>(t.lexeme, valueType, expr);
+		declare(t.lexeme);
+		return std::make_shared<ASTVarDeclStmt>(strings.intern(t.lexeme), valueType, expr);
 	}
 	/*
 	assert(false);	// logic isn't correct, something isn't implemented.
@@ -300,6 +348,7 @@ ASTStmtPtr Parser::forStatement()
 	//			expression? 
 	//			block
 
+	Scope scope(*this);	// the init variable's
 	ASTStmtPtr init = nullptr;
 	ASTExprPtr condition = nullptr;
 	ASTExprPtr increment = nullptr;
@@ -371,6 +420,7 @@ ASTStmtPtr Parser::forStatement()
 
 ASTStmtPtr Parser::block()
 {
+	Scope scope(*this);
 	std::vector<ASTStmtPtr> stmts;
 
 	while(!tok.done() && tok.peek().type != TokenType::RIGHT_BRACE) {
@@ -402,6 +452,10 @@ ASTExprPtr Parser::assignment()
 	if (check(TokenType::EQUAL, t)) {
 		// The expression should be an l-value
 		ASTExprPtr rValue = assignment();
+		if (!expr) return nullptr;
+		if (const ASTIndexExpr* index = expr->asIndex()) {
+			return std::make_shared<ASTIndexAssignExpr>(index->list, index->index, rValue);
+		}
 		const ASTIdentifierExpr* ident = expr->asIdentifier();
 
 		if (!ident) {
@@ -500,6 +554,28 @@ ASTExprPtr Parser::call()
 		if (check(TokenType::LEFT_PAREN)) {
 			expr = finishCall(expr);
 		}
+		else if (check(TokenType::LEFT_BRACKET)) {
+			ASTExprPtr index;
+			if (tok.peek().type != TokenType::COLON)
+				index = expression();
+			if (check(TokenType::COLON)) {
+				ASTExprPtr end;
+				if (tok.peek().type != TokenType::RIGHT_BRACKET)
+					end = expression();
+				if (!check(TokenType::RIGHT_BRACKET)) {
+					ErrorReporter::report(ctxName, tok.peek().line, "Expected ']'");
+					return nullptr;
+				}
+				expr = std::make_shared<ASTSliceExpr>(expr, index, end);
+				continue;
+			}
+			if (!index) return nullptr;
+			if (!check(TokenType::RIGHT_BRACKET)) {
+				ErrorReporter::report(ctxName, tok.peek().line, "Expected ']'");
+				return nullptr;
+			}
+			expr = std::make_shared<ASTIndexExpr>(expr, index);
+		}
 		else {
 			break;
 		}
@@ -521,10 +597,21 @@ ASTExprPtr Parser::finishCall(ASTExprPtr expr)
 		return nullptr;
 	}
 	// FIXME: maximum argument count
+
+	ListFunc func = ListFunc::kSize;
+	int nArgs = 0;
+	const ASTIdentifierExpr* ident = expr ? expr->asIdentifier() : nullptr;
+	if (ident && !isShadowed(ident->name.str()) && ASTListFuncExpr::FromName(ident->name.str(), func, nArgs)) {
+		if ((int)arguments.size() != nArgs) {
+			ErrorReporter::report(ctxName, t.line, fmt::format("Expected {} arguments to '{}'", nArgs, ident->name.str()));
+			return nullptr;
+		}
+		return std::make_shared<ASTListFuncExpr>(func, arguments);
+	}
 	return std::make_shared<ASTCallExpr>(expr, t, arguments);
 }
 
-// NUMBER | STRING | identifier | "true" | "false" | "(" expr ")"
+// NUMBER | STRING | identifier | "true" | "false" | "(" expr ")" | "[" arguments? "]"
 ASTExprPtr Parser::primary()
 {
 	Token t = tok.get();
@@ -532,9 +619,9 @@ ASTExprPtr Parser::primary()
 		case TokenType::NUMBER:
 			return std::make_shared<ASTValueExpr>(Value::Number(t.dValue));
 		case TokenType::STRING:
-			return std::make_shared<ASTValueExpr>(Value::String(t.lexeme));
+			return std::make_shared<ASTValueExpr>(Value::String(strings.intern(t.lexeme)));
 		case TokenType::IDENT:
-			return std::make_shared<ASTIdentifierExpr>(t.lexeme);
+			return std::make_shared<ASTIdentifierExpr>(strings.intern(t.lexeme));
 		case TokenType::TRUE:	
 			return std::make_shared<ASTValueExpr>(Value::Boolean(true));
 		case TokenType::FALSE:
@@ -549,8 +636,38 @@ ASTExprPtr Parser::primary()
 			}
 			return expr;
 		}
+		case TokenType::LEFT_BRACKET:
+			return listLiteral(t);
 		default:
 			ErrorReporter::report(ctxName, t.line, "Unexpected token");
 	}
 	return nullptr;
 }
+
+ASTExprPtr Parser::listLiteral(const Token& bracket)
+{
+	std::vector<ASTExprPtr> elements;
+	if (!peek(TokenType::RIGHT_BRACKET)) {
+		do {
+			elements.push_back(expression());
+		} while (check(TokenType::COMMA));
+	}
+	if (!check(TokenType::RIGHT_BRACKET)) {
+		ErrorReporter::report(ctxName, bracket.line, "Expected ']'");
+		return nullptr;
+	}
+
+	// The type, if every element duck types to the same scalar.
+	ValueType type;
+	for (size_t i = 0; i < elements.size(); i++) {
+		ValueType t = elements[i] ? elements[i]->duckType() : ValueType();
+		if (t.layout != Layout::tScalar || (i > 0 && t.pType != type.pType)) {
+			type = ValueType();
+			break;
+		}
+		type = ValueType(t.pType, Layout::tList);
+	}
+	if (type.pType == PType::tNone)
+		type = ValueType();
+	return std::make_shared<ASTListExpr>(elements, type);
+}
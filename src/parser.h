@@ -3,22 +3,47 @@
 #include "token.h"
 #include "ast.h"
 
+#include <string>
 #include <vector>
 
 /* 
-* The Parser produces the AST
+* The Parser produces the AST. Identifiers, string literals, and func
+* names are interned in 'strings', or in the Parser's own table if
+* there isn't one.
+*
+* A call to append(), size(), etc. is a list function, unless the script
+* has declared a variable of that name in scope.
 */
 class Parser
 {
 public:
-	Parser(Tokenizer& tok, const std::string& ctxName) : tok(tok), ctxName(ctxName) {}
+	Parser(Tokenizer& tok, const std::string& ctxName, StringTable* strings = nullptr)
+		: tok(tok), ctxName(ctxName), strings(strings ? *strings : ownStrings) {}
 
 	ASTExprPtr parseExpr() { return expression(); }
 	std::vector<ASTStmtPtr> parseStmts();
 
+	// The list function names declared as globals. The Interpreter hands
+	// them to the next script's Parser, since the globals persist.
+	const std::vector<std::string>& shadowedGlobals() const { return shadowed; }
+	void setShadowedGlobals(const std::vector<std::string>& names) { shadowed = names; }
+
 private:
 	Tokenizer& tok;
 	std::string ctxName;
+	StringTable ownStrings;
+	StringTable& strings;
+	std::vector<std::string> shadowed;	// list function names declared in scope, innermost last
+
+	// Forgets the names declared in a block when it ends.
+	struct Scope {
+		Scope(Parser& parser) : parser(parser), start(parser.shadowed.size()) {}
+		~Scope() { parser.shadowed.resize(start); }
+		Parser& parser;
+		size_t start;
+	};
+	void declare(const std::string& name);
+	bool isShadowed(const std::string& name) const;
 
 	// Consumes the token:
 	bool check(TokenType type);
@@ -52,5 +77,6 @@ private:
 	ASTExprPtr primary();
 	ASTExprPtr call();
 	ASTExprPtr finishCall(ASTExprPtr expr);
+	ASTExprPtr listLiteral(const Token& bracket);	// the '[' has been read
 
 };
@@ -0,0 +1,37 @@
+#include "pool.h"
+#include "error.h"
+
+static constexpr size_t kAlign = alignof(max_align_t);
+
+SlabPool::SlabPool(size_t blockSize, Allocator& allocator) : _allocator(allocator)
+{
+	REQUIRE(blockSize > 0);
+	_blockSize = (blockSize + kAlign - 1) / kAlign * kAlign;
+	REQUIRE(_blockSize <= kSlabBytes);
+}
+
+SlabPool::~SlabPool()
+{
+	for (void* slab : _slabs) {
+		_allocator.free(slab, kSlabBytes);
+	}
+}
+
+void SlabPool::grow()
+{
+	// Room first, so a slab is never lost if the push_back throws.
+	if (_slabs.size() == _slabs.capacity())
+		_slabs.reserve(_slabs.empty() ? 8 : _slabs.size() * 2);
+	char* slab = static_cast<char*>(_allocator.alloc(kSlabBytes));
+	if (!slab)
+		throw OutOfMemory();
+	_slabs.push_back(slab);
+
+	// Threaded onto the free list in address order.
+	const size_t n = kSlabBytes / _blockSize;
+	for (size_t i = n; i > 0; i--) {
+		FreeBlock* b = reinterpret_cast<FreeBlock*>(slab + (i - 1) * _blockSize);
+		b->next = _free;
+		_free = b;
+	}
+}
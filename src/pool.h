@@ -0,0 +1,54 @@
+#pragma once
+
+#include "allocator.h"
+
+#include <stddef.h>
+#include <vector>
+
+/*
+* Fixed size blocks, carved from slabs of kSlabBytes. A freed block goes
+* on a free list for the next alloc(), so once the pool has grown,
+* allocating doesn't call malloc. The slabs come from an Allocator, and
+* are only returned when the pool is destroyed, all at once.
+*/
+class SlabPool {
+public:
+	static constexpr size_t kSlabBytes = 64 * 1024;
+
+	// 'blockSize' is rounded up to keep blocks aligned for any type.
+	explicit SlabPool(size_t blockSize, Allocator& allocator = Allocator::Default());
+	~SlabPool();
+
+	SlabPool(const SlabPool&) = delete;
+	SlabPool& operator=(const SlabPool&) = delete;
+
+	void* alloc() {
+		if (!_free) grow();
+		FreeBlock* b = _free;
+		_free = b->next;
+		_inUse++;
+		return b;
+	}
+	void free(void* p) {
+		FreeBlock* b = static_cast<FreeBlock*>(p);
+		b->next = _free;
+		_free = b;
+		_inUse--;
+	}
+
+	size_t blockSize() const { return _blockSize; }
+	size_t blocksInUse() const { return _inUse; }
+	size_t bytesReserved() const { return _slabs.size() * kSlabBytes; }
+
+private:
+	struct FreeBlock {
+		FreeBlock* next;
+	};
+	void grow();
+
+	Allocator& _allocator;
+	size_t _blockSize;
+	size_t _inUse = 0;
+	FreeBlock* _free = nullptr;
+	std::vector<void*> _slabs;
+};
@@ -0,0 +1,101 @@
+#include "resolver.h"
+#include "errorreporting.h"
+
+#include <fmt/core.h>
+
+class ASTResolver : public ASTExprVisitor, public ASTStmtVisitor {
+public:
+	void resolve(const ASTExprPtr& expr) { if (expr) expr->accept(*this, 0); }
+	void resolve(const ASTStmtPtr& stmt) { if (stmt) stmt->accept(*this, 0); }
+
+	void visit(const ASTValueExpr&, int) override {}
+	void visit(const ASTIdentifierExpr& node, int) override { node.slot = lookup(node.name); }
+	void visit(const ASTAssignmentExpr& node, int) override {
+		resolve(node.right);
+		node.slot = lookup(node.name);
+	}
+	void visit(const ASTBinaryExpr& node, int) override { resolve(node.left); resolve(node.right); }
+	void visit(const ASTUnaryExpr& node, int) override { resolve(node.right); }
+	void visit(const ASTLogicalExpr& node, int) override { resolve(node.left); resolve(node.right); }
+	void visit(const ASTCallExpr& node, int) override {
+		resolve(node.callee);
+		for (const ASTExprPtr& arg : node.arguments) resolve(arg);
+	}
+	void visit(const ASTListExpr& node, int) override {
+		for (const ASTExprPtr& e : node.elements) resolve(e);
+	}
+	void visit(const ASTIndexExpr& node, int) override { resolve(node.list); resolve(node.index); }
+	void visit(const ASTIndexAssignExpr& node, int) override { resolve(node.list); resolve(node.index); resolve(node.right); }
+	void visit(const ASTSliceExpr& node, int) override { resolve(node.list); resolve(node.begin); resolve(node.end); }
+	void visit(const ASTListFuncExpr& node, int) override {
+		for (const ASTExprPtr& arg : node.arguments) resolve(arg);
+	}
+
+	void visit(const ASTExprStmt& node, int) override { resolve(node.expr); }
+	void visit(const ASTReturnStmt& node, int) override { resolve(node.expr); }
+	void visit(const ASTBlockStmt& node, int) override;
+	void visit(const ASTVarDeclStmt& node, int) override;
+	void visit(const ASTIfStmt& node, int) override { resolve(node.condition); resolve(node.thenBranch); resolve(node.elseBranch); }
+	void visit(const ASTWhileStmt& node, int) override { resolve(node.condition); resolve(node.body); }
+	void visit(const ASTFuncDeclStmt&, int) override {}
+
+private:
+	VarSlot lookup(const StrPtr& name) const;
+
+	// The names in each scope, innermost last. Names are interned,
+	// so they compare by pointer.
+	std::vector<std::vector<StrPtr>> scopes;
+};
+
+VarSlot ASTResolver::lookup(const StrPtr& name) const
+{
+	VarSlot s;
+	for (size_t depth = 0; depth < scopes.size(); depth++) {
+		const std::vector<StrPtr>& scope = scopes[scopes.size() - 1 - depth];
+		for (size_t i = 0; i < scope.size(); i++) {
+			if (scope[i] == name) {
+				s.depth = static_cast<int>(depth);
+				s.slot = static_cast<int>(i);
+				return s;
+			}
+		}
+	}
+	return s;
+}
+
+void ASTResolver::visit(const ASTBlockStmt& node, int)
+{
+	scopes.emplace_back();
+	for (const ASTStmtPtr& stmt : node.stmts) {
+		resolve(stmt);
+	}
+	scopes.pop_back();
+}
+
+void ASTResolver::visit(const ASTVarDeclStmt& node, int)
+{
+	// The initializer can't see the variable: 'var x = x' is the outer x.
+	resolve(node.expr);
+	if (scopes.empty()) {
+		node.slot = VarSlot();
+		return;
+	}
+	std::vector<StrPtr>& scope = scopes.back();
+	for (const StrPtr& name : scope) {
+		if (name == node.name) {
+			ErrorReporter::report("Resolver", node.line, fmt::format("Local variable {} already defined", node.name.str()));
+			return;
+		}
+	}
+	node.slot.depth = 0;
+	node.slot.slot = static_cast<int>(scope.size());
+	scope.push_back(node.name);
+}
+
+void ResolveSlots(const std::vector<ASTStmtPtr>& stmts)
+{
+	ASTResolver resolver;
+	for (const ASTStmtPtr& stmt : stmts) {
+		resolver.resolve(stmt);
+	}
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "ast.h"
+
+/*
+* Resolves the variables of the tree walker to slots, before it runs.
+* Each block is a scope, and its locals are numbered in declaration
+* order; a use of a local is (depth, slot), where depth is the number
+* of blocks out from the use. Anything declared at the top level, or
+* not declared at all, is a global.
+*
+* Re-declaring a local in its own scope is reported as an error, as
+* it is by the byte code generator.
+*/
+void ResolveSlots(const std::vector<ASTStmtPtr>& stmts);
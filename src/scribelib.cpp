@@ -1,7 +1,12 @@
 #include "scribelib.h"
 #include "func.h"
+#include "listops.h"
+#include "sort.h"
+#include "vecops.h"
 
+#include <algorithm>
 #include <chrono>
+#include <type_traits>
 
 class STDClock : public FFIHandler
 {
@@ -72,14 +77,190 @@ public:
 	}
 };
 
+/*
+* The list functions work on a list's storage directly, rather than an
+* element at a time through Values, and use the vecops kernels for num[].
+* An empty list to min() or max(), or lists of different sizes to dot(),
+* is an error, as is a list or value of the wrong type to the functions
+* that take any list.
+*/
+
+// A num[] argument, which the FFI has type checked.
+static const NumList* NumListArg(const Value& v)
+{
+	const NumList* list = static_cast<const NumList*>(v.heapPtr.get());
+	REQUIRE(list);
+	return list;
+}
+
+// sum(a: num[]), min(a: num[]), max(a: num[])
+class STDNumReduce : public FFIHandler
+{
+public:
+	virtual Value call(const std::string& name,
+		const std::vector<Value>& args,
+		ValueType returnType) override
+	{
+		(void)returnType;
+		const NumList* list = NumListArg(args[0]);
+		const size_t n = list->size();
+		if (name == "sum")
+			return Value::Number(VecSum(list->data(), n));
+		if (n == 0) {
+			error = fmt::format("{}: the list is empty", name);
+			return Value();
+		}
+		REQUIRE(name == "min" || name == "max");
+		return Value::Number(name == "min" ? VecMin(list->data(), n) : VecMax(list->data(), n));
+	}
+};
+
+// dot(a: num[], b: num[])
+class STDDot : public FFIHandler
+{
+public:
+	virtual Value call(const std::string& name,
+		const std::vector<Value>& args,
+		ValueType returnType) override
+	{
+		(void)returnType;
+		(void)name;
+		const NumList* a = NumListArg(args[0]);
+		const NumList* b = NumListArg(args[1]);
+		if (a->size() != b->size()) {
+			error = fmt::format("dot: the sizes {} and {} differ", a->size(), b->size());
+			return Value();
+		}
+		return Value::Number(VecDot(a->data(), b->data(), a->size()));
+	}
+};
+
+// sort(list), in place. A num[] is radix sorted, a bool[] counted, and a
+// str[] goes through PdqSort().
+class STDSort : public FFIHandler
+{
+public:
+	virtual Value call(const std::string& name,
+		const std::vector<Value>& args,
+		ValueType returnType) override
+	{
+		(void)returnType;
+		(void)name;
+		if (args.size() != 1) {
+			error = fmt::format("sort: expected 1 argument, not {}", args.size());
+			return Value();
+		}
+		WithList("sort", args[0], error, [&](auto* l) {
+			using L = std::remove_pointer_t<decltype(l)>;
+			// The non-const data() gives a view its own copy to sort.
+			auto* d = l->data();
+			const size_t n = l->size();
+			if constexpr (std::is_same<L, NumList>::value) {
+				RadixSortNums(d, n);
+			}
+			else if constexpr (std::is_same<L, BoolList>::value) {
+				const size_t trues = std::count(d, d + n, uint8_t(1));
+				std::fill(d, d + n - trues, uint8_t(0));
+				std::fill(d + n - trues, d + n, uint8_t(1));
+			}
+			else {
+				PdqSort(d, d + n);
+			}
+		});
+		return Value();
+	}
+};
+
+template<typename E>
+static size_t Find(const E* a, const E& v, size_t n)
+{
+	return std::find(a, a + n, v) - a;
+}
+
+static size_t Find(const double* a, const double& v, size_t n)
+{
+	return VecFind(a, v, n);
+}
+
+template<typename E>
+static size_t Count(const E* a, const E& v, size_t n)
+{
+	return std::count(a, a + n, v);
+}
+
+static size_t Count(const double* a, const double& v, size_t n)
+{
+	return VecCount(a, v, n);
+}
+
+// indexOf(list, v) and binarySearch(list, v) return the index of the
+// first element equal to 'v', or -1; binarySearch() takes a sorted list.
+// count(list, v) is the number of them.
+class STDSearch : public FFIHandler
+{
+public:
+	virtual Value call(const std::string& name,
+		const std::vector<Value>& args,
+		ValueType returnType) override
+	{
+		(void)returnType;
+		const char* ctx = name.c_str();
+		if (args.size() != 2) {
+			error = fmt::format("{}: expected a list and a value, not {} arguments", name, args.size());
+			return Value();
+		}
+		Value result;
+		WithList(ctx, args[0], error, [&](auto* l) {
+			using L = std::remove_pointer_t<decltype(l)>;
+			using Element = typename L::Element;
+			if (!CheckElement(ctx, l, args[1], error))
+				return;
+			const Element v = Element(ListTraits<L>::get(args[1]));
+			const Element* d = static_cast<const L*>(l)->data();
+			const size_t n = l->size();
+			size_t i = n;
+			if (name == "count") {
+				result = Value::Number(double(Count(d, v, n)));
+				return;
+			}
+			if (name == "indexOf") {
+				i = Find(d, v, n);
+			}
+			else {
+				REQUIRE(name == "binarySearch");
+				i = std::lower_bound(d, d + n, v) - d;
+				if (i < n && !(d[i] == v))
+					i = n;
+			}
+			result = Value::Number(i < n ? double(i) : -1.0);
+		});
+		return result;
+	}
+};
+
 static STDClock stdClock;
 static STDPrint stdPrint;
 static STDFormat stdFormat;
+static STDNumReduce stdNumReduce;
+static STDDot stdDot;
+static STDSort stdSort;
+static STDSearch stdSearch;
 
 void AttachStdLib(FFI& ffi, Environment& env)
 {
 	ffi.add("clock", false, {}, ValueType(PType::tNum), &stdClock, env);
 	ffi.add("print", true, {}, ValueType(PType::tNone), &stdPrint, env);
 	ffi.add("format", true, {}, ValueType(PType::tStr), &stdFormat, env);
+
+	const ValueType num(PType::tNum);
+	const ValueType numList(PType::tNum, Layout::tList);
+	ffi.add("sum", false, { numList }, num, &stdNumReduce, env);
+	ffi.add("min", false, { numList }, num, &stdNumReduce, env);
+	ffi.add("max", false, { numList }, num, &stdNumReduce, env);
+	ffi.add("dot", false, { numList, numList }, num, &stdDot, env);
+	ffi.add("sort", true, {}, ValueType(PType::tNone), &stdSort, env);
+	ffi.add("indexOf", true, {}, num, &stdSearch, env);
+	ffi.add("count", true, {}, num, &stdSearch, env);
+	ffi.add("binarySearch", true, {}, num, &stdSearch, env);
 }
 
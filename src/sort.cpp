@@ -0,0 +1,83 @@
+#include "sort.h"
+
+#include <string.h>
+#include <vector>
+
+// Below this, building the histograms costs more than the sort.
+static constexpr size_t kRadixMinSize = 256;
+
+static constexpr uint64_t kSignBit = 0x8000'0000'0000'0000ull;
+
+// The bits of a double as a key that sorts, as unsigned, in the order of
+// the values: a positive number sets the sign bit, and a negative one
+// flips all the bits, so the larger its magnitude the smaller its key.
+// Every NaN gets the largest key.
+static inline uint64_t NumKey(double d)
+{
+	if (d != d)
+		return ~0ull;
+	uint64_t u;
+	memcpy(&u, &d, sizeof(u));
+	return (u & kSignBit) ? ~u : (u | kSignBit);
+}
+
+static inline double KeyNum(uint64_t key)
+{
+	const uint64_t u = (key & kSignBit) ? (key & ~kSignBit) : ~key;
+	double d;
+	memcpy(&d, &u, sizeof(d));
+	return d;
+}
+
+void RadixSortNums(double* a, size_t n)
+{
+	if (n < 2) return;
+	std::vector<uint64_t> keys(n);
+	if (n < kRadixMinSize) {
+		for (size_t i = 0; i < n; i++)
+			keys[i] = NumKey(a[i]);
+		PdqSort(keys.data(), keys.data() + n);
+	}
+	else {
+		// LSD radix sort, 11 bits at a time (so the counts stay in the
+		// cache.) The keys are counted as they are made; a digit that is
+		// the same in every key (the low bits of small integers, say) has
+		// a single bucket, and its pass is skipped.
+		constexpr int kBits = 11;
+		constexpr size_t kBuckets = size_t(1) << kBits;
+		constexpr int kPasses = (64 + kBits - 1) / kBits;
+		std::vector<size_t> counts(kPasses * kBuckets, 0);
+		for (size_t i = 0; i < n; i++) {
+			const uint64_t k = NumKey(a[i]);
+			keys[i] = k;
+			for (int p = 0; p < kPasses; p++)
+				counts[p * kBuckets + ((k >> (p * kBits)) & (kBuckets - 1))]++;
+		}
+		std::vector<uint64_t> scratch(n);
+		uint64_t* src = keys.data();
+		uint64_t* dst = scratch.data();
+		for (int p = 0; p < kPasses; p++) {
+			size_t* count = &counts[p * kBuckets];
+			const int shift = p * kBits;
+			if (count[(src[0] >> shift) & (kBuckets - 1)] == n)
+				continue;
+			// The counts become the offset of each bucket.
+			size_t offset = 0;
+			for (size_t b = 0; b < kBuckets; b++) {
+				const size_t c = count[b];
+				count[b] = offset;
+				offset += c;
+			}
+			for (size_t i = 0; i < n; i++) {
+				const uint64_t k = src[i];
+				dst[count[(k >> shift) & (kBuckets - 1)]++] = k;
+			}
+			std::swap(src, dst);
+		}
+		if (src != keys.data())
+			keys.swap(scratch);
+	}
+
+	for (size_t i = 0; i < n; i++)
+		a[i] = KeyNum(keys[i]);
+}
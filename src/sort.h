@@ -0,0 +1,262 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <utility>
+
+/*
+* The sorts behind the sort() built in (see scribelib.)
+*
+* PdqSort() is pattern-defeating quicksort: a quicksort that uses
+* insertion sort on small ranges, picks the pivot from 3 (or 9) elements,
+* notices ranges that are already sorted, and, if its partitions keep
+* coming out badly unbalanced, shuffles the range and finally falls back
+* to heapsort, so it is never worse than O(n log n). It isn't stable.
+* 'less' must be a strict weak order: the partition loops rely on it to
+* stay in bounds.
+*
+* RadixSortNums() sorts doubles by their bits, in O(n): it is what sort()
+* uses for a num[].
+*/
+
+namespace pdq {
+
+constexpr ptrdiff_t kInsertionSortSize = 24;
+constexpr ptrdiff_t kNintherSize = 128;
+// partialInsertionSort() gives up after moving this many elements.
+constexpr ptrdiff_t kPartialInsertionLimit = 8;
+
+template<typename T, typename Less>
+void insertionSort(T* begin, T* end, Less& less)
+{
+	if (begin == end) return;
+	for (T* cur = begin + 1; cur != end; cur++) {
+		T* sift = cur;
+		if (less(*sift, *(sift - 1))) {
+			T tmp = std::move(*sift);
+			do {
+				*sift = std::move(*(sift - 1));
+				sift--;
+			} while (sift != begin && less(tmp, *(sift - 1)));
+			*sift = std::move(tmp);
+		}
+	}
+}
+
+// The element before 'begin' is no greater than any in the range, so it
+// stops the sift without a bounds check.
+template<typename T, typename Less>
+void unguardedInsertionSort(T* begin, T* end, Less& less)
+{
+	if (begin == end) return;
+	for (T* cur = begin + 1; cur != end; cur++) {
+		T* sift = cur;
+		if (less(*sift, *(sift - 1))) {
+			T tmp = std::move(*sift);
+			do {
+				*sift = std::move(*(sift - 1));
+				sift--;
+			} while (less(tmp, *(sift - 1)));
+			*sift = std::move(tmp);
+		}
+	}
+}
+
+// An insertion sort that gives up (and returns false) if the range turns
+// out not to be nearly sorted.
+template<typename T, typename Less>
+bool partialInsertionSort(T* begin, T* end, Less& less)
+{
+	if (begin == end) return true;
+	ptrdiff_t moved = 0;
+	for (T* cur = begin + 1; cur != end; cur++) {
+		T* sift = cur;
+		if (less(*sift, *(sift - 1))) {
+			T tmp = std::move(*sift);
+			do {
+				*sift = std::move(*(sift - 1));
+				sift--;
+			} while (sift != begin && less(tmp, *(sift - 1)));
+			*sift = std::move(tmp);
+			moved += cur - sift;
+		}
+		if (moved > kPartialInsertionLimit) return false;
+	}
+	return true;
+}
+
+template<typename T, typename Less>
+inline void sort2(T* a, T* b, Less& less)
+{
+	if (less(*b, *a)) std::swap(*a, *b);
+}
+
+template<typename T, typename Less>
+inline void sort3(T* a, T* b, T* c, Less& less)
+{
+	sort2(a, b, less);
+	sort2(b, c, less);
+	sort2(a, b, less);
+}
+
+// Partitions around the pivot at *begin: the elements less than it go to
+// its left, and the rest to its right. Returns where the pivot ended up,
+// and whether the range was already partitioned (nothing was swapped.)
+template<typename T, typename Less>
+std::pair<T*, bool> partitionRight(T* begin, T* end, Less& less)
+{
+	T pivot = std::move(*begin);
+	T* first = begin;
+	T* last = end;
+	// The median of 3 put an element >= the pivot at the end, so the first
+	// scan stops; the second needs a check only if the first didn't move.
+	while (less(*++first, pivot)) {}
+	if (first - 1 == begin) {
+		while (first < last && !less(*--last, pivot)) {}
+	}
+	else {
+		while (!less(*--last, pivot)) {}
+	}
+	const bool alreadyPartitioned = first >= last;
+	while (first < last) {
+		std::swap(*first, *last);
+		while (less(*++first, pivot)) {}
+		while (!less(*--last, pivot)) {}
+	}
+	T* pivotPos = first - 1;
+	*begin = std::move(*pivotPos);
+	*pivotPos = std::move(pivot);
+	return { pivotPos, alreadyPartitioned };
+}
+
+// Like partitionRight(), but the elements equal to the pivot go to its
+// left. Used when the pivot equals the element before the range: then
+// nothing is less than it, and the left side is all equal, and done.
+template<typename T, typename Less>
+T* partitionLeft(T* begin, T* end, Less& less)
+{
+	T pivot = std::move(*begin);
+	T* first = begin;
+	T* last = end;
+	while (less(pivot, *--last)) {}
+	if (last + 1 == end) {
+		while (first < last && !less(pivot, *++first)) {}
+	}
+	else {
+		while (!less(pivot, *++first)) {}
+	}
+	while (first < last) {
+		std::swap(*first, *last);
+		while (less(pivot, *--last)) {}
+		while (!less(pivot, *++first)) {}
+	}
+	T* pivotPos = last;
+	*begin = std::move(*pivotPos);
+	*pivotPos = std::move(pivot);
+	return pivotPos;
+}
+
+// Breaks up a pattern that made a bad partition, by swapping a few
+// elements from the ends of the range with ones a quarter of the way in.
+template<typename T>
+void shuffleEnds(T* begin, T* end)
+{
+	const ptrdiff_t size = end - begin;
+	if (size < kInsertionSortSize) return;
+	const ptrdiff_t q = size / 4;
+	std::swap(begin[0], begin[q]);
+	std::swap(end[-1], end[-q]);
+	if (size > kNintherSize) {
+		std::swap(begin[1], begin[q + 1]);
+		std::swap(begin[2], begin[q + 2]);
+		std::swap(end[-2], end[-q - 1]);
+		std::swap(end[-3], end[-q - 2]);
+	}
+}
+
+// Sorts [begin, end). 'badAllowed' is how many unbalanced partitions are
+// left before heapsort. 'leftmost' is false when the element before
+// 'begin' belongs to the array and is no greater than the range.
+template<typename T, typename Less>
+void sortLoop(T* begin, T* end, Less& less, int badAllowed, bool leftmost)
+{
+	while (true) {
+		const ptrdiff_t size = end - begin;
+		if (size < kInsertionSortSize) {
+			if (leftmost)
+				insertionSort(begin, end, less);
+			else
+				unguardedInsertionSort(begin, end, less);
+			return;
+		}
+
+		// The pivot goes to *begin: the median of 3, or the ninther.
+		const ptrdiff_t half = size / 2;
+		if (size > kNintherSize) {
+			sort3(begin, begin + half, end - 1, less);
+			sort3(begin + 1, begin + (half - 1), end - 2, less);
+			sort3(begin + 2, begin + (half + 1), end - 3, less);
+			sort3(begin + (half - 1), begin + half, begin + (half + 1), less);
+			std::swap(*begin, *(begin + half));
+		}
+		else {
+			sort3(begin + half, begin, end - 1, less);
+		}
+
+		// Lots of equal elements: the pivot is the same as the element
+		// before the range, so put the equal ones to the left, and skip them.
+		if (!leftmost && !less(*(begin - 1), *begin)) {
+			begin = partitionLeft(begin, end, less) + 1;
+			continue;
+		}
+
+		const std::pair<T*, bool> part = partitionRight(begin, end, less);
+		T* pivotPos = part.first;
+		const ptrdiff_t leftSize = pivotPos - begin;
+		const ptrdiff_t rightSize = end - (pivotPos + 1);
+
+		if (leftSize < size / 8 || rightSize < size / 8) {
+			if (--badAllowed == 0) {
+				std::make_heap(begin, end, less);
+				std::sort_heap(begin, end, less);
+				return;
+			}
+			shuffleEnds(begin, pivotPos);
+			shuffleEnds(pivotPos + 1, end);
+		}
+		else if (part.second && partialInsertionSort(begin, pivotPos, less)
+			&& partialInsertionSort(pivotPos + 1, end, less)) {
+			// It was (nearly) sorted already.
+			return;
+		}
+
+		// Recurse into the left side, and loop on the right.
+		sortLoop(begin, pivotPos, less, badAllowed, leftmost);
+		begin = pivotPos + 1;
+		leftmost = false;
+	}
+}
+
+} // namespace pdq
+
+template<typename T, typename Less>
+void PdqSort(T* begin, T* end, Less less)
+{
+	if (end - begin < 2) return;
+	int log2 = 0;
+	for (size_t n = size_t(end - begin); n > 1; n >>= 1)
+		log2++;
+	pdq::sortLoop(begin, end, less, log2, true);
+}
+
+template<typename T>
+void PdqSort(T* begin, T* end)
+{
+	PdqSort(begin, end, [](const T& a, const T& b) { return a < b; });
+}
+
+// Sorts ascending by value, with -0 before 0, and NaNs at the end.
+void RadixSortNums(double* a, size_t n);
+
+void SortTest();
@@ -0,0 +1,111 @@
+#include "sort.h"
+#include "test.h"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+// The inputs that trip up a plain quicksort, at sizes on either side of
+// the insertion sort and ninther cutoffs.
+static std::vector<int> Pattern(int pattern, int n, std::mt19937& rng)
+{
+	std::vector<int> v(n);
+	for (int i = 0; i < n; i++) {
+		switch (pattern) {
+		case 0: v[i] = int(rng() % 1000); break;		// random
+		case 1: v[i] = i; break;						// sorted
+		case 2: v[i] = n - i; break;					// reversed
+		case 3: v[i] = 7; break;						// all equal
+		case 4: v[i] = i < n / 2 ? i : n - i; break;	// organ pipe
+		case 5: v[i] = i % 16; break;					// sawtooth
+		default: v[i] = int(rng() % 4); break;		// few values
+		}
+	}
+	if (pattern == 1 && n > 2)
+		std::swap(v[n / 3], v[n / 2]);	// nearly sorted
+	return v;
+}
+
+static void PdqSortPatterns()
+{
+	std::mt19937 rng(1234);
+	for (int pattern = 0; pattern <= 6; pattern++) {
+		for (int n : { 0, 1, 2, 3, 23, 24, 25, 100, 129, 1000, 5000 }) {
+			std::vector<int> v = Pattern(pattern, n, rng);
+			std::vector<int> expected = v;
+			std::sort(expected.begin(), expected.end());
+			PdqSort(v.data(), v.data() + n);
+			TEST(v == expected);
+		}
+	}
+
+	// Sorted input is found out, and takes about one compare per element.
+	std::vector<int> sorted(10000);
+	for (int i = 0; i < 10000; i++)
+		sorted[i] = i;
+	size_t compares = 0;
+	PdqSort(sorted.data(), sorted.data() + sorted.size(), [&](int a, int b) {
+		compares++;
+		return a < b;
+	});
+	TEST(std::is_sorted(sorted.begin(), sorted.end()));
+	TEST(compares < 3 * sorted.size());
+
+	std::vector<std::string> strs = { "pear", "apple", "fig", "", "apple", "banana", "Zoo" };
+	std::vector<std::string> expected = strs;
+	std::sort(expected.begin(), expected.end());
+	PdqSort(strs.data(), strs.data() + strs.size());
+	TEST(strs == expected);
+}
+
+static bool SameBits(double a, double b)
+{
+	return memcmp(&a, &b, sizeof(double)) == 0;
+}
+
+static void RadixSort()
+{
+	std::mt19937 rng(99);
+	std::uniform_real_distribution<double> real(-1e6, 1e6);
+	for (size_t n : { 0, 1, 2, 255, 256, 257, 3000 }) {
+		std::vector<double> v(n);
+		for (size_t i = 0; i < n; i++) {
+			switch (rng() % 8) {
+			case 0: v[i] = double(rng() % 100); break;	// small integers
+			case 1: v[i] = -0.0; break;
+			case 2: v[i] = 0.0; break;
+			case 3: v[i] = (rng() & 1) ? HUGE_VAL : -HUGE_VAL; break;
+			case 4: v[i] = 1e-310; break;	// denormal
+			default: v[i] = real(rng); break;
+			}
+		}
+		if (n > 2)
+			v[n / 2] = NAN;
+		std::vector<double> expected = v;
+		std::sort(expected.begin(), expected.end(), [](double a, double b) {
+			if (isnan(a) || isnan(b))
+				return !isnan(a) && isnan(b);
+			if (a == b)
+				return signbit(a) && !signbit(b);	// -0 before 0
+			return a < b;
+		});
+		RadixSortNums(v.data(), n);
+		for (size_t i = 0; i < n; i++) {
+			if (isnan(expected[i])) {
+				TEST(isnan(v[i]));
+			}
+			else {
+				TEST(SameBits(v[i], expected[i]));
+			}
+		}
+	}
+}
+
+void SortTest()
+{
+	RUN_TEST(PdqSortPatterns());
+	RUN_TEST(RadixSort());
+}
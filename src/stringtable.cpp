@@ -0,0 +1,257 @@
+#include "stringtable.h"
+#include "allocator.h"
+#include "error.h"
+#include "pool.h"
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+static SlabPool& StrPool()
+{
+	// Never destroyed: strings may be released during static destruction.
+	static SlabPool* pool = new SlabPool(sizeof(StrObj));
+	return *pool;
+}
+
+static StrObj::Stats gStats;
+
+/*static*/ StrObj::Stats StrObj::GetStats()
+{
+	return gStats;
+}
+
+StrObj::StrObj(std::string&& s) : _length(s.size()), _str(std::move(s))
+{
+	attach(bytes());
+	gStats.count++;
+	gStats.bytes += sizeof(StrObj) + _str.capacity();
+}
+
+StrObj::StrObj(StrObj* left, StrObj* right) : _length(left->_length + right->_length)
+{
+	// Charged as if flattened: see bytes().
+	attach(sizeof(StrObj) + _str.capacity() + _length);
+	_left = left;
+	_right = right;
+	right->addRef();
+	gStats.count++;
+	gStats.bytes += sizeof(StrObj) + _str.capacity();
+}
+
+StrObj::~StrObj()
+{
+	gStats.count--;
+	gStats.bytes -= sizeof(StrObj) + _str.capacity();
+	if (_budget) {
+		_budget->uncharge(bytes());
+		_budget->release();
+	}
+}
+
+void StrObj::attach(size_t bytes)
+{
+	StrBudget* budget = StrBudget::Current();
+	if (!budget) return;
+	budget->charge(bytes);
+	budget->addRef();
+	_budget = budget;
+}
+
+/*static*/ void* StrObj::operator new(size_t size)
+{
+	REQUIRE(size == sizeof(StrObj));
+	return StrPool().alloc();
+}
+
+/*static*/ void StrObj::operator delete(void* p)
+{
+	StrPool().free(p);
+}
+
+/*static*/ size_t StrObj::Hash(const std::string& s)
+{
+	return std::hash<std::string>()(s);
+}
+
+/*static*/ StrObj* StrObj::Create(std::string s)
+{
+	return new StrObj(std::move(s));
+}
+
+size_t StrObj::hash() const
+{
+	if (!_hashed) {
+		_hash = Hash(str());
+		_hashed = true;
+	}
+	return _hash;
+}
+
+/*static*/ StrObj* StrObj::Concat(StrObj* left, StrObj* right)
+{
+	if (left->_refCount == 1 && !left->_table && !left->_left) {
+		const std::string& r = right->str();
+		const size_t before = left->bytes();
+		size_t charged = before;
+		const size_t capacity = left->_str.capacity();
+		if (left->_length + r.size() > capacity) {
+			// Charged before it grows, so going over the limit leaves
+			// 'left' as it was.
+			const size_t grown = std::max(left->_length + r.size(), 2 * capacity);
+			if (left->_budget) {
+				left->_budget->charge(grown - capacity);
+				charged += grown - capacity;
+			}
+			left->_str.reserve(grown);
+		}
+		gStats.bytes -= capacity;
+		left->_str += r;
+		gStats.bytes += left->_str.capacity();
+		left->_length = left->_str.size();
+		left->_hashed = false;
+		if (left->_budget)
+			left->_budget->recharge(charged, left->bytes());
+		return left;
+	}
+	if (left->_length + right->_length < kMinRope) {
+		StrObj* s = Create(left->str() + right->str());
+		left->release();
+		return s;
+	}
+	return new StrObj(left, right);
+}
+
+void StrObj::flatten() const
+{
+	REQUIRE(_left && _right);
+	const size_t before = bytes();
+	gStats.bytes -= _str.capacity();
+	_str.reserve(_length);
+
+	// In order, without recursion: ropes built in a loop are deep.
+	std::vector<const StrObj*> work = { _right, _left };
+	while (!work.empty()) {
+		const StrObj* s = work.back();
+		work.pop_back();
+		if (s->_left) {
+			work.push_back(s->_right);
+			work.push_back(s->_left);
+		}
+		else {
+			_str += s->_str;
+		}
+	}
+	gStats.bytes += _str.capacity();
+	_left->release();
+	_right->release();
+	_left = _right = nullptr;
+	if (_budget)
+		_budget->recharge(before, bytes());
+}
+
+void StrObj::release()
+{
+	REQUIRE(_refCount > 0);
+	if (--_refCount > 0)
+		return;
+
+	if (!_left) {
+		if (_table)
+			_table->remove(this);
+		delete this;
+		return;
+	}
+	// A rope: release the parts with a work list rather than recursion.
+	std::vector<StrObj*> dead = { this };
+	while (!dead.empty()) {
+		StrObj* s = dead.back();
+		dead.pop_back();
+		for (StrObj* part : { s->_left, s->_right }) {
+			if (part && --part->_refCount == 0)
+				dead.push_back(part);
+		}
+		if (s->_table)
+			s->_table->remove(s);
+		delete s;
+	}
+}
+
+StrBudget* StrBudget::gCurrent = nullptr;
+
+void StrBudget::charge(size_t bytes)
+{
+	if (!_limited) return;
+	_limited->charge(bytes);
+	_charged += bytes;
+}
+
+void StrBudget::uncharge(size_t bytes)
+{
+	if (!_limited) return;
+	_limited->uncharge(bytes);
+	_charged -= bytes;
+}
+
+void StrBudget::recharge(size_t from, size_t to)
+{
+	if (!_limited) return;
+	if (to >= from) {
+		_limited->charge(to - from, true);
+		_charged += to - from;
+	}
+	else {
+		uncharge(from - to);
+	}
+}
+
+void StrBudget::detach()
+{
+	if (_limited)
+		_limited->uncharge(_charged);
+	_limited = nullptr;
+	_charged = 0;
+}
+
+/*static*/ bool StrObj::Equal(const StrObj* a, const StrObj* b)
+{
+	if (a == b) return true;
+	// Interned in the same table, and not the same pointer.
+	if (a->_table && a->_table == b->_table) return false;
+	return a->_length == b->_length && a->hash() == b->hash() && a->str() == b->str();
+}
+
+StringTable::~StringTable()
+{
+	for (auto& it : index) {
+		it.second->_table = nullptr;
+	}
+}
+
+StrPtr StringTable::intern(const std::string& s)
+{
+	size_t h = StrObj::Hash(s);
+	auto range = index.equal_range(h);
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second->str() == s)
+			return StrPtr::Share(it->second);
+	}
+	StrObj* obj = new StrObj(std::string(s));
+	obj->_hash = h;
+	obj->_hashed = true;
+	obj->_table = this;
+	index.emplace(h, obj);
+	return StrPtr::Adopt(obj);
+}
+
+void StringTable::remove(StrObj* s)
+{
+	auto range = index.equal_range(s->hash());
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second == s) {
+			index.erase(it);
+			return;
+		}
+	}
+	REQUIRE(false);
+}
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <stddef.h>
+#include <string>
+#include <unordered_map>
+
+class LimitedAllocator;
+class StrBudget;
+class StringTable;
+
+/*
+* An immutable, refcounted string, with its hash computed once. Copying
+* a string Value shares the StrObj, rather than copying the characters.
+*
+* Strings from a StringTable are interned: the table has one StrObj for
+* each distinct string, so two strings interned in the same table are
+* equal exactly when their pointers are.
+*
+* Concat() defers the work: the result is a rope (the two strings it
+* joins), which is flattened the first time its characters are needed.
+* So building a string with 'log = log + line' copies each line once,
+* rather than the whole log each time.
+*
+* A string made while a StrBudget is current is charged to it, for as
+* long as it lives.
+*/
+class StrObj {
+public:
+	// A new, not interned string, with a ref count of 1.
+	static StrObj* Create(std::string s);
+	// 'left' + 'right'. Takes over the caller's reference to 'left', and
+	// returns a new reference. If that was the only reference (and 'left'
+	// is flat and not interned) it is appended to in place.
+	static StrObj* Concat(StrObj* left, StrObj* right);
+
+	const std::string& str() const {
+		if (_left) flatten();
+		return _str;
+	}
+	size_t length() const { return _length; }
+	size_t hash() const;
+	bool isInterned() const { return _table != nullptr; }
+	bool isRope() const { return _left != nullptr; }
+	int refCount() const { return _refCount; }
+
+	void addRef() { _refCount++; }
+	void release();		// deletes the string when the count reaches 0
+
+	static size_t Hash(const std::string& s);
+	static bool Equal(const StrObj* a, const StrObj* b);
+
+	// Every live string, from every Interpreter, since they are shared.
+	// Bytes are the StrObjs, and the capacity of their characters.
+	struct Stats {
+		size_t count = 0;
+		size_t bytes = 0;
+	};
+	static Stats GetStats();
+
+	// StrObjs come from a SlabPool, rather than malloc. A string can
+	// outlive the Interpreter that made it (a script's result) so the
+	// pool is shared, rather than owned by a Heap.
+	static void* operator new(size_t size);
+	static void operator delete(void* p);
+
+	// Ropes shorter than this are joined right away.
+	static constexpr size_t kMinRope = 128;
+
+private:
+	friend class StringTable;
+	StrObj(std::string&& s);
+	// Takes over the caller's reference to 'left'.
+	StrObj(StrObj* left, StrObj* right);
+	~StrObj();
+	StrObj(const StrObj&) = delete;
+	StrObj& operator=(const StrObj&) = delete;
+
+	void flatten() const;
+
+	// What is charged to the budget. A rope is charged for the characters
+	// it will flatten to, so the limit stops a string being built up, not
+	// just read.
+	size_t bytes() const { return sizeof(StrObj) + _str.capacity() + (_left ? _length : 0); }
+	// Charges the current budget, if any, or throws OutOfMemory.
+	void attach(size_t bytes);
+
+	int _refCount = 1;
+	size_t _length = 0;
+	mutable size_t _hash = 0;
+	mutable bool _hashed = false;
+	StringTable* _table = nullptr;
+	StrBudget* _budget = nullptr;
+	mutable std::string _str;
+	// A rope until flattened.
+	mutable StrObj* _left = nullptr;
+	mutable StrObj* _right = nullptr;
+};
+
+/*
+* The bytes of the strings an Interpreter makes, charged against its
+* Heap's memory limit. The Interpreter makes its budget current (with a
+* Scope) while it runs; making or growing a string that would go over the
+* limit throws OutOfMemory.
+*
+* Refcounted by the strings charged to it, since they can outlive the
+* Interpreter. The Heap detach()es it when it is destroyed: the charges
+* are taken back, and later ones ignored.
+*/
+class StrBudget {
+public:
+	StrBudget(LimitedAllocator& limited) : _limited(&limited) {}
+	StrBudget(const StrBudget&) = delete;
+	StrBudget& operator=(const StrBudget&) = delete;
+
+	void addRef() { _refCount++; }
+	void release() { if (--_refCount == 0) delete this; }
+
+	void charge(size_t bytes);
+	void uncharge(size_t bytes);
+	// For a string that has already changed size: never throws.
+	void recharge(size_t from, size_t to);
+	void detach();
+
+	static StrBudget* Current() { return gCurrent; }
+
+	class Scope {
+	public:
+		Scope(StrBudget* budget) : _prev(gCurrent) { gCurrent = budget; }
+		~Scope() { gCurrent = _prev; }
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+	private:
+		StrBudget* _prev;
+	};
+
+private:
+	~StrBudget() {}
+
+	static StrBudget* gCurrent;
+	LimitedAllocator* _limited;		// null once detached
+	size_t _charged = 0;
+	int _refCount = 1;
+};
+
+// Holds a reference to a StrObj, as HeapPtr does for a HeapObject.
+class StrPtr {
+public:
+	StrPtr() {}
+	~StrPtr() { clear(); }
+
+	StrPtr(const StrPtr& other) : _ptr(other._ptr) {
+		if (_ptr) _ptr->addRef();
+	}
+	StrPtr(StrPtr&& other) noexcept : _ptr(other._ptr) {
+		other._ptr = nullptr;
+	}
+	StrPtr& operator=(const StrPtr& other) {
+		if (other._ptr) other._ptr->addRef();
+		clear();
+		_ptr = other._ptr;
+		return *this;
+	}
+	StrPtr& operator=(StrPtr&& other) noexcept {
+		if (this != &other) {
+			clear();
+			_ptr = other._ptr;
+			other._ptr = nullptr;
+		}
+		return *this;
+	}
+
+	// Takes over a reference the caller already holds (from Create()).
+	static StrPtr Adopt(StrObj* p) { StrPtr s; s._ptr = p; return s; }
+	// Adds a reference.
+	static StrPtr Share(StrObj* p) { if (p) p->addRef(); return Adopt(p); }
+
+	StrObj* get() const { return _ptr; }
+	const std::string& str() const { return _ptr->str(); }
+	explicit operator bool() const { return _ptr != nullptr; }
+
+	// Identity, which is equality for strings from the same StringTable.
+	bool operator==(const StrPtr& rhs) const { return _ptr == rhs._ptr; }
+	bool operator!=(const StrPtr& rhs) const { return _ptr != rhs._ptr; }
+
+	struct Hash {
+		size_t operator()(const StrPtr& s) const { return s._ptr ? s._ptr->hash() : 0; }
+	};
+
+	void clear() {
+		if (_ptr) {
+			_ptr->release();
+			_ptr = nullptr;
+		}
+	}
+
+private:
+	StrObj* _ptr = nullptr;
+};
+
+// The intern table. It doesn't hold references: a string leaves the table
+// when its last reference is released. Strings that outlive the table
+// are no longer interned, but are still valid.
+class StringTable {
+public:
+	StringTable() {}
+	~StringTable();
+
+	StringTable(const StringTable&) = delete;
+	StringTable& operator=(const StringTable&) = delete;
+
+	StrPtr intern(const std::string& s);
+	size_t size() const { return index.size(); }
+
+private:
+	friend class StrObj;
+	void remove(StrObj* s);
+
+	std::unordered_multimap<size_t, StrObj*> index;	// hash -> string
+};
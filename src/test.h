@@ -2,6 +2,7 @@
 
 #include <fmt/core.h>
 #include <assert.h>
+#include <math.h>
 
 #define TEST(x)                                                 \
 	if (!(x)) {	                                                \
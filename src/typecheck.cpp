@@ -0,0 +1,280 @@
+#include "typecheck.h"
+#include "func.h"
+
+void TypeChecker::check(const std::vector<ASTStmtPtr>& stmts)
+{
+	REQUIRE(scopes.size() == 1);
+	for (const ASTStmtPtr& stmt : stmts) {
+		if (stmt) stmt->accept(*this, 0);
+	}
+}
+
+ValueType TypeChecker::resolve(const ASTExprPtr& expr)
+{
+	if (!expr) return ValueType();
+	expr->accept(*this, 0);
+	return expr->staticType;
+}
+
+void TypeChecker::declare(const std::string& name, ValueType type)
+{
+	// A re-declaration is a run-time error, and the variable keeps its old
+	// value. So if the types differ, it could be either.
+	std::map<std::string, ValueType>& scope = scopes.back();
+	auto it = scope.find(name);
+	if (it != scope.end() && it->second != type)
+		type = ValueType();
+	scope[name] = type;
+}
+
+bool TypeChecker::declared(const std::string& name) const
+{
+	for (const std::map<std::string, ValueType>& scope : scopes) {
+		if (scope.count(name))
+			return true;
+	}
+	return false;
+}
+
+ValueType TypeChecker::lookup(const std::string& name) const
+{
+	for (size_t i = scopes.size(); i > 0; i--) {
+		auto it = scopes[i - 1].find(name);
+		if (it != scopes[i - 1].end())
+			return it->second;
+	}
+	if (ffi && ffi->returnType(name) != ValueType())
+		return ValueType(PType::tFunc);
+	return ValueType();
+}
+
+/*static*/ ValueType TypeChecker::BinaryType(TokenType op, ValueType operands)
+{
+	if (operands.layout != Layout::tScalar)
+		return ValueType();
+
+	switch (operands.pType) {
+	case PType::tNum:
+		switch (op) {
+		case TokenType::PLUS:
+		case TokenType::MINUS:
+		case TokenType::MULT:
+		case TokenType::DIVIDE:
+			return ValueType(PType::tNum);
+		case TokenType::LESS:
+		case TokenType::LESS_EQUAL:
+		case TokenType::GREATER:
+		case TokenType::GREATER_EQUAL:
+		case TokenType::EQUAL_EQUAL:
+		case TokenType::BANG_EQUAL:
+			return ValueType(PType::tBool);
+		default:
+			break;
+		}
+		break;
+	case PType::tStr:
+		if (op == TokenType::PLUS)
+			return ValueType(PType::tStr);
+		if (op == TokenType::EQUAL_EQUAL || op == TokenType::BANG_EQUAL)
+			return ValueType(PType::tBool);
+		break;
+	case PType::tBool:
+		if (op == TokenType::EQUAL_EQUAL || op == TokenType::BANG_EQUAL)
+			return ValueType(PType::tBool);
+		break;
+	default:
+		break;
+	}
+	return ValueType();
+}
+
+/*static*/ ValueType TypeChecker::NumListBinaryType(TokenType op, ValueType left, ValueType right)
+{
+	const ValueType kNum(PType::tNum);
+	const ValueType kNumList(PType::tNum, Layout::tList);
+	if ((left != kNum && left != kNumList) || (right != kNum && right != kNumList))
+		return ValueType();
+
+	// The scalar result type, as a list.
+	ValueType type = BinaryType(op, kNum);
+	if (type != ValueType())
+		type.layout = Layout::tList;
+	return type;
+}
+
+void TypeChecker::visit(const ASTValueExpr& node, int)
+{
+	node.staticType = node.value.type;
+}
+
+void TypeChecker::visit(const ASTIdentifierExpr& node, int)
+{
+	node.staticType = lookup(node.name.str());
+}
+
+void TypeChecker::visit(const ASTAssignmentExpr& node, int)
+{
+	// Both engines check that the new value has the type of the variable.
+	ValueType right = resolve(node.right);
+	ValueType var = lookup(node.name.str());
+	node.staticType = right == var ? var : ValueType();
+}
+
+void TypeChecker::visit(const ASTBinaryExpr& node, int)
+{
+	ValueType left = resolve(node.left);
+	ValueType right = resolve(node.right);
+	if (left == ValueType(PType::tNum, Layout::tList) || right == ValueType(PType::tNum, Layout::tList))
+		node.staticType = NumListBinaryType(node.type, left, right);
+	else
+		node.staticType = left == right ? BinaryType(node.type, left) : ValueType();
+}
+
+void TypeChecker::visit(const ASTUnaryExpr& node, int)
+{
+	ValueType right = resolve(node.right);
+	if (node.type == TokenType::BANG)
+		node.staticType = ValueType(PType::tBool);
+	else if (node.type == TokenType::MINUS && right == ValueType(PType::tNum))
+		node.staticType = right;
+	else
+		node.staticType = ValueType();
+}
+
+void TypeChecker::visit(const ASTLogicalExpr& node, int)
+{
+	// If the left side decides, the result is a bool; else it is the right side.
+	resolve(node.left);
+	ValueType right = resolve(node.right);
+	node.staticType = right == ValueType(PType::tBool) ? right : ValueType();
+}
+
+void TypeChecker::visit(const ASTCallExpr& node, int)
+{
+	resolve(node.callee);
+	for (const ASTExprPtr& arg : node.arguments) {
+		resolve(arg);
+	}
+
+	// FFI::call() checks the return type.
+	node.staticType = ValueType();
+	const ASTIdentifierExpr* ident = node.callee->asIdentifier();
+	if (ffi && ident && !declared(ident->name.str()) && node.callee->staticType == ValueType(PType::tFunc))
+		node.staticType = ffi->returnType(ident->name.str());
+}
+
+/*static*/ ValueType TypeChecker::ElementType(ValueType list)
+{
+	if (list.layout == Layout::tScalar)
+		return ValueType();
+	return ValueType(list.pType);
+}
+
+/*static*/ ValueType TypeChecker::IndexType(ValueType list)
+{
+	return ValueType(list.layout == Layout::tMap ? PType::tStr : PType::tNum);
+}
+
+void TypeChecker::visit(const ASTListExpr& node, int)
+{
+	// The engines check each element against the type.
+	bool known = node.type.pType != PType::tNone;
+	for (const ASTExprPtr& e : node.elements) {
+		known = resolve(e) == ValueType(node.type.pType) && known;
+	}
+	node.staticType = known ? node.type : ValueType();
+}
+
+void TypeChecker::visit(const ASTIndexExpr& node, int)
+{
+	ValueType list = resolve(node.list);
+	ValueType index = resolve(node.index);
+	node.staticType = index == IndexType(list) ? ElementType(list) : ValueType();
+}
+
+void TypeChecker::visit(const ASTIndexAssignExpr& node, int)
+{
+	ValueType list = resolve(node.list);
+	ValueType index = resolve(node.index);
+	ValueType right = resolve(node.right);
+	node.staticType = index == IndexType(list) && right == ElementType(list) ? right : ValueType();
+}
+
+void TypeChecker::visit(const ASTSliceExpr& node, int)
+{
+	ValueType list = resolve(node.list);
+	ValueType begin = node.begin ? resolve(node.begin) : ValueType(PType::tNum);
+	ValueType end = node.end ? resolve(node.end) : ValueType(PType::tNum);
+	const bool known = list.layout == Layout::tList && begin == ValueType(PType::tNum) && end == ValueType(PType::tNum);
+	node.staticType = known ? list : ValueType();
+}
+
+void TypeChecker::visit(const ASTListFuncExpr& node, int)
+{
+	ValueType list;
+	for (size_t i = 0; i < node.arguments.size(); i++) {
+		ValueType t = resolve(node.arguments[i]);
+		if (i == 0) list = t;
+	}
+	switch (node.func) {
+	case ListFunc::kPop: node.staticType = ElementType(list); break;
+	case ListFunc::kSize: node.staticType = list.layout != Layout::tScalar ? ValueType(PType::tNum) : ValueType(); break;
+	case ListFunc::kHas:
+	case ListFunc::kRemove: node.staticType = list.layout == Layout::tMap ? ValueType(PType::tBool) : ValueType(); break;
+	case ListFunc::kKeys: node.staticType = list.layout == Layout::tMap ? ValueType(PType::tStr, Layout::tList) : ValueType(); break;
+	default: node.staticType = ValueType(); break;
+	}
+}
+
+void TypeChecker::visit(const ASTExprStmt& node, int)
+{
+	resolve(node.expr);
+}
+
+void TypeChecker::visit(const ASTReturnStmt& node, int)
+{
+	resolve(node.expr);
+}
+
+void TypeChecker::visit(const ASTBlockStmt& node, int)
+{
+	scopes.emplace_back();
+	for (const ASTStmtPtr& stmt : node.stmts) {
+		stmt->accept(*this, 0);
+	}
+	scopes.pop_back();
+}
+
+void TypeChecker::visit(const ASTVarDeclStmt& node, int)
+{
+	// The declared type is only trusted if the initializer has it: the
+	// engines don't (all) check the declaration.
+	ValueType type = node.valueType;
+	if (node.expr && resolve(node.expr) != type)
+		type = ValueType();
+	declare(node.name.str(), type);
+}
+
+void TypeChecker::visit(const ASTIfStmt& node, int)
+{
+	resolve(node.condition);
+	node.thenBranch->accept(*this, 0);
+	if (node.elseBranch)
+		node.elseBranch->accept(*this, 0);
+}
+
+void TypeChecker::visit(const ASTWhileStmt& node, int)
+{
+	resolve(node.condition);
+	node.body->accept(*this, 0);
+}
+
+void TypeChecker::visit(const ASTFuncDeclStmt& node, int)
+{
+	scopes.emplace_back();
+	for (const Param& param : node.params) {
+		declare(param.name, param.valueType);
+	}
+	node.body->accept(*this, 0);
+	scopes.pop_back();
+}
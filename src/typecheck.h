@@ -0,0 +1,69 @@
+#pragma once
+
+#include "ast.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+class FFI;
+
+/*
+* Resolves the static type of every expression, and stores it in
+* ASTExprNode::staticType, so code generation can emit the typed
+* op codes (ADD_NUM, CONCAT_STR, etc.) that skip the run-time checks.
+*
+* Types come from the declarations (Parser::varDecl) and values, and
+* flow up through the operators. Anything that can't be resolved - a
+* type error, or a global declared somewhere else - is left as
+* ValueType() and is checked at run time, as before. Globals are
+* remembered between calls to check(), for the REPL.
+*/
+class TypeChecker : public ASTExprVisitor, public ASTStmtVisitor {
+public:
+	TypeChecker(const FFI* ffi = nullptr) : ffi(ffi) { scopes.resize(1); }
+
+	void check(const std::vector<ASTStmtPtr>& stmts);
+
+	void visit(const ASTValueExpr& node, int depth) override;
+	void visit(const ASTIdentifierExpr& node, int depth) override;
+	void visit(const ASTAssignmentExpr& node, int depth) override;
+	void visit(const ASTBinaryExpr& node, int depth) override;
+	void visit(const ASTUnaryExpr& node, int depth) override;
+	void visit(const ASTLogicalExpr& node, int depth) override;
+	void visit(const ASTCallExpr& node, int depth) override;
+	void visit(const ASTListExpr& node, int depth) override;
+	void visit(const ASTIndexExpr& node, int depth) override;
+	void visit(const ASTIndexAssignExpr& node, int depth) override;
+	void visit(const ASTSliceExpr& node, int depth) override;
+	void visit(const ASTListFuncExpr& node, int depth) override;
+
+	void visit(const ASTExprStmt& node, int depth) override;
+	void visit(const ASTReturnStmt& node, int depth) override;
+	void visit(const ASTBlockStmt& node, int depth) override;
+	void visit(const ASTVarDeclStmt& node, int depth) override;
+	void visit(const ASTIfStmt& node, int depth) override;
+	void visit(const ASTWhileStmt& node, int depth) override;
+	void visit(const ASTFuncDeclStmt& node, int depth) override;
+
+	// The type of an operator, given known (and equal) operand types.
+	// ValueType() if the operator doesn't apply.
+	static ValueType BinaryType(TokenType op, ValueType operands);
+	// The num[] operators (see vecops.h), where either operand is a num[].
+	static ValueType NumListBinaryType(TokenType op, ValueType left, ValueType right);
+
+private:
+	ValueType resolve(const ASTExprPtr& expr);	// checks the expression, and returns its type
+	void declare(const std::string& name, ValueType type);
+	ValueType lookup(const std::string& name) const;
+	// A variable the script declared, which may hide a builtin.
+	bool declared(const std::string& name) const;
+	// The element type of a list or map type, or ValueType() if it isn't one.
+	static ValueType ElementType(ValueType list);
+	// The type that indexes it: num for a list, str for a map.
+	static ValueType IndexType(ValueType list);
+
+	const FFI* ffi;
+	// scopes[0] is the globals
+	std::vector<std::map<std::string, ValueType>> scopes;
+};
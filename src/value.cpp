@@ -1,4 +1,5 @@
 #include "value.h"
+#include "hashmap.h"
 
 #include <fmt/core.h>
 #include <assert.h>
@@ -30,24 +31,41 @@ Value Value::Default(ValueType valueType, Heap& heap)
 
 		switch (valueType.pType) {
 		case PType::tNum:
-			obj = new NumList(0);
+			obj = heap.make<NumList>(heap, 0);
 			break;
 		case PType::tBool:
-			obj = new BoolList(0);
+			obj = heap.make<BoolList>(heap, 0);
 			break;
 		case PType::tStr:
-			obj = new StrList(0);
+			obj = heap.make<StrList>(heap, 0);
 			break;
 		case PType::tFunc:
 		default:
 			break;
 		}
 		REQUIRE(obj);
-		heap.add(obj);
 		v.heapPtr.set(obj);
 	}
 	else if (valueType.layout == Layout::tMap) {
-		assert(false); // not yet implemented
+		v.type = valueType;
+		HeapObject* obj = nullptr;
+
+		switch (valueType.pType) {
+		case PType::tNum:
+			obj = heap.make<NumMap>(heap, 0);
+			break;
+		case PType::tBool:
+			obj = heap.make<BoolMap>(heap, 0);
+			break;
+		case PType::tStr:
+			obj = heap.make<StrMap>(heap, 0);
+			break;
+		case PType::tFunc:
+		default:
+			break;
+		}
+		REQUIRE(obj);
+		v.heapPtr.set(obj);
 	}
 	else {
 		assert(false); // not yet implemented
@@ -56,6 +74,24 @@ Value Value::Default(ValueType valueType, Heap& heap)
 }
 
 
+uint64_t Value::stringAllocations = 0;
+
+/*static*/ Value Value::Concat(Value&& lhs, const Value& rhs)
+{
+	REQUIRE(lhs.type == ValueType(PType::tStr) && rhs.type == ValueType(PType::tStr));
+	StrObj* s = StrObj::Concat(lhs.vStr, rhs.vStr);
+	if (s != lhs.vStr)
+		stringAllocations++;
+	// The reference to the lhs string went to Concat().
+	lhs.type = ValueType();
+	lhs.vNumber = 0;
+
+	Value v;
+	v.type.pType = PType::tStr;
+	v.vStr = s;
+	return v;
+}
+
 Value::Value(const Value& rhs)
 {
 	copy(rhs);
@@ -68,9 +104,24 @@ Value& Value::operator=(const Value& rhs)
 	return *this;
 }
 
+Value::Value(Value&& rhs) noexcept
+{
+	move(rhs);
+}
+
+Value& Value::operator=(Value&& rhs) noexcept
+{
+	if (this == &rhs) return *this;
+	clear();
+	move(rhs);
+	return *this;
+}
+
 bool Value::operator==(const Value& rhs) const
 {
 	if (type != rhs.type) return false;
+	// Lists and maps are references: equal if they are the same object.
+	if (type.layout != Layout::tScalar) return heapPtr.get() == rhs.heapPtr.get();
 	assert(type.layout == Layout::tScalar); // not yet implemented
 	assert(rhs.type.layout == Layout::tScalar); // not yet implemented
 
@@ -78,8 +129,8 @@ bool Value::operator==(const Value& rhs) const
 	case PType::tNone: return true;
 	case PType::tNum: return vNumber == rhs.vNumber;
 	case PType::tBool: return vBoolean == rhs.vBoolean;
-	case PType::tStr: return *vString == *rhs.vString;
-	case PType::tFunc: return *vString == *rhs.vString;
+	case PType::tStr: return StrObj::Equal(vStr, rhs.vStr);
+	case PType::tFunc: return StrObj::Equal(vStr, rhs.vStr);
 	default:
 		assert(false); // not yet implemnted
 	}
@@ -93,26 +144,22 @@ Value::~Value()
 
 void Value::clear()
 {
-	if (type.layout == Layout::tList) {
+	if (type.layout != Layout::tScalar) {
 		heapPtr.clear();
 	}
-	else if (type.layout == Layout::tMap) {
-		assert(false); // not yet implemented
-	}
-
-	switch (type.pType) {
-	case PType::tNone:
-	case PType::tNum:
-	case PType::tBool:
-		break;
-	case PType::tStr: 
-		delete vString;
-		break;
-	case PType::tFunc:
-		delete vString;
-		break;
-	default:
-		REQUIRE(false);
+	else {
+		switch (type.pType) {
+		case PType::tNone:
+		case PType::tNum:
+		case PType::tBool:
+			break;
+		case PType::tStr:
+		case PType::tFunc:
+			vStr->release();
+			break;
+		default:
+			REQUIRE(false);
+		}
 	}
 	type = PType::tNone;
 	vNumber = 0;
@@ -124,6 +171,12 @@ void Value::copy(const Value& rhs)
 	assert(type.layout == Layout::tScalar); // not yet implemented
 
 	type = rhs.type;
+	if (type.layout != Layout::tScalar) {
+		// The list or map is shared, not copied.
+		if (rhs.heapPtr.get())
+			heapPtr.set(rhs.heapPtr.get());
+		return;
+	}
 	switch (type.pType) {
 	case PType::tNone:
 		vNumber = 0;
@@ -135,18 +188,86 @@ void Value::copy(const Value& rhs)
 		vBoolean = rhs.vBoolean;
 		break;
 	case PType::tStr:
-		vString = new std::string(*rhs.vString); 
-		break;
 	case PType::tFunc:
-		vString = new std::string(*rhs.vString);
+		vStr = rhs.vStr;
+		vStr->addRef();
 		break;
 	default:
 		assert(false); // not yet implemented
 	}
 }
 
+// Takes the string, or the list, and leaves 'rhs' as none.
+// 'this' must be clear.
+void Value::move(Value& rhs) noexcept
+{
+	type = rhs.type;
+	if (type.layout != Layout::tScalar) {
+		heapPtr = std::move(rhs.heapPtr);
+		vNumber = 0;
+	}
+	else {
+		switch (type.pType) {
+		case PType::tStr:
+		case PType::tFunc:
+			vStr = rhs.vStr;
+			break;
+		case PType::tBool:
+			vBoolean = rhs.vBoolean;
+			break;
+		default:
+			vNumber = rhs.vNumber;
+			break;
+		}
+	}
+	rhs.type = ValueType();
+	rhs.vNumber = 0;
+}
+
+template<typename L>
+static std::string ListToString(const L* list)
+{
+	std::string s = "[";
+	for (int i = 0; i < list->size(); i++) {
+		if (i) s += ", ";
+		s += fmt::format("{}", list->get(i));
+	}
+	return s + "]";
+}
+
+template<typename M>
+static std::string MapToString(const M* map)
+{
+	std::string s = "{";
+	bool first = true;
+	map->forEach([&](const std::string& key, const auto& value) {
+		if (!first) s += ", ";
+		first = false;
+		s += fmt::format("{}: {}", key, value);
+	});
+	return s + "}";
+}
+
 std::string Value::toString() const
 {
+	if (type.layout == Layout::tList) {
+		const HeapObject* obj = heapPtr.get();
+		switch (type.pType) {
+		case PType::tNum: return ListToString(static_cast<const NumList*>(obj));
+		case PType::tBool: return ListToString(static_cast<const BoolList*>(obj));
+		case PType::tStr: return ListToString(static_cast<const StrList*>(obj));
+		default: break;
+		}
+	}
+	if (type.layout == Layout::tMap) {
+		const HeapObject* obj = heapPtr.get();
+		switch (type.pType) {
+		case PType::tNum: return MapToString(static_cast<const NumMap*>(obj));
+		case PType::tBool: return MapToString(static_cast<const BoolMap*>(obj));
+		case PType::tStr: return MapToString(static_cast<const StrMap*>(obj));
+		default: break;
+		}
+	}
 	assert(type.layout == Layout::tScalar); // not yet implemented
 
 	switch (type.pType) {
@@ -157,9 +278,9 @@ std::string Value::toString() const
 	case PType::tBool:
 		return vBoolean ? "true" : "false";
 	case PType::tStr:
-		return *vString;
+		return vStr->str();
 	case PType::tFunc:
-		return *vString;
+		return vStr->str();
 	default:
 		assert(false); // not implemented
 	}
@@ -169,6 +290,25 @@ std::string Value::toString() const
 
 bool Value::isTruthy() const
 {
+	// A list or map, like a str, is true if it isn't empty.
+	if (type.layout == Layout::tList) {
+		const HeapObject* obj = heapPtr.get();
+		switch (type.pType) {
+		case PType::tNum: return static_cast<const NumList*>(obj)->size() > 0;
+		case PType::tBool: return static_cast<const BoolList*>(obj)->size() > 0;
+		case PType::tStr: return static_cast<const StrList*>(obj)->size() > 0;
+		default: break;
+		}
+	}
+	if (type.layout == Layout::tMap) {
+		const HeapObject* obj = heapPtr.get();
+		switch (type.pType) {
+		case PType::tNum: return static_cast<const NumMap*>(obj)->size() > 0;
+		case PType::tBool: return static_cast<const BoolMap*>(obj)->size() > 0;
+		case PType::tStr: return static_cast<const StrMap*>(obj)->size() > 0;
+		default: break;
+		}
+	}
 	assert(type.layout == Layout::tScalar); // not yet implemented
 
 	switch (type.pType) {
@@ -179,7 +319,7 @@ bool Value::isTruthy() const
 	case PType::tBool:
 		return vBoolean;
 	case PType::tStr:
-		return !vString->empty();
+		return vStr->length() > 0;
 	case PType::tFunc:
 		return true;
 	default:
@@ -3,8 +3,10 @@
 #include "error.h"
 #include "type.h"
 #include "heap.h"
+#include "stringtable.h"
 
 #include <string>
+#include <utility>
 #include <vector>
 #include <map>
 
@@ -14,8 +16,8 @@ struct Value {
 
 	Value(const Value& rhs); // II. copy constructor
 	Value& operator=(const Value& other); // III. copy assignment
-	//Value(Value&& other) noexcept; // IV. move constructor
-	//Value& operator=(Value&& rhs) noexcept; // V. move assignment
+	Value(Value&& other) noexcept; // IV. move constructor
+	Value& operator=(Value&& rhs) noexcept; // V. move assignment
 	
 	bool operator==(const Value& rhs) const;
 	bool operator!=(const Value& rhs) const { return !(*this == rhs); }
@@ -26,19 +28,33 @@ struct Value {
 	static Value Number(double v) {
 		Value val; val.type.pType = PType::tNum; val.vNumber = v; return val;
 	}
-	static Value String(const std::string& v) {
-		Value val; val.type.pType = PType::tStr; val.vString = new std::string(v); return val;
+	static Value String(std::string v) {
+		Value val; val.type.pType = PType::tStr; val.vStr = NewString(std::move(v)); return val;
+	}
+	// Shares the string, which may be interned.
+	static Value String(const StrPtr& v) {
+		Value val; val.type.pType = PType::tStr; val.vStr = Share(v); return val;
 	}
 	static Value Boolean(bool v) {
 		Value val; val.type.pType = PType::tBool; val.vBoolean = v; return val;
 	}
-	static Value Func(const std::string& v) {
-		Value val; val.type.pType = PType::tFunc; val.vString = new std::string(v); return val;
+	static Value Func(std::string v) {
+		Value val; val.type.pType = PType::tFunc; val.vStr = NewString(std::move(v)); return val;
+	}
+	static Value Func(const StrPtr& v) {
+		Value val; val.type.pType = PType::tFunc; val.vStr = Share(v); return val;
 	}
 	static Value Default(ValueType valueType, Heap& heap);
 
+	// lhs + rhs, for strings (see StrObj::Concat). 'lhs' is moved from,
+	// so a string that only it holds can be appended to in place.
+	static Value Concat(Value&& lhs, const Value& rhs);
+
 	std::string toString() const;
 
+	// The characters of a str or func. Warning: unchecked!
+	const std::string& str() const { return vStr->str(); }
+
 	// Oh boy. This is always up to debate.
 	bool isTruthy() const;
 	bool isFalsey() const { return !isTruthy(); }
@@ -46,12 +62,27 @@ struct Value {
 	ValueType type;
 	union {
 		double vNumber;
-		std::string* vString;
+		StrObj* vStr;		// str and func: immutable, so copies share it
 		bool vBoolean;
 	};
 	HeapPtr heapPtr;
 
+	// Count of the strings allocated by String() and Func(), so tests
+	// can check that values are shared rather than copied.
+	static uint64_t stringAllocations;
+
 private:
 	void clear();
 	void copy(const Value& rhs);
+	void move(Value& rhs) noexcept;
+
+	static StrObj* NewString(std::string&& s) {
+		stringAllocations++;
+		return StrObj::Create(std::move(s));
+	}
+	static StrObj* Share(const StrPtr& s) {
+		REQUIRE(s);
+		s.get()->addRef();
+		return s.get();
+	}
 };
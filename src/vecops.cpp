@@ -0,0 +1,600 @@
+#include "vecops.h"
+
+#include <fmt/core.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#	define VEC_X86() 1
+#	include <immintrin.h>
+#	if defined(_MSC_VER)
+#		include <intrin.h>
+#	endif
+#else
+#	define VEC_X86() 0
+#endif
+
+// The AVX kernels are compiled for AVX whatever the target, and only
+// called when the CPU has it. (MSVC allows the intrinsics anywhere.)
+#if defined(__GNUC__) || defined(__clang__)
+#	define TARGET_AVX __attribute__((target("avx")))
+#else
+#	define TARGET_AVX
+#endif
+
+static SimdLevel Detect()
+{
+#if VEC_X86()
+#	if defined(__GNUC__) || defined(__clang__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx"))
+		return SimdLevel::kAVX;
+#	else
+	// AVX, and the OS saves the YMM registers.
+	int info[4] = {};
+	__cpuid(info, 1);
+	const bool osxsave = (info[2] & (1 << 27)) != 0;
+	const bool avx = (info[2] & (1 << 28)) != 0;
+	if (osxsave && avx && (_xgetbv(0) & 6) == 6)
+		return SimdLevel::kAVX;
+#	endif
+	return SimdLevel::kSSE2;	// every x86-64 has it
+#else
+	return SimdLevel::kScalar;
+#endif
+}
+
+SimdLevel DetectSimdLevel()
+{
+	static const SimdLevel level = Detect();
+	return level;
+}
+
+static SimdLevel gLevel = DetectSimdLevel();
+
+SimdLevel GetSimdLevel()
+{
+	return gLevel;
+}
+
+void SetSimdLevel(SimdLevel level)
+{
+	gLevel = level < DetectSimdLevel() ? level : DetectSimdLevel();
+}
+
+const char* SimdLevelName(SimdLevel level)
+{
+	switch (level) {
+	case SimdLevel::kAVX: return "AVX";
+	case SimdLevel::kSSE2: return "SSE2";
+	default: return "scalar";
+	}
+}
+
+// One element.
+template<VecOp OP>
+static inline double Arith(double a, double b)
+{
+	switch (OP) {
+	case VecOp::kAdd: return a + b;
+	case VecOp::kSub: return a - b;
+	case VecOp::kMul: return a * b;
+	default: return a / b;
+	}
+}
+
+template<VecOp OP>
+static inline bool Compare(double a, double b)
+{
+	switch (OP) {
+	case VecOp::kLess: return a < b;
+	case VecOp::kLessEqual: return a <= b;
+	case VecOp::kGreater: return a > b;
+	case VecOp::kGreaterEqual: return a >= b;
+	case VecOp::kEqual: return a == b;
+	default: return a != b;
+	}
+}
+
+// Element i of an operand, which is p[0] if it is broadcast.
+template<bool BROADCAST>
+static inline double At(const double* p, size_t i)
+{
+	return BROADCAST ? p[0] : p[i];
+}
+
+// The plain loops, which also do the tails of the SIMD ones.
+template<VecOp OP, Broadcast B>
+static void ArithLoop(const double* a, const double* b, double* out, size_t i, size_t n)
+{
+	for (; i < n; i++)
+		out[i] = Arith<OP>(At<B == Broadcast::kLeft>(a, i), At<B == Broadcast::kRight>(b, i));
+}
+
+template<VecOp OP, Broadcast B>
+static void CompareLoop(const double* a, const double* b, uint8_t* out, size_t i, size_t n)
+{
+	for (; i < n; i++)
+		out[i] = Compare<OP>(At<B == Broadcast::kLeft>(a, i), At<B == Broadcast::kRight>(b, i)) ? 1 : 0;
+}
+
+#if VEC_X86()
+
+// A compare mask (one bit per element, from movemask) as bytes of 0 or 1.
+static const uint32_t kMaskBytes[16] = {
+	0x00000000, 0x00000001, 0x00000100, 0x00000101,
+	0x00010000, 0x00010001, 0x00010100, 0x00010101,
+	0x01000000, 0x01000001, 0x01000100, 0x01000101,
+	0x01010000, 0x01010001, 0x01010100, 0x01010101,
+};
+
+template<bool BROADCAST>
+static inline __m128d LoadSSE2(const double* p, size_t i)
+{
+	return BROADCAST ? _mm_set1_pd(p[0]) : _mm_loadu_pd(p + i);
+}
+
+template<VecOp OP>
+static inline __m128d ArithSSE2(__m128d a, __m128d b)
+{
+	switch (OP) {
+	case VecOp::kAdd: return _mm_add_pd(a, b);
+	case VecOp::kSub: return _mm_sub_pd(a, b);
+	case VecOp::kMul: return _mm_mul_pd(a, b);
+	default: return _mm_div_pd(a, b);
+	}
+}
+
+template<VecOp OP>
+static inline int CompareSSE2(__m128d a, __m128d b)
+{
+	switch (OP) {
+	case VecOp::kLess: return _mm_movemask_pd(_mm_cmplt_pd(a, b));
+	case VecOp::kLessEqual: return _mm_movemask_pd(_mm_cmple_pd(a, b));
+	case VecOp::kGreater: return _mm_movemask_pd(_mm_cmpgt_pd(a, b));
+	case VecOp::kGreaterEqual: return _mm_movemask_pd(_mm_cmpge_pd(a, b));
+	case VecOp::kEqual: return _mm_movemask_pd(_mm_cmpeq_pd(a, b));
+	default: return _mm_movemask_pd(_mm_cmpneq_pd(a, b));	// true for NaN, as !=
+	}
+}
+
+template<VecOp OP, Broadcast B>
+static void ArithSSE2Loop(const double* a, const double* b, double* out, size_t n)
+{
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2) {
+		__m128d x = LoadSSE2<B == Broadcast::kLeft>(a, i);
+		__m128d y = LoadSSE2<B == Broadcast::kRight>(b, i);
+		_mm_storeu_pd(out + i, ArithSSE2<OP>(x, y));
+	}
+	ArithLoop<OP, B>(a, b, out, i, n);
+}
+
+template<VecOp OP, Broadcast B>
+static void CompareSSE2Loop(const double* a, const double* b, uint8_t* out, size_t n)
+{
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2) {
+		__m128d x = LoadSSE2<B == Broadcast::kLeft>(a, i);
+		__m128d y = LoadSSE2<B == Broadcast::kRight>(b, i);
+		uint16_t bytes = static_cast<uint16_t>(kMaskBytes[CompareSSE2<OP>(x, y)]);
+		memcpy(out + i, &bytes, sizeof(bytes));
+	}
+	CompareLoop<OP, B>(a, b, out, i, n);
+}
+
+template<bool BROADCAST>
+TARGET_AVX static inline __m256d LoadAVX(const double* p, size_t i)
+{
+	return BROADCAST ? _mm256_set1_pd(p[0]) : _mm256_loadu_pd(p + i);
+}
+
+template<VecOp OP>
+TARGET_AVX static inline __m256d ArithAVX(__m256d a, __m256d b)
+{
+	switch (OP) {
+	case VecOp::kAdd: return _mm256_add_pd(a, b);
+	case VecOp::kSub: return _mm256_sub_pd(a, b);
+	case VecOp::kMul: return _mm256_mul_pd(a, b);
+	default: return _mm256_div_pd(a, b);
+	}
+}
+
+template<VecOp OP>
+TARGET_AVX static inline int CompareAVX(__m256d a, __m256d b)
+{
+	switch (OP) {
+	case VecOp::kLess: return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LT_OQ));
+	case VecOp::kLessEqual: return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LE_OQ));
+	case VecOp::kGreater: return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_GT_OQ));
+	case VecOp::kGreaterEqual: return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_GE_OQ));
+	case VecOp::kEqual: return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_EQ_OQ));
+	default: return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_NEQ_UQ));
+	}
+}
+
+template<VecOp OP, Broadcast B>
+TARGET_AVX static void ArithAVXLoop(const double* a, const double* b, double* out, size_t n)
+{
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256d x = LoadAVX<B == Broadcast::kLeft>(a, i);
+		__m256d y = LoadAVX<B == Broadcast::kRight>(b, i);
+		_mm256_storeu_pd(out + i, ArithAVX<OP>(x, y));
+	}
+	ArithLoop<OP, B>(a, b, out, i, n);
+}
+
+template<VecOp OP, Broadcast B>
+TARGET_AVX static void CompareAVXLoop(const double* a, const double* b, uint8_t* out, size_t n)
+{
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256d x = LoadAVX<B == Broadcast::kLeft>(a, i);
+		__m256d y = LoadAVX<B == Broadcast::kRight>(b, i);
+		memcpy(out + i, &kMaskBytes[CompareAVX<OP>(x, y)], 4);
+	}
+	CompareLoop<OP, B>(a, b, out, i, n);
+}
+
+#endif
+
+template<VecOp OP, Broadcast B>
+static void ArithKernel(const double* a, const double* b, double* out, size_t n)
+{
+#if VEC_X86()
+	switch (gLevel) {
+	case SimdLevel::kAVX: ArithAVXLoop<OP, B>(a, b, out, n); return;
+	case SimdLevel::kSSE2: ArithSSE2Loop<OP, B>(a, b, out, n); return;
+	default: break;
+	}
+#endif
+	ArithLoop<OP, B>(a, b, out, 0, n);
+}
+
+template<VecOp OP, Broadcast B>
+static void CompareKernel(const double* a, const double* b, uint8_t* out, size_t n)
+{
+#if VEC_X86()
+	switch (gLevel) {
+	case SimdLevel::kAVX: CompareAVXLoop<OP, B>(a, b, out, n); return;
+	case SimdLevel::kSSE2: CompareSSE2Loop<OP, B>(a, b, out, n); return;
+	default: break;
+	}
+#endif
+	CompareLoop<OP, B>(a, b, out, 0, n);
+}
+
+template<VecOp OP>
+static void ArithBroadcast(const double* a, const double* b, Broadcast broadcast, double* out, size_t n)
+{
+	switch (broadcast) {
+	case Broadcast::kNone: ArithKernel<OP, Broadcast::kNone>(a, b, out, n); break;
+	case Broadcast::kLeft: ArithKernel<OP, Broadcast::kLeft>(a, b, out, n); break;
+	case Broadcast::kRight: ArithKernel<OP, Broadcast::kRight>(a, b, out, n); break;
+	}
+}
+
+template<VecOp OP>
+static void CompareBroadcast(const double* a, const double* b, Broadcast broadcast, uint8_t* out, size_t n)
+{
+	switch (broadcast) {
+	case Broadcast::kNone: CompareKernel<OP, Broadcast::kNone>(a, b, out, n); break;
+	case Broadcast::kLeft: CompareKernel<OP, Broadcast::kLeft>(a, b, out, n); break;
+	case Broadcast::kRight: CompareKernel<OP, Broadcast::kRight>(a, b, out, n); break;
+	}
+}
+
+void VecArith(VecOp op, const double* a, const double* b, Broadcast broadcast, double* out, size_t n)
+{
+	if (n == 0) return;
+	switch (op) {
+	case VecOp::kAdd: ArithBroadcast<VecOp::kAdd>(a, b, broadcast, out, n); break;
+	case VecOp::kSub: ArithBroadcast<VecOp::kSub>(a, b, broadcast, out, n); break;
+	case VecOp::kMul: ArithBroadcast<VecOp::kMul>(a, b, broadcast, out, n); break;
+	case VecOp::kDiv: ArithBroadcast<VecOp::kDiv>(a, b, broadcast, out, n); break;
+	default: REQUIRE(false);
+	}
+}
+
+void VecCompare(VecOp op, const double* a, const double* b, Broadcast broadcast, uint8_t* out, size_t n)
+{
+	if (n == 0) return;
+	switch (op) {
+	case VecOp::kLess: CompareBroadcast<VecOp::kLess>(a, b, broadcast, out, n); break;
+	case VecOp::kLessEqual: CompareBroadcast<VecOp::kLessEqual>(a, b, broadcast, out, n); break;
+	case VecOp::kGreater: CompareBroadcast<VecOp::kGreater>(a, b, broadcast, out, n); break;
+	case VecOp::kGreaterEqual: CompareBroadcast<VecOp::kGreaterEqual>(a, b, broadcast, out, n); break;
+	case VecOp::kEqual: CompareBroadcast<VecOp::kEqual>(a, b, broadcast, out, n); break;
+	case VecOp::kNotEqual: CompareBroadcast<VecOp::kNotEqual>(a, b, broadcast, out, n); break;
+	default: REQUIRE(false);
+	}
+}
+
+// The reductions: a plain loop (which also does the tails), and SSE2 and
+// AVX versions that keep the lanes apart until the end. min and max take
+// the new element as the first operand of minpd and maxpd, which returns
+// the second operand on a NaN: like Combine(), a NaN never replaces the
+// value so far.
+enum class Reduce { kSum, kMin, kMax };
+
+template<Reduce R>
+static inline double Combine(double x, double m)
+{
+	switch (R) {
+	case Reduce::kSum: return m + x;
+	case Reduce::kMin: return x < m ? x : m;
+	default: return x > m ? x : m;
+	}
+}
+
+template<Reduce R>
+static double ReduceLoop(const double* a, double m, size_t i, size_t n)
+{
+	for (; i < n; i++)
+		m = Combine<R>(a[i], m);
+	return m;
+}
+
+static double DotLoop(const double* a, const double* b, double sum, size_t i, size_t n)
+{
+	for (; i < n; i++)
+		sum += a[i] * b[i];
+	return sum;
+}
+
+// The index of the first match, or n; and the count of them.
+static size_t FindLoop(const double* a, double v, size_t i, size_t n)
+{
+	for (; i < n; i++) {
+		if (a[i] == v) return i;
+	}
+	return n;
+}
+
+static size_t CountLoop(const double* a, double v, size_t i, size_t n)
+{
+	size_t count = 0;
+	for (; i < n; i++)
+		count += a[i] == v;
+	return count;
+}
+
+// Set bits, and the lowest, of a 4 bit compare mask.
+static const uint8_t kMaskCount[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+static const uint8_t kMaskFirst[16] = { 0, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0 };
+
+#if VEC_X86()
+
+template<Reduce R>
+static inline __m128d CombineSSE2(__m128d x, __m128d m)
+{
+	switch (R) {
+	case Reduce::kSum: return _mm_add_pd(m, x);
+	case Reduce::kMin: return _mm_min_pd(x, m);
+	default: return _mm_max_pd(x, m);
+	}
+}
+
+template<Reduce R>
+static double ReduceSSE2(const double* a, double init, size_t n)
+{
+	// Two accumulators, so the adds don't wait on each other.
+	__m128d m0 = _mm_set1_pd(init), m1 = m0;
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		m0 = CombineSSE2<R>(_mm_loadu_pd(a + i), m0);
+		m1 = CombineSSE2<R>(_mm_loadu_pd(a + i + 2), m1);
+	}
+	double lanes[4];
+	_mm_storeu_pd(lanes, m0);
+	_mm_storeu_pd(lanes + 2, m1);
+	double m = lanes[0];
+	for (int l = 1; l < 4; l++)
+		m = Combine<R>(lanes[l], m);
+	return ReduceLoop<R>(a, m, i, n);
+}
+
+static double DotSSE2(const double* a, const double* b, size_t n)
+{
+	__m128d s0 = _mm_setzero_pd(), s1 = s0;
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+		s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+	}
+	double lanes[2];
+	_mm_storeu_pd(lanes, _mm_add_pd(s0, s1));
+	return DotLoop(a, b, lanes[0] + lanes[1], i, n);
+}
+
+static size_t FindSSE2(const double* a, double v, size_t n)
+{
+	const __m128d x = _mm_set1_pd(v);
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2) {
+		int mask = _mm_movemask_pd(_mm_cmpeq_pd(_mm_loadu_pd(a + i), x));
+		if (mask) return i + kMaskFirst[mask];
+	}
+	return FindLoop(a, v, i, n);
+}
+
+static size_t CountSSE2(const double* a, double v, size_t n)
+{
+	const __m128d x = _mm_set1_pd(v);
+	size_t count = 0, i = 0;
+	for (; i + 2 <= n; i += 2)
+		count += kMaskCount[_mm_movemask_pd(_mm_cmpeq_pd(_mm_loadu_pd(a + i), x))];
+	return count + CountLoop(a, v, i, n);
+}
+
+template<Reduce R>
+TARGET_AVX static inline __m256d CombineAVX(__m256d x, __m256d m)
+{
+	switch (R) {
+	case Reduce::kSum: return _mm256_add_pd(m, x);
+	case Reduce::kMin: return _mm256_min_pd(x, m);
+	default: return _mm256_max_pd(x, m);
+	}
+}
+
+template<Reduce R>
+TARGET_AVX static double ReduceAVX(const double* a, double init, size_t n)
+{
+	__m256d m0 = _mm256_set1_pd(init), m1 = m0;
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		m0 = CombineAVX<R>(_mm256_loadu_pd(a + i), m0);
+		m1 = CombineAVX<R>(_mm256_loadu_pd(a + i + 4), m1);
+	}
+	double lanes[8];
+	_mm256_storeu_pd(lanes, m0);
+	_mm256_storeu_pd(lanes + 4, m1);
+	double m = lanes[0];
+	for (int l = 1; l < 8; l++)
+		m = Combine<R>(lanes[l], m);
+	return ReduceLoop<R>(a, m, i, n);
+}
+
+TARGET_AVX static double DotAVX(const double* a, const double* b, size_t n)
+{
+	__m256d s0 = _mm256_setzero_pd(), s1 = s0;
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		s0 = _mm256_add_pd(s0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+		s1 = _mm256_add_pd(s1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+	}
+	double lanes[4];
+	_mm256_storeu_pd(lanes, _mm256_add_pd(s0, s1));
+	return DotLoop(a, b, (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]), i, n);
+}
+
+TARGET_AVX static size_t FindAVX(const double* a, double v, size_t n)
+{
+	const __m256d x = _mm256_set1_pd(v);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		int mask = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(a + i), x, _CMP_EQ_OQ));
+		if (mask) return i + kMaskFirst[mask];
+	}
+	return FindLoop(a, v, i, n);
+}
+
+TARGET_AVX static size_t CountAVX(const double* a, double v, size_t n)
+{
+	const __m256d x = _mm256_set1_pd(v);
+	size_t count = 0, i = 0;
+	for (; i + 4 <= n; i += 4)
+		count += kMaskCount[_mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(a + i), x, _CMP_EQ_OQ))];
+	return count + CountLoop(a, v, i, n);
+}
+
+#endif
+
+template<Reduce R>
+static double ReduceKernel(const double* a, double init, size_t n)
+{
+#if VEC_X86()
+	switch (gLevel) {
+	case SimdLevel::kAVX: return ReduceAVX<R>(a, init, n);
+	case SimdLevel::kSSE2: return ReduceSSE2<R>(a, init, n);
+	default: break;
+	}
+#endif
+	return ReduceLoop<R>(a, init, 0, n);
+}
+
+double VecSum(const double* a, size_t n)
+{
+	return ReduceKernel<Reduce::kSum>(a, 0.0, n);
+}
+
+double VecMin(const double* a, size_t n)
+{
+	REQUIRE(n > 0);
+	return ReduceKernel<Reduce::kMin>(a, a[0], n);
+}
+
+double VecMax(const double* a, size_t n)
+{
+	REQUIRE(n > 0);
+	return ReduceKernel<Reduce::kMax>(a, a[0], n);
+}
+
+double VecDot(const double* a, const double* b, size_t n)
+{
+#if VEC_X86()
+	switch (gLevel) {
+	case SimdLevel::kAVX: return DotAVX(a, b, n);
+	case SimdLevel::kSSE2: return DotSSE2(a, b, n);
+	default: break;
+	}
+#endif
+	return DotLoop(a, b, 0.0, 0, n);
+}
+
+size_t VecFind(const double* a, double v, size_t n)
+{
+#if VEC_X86()
+	switch (gLevel) {
+	case SimdLevel::kAVX: return FindAVX(a, v, n);
+	case SimdLevel::kSSE2: return FindSSE2(a, v, n);
+	default: break;
+	}
+#endif
+	return FindLoop(a, v, 0, n);
+}
+
+size_t VecCount(const double* a, double v, size_t n)
+{
+#if VEC_X86()
+	switch (gLevel) {
+	case SimdLevel::kAVX: return CountAVX(a, v, n);
+	case SimdLevel::kSSE2: return CountSSE2(a, v, n);
+	default: break;
+	}
+#endif
+	return CountLoop(a, v, 0, n);
+}
+
+static const ValueType kNumList(PType::tNum, Layout::tList);
+
+bool IsNumListOp(const Value& lhs, const Value& rhs)
+{
+	return lhs.type == kNumList || rhs.type == kNumList;
+}
+
+Value NumListOp(Heap& heap, VecOp op, const Value& lhs, const Value& rhs, std::string& error)
+{
+	const ValueType kNum(PType::tNum);
+	const bool lhsList = lhs.type == kNumList;
+	const bool rhsList = rhs.type == kNumList;
+	if (!(lhsList || lhs.type == kNum) || !(rhsList || rhs.type == kNum) || !(lhsList || rhsList)) {
+		error = fmt::format("num[] operator: expected num[] or num, not '{}' and '{}'", lhs.type.typeName(), rhs.type.typeName());
+		return Value();
+	}
+	const NumList* a = lhsList ? static_cast<const NumList*>(lhs.heapPtr.get()) : nullptr;
+	const NumList* b = rhsList ? static_cast<const NumList*>(rhs.heapPtr.get()) : nullptr;
+	if (a && b && a->size() != b->size()) {
+		error = fmt::format("num[] operator: sizes differ: {} and {}", a->size(), b->size());
+		return Value();
+	}
+	const int n = a ? a->size() : b->size();
+	const double* pa = a ? a->data() : &lhs.vNumber;
+	const double* pb = b ? b->data() : &rhs.vNumber;
+	const Broadcast broadcast = !a ? Broadcast::kLeft : (!b ? Broadcast::kRight : Broadcast::kNone);
+
+	Value result;
+	if (IsCompare(op)) {
+		BoolList* out = heap.make<BoolList>(heap, n);
+		result.type = ValueType(PType::tBool, Layout::tList);
+		result.heapPtr.set(out);
+		VecCompare(op, pa, pb, broadcast, out->data(), n);
+	}
+	else {
+		NumList* out = heap.make<NumList>(heap, n);
+		result.type = kNumList;
+		result.heapPtr.set(out);
+		VecArith(op, pa, pb, broadcast, out->data(), n);
+	}
+	return result;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "value.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+/*
+* Element-wise kernels over arrays of doubles, for the num[] operators.
+* On x86-64 they use AVX (4 doubles at a time) or SSE2 (2 at a time),
+* whichever the CPU supports, found at run time; elsewhere, a plain loop.
+*
+* Comparisons write 1 or 0 per element: the storage of a BoolList.
+*/
+enum class VecOp {
+	kAdd,
+	kSub,
+	kMul,
+	kDiv,
+	kLess,
+	kLessEqual,
+	kGreater,
+	kGreaterEqual,
+	kEqual,
+	kNotEqual,
+};
+
+inline bool IsCompare(VecOp op) { return op >= VecOp::kLess; }
+
+// Which operand, if either, is one value used for every element.
+enum class Broadcast {
+	kNone,
+	kLeft,
+	kRight,
+};
+
+// out[i] = a[i] op b[i]
+void VecArith(VecOp op, const double* a, const double* b, Broadcast broadcast, double* out, size_t n);
+void VecCompare(VecOp op, const double* a, const double* b, Broadcast broadcast, uint8_t* out, size_t n);
+
+// Reductions and searches over a[0, n), for the native list functions
+// (scribelib.) The sum and dot product add in lanes, so their rounding
+// can differ, in the last bits, from a plain loop.
+double VecSum(const double* a, size_t n);
+double VecDot(const double* a, const double* b, size_t n);
+// The least (or greatest) element. 'n' must not be 0. A NaN is skipped,
+// unless it is a[0].
+double VecMin(const double* a, size_t n);
+double VecMax(const double* a, size_t n);
+// The number of elements equal to 'v', and the index of the first one
+// (or n, if there are none.)
+size_t VecCount(const double* a, double v, size_t n);
+size_t VecFind(const double* a, double v, size_t n);
+
+enum class SimdLevel {
+	kScalar,
+	kSSE2,
+	kAVX,
+};
+
+// What the CPU supports.
+SimdLevel DetectSimdLevel();
+// What the kernels use: the detected level, unless it has been set
+// lower (for tests and benchmarks.) Setting it higher has no effect.
+SimdLevel GetSimdLevel();
+void SetSimdLevel(SimdLevel level);
+const char* SimdLevelName(SimdLevel level);
+
+// The num[] operators, for both engines: one operand is a num[], and the
+// other a num[] of the same size, or a num. The result is a new num[] (or
+// bool[], for a comparison.) On a type or size mismatch, sets 'error' and
+// returns Value().
+bool IsNumListOp(const Value& lhs, const Value& rhs);	// either is a num[]
+Value NumListOp(Heap& heap, VecOp op, const Value& lhs, const Value& rhs, std::string& error);
+
+void VecOpsTest();
@@ -0,0 +1,175 @@
+#include "vecops.h"
+#include "test.h"
+
+#include <math.h>
+#include <vector>
+
+static double Reference(VecOp op, double a, double b)
+{
+	switch (op) {
+	case VecOp::kAdd: return a + b;
+	case VecOp::kSub: return a - b;
+	case VecOp::kMul: return a * b;
+	case VecOp::kDiv: return a / b;
+	case VecOp::kLess: return a < b;
+	case VecOp::kLessEqual: return a <= b;
+	case VecOp::kGreater: return a > b;
+	case VecOp::kGreaterEqual: return a >= b;
+	case VecOp::kEqual: return a == b;
+	default: return a != b;
+	}
+}
+
+static bool Same(double a, double b)
+{
+	return a == b || (isnan(a) && isnan(b));
+}
+
+// Every op, broadcast, and level, over sizes that leave each SIMD width
+// a tail, against the plain C++ operators.
+static void Kernels()
+{
+	static const double kValues[] = { 1, -2.5, 0, -0.0, 3, NAN, HUGE_VAL, 7, 1e-300, 3, -4, 2, 0.5, NAN, 9, 3, 2 };
+	static constexpr size_t kMax = sizeof(kValues) / sizeof(kValues[0]);
+	std::vector<double> a(kValues, kValues + kMax);
+	std::vector<double> b(kMax);
+	for (size_t i = 0; i < kMax; i++) {
+		b[i] = kValues[(i * 7 + 3) % kMax];
+	}
+
+	const SimdLevel detected = DetectSimdLevel();
+	for (SimdLevel level : { SimdLevel::kScalar, SimdLevel::kSSE2, SimdLevel::kAVX }) {
+		SetSimdLevel(level);
+		TEST(GetSimdLevel() == (level < detected ? level : detected));
+		for (int o = 0; o <= (int)VecOp::kNotEqual; o++) {
+			const VecOp op = static_cast<VecOp>(o);
+			for (Broadcast broadcast : { Broadcast::kNone, Broadcast::kLeft, Broadcast::kRight }) {
+				for (size_t n = 0; n <= kMax; n++) {
+					std::vector<double> out(kMax + 1, -1);
+					std::vector<uint8_t> flags(kMax + 1, 2);
+					if (IsCompare(op))
+						VecCompare(op, a.data(), b.data(), broadcast, flags.data(), n);
+					else
+						VecArith(op, a.data(), b.data(), broadcast, out.data(), n);
+
+					for (size_t i = 0; i < n; i++) {
+						double x = broadcast == Broadcast::kLeft ? a[0] : a[i];
+						double y = broadcast == Broadcast::kRight ? b[0] : b[i];
+						if (IsCompare(op)) {
+							TEST(flags[i] == Reference(op, x, y));
+						}
+						else {
+							TEST(Same(out[i], Reference(op, x, y)));
+						}
+					}
+					// Nothing written past the end.
+					TEST(out[n] == -1 && flags[n] == 2);
+				}
+			}
+		}
+	}
+	SetSimdLevel(detected);
+}
+
+// The reductions and searches, at every level, over every size up to a
+// couple of AVX blocks and a tail. Small integers add exactly, in any order.
+static void Reductions()
+{
+	static const double kValues[] = { 3, -2, 0, 5, NAN, 7, -0.0, 2, 3, -9, 4, 3, 11, 1, NAN, 3, -2, 6, 3, 0 };
+	static constexpr size_t kMax = sizeof(kValues) / sizeof(kValues[0]);
+	std::vector<double> a(kValues, kValues + kMax);
+	std::vector<double> b(kMax);
+	for (size_t i = 0; i < kMax; i++) {
+		a[i] = isnan(a[i]) ? 1 : a[i];
+		b[i] = double(i % 5) - 2;
+	}
+
+	const SimdLevel detected = DetectSimdLevel();
+	for (SimdLevel level : { SimdLevel::kScalar, SimdLevel::kSSE2, SimdLevel::kAVX }) {
+		SetSimdLevel(level);
+		for (size_t n = 0; n <= kMax; n++) {
+			double sum = 0, dot = 0;
+			for (size_t i = 0; i < n; i++) {
+				sum += a[i];
+				dot += a[i] * b[i];
+			}
+			TEST(VecSum(a.data(), n) == sum);
+			TEST(VecDot(a.data(), b.data(), n) == dot);
+
+			if (n > 0) {
+				// A NaN is skipped, unless it comes first.
+				double lo = kValues[0], hi = kValues[0];
+				for (size_t i = 1; i < n; i++) {
+					lo = kValues[i] < lo ? kValues[i] : lo;
+					hi = kValues[i] > hi ? kValues[i] : hi;
+				}
+				TEST(VecMin(kValues, n) == lo);
+				TEST(VecMax(kValues, n) == hi);
+				TEST(isnan(VecMin(kValues + 4, n > kMax - 4 ? kMax - 4 : n)));
+			}
+
+			for (double v : { 3.0, 0.0, 1.0, 42.0, double(NAN) }) {
+				size_t first = n, count = 0;
+				for (size_t i = 0; i < n; i++) {
+					if (kValues[i] == v) {
+						first = count ? first : i;
+						count++;
+					}
+				}
+				TEST(VecFind(kValues, v, n) == first);
+				TEST(VecCount(kValues, v, n) == count);
+			}
+		}
+	}
+	SetSimdLevel(detected);
+}
+
+static Value List(Heap& heap, std::vector<double> values)
+{
+	Value v = Value::Default(ValueType(PType::tNum, Layout::tList), heap);
+	static_cast<NumList*>(v.heapPtr.get())->append(values.data(), (int)values.size());
+	return v;
+}
+
+static void ListOps()
+{
+	Heap heap;
+	Value a = List(heap, { 1, 2, 3, 4, 5 });
+	Value b = List(heap, { 5, 4, 3, 2, 1 });
+	std::string error;
+
+	Value sum = NumListOp(heap, VecOp::kAdd, a, b, error);
+	TEST(error.empty());
+	TEST(sum.type == ValueType(PType::tNum, Layout::tList));
+	const NumList* s = static_cast<const NumList*>(sum.heapPtr.get());
+	TEST(s->size() == 5);
+	for (int i = 0; i < 5; i++)
+		TEST(s->get(i) == 6);
+
+	Value scaled = NumListOp(heap, VecOp::kDiv, Value::Number(10), a, error);
+	TEST(static_cast<const NumList*>(scaled.heapPtr.get())->get(1) == 5);
+
+	Value less = NumListOp(heap, VecOp::kLess, a, Value::Number(3), error);
+	TEST(less.type == ValueType(PType::tBool, Layout::tList));
+	const BoolList* l = static_cast<const BoolList*>(less.heapPtr.get());
+	TEST(l->size() == 5 && l->get(0) && l->get(1) && !l->get(2) && !l->get(4));
+
+	// The operands are left as they were.
+	TEST(static_cast<const NumList*>(a.heapPtr.get())->get(0) == 1);
+
+	TEST(NumListOp(heap, VecOp::kAdd, a, List(heap, { 1 }), error).type == ValueType());
+	TEST(!error.empty());
+	error.clear();
+	TEST(NumListOp(heap, VecOp::kAdd, a, Value::Boolean(true), error).type == ValueType());
+	TEST(!error.empty());
+	TEST(IsNumListOp(Value::Number(1), a));
+	TEST(!IsNumListOp(Value::Number(1), Value::Number(2)));
+}
+
+void VecOpsTest()
+{
+	fmt::print("VecOps: {}\n", SimdLevelName(DetectSimdLevel()));
+	RUN_TEST(Kernels());
+	RUN_TEST(Reductions());
+	RUN_TEST(ListOps());
+}